@@ -0,0 +1,96 @@
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "huffman.h"
+#include "codegen_table.h"
+
+/*
+ * Rebuilds the table the generated code was made from, then checks that the
+ * generated encoder and decoder agree with HuffmanTable for every line of the
+ * corpus, and that both encoders reject malformed UTF-8.
+ */
+int main(int argc, char *argv[]) {
+    HuffmanTable ht;
+    std::vector<std::string> lines;
+    for (int i = 1; i < argc; ++i) {
+        std::ifstream corpus(argv[i]);
+        std::string line;
+        while (std::getline(corpus, line)) {
+            if (!line.empty()) {
+                ht.addFrequencies(line);
+                lines.push_back(line);
+            }
+        }
+    }
+    ht.buildTree();
+
+    int failures = 0;
+    for (const std::string &line : lines) {
+        std::vector<bool> bits = ht.encode(line);
+        std::vector<unsigned char> packed((bits.size() + 7) / 8);
+        for (size_t i = 0; i < bits.size(); ++i) {
+            if (bits[i]) {
+                packed[i / 8] |= 0x80 >> (i % 8);
+            }
+        }
+
+        std::vector<unsigned char> generatedBits(packed.size() + 1);
+        size_t bitLength = codegen_table::encode(line.data(), line.size(), generatedBits.data(), generatedBits.size());
+        std::string out(line.size(), '\0');
+        size_t length = codegen_table::decode(packed.data(), bits.size(), &out[0], out.size());
+        out.resize(length);
+
+        if (bitLength != bits.size() || !std::equal(packed.begin(), packed.end(), generatedBits.begin())) {
+            std::cerr << "ERROR: generated encoder disagrees on \"" << line << "\"\n";
+            ++failures;
+        }
+        if (out != ht.decode(bits)) {
+            std::cerr << "ERROR: generated decoder disagrees on \"" << line << "\"\n";
+            ++failures;
+        }
+        bool truncated = false;
+        try {
+            codegen_table::decode(packed.data(), bits.size() - 1, &out[0], out.size());
+        } catch (std::runtime_error&) {
+            truncated = true;
+        }
+        if (!truncated) {
+            std::cerr << "ERROR: generated decoder accepted truncated \"" << line << "\"\n";
+            ++failures;
+        }
+    }
+
+    const std::vector<std::string> malformed = {
+        "\x80", "a\xBF", "\xC0\x80", "\xC3", "\xC3(", "\xE0\x80\x80", "\xED\xA0\x80",
+        "\xF4\x90\x80\x80", "\xF8\x88\x80\x80\x80", "\xFF",
+    };
+    for (const std::string &text : malformed) {
+        std::vector<unsigned char> out(64);
+        std::string error;
+        try {
+            codegen_table::encode(text.data(), text.size(), out.data(), out.size());
+        } catch (std::runtime_error &e) {
+            error = e.what();
+        }
+        if (error.find("UTF-8") == std::string::npos) {
+            std::cerr << "ERROR: generated encoder did not reject malformed UTF-8 \"" << text << "\"\n";
+            ++failures;
+        }
+        bool rejected = false;
+        try {
+            ht.encode(text);
+        } catch (std::exception&) {
+            rejected = true;
+        }
+        if (!rejected) {
+            std::cerr << "ERROR: HuffmanTable accepted malformed UTF-8 \"" << text << "\"\n";
+            ++failures;
+        }
+    }
+
+    std::cout << "Generated code checked against " << lines.size() << " strings, " << failures << " failures\n";
+    return failures ? 1 : 0;
+}
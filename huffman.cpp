@@ -1,15 +1,19 @@
+#include <algorithm>
 #include <cstring>
 #include <fstream>
 #include <iomanip>
 #include <iterator>
 #include <map>
+#include <memory>
 #include <queue>
 #include <sstream>
 #include <string>
 #include <vector>
 
-#include "utf8/utf8.h"
 #include "huffman.h"
+#include "huffman_bits.h"
+#include "huffman_io.h"
+#include "huffman_utf8.h"
 
 
 static std::string codePointToString(int codePoint) {
@@ -18,43 +22,306 @@ static std::string codePointToString(int codePoint) {
 	return result;
 }
 
+/* ***************************************************************************
+ * Bodies for Huffman node methods
+ */
+
+void HuffmanLeafChar::setCharacter(int character) {
+	_character = character;
+	_utf8Length = static_cast<unsigned char>(utf8::append(character, _utf8) - _utf8);
+}
+
+
 /* ***************************************************************************
  * Bodies for Huffman tree dumping methods
  */
 
+static const char hexDigits[] = "0123456789ABCDEF";
+
+static void appendHex(std::string &buffer, uint32_t value) {
+	char digits[8];
+	int count = 0;
+	do {
+		digits[count++] = hexDigits[value & 0xF];
+		value >>= 4;
+	} while (value);
+	while (count > 0) {
+		buffer += digits[--count];
+	}
+}
+
+/*
+ * Append one line of the text dump: the code padded to sixteen columns,
+ * honouring the stream's alignment as setw() would, then what it decodes to.
+ */
+static void appendDumpLine(std::string &buffer, const std::string &code, const HuffmanNode *node, bool alignLeft) {
+	size_t padding = code.size() < 16 ? 16 - code.size() : 0;
+	if (!alignLeft) {
+		buffer.append(padding, ' ');
+	}
+	buffer += code;
+	if (alignLeft) {
+		buffer.append(padding, ' ');
+	}
+	buffer += ": ";
+
+	if (node->getType() == HuffmanNode::End) {
+		buffer += "NUL";
+	} else if (node->getType() == HuffmanNode::Escape) {
+		buffer += "ESCAPE";
+	} else {
+		const HuffmanLeafChar *leaf = static_cast<const HuffmanLeafChar*>(node);
+		int character = leaf->getCharacter();
+		if (character >= 0x20 && character != 0x7F) {
+			buffer += '\'';
+			buffer.append(leaf->getUtf8(), leaf->getUtf8Length());
+			buffer += "' (0x";
+			appendHex(buffer, character);
+			buffer += ')';
+		} else {
+			buffer += "0x";
+			appendHex(buffer, character);
+		}
+	}
+	buffer += '\n';
+}
+
+/*
+ * Dump every leaf below node without recursion. The code of the current
+ * node is kept in a single buffer that grows and shrinks as the walk moves
+ * down and back up the tree, and the output is written in large blocks.
+ */
+static void dumpNodes(std::ostream &out, const HuffmanNode *node, const std::string &prefix) {
+	struct Pending {
+		const HuffmanNode *node;
+		size_t depth;
+		char bit;
+	};
+	bool alignLeft = (out.flags() & std::ios::adjustfield) == std::ios::left;
+	std::string code = prefix, buffer;
+	std::vector<Pending> stack;
+	stack.push_back(Pending{node, prefix.size(), 0});
+	while (!stack.empty()) {
+		Pending pending = stack.back();
+		stack.pop_back();
+		code.resize(pending.depth);
+		if (pending.bit) {
+			code += pending.bit;
+		}
+
+		if (pending.node->getType() == HuffmanNode::Branch) {
+			const HuffmanBranch *branch = static_cast<const HuffmanBranch*>(pending.node);
+			if (branch->getRight()) {
+				stack.push_back(Pending{branch->getRight(), code.size(), '1'});
+			}
+			if (branch->getLeft()) {
+				stack.push_back(Pending{branch->getLeft(), code.size(), '0'});
+			}
+			continue;
+		}
+		appendDumpLine(buffer, code, pending.node, alignLeft);
+		if (buffer.size() >= 65536) {
+			out.write(buffer.data(), buffer.size());
+			buffer.clear();
+		}
+	}
+	out.write(buffer.data(), buffer.size());
+}
+
 void HuffmanTable::dumpTree(std::ostream &out) const {
 	if (!root) {
 		throw HuffmanException("Tried to dump non-existant tree");
 	}
 	out << "HUFFMAN TREE DATA DUMP\n    BIT SEQUENCE  CHARACTER\n";
-	root->dump(out, "");
+	dumpNodes(out, root.get(), "");
 }
 
 void HuffmanBranch::dump(std::ostream &out, std::string s) const {
-	if (_left) {
-		_left->dump(out, s + "0");
+	dumpNodes(out, this, s);
+}
+
+void HuffmanLeafChar::dump(std::ostream &out, std::string s) const {
+	dumpNodes(out, this, s);
+}
+
+void HuffmanLeafEnd::dump(std::ostream &out, std::string s) const {
+	dumpNodes(out, this, s);
+}
+
+void HuffmanLeafEscape::dump(std::ostream &out, std::string s) const {
+	dumpNodes(out, this, s);
+}
+
+/*
+ * Append text as a double quoted string, escaped for both DOT and JSON.
+ */
+static void appendQuoted(std::string &buffer, const char *text, size_t length) {
+	buffer += '"';
+	for (size_t i = 0; i < length; ++i) {
+		unsigned char c = static_cast<unsigned char>(text[i]);
+		if (c == '"' || c == '\\') {
+			buffer += '\\';
+			buffer += static_cast<char>(c);
+		} else if (c == '\n') {
+			buffer += "\\n";
+		} else if (c < 0x20 || c == 0x7F) {
+			buffer += "\\u00";
+			buffer += hexDigits[c >> 4];
+			buffer += hexDigits[c & 0xF];
+		} else {
+			buffer += static_cast<char>(c);
+		}
 	}
-	if (_right) {
-		_right->dump(out, s + "1");
+	buffer += '"';
+}
+
+static void appendCode(std::string &buffer, const HuffmanCode &code) {
+	buffer += '"';
+	for (unsigned bit = code.length; bit > 0; --bit) {
+		buffer += ((code.bits >> (bit - 1)) & 1) ? '1' : '0';
 	}
+	buffer += '"';
 }
 
-void HuffmanLeafChar::dump(std::ostream &out, std::string s) const {
-	out << std::setw(16) << s << ": ";
-	if (_character >= 0x20 && _character != 0x1F) {
-		out << '\'' << codePointToString(_character) << "' (0x" << std::hex << std::uppercase << _character << std::dec << ')';
-	} else {
-		out << "0x" << std::hex << _character << std::dec;
+void HuffmanTable::writeDot(std::ostream &out) const {
+	if (!root) {
+		throw HuffmanException("Tried to dump non-existant tree");
 	}
-	out << '\n';
+	struct Pending {
+		const HuffmanNode *node;
+		size_t id;
+		unsigned depth;
+	};
+	std::string buffer = "digraph huffman {\n\tnode [fontname=\"monospace\"];\n";
+	std::vector<Pending> stack;
+	stack.push_back(Pending{root.get(), 0, 0});
+	size_t nextId = 1;
+	while (!stack.empty()) {
+		Pending pending = stack.back();
+		stack.pop_back();
+		const HuffmanNode *node = pending.node;
+		std::string id = "\tn" + std::to_string(pending.id);
+
+		if (node->getType() == HuffmanNode::Branch) {
+			const HuffmanBranch *branch = static_cast<const HuffmanBranch*>(node);
+			buffer += id + " [shape=circle, label=\"" + std::to_string(node->getWeight()) + "\"];\n";
+			size_t left = nextId++, right = nextId++;
+			buffer += id + " -> n" + std::to_string(left) + " [label=\"0\"];\n";
+			buffer += id + " -> n" + std::to_string(right) + " [label=\"1\"];\n";
+			stack.push_back(Pending{branch->getRight(), right, pending.depth + 1});
+			stack.push_back(Pending{branch->getLeft(), left, pending.depth + 1});
+		} else {
+			std::string label;
+			if (node->getType() == HuffmanNode::End) {
+				label = "END";
+			} else if (node->getType() == HuffmanNode::Escape) {
+				label = "ESCAPE";
+			} else {
+				const HuffmanLeafChar *leaf = static_cast<const HuffmanLeafChar*>(node);
+				if (leaf->getCharacter() > 0x20 && leaf->getCharacter() != 0x7F) {
+					label.append(leaf->getUtf8(), leaf->getUtf8Length());
+					label += ' ';
+				}
+				label += "U+";
+				appendHex(label, leaf->getCharacter());
+			}
+			label += "\n" + std::to_string(node->getWeight()) + " x " + std::to_string(pending.depth) + " bits";
+			buffer += id + " [shape=box, label=";
+			appendQuoted(buffer, label.data(), label.size());
+			buffer += "];\n";
+		}
+		if (buffer.size() >= 65536) {
+			out.write(buffer.data(), buffer.size());
+			buffer.clear();
+		}
+	}
+	buffer += "}\n";
+	out.write(buffer.data(), buffer.size());
 }
 
-void HuffmanLeafEnd::dump(std::ostream &out, std::string s) const {
-	out << std::setw(16) << s << ": NUL\n";
+void HuffmanTable::writeJson(std::ostream &out) const {
+	if (!root) {
+		throw HuffmanException("Tried to dump non-existant tree");
+	}
+	std::string buffer = "{\"lengthPrefixed\":";
+	buffer += lengthPrefixed ? "true" : "false";
+	buffer += ",\"escape\":";
+	buffer += escape ? "true" : "false";
+	buffer += ",\"symbols\":[";
+	for (size_t i = 0; i < codes.size(); ++i) {
+		buffer += i ? ",\n" : "\n";
+		if (symbols[i] == 0) {
+			buffer += "{\"type\":\"end\"";
+		} else {
+			char utf8[4];
+			size_t length = utf8::append(symbols[i], utf8) - utf8;
+			buffer += "{\"type\":\"char\",\"character\":" + std::to_string(symbols[i]) + ",\"text\":";
+			appendQuoted(buffer, utf8, length);
+		}
+		buffer += ",\"weight\":" + std::to_string(charFrequency.count(symbols[i]));
+		buffer += ",\"length\":" + std::to_string(codes[i].length) + ",\"code\":";
+		appendCode(buffer, codes[i]);
+		buffer += '}';
+		if (buffer.size() >= 65536) {
+			out.write(buffer.data(), buffer.size());
+			buffer.clear();
+		}
+	}
+	if (escape) {
+		buffer += ",\n{\"type\":\"escape\",\"length\":" + std::to_string(escapeCode.length) + ",\"code\":";
+		appendCode(buffer, escapeCode);
+		buffer += '}';
+	}
+	buffer += "\n]}\n";
+	out.write(buffer.data(), buffer.size());
+}
+
+std::vector<size_t> HuffmanTable::getCodeLengthCounts() const {
+	std::vector<size_t> counts;
+	auto count = [&counts](unsigned length) {
+		if (counts.size() <= length) {
+			counts.resize(length + 1, 0);
+		}
+		++counts[length];
+	};
+	for (const HuffmanCode &code : codes) {
+		count(code.length);
+	}
+	if (escape && root) {
+		count(escapeCode.length);
+	}
+	return counts;
+}
+
+void HuffmanTable::dumpCodeLengths(std::ostream &out) const {
+	if (!root) {
+		throw HuffmanException("Tried to dump non-existant tree");
+	}
+	std::vector<size_t> counts = getCodeLengthCounts();
+	size_t shortest = 0;
+	while (counts[shortest] == 0) {
+		++shortest;
+	}
+	uint64_t totalWeight = 0, totalBits = 0;
+	for (size_t i = 0; i < codes.size(); ++i) {
+		uint64_t weight = charFrequency.count(symbols[i]);
+		totalWeight += weight;
+		totalBits += weight * codes[i].length;
+	}
+
+	std::ostringstream summary;
+	summary << "SYMBOLS " << codes.size() + (escape ? 1 : 0) << "  SHORTEST " << shortest
+	        << "  LONGEST " << counts.size() - 1 << "  AVERAGE ";
+	summary << std::fixed << std::setprecision(3) << (totalWeight ? double(totalBits) / totalWeight : 0.0) << " bits\n";
+	summary << "LENGTH    COUNT\n";
+	for (size_t length = shortest; length < counts.size(); ++length) {
+		summary << std::right << std::setw(6) << length << ' ' << std::setw(8) << counts[length] << '\n';
+	}
+	out << summary.str();
 }
 
 void HuffmanTable::dumpFrequencies(std::ostream &out) const {
-	std::multimap<int, int> reverseMap;
+	std::multimap<uint64_t, int> reverseMap;
 	for (const auto &i : charFrequency) {
 		reverseMap.insert(std::make_pair(i.second, i.first));
 	}
@@ -74,23 +341,56 @@ void HuffmanTable::dumpFrequencies(std::ostream &out) const {
  * Bodies for methods for manipulating the Huffman tree
  */
 
-void HuffmanTable::addFrequencies(const std::string &text) {
-	std::string::const_iterator iter = text.begin();
-	do {
-		int codePoint = utf8::next(iter, text.end());
-		++charFrequency[codePoint];
-	} while (iter != text.end());
-	++charFrequency[0];
+/*
+ * Copy a subtree. Trees are at most as deep as their longest code, so the
+ * recursion stays shallow.
+ */
+static HuffmanNode* cloneNode(const HuffmanNode *node) {
+	switch (node->getType()) {
+	case HuffmanNode::Branch: {
+		const HuffmanBranch *branch = static_cast<const HuffmanBranch*>(node);
+		std::unique_ptr<HuffmanNode> left(cloneNode(branch->getLeft()));
+		HuffmanNode *right = cloneNode(branch->getRight());
+		return new HuffmanBranch(left.release(), right);
+	}
+	case HuffmanNode::SingleChar:
+		return new HuffmanLeafChar(*static_cast<const HuffmanLeafChar*>(node));
+	case HuffmanNode::End:
+		return new HuffmanLeafEnd(*static_cast<const HuffmanLeafEnd*>(node));
+	case HuffmanNode::Escape:
+		return new HuffmanLeafEscape(*static_cast<const HuffmanLeafEscape*>(node));
+	case HuffmanNode::BadType:
+		break;
+	}
+	throw HuffmanException("Unknown Node Type");
+}
+
+HuffmanTable::HuffmanTable(const HuffmanTable &other)
+: root(other.root ? cloneNode(other.root.get()) : nullptr),
+  charFrequency(other.charFrequency), symbols(other.symbols), codes(other.codes),
+  symbolIndex(other.symbolIndex), escapeCode(other.escapeCode), rescaleTotal(other.rescaleTotal),
+  lengthPrefixed(other.lengthPrefixed), escape(other.escape)
+{ }
+
+HuffmanTable& HuffmanTable::operator=(const HuffmanTable &other) {
+	if (this != &other) {
+		*this = HuffmanTable(other);
+	}
+	return *this;
+}
+
+void HuffmanTable::addFrequencies(std::string_view text) {
+	charFrequency.add(text);
 }
 
 void HuffmanTable::addMinFrequencies() {
 	for (size_t i = 32; i < 127; ++i) {
-		if (charFrequency[i] == 0) {
-			charFrequency[i] = 1;
+		if (charFrequency.count(i) == 0) {
+			charFrequency.add(i);
 		}
 	}
-	if (charFrequency[10] == 0) {
-		charFrequency[10] = 1;
+	if (charFrequency.count(10) == 0) {
+		charFrequency.add(10);
 	}
 }
 
@@ -102,14 +402,29 @@ public:
 	}
 };
 void HuffmanTable::buildTree() {
-	std::priority_queue<HuffmanNode*, std::vector<HuffmanNode*>, HuffmanNodeCompareWeights> q;
-	for (const auto &i : charFrequency) {
+	HuffmanHistogram rescaled;
+	if (rescaleTotal) {
+		rescaled = charFrequency;
+		rescaled.rescale(rescaleTotal);
+	}
+	// make every leaf before queueing any, so a bad code point leaks nothing
+	std::vector<std::unique_ptr<HuffmanNode>> leaves;
+	for (const auto &i : rescaleTotal ? rescaled : charFrequency) {
 		if (i.first == 0 || i.first == 1) {
-			q.push(new HuffmanLeafEnd(i.second));
+			if (!lengthPrefixed) {
+				leaves.emplace_back(new HuffmanLeafEnd(i.second));
+			}
 		} else {
-			q.push(new HuffmanLeafChar(i.first,i.second));
+			leaves.emplace_back(new HuffmanLeafChar(i.first,i.second));
 		}
 	}
+	if (escape) {
+		leaves.emplace_back(new HuffmanLeafEscape(1));
+	}
+	std::priority_queue<HuffmanNode*, std::vector<HuffmanNode*>, HuffmanNodeCompareWeights> q;
+	for (std::unique_ptr<HuffmanNode> &leaf : leaves) {
+		q.push(leaf.release());
+	}
 
 	while(q.size() > 1) {
 		HuffmanNode *right = q.top();
@@ -120,7 +435,132 @@ void HuffmanTable::buildTree() {
 		HuffmanBranch *newNode = new HuffmanBranch(left, right);
 		q.push(newNode);
 	}
-	root = q.top();
+	if (q.empty()) {
+		throw HuffmanException("No Frequency Data to Build Tree From");
+	}
+	root.reset(q.top());
+	buildCodes();
+}
+
+void HuffmanTable::buildCodes() {
+	std::vector<std::pair<int, HuffmanCode>> found;
+	escapeCode = HuffmanCode{0, 0};
+	std::vector<std::pair<const HuffmanNode*, HuffmanCode>> stack;
+	stack.push_back(std::make_pair(root.get(), HuffmanCode{0, 0}));
+	while (!stack.empty()) {
+		const HuffmanNode *node = stack.back().first;
+		HuffmanCode code = stack.back().second;
+		stack.pop_back();
+
+		if (node->getType() == HuffmanNode::Branch) {
+			if (code.length == 64) {
+				throw HuffmanException("Huffman Code Longer than 64 Bits");
+			}
+			const HuffmanBranch *branch = static_cast<const HuffmanBranch*>(node);
+			stack.push_back(std::make_pair(branch->getRight(), HuffmanCode{(code.bits << 1) | 1, code.length + 1}));
+			stack.push_back(std::make_pair(branch->getLeft(), HuffmanCode{code.bits << 1, code.length + 1}));
+		} else if (node->getType() == HuffmanNode::SingleChar) {
+			found.push_back(std::make_pair(static_cast<const HuffmanLeafChar*>(node)->getCharacter(), code));
+		} else if (node->getType() == HuffmanNode::End) {
+			found.push_back(std::make_pair(0, code));
+		} else if (node->getType() == HuffmanNode::Escape) {
+			escapeCode = code;
+		}
+	}
+
+	// number the symbols in order of code point
+	std::stable_sort(found.begin(), found.end(), [](const std::pair<int, HuffmanCode> &lhs, const std::pair<int, HuffmanCode> &rhs) {
+		return lhs.first < rhs.first;
+	});
+	symbols.clear();
+	codes.clear();
+	for (const auto &i : found) {
+		if (!symbols.empty() && symbols.back() == i.first) {
+			// buildTree() can make two end marker leaves; keep the first
+			continue;
+		}
+		symbols.push_back(i.first);
+		codes.push_back(i.second);
+	}
+	symbolIndex.build(symbols);
+}
+
+
+/* ***************************************************************************
+ * Helpers for reading and writing bits
+ */
+
+/*
+ * Read-only view of a packed bit buffer with the same interface as
+ * std::vector<bool>, so the decoding routines can be shared between both.
+ * Bits are packed most significant bit first.
+ */
+class PackedBits {
+public:
+	PackedBits(const unsigned char *data, size_t bitLength)
+	: data(data), bitLength(bitLength)
+	{ }
+
+	bool operator[](size_t pos) const {
+		return (data[pos >> 3] >> (7 - (pos & 7))) & 1;
+	}
+	size_t size() const {
+		return bitLength;
+	}
+private:
+	const unsigned char *data;
+	size_t bitLength;
+};
+
+static void appendBits(uint64_t bits, unsigned length, std::vector<bool> &result) {
+	while (length > 0) {
+		--length;
+		result.push_back((bits >> length) & 1);
+	}
+}
+
+/*
+ * The varint length header is written as groups of a continuation bit
+ * followed by seven value bits, least significant group first. This returns
+ * each group as eight bits ready to be written.
+ */
+template<class Writer>
+static void writeVarint(size_t value, Writer write) {
+	do {
+		write((value >= 0x80 ? 0x80u : 0u) | (value & 0x7F), 8);
+		value >>= 7;
+	} while (value > 0);
+}
+
+static size_t varintBitLength(size_t value) {
+	size_t bits = 8;
+	while (value >= 0x80) {
+		value >>= 7;
+		bits += 8;
+	}
+	return bits;
+}
+
+template<class Bits>
+static size_t readVarint(const Bits &data, size_t &pos) {
+	size_t value = 0;
+	for (unsigned shift = 0; ; shift += 7) {
+		if (pos + 8 > data.size()) {
+			throw HuffmanException("Unexpected End of Data");
+		}
+		if (shift > 8 * sizeof(size_t) - 7) {
+			throw HuffmanException("Malformed Length Header");
+		}
+		bool more = data[pos++];
+		size_t group = 0;
+		for (int bit = 0; bit < 7; ++bit) {
+			group = (group << 1) | data[pos++];
+		}
+		value |= group << shift;
+		if (!more) {
+			return value;
+		}
+	}
 }
 
 
@@ -128,79 +568,621 @@ void HuffmanTable::buildTree() {
  * Bodies for encoding/decoding method bodies
  */
 
-std::vector<bool> HuffmanTable::encode(const std::string &text) const {
+void huffmanMissingCharacter(int c) {
+	std::stringstream ss;
+	ss << "Character ";
+	if (c >= 0x20 && c != 0x7F) {
+		ss << '\'' << codePointToString(c) << "' (" << std::hex << "0x" << c << ") ";
+	} else {
+		ss << std::hex << "0x" << c << ' ';
+	}
+	ss << "Not in Huffman Table";
+	throw HuffmanException(ss.str());
+}
+
+/*
+ * Kept out of line so the common case in writeCode() stays small.
+ */
+const HuffmanCode& HuffmanTable::missingCode(int c) const {
+	if (!escape) {
+		huffmanMissingCharacter(c);
+	}
+	return escapeCode;
+}
+
+const HuffmanCode& HuffmanTable::getEscapeCode() const {
+	if (!escape || !root) {
+		throw HuffmanException("Escape Code Not in Huffman Table");
+	}
+	return escapeCode;
+}
+
+template<class Write>
+void HuffmanTable::writeCode(int c, Write write) const {
+	uint32_t rank = symbolIndex.rank(c);
+	// the end marker is stored under 0, so a NUL in the text can never match it
+	if (rank != HuffmanSymbolIndex::NoSymbol && c != 0) {
+		write(codes[rank].bits, codes[rank].length);
+		return;
+	}
+	const HuffmanCode &code = missingCode(c);
+	write(code.bits, code.length);
+	write(static_cast<uint64_t>(c), EscapeBits);
+}
+
+const HuffmanCode& HuffmanTable::endCode() const {
+	// the end marker sorts first, so it always has rank 0
+	if (symbols.empty() || symbols[0] != 0) {
+		throw HuffmanException("End Marker Not in Huffman Table");
+	}
+	return codes[0];
+}
+
+size_t HuffmanTable::encodedBitLength(std::string_view text) const {
+	if (!root) {
+		throw HuffmanException("Tried to encode with non-existant tree");
+	}
+	size_t bits = lengthPrefixed ? varintBitLength(text.size()) : endCode().length;
+	return bits + symbolsBitLength(text);
+}
+
+std::vector<bool> HuffmanTable::encode(std::string_view text) const {
 	std::vector<bool> result;
-	std::string::const_iterator iter = text.begin();
+	result.reserve(encodedBitLength(text));
+	if (lengthPrefixed) {
+		writeVarint(text.size(), [&result](uint64_t bits, unsigned length) {
+			appendBits(bits, length, result);
+		});
+	}
+
+	auto append = [&result](uint64_t bits, unsigned length) {
+		appendBits(bits, length, result);
+	};
+	auto iter = text.begin();
+	while (iter != text.end()) {
+		writeCode(utf8::next(iter, text.end()), append);
+	}
+	if (!lengthPrefixed) {
+		const HuffmanCode &end = endCode();
+		appendBits(end.bits, end.length, result);
+	}
+	return result;
+}
+
+size_t HuffmanTable::encode(std::string_view text, unsigned char *out, size_t outSize) const {
+	if (!root) {
+		throw HuffmanException("Tried to encode with non-existant tree");
+	}
+	HuffmanBitWriter writer(out, outSize);
+	if (lengthPrefixed) {
+		writeVarint(text.size(), [&writer](uint64_t bits, unsigned length) {
+			writer.write(bits, length);
+		});
+	}
 
+	auto write = [&writer](uint64_t bits, unsigned length) {
+		writer.write(bits, length);
+	};
+	auto iter = text.begin();
+	while (iter != text.end()) {
+		writeCode(utf8::next(iter, text.end()), write);
+	}
+	if (!lengthPrefixed) {
+		const HuffmanCode &end = endCode();
+		writer.write(end.bits, end.length);
+	}
+	return writer.size();
+}
+
+std::vector<bool> HuffmanTable::encodeSymbols(std::string_view text) const {
+	if (!root) {
+		throw HuffmanException("Tried to encode with non-existant tree");
+	}
+	std::vector<bool> result;
+	auto append = [&result](uint64_t bits, unsigned length) {
+		appendBits(bits, length, result);
+	};
+	auto iter = text.begin();
+	while (iter != text.end()) {
+		writeCode(utf8::next(iter, text.end()), append);
+	}
+	return result;
+}
+
+/*
+ * Follow the bits of one code from the root down to a leaf.
+ */
+template<class Bits>
+static const HuffmanNode* walkCode(const HuffmanNode *node, const Bits &data, size_t &pos) {
+	while (node->getType() == HuffmanNode::Branch) {
+		if (pos >= data.size()) {
+			throw HuffmanException("Unexpected End of Data");
+		}
+		node = static_cast<const HuffmanBranch*>(node)->nextNode(data[pos++]);
+	}
+	return node;
+}
+
+/*
+ * Read one code and return the leaf for its character, or nullptr for the
+ * end marker. An escaped character is read into the escaped leaf.
+ */
+template<class Bits>
+const HuffmanLeafChar* HuffmanTable::readCharacter(const Bits &data, size_t &pos, HuffmanLeafChar &escaped) const {
+	const HuffmanNode *node = walkCode(root.get(), data, pos);
+	if (node->getType() == HuffmanNode::SingleChar) {
+		return static_cast<const HuffmanLeafChar*>(node);
+	} else if (node->getType() == HuffmanNode::End) {
+		return nullptr;
+	} else if (node->getType() != HuffmanNode::Escape) {
+		throw HuffmanException("Bad Decode Path");
+	}
+
+	if (data.size() - pos < EscapeBits) {
+		throw HuffmanException("Unexpected End of Data");
+	}
+	int c = 0;
+	for (unsigned bit = 0; bit < EscapeBits; ++bit) {
+		c = (c << 1) | data[pos++];
+	}
+	if (c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF)) {
+		throw HuffmanException("Bad Escaped Character");
+	}
+	escaped.setCharacter(c);
+	return &escaped;
+}
+
+size_t HuffmanTable::readLengthHeader(const std::vector<bool> &data, size_t &pos) const {
+	return readVarint(data, pos);
+}
+
+const HuffmanLeafChar* HuffmanTable::nextLeaf(const std::vector<bool> &data, size_t &pos, HuffmanLeafChar &escaped) const {
+	if (!root) {
+		throw HuffmanException("Tried to decode with non-existant tree");
+	}
+	return readCharacter(data, pos, escaped);
+}
+
+size_t HuffmanTable::encodeSymbols(std::string_view text, unsigned char *out, size_t outSize) const {
+	if (!root) {
+		throw HuffmanException("Tried to encode with non-existant tree");
+	}
+	HuffmanBitWriter writer(out, outSize);
+	auto write = [&writer](uint64_t bits, unsigned length) {
+		writer.write(bits, length);
+	};
+	auto iter = text.begin();
+	while (iter != text.end()) {
+		writeCode(utf8::next(iter, text.end()), write);
+	}
+	return writer.size();
+}
+
+size_t HuffmanTable::symbolsBitLength(std::string_view text) const {
+	if (!root) {
+		throw HuffmanException("Tried to encode with non-existant tree");
+	}
+	size_t bits = 0;
+	auto count = [&bits](uint64_t, unsigned length) {
+		bits += length;
+	};
+	auto iter = text.begin();
+	while (iter != text.end()) {
+		writeCode(utf8::next(iter, text.end()), count);
+	}
+	return bits;
+}
+
+template<class Bits>
+size_t HuffmanTable::measureCharacters(const Bits &data, size_t pos) const {
+	if (!root) {
+		throw HuffmanException("Tried to decode with non-existant tree");
+	}
+	if (lengthPrefixed) {
+		return readVarint(data, pos);
+	}
+
+	size_t length = 0;
+	HuffmanLeafChar escaped;
 	while (true) {
-		int c = 0;
-		if (iter != text.end()) {
-			c = utf8::next(iter, text.end());
+		const HuffmanLeafChar *leaf = readCharacter(data, pos, escaped);
+		if (!leaf) {
+			return length;
 		}
+		length += leaf->getUtf8Length();
+	}
+}
 
-		HuffmanNode *node = root;
-		while (node->getType() == HuffmanNode::Branch) {
-			HuffmanBranch *branch = dynamic_cast<HuffmanBranch*>(node);
-			if (!branch) {
-				return result;
-			}
+template<class Bits>
+size_t HuffmanTable::decodeCharacters(const Bits &data, size_t &pos, char *out, size_t outSize, bool untilEnd) const {
+	if (!root) {
+		throw HuffmanException("Tried to decode with non-existant tree");
+	}
+	size_t written = 0;
+	HuffmanLeafChar escaped;
 
-			if (branch->getLeft()->contains(c)) {
-				node = branch->getLeft();
-				result.push_back(false);
-			} else if (branch->getRight()->contains(c)) {
-				node = branch->getRight();
-				result.push_back(true);
-			} else {
-				std::stringstream ss;
-				ss << "Character ";
-				if (c >= 0x20 && c != 0x7F) {
-					ss << '\'' << static_cast<char>(c) << "' (" << std::hex << "0x" << c << ") ";
-				} else {
-					ss << std::hex << "0x" << c << ' ';
-				}
-				ss << "Not in Huffman Table";
-				throw HuffmanException(ss.str());
+	while (untilEnd || written < outSize) {
+		const HuffmanLeafChar *leaf = readCharacter(data, pos, escaped);
+		if (!leaf) {
+			if (untilEnd) {
+				return written;
 			}
+			throw HuffmanException("Bad Decode Path");
 		}
 
-		if (c == 0) {
-			return result;
+		size_t length = leaf->getUtf8Length();
+		if (outSize - written < length) {
+			throw HuffmanException(untilEnd ? "Output Buffer Too Small" : "Decoded Length Mismatch");
 		}
+		std::memcpy(out + written, leaf->getUtf8(), length);
+		written += length;
 	}
+	return written;
 }
 
 std::string HuffmanTable::decode(const std::vector<bool> &data) const {
+	if (lengthPrefixed) {
+		size_t pos = 0;
+		size_t byteLength = readVarint(data, pos);
+		// every code is at least one bit unless the tree is a single leaf
+		if (root && root->getType() == HuffmanNode::Branch && byteLength / 4 > data.size() - pos) {
+			throw HuffmanException("Malformed Length Header");
+		}
+		std::string result(byteLength, '\0');
+		decodeCharacters(data, pos, &result[0], result.size(), false);
+		return result;
+	}
+
+	if (!root) {
+		throw HuffmanException("Tried to decode with non-existant tree");
+	}
 	std::string result;
 	size_t pos = 0;
+	HuffmanLeafChar escaped;
 
-	while (pos < data.size()) {
-		HuffmanNode *node = root;
-		while (node->getType() == HuffmanNode::Branch) {
-			HuffmanBranch *branch = dynamic_cast<HuffmanBranch*>(node);
-			if (!branch) {
-				throw HuffmanException("Malformed Tree in Decoding");
-			}
+	while (true) {
+		const HuffmanLeafChar *leaf = readCharacter(data, pos, escaped);
+		if (!leaf) {
+			return result;
+		}
+		result.append(leaf->getUtf8(), leaf->getUtf8Length());
+	}
+}
 
-			bool bit = data[pos++];
-			node = branch->nextNode(bit);
+std::string HuffmanTable::decode(const std::vector<bool> &data, size_t byteLength) const {
+	std::string result(byteLength, '\0');
+	size_t pos = 0;
+	decodeCharacters(data, pos, &result[0], byteLength, false);
+	return result;
+}
+
+size_t HuffmanTable::decode(const unsigned char *data, size_t bitLength, char *out, size_t outSize) const {
+	PackedBits bits(data, bitLength);
+	size_t pos = 0;
+	if (lengthPrefixed) {
+		size_t length = readVarint(bits, pos);
+		if (length > outSize) {
+			throw HuffmanException("Output Buffer Too Small");
 		}
+		return decodeCharacters(bits, pos, out, length, false);
+	}
+	return decodeCharacters(bits, pos, out, outSize, true);
+}
 
-		switch(node->getType()) {
-			case HuffmanNode::Branch:
-			case HuffmanNode::BadType:
-				throw HuffmanException("Bad Decode Path");
-			case HuffmanNode::SingleChar: {
-				HuffmanLeafChar *leaf = dynamic_cast<HuffmanLeafChar*>(node);
-				if (!leaf) {
-					throw HuffmanException("Malformed Tree in Decoding");
-				}
-				result += codePointToString(leaf->getCharacter());
-				break; }
-			case HuffmanNode::End:
-				return result;
+size_t HuffmanTable::decodeSymbols(const unsigned char *data, size_t bitLength, char *out, size_t byteLength) const {
+	size_t pos = 0;
+	return decodeCharacters(PackedBits(data, bitLength), pos, out, byteLength, false);
+}
+
+size_t HuffmanTable::decodedByteLength(const std::vector<bool> &data) const {
+	return measureCharacters(data, 0);
+}
+
+size_t HuffmanTable::decodedByteLength(const unsigned char *data, size_t bitLength) const {
+	return measureCharacters(PackedBits(data, bitLength), 0);
+}
+
+/*
+ * Read the next character of a packed string for the lazy decoders, or
+ * return nullptr at its end. remaining counts down the bytes left in
+ * length-prefixed strings.
+ */
+const HuffmanLeafChar* HuffmanTable::nextLeaf(const unsigned char *data, size_t bitLength, size_t &pos, size_t &remaining,
+                                              HuffmanLeafChar &escaped) const {
+	if (!root) {
+		throw HuffmanException("Tried to decode with non-existant tree");
+	}
+	if (lengthPrefixed && remaining == 0) {
+		return nullptr;
+	}
+	const HuffmanLeafChar *leaf = readCharacter(PackedBits(data, bitLength), pos, escaped);
+	if (!leaf) {
+		if (lengthPrefixed) {
+			throw HuffmanException("Bad Decode Path");
+		}
+		return nullptr;
+	}
+	if (lengthPrefixed) {
+		if (leaf->getUtf8Length() > remaining) {
+			throw HuffmanException("Decoded Length Mismatch");
+		}
+		remaining -= leaf->getUtf8Length();
+	}
+	return leaf;
+}
+
+std::string HuffmanTable::decodePrefix(const unsigned char *data, size_t bitLength, size_t maxChars) const {
+	if (!root) {
+		throw HuffmanException("Tried to decode with non-existant tree");
+	}
+	size_t pos = 0;
+	size_t remaining = lengthPrefixed ? readVarint(PackedBits(data, bitLength), pos) : 0;
+	std::string result;
+	HuffmanLeafChar escaped;
+	for (size_t i = 0; i < maxChars; ++i) {
+		const HuffmanLeafChar *leaf = nextLeaf(data, bitLength, pos, remaining, escaped);
+		if (!leaf) {
+			break;
+		}
+		result.append(leaf->getUtf8(), leaf->getUtf8Length());
+	}
+	return result;
+}
+
+HuffmanCodePointIterator::HuffmanCodePointIterator(const HuffmanTable &table, const unsigned char *data, size_t bitLength)
+: table(&table), data(data), bitLength(bitLength)
+{
+	if (!table.root) {
+		throw HuffmanException("Tried to decode with non-existant tree");
+	}
+	if (table.lengthPrefixed) {
+		remaining = readVarint(PackedBits(data, bitLength), pos);
+	}
+	++*this;
+}
+
+HuffmanCodePointIterator& HuffmanCodePointIterator::operator++() {
+	HuffmanLeafChar escaped;
+	const HuffmanLeafChar *leaf = table->nextLeaf(data, bitLength, pos, remaining, escaped);
+	if (!leaf) {
+		*this = HuffmanCodePointIterator();
+	} else {
+		character = leaf->getCharacter();
+	}
+	return *this;
+}
+
+
+/* ***************************************************************************
+ * Saving and loading built tables
+ */
+
+static const char tableMagic[4] = { 'H', 'U', 'F', 'T' };
+static const uint32_t tableVersion = 1;
+
+/*
+ * Rebuild the subtree holding symbols [first, last), which must be sorted by
+ * their left aligned codes and all share the same first depth bits.
+ */
+static HuffmanNode* buildFromCodes(const std::vector<std::pair<int, HuffmanCode>> &symbols, const std::map<int,uint64_t> &weights,
+                                   size_t first, size_t last, unsigned depth) {
+	if (last - first == 1 && symbols[first].second.length == depth) {
+		int character = symbols[first].first;
+		uint64_t weight = weights.at(character);
+		if (character == 0) {
+			return new HuffmanLeafEnd(weight);
+		} else if (character == HuffmanTable::EscapeSymbol) {
+			return new HuffmanLeafEscape(weight);
 		}
+		return new HuffmanLeafChar(character, weight);
+	}
+	if (depth >= 64) {
+		throw HuffmanException("Malformed Huffman Table");
 	}
 
-	throw HuffmanException("Unexpected End of Data");
-}
\ No newline at end of file
+	// symbols are sorted, so the ones whose next bit is set are all at the end
+	size_t middle = first;
+	while (middle < last) {
+		const HuffmanCode &code = symbols[middle].second;
+		if (code.length <= depth) {
+			throw HuffmanException("Malformed Huffman Table");
+		}
+		if ((code.bits >> (code.length - depth - 1)) & 1) {
+			break;
+		}
+		++middle;
+	}
+	if (middle == first || middle == last) {
+		throw HuffmanException("Malformed Huffman Table");
+	}
+	std::unique_ptr<HuffmanNode> left(buildFromCodes(symbols, weights, first, middle, depth + 1));
+	HuffmanNode *right = buildFromCodes(symbols, weights, middle, last, depth + 1);
+	return new HuffmanBranch(left.release(), right);
+}
+
+void HuffmanTable::save(std::ostream &out) const {
+	if (!root) {
+		throw HuffmanException("Tried to save non-existant tree");
+	}
+	out.write(tableMagic, sizeof(tableMagic));
+	huffmanWriteU32(out, tableVersion);
+	huffmanWriteU32(out, (lengthPrefixed ? 1 : 0) | (escape ? 2 : 0));
+	huffmanWriteU32(out, static_cast<uint32_t>(codes.size() + (escape ? 1 : 0)));
+	for (size_t i = 0; i < codes.size(); ++i) {
+		huffmanWriteU32(out, static_cast<uint32_t>(symbols[i]));
+		huffmanWriteU64(out, charFrequency.count(symbols[i]));
+		out.put(static_cast<char>(codes[i].length));
+		huffmanWriteU64(out, codes[i].bits);
+	}
+	if (escape) {
+		huffmanWriteU32(out, EscapeSymbol);
+		huffmanWriteU64(out, 1);
+		out.put(static_cast<char>(escapeCode.length));
+		huffmanWriteU64(out, escapeCode.bits);
+	}
+}
+
+void HuffmanTable::load(std::istream &in) {
+	char magic[sizeof(tableMagic)];
+	if (!in.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), tableMagic)) {
+		throw HuffmanException("Not a Huffman Table");
+	}
+	if (huffmanReadU32(in) != tableVersion) {
+		throw HuffmanException("Unsupported Huffman Table Version");
+	}
+	uint32_t flags = huffmanReadU32(in);
+	bool newLengthPrefixed = (flags & 1) != 0;
+	bool newEscape = (flags & 2) != 0;
+	uint32_t count = huffmanReadU32(in);
+	if (count == 0) {
+		throw HuffmanException("Malformed Huffman Table");
+	}
+
+	std::map<int,uint64_t> newFrequency;
+	std::vector<std::pair<int, HuffmanCode>> loaded;
+	for (uint32_t i = 0; i < count; ++i) {
+		int character = static_cast<int>(huffmanReadU32(in));
+		uint64_t weight = huffmanReadU64(in);
+		int length = in.get();
+		uint64_t bits = huffmanReadU64(in);
+		int maxCharacter = newEscape ? EscapeSymbol : 0x10FFFF;
+		if (length < 0 || length > 64 || character < 0 || character > maxCharacter
+				|| (length < 64 && (bits >> length) != 0) || !newFrequency.emplace(character, weight).second) {
+			throw HuffmanException("Malformed Huffman Table");
+		}
+		loaded.push_back(std::make_pair(character, HuffmanCode{bits, static_cast<unsigned>(length)}));
+	}
+	if (newEscape && newFrequency.count(EscapeSymbol) == 0) {
+		throw HuffmanException("Malformed Huffman Table");
+	}
+
+	HuffmanHistogram newHistogram;
+	for (const auto &i : newFrequency) {
+		if (i.first != EscapeSymbol) {
+			newHistogram.add(i.first, i.second);
+		}
+	}
+	rebuildFromCodes(loaded, newFrequency);
+	charFrequency = newHistogram;
+	lengthPrefixed = newLengthPrefixed;
+	escape = newEscape;
+}
+
+/*
+ * Replace the tree with one holding exactly the given codes, leaving the
+ * table untouched if they do not make a whole tree.
+ */
+void HuffmanTable::rebuildFromCodes(std::vector<std::pair<int, HuffmanCode>> &loaded, const std::map<int,uint64_t> &weights) {
+	// order the codes as they appear left to right in the tree
+	std::sort(loaded.begin(), loaded.end(), [](const std::pair<int, HuffmanCode> &lhs, const std::pair<int, HuffmanCode> &rhs) {
+		uint64_t left = lhs.second.length ? lhs.second.bits << (64 - lhs.second.length) : 0;
+		uint64_t right = rhs.second.length ? rhs.second.bits << (64 - rhs.second.length) : 0;
+		return left < right || (left == right && lhs.second.length < rhs.second.length);
+	});
+	root.reset(buildFromCodes(loaded, weights, 0, loaded.size(), 0));
+	buildCodes();
+}
+
+/*
+ * Give each symbol, whose code length is already set, its canonical code:
+ * codes are handed out counting up in order of length and then code point.
+ */
+static void assignCanonicalCodes(std::vector<std::pair<int, HuffmanCode>> &symbols) {
+	std::sort(symbols.begin(), symbols.end(), [](const std::pair<int, HuffmanCode> &lhs, const std::pair<int, HuffmanCode> &rhs) {
+		return lhs.second.length < rhs.second.length
+		       || (lhs.second.length == rhs.second.length && lhs.first < rhs.first);
+	});
+	uint64_t next = 0;
+	unsigned length = 0;
+	for (auto &i : symbols) {
+		next <<= i.second.length - length;
+		length = i.second.length;
+		if (length < 64 && (next >> length) != 0) {
+			throw HuffmanException("Malformed Huffman Table");
+		}
+		i.second.bits = next++;
+	}
+}
+
+void HuffmanTable::saveCodeLengths(std::ostream &out) const {
+	if (!root) {
+		throw HuffmanException("Tried to save non-existant tree");
+	}
+	out.put(static_cast<char>((lengthPrefixed ? 1 : 0) | (escape ? 2 : 0)));
+	huffmanWriteVarint(out, codes.size() + (escape ? 1 : 0));
+	int previous = -1;
+	for (size_t i = 0; i < codes.size(); ++i) {
+		huffmanWriteVarint(out, static_cast<uint64_t>(symbols[i] - previous - 1));
+		out.put(static_cast<char>(codes[i].length));
+		previous = symbols[i];
+	}
+	if (escape) {
+		huffmanWriteVarint(out, static_cast<uint64_t>(EscapeSymbol - previous - 1));
+		out.put(static_cast<char>(escapeCode.length));
+	}
+}
+
+void HuffmanTable::loadCodeLengths(std::istream &in) {
+	int flags = in.get();
+	if (flags < 0 || flags > 3) {
+		throw HuffmanException("Malformed Huffman Table");
+	}
+	bool newLengthPrefixed = (flags & 1) != 0;
+	bool newEscape = (flags & 2) != 0;
+	uint64_t count = huffmanReadVarint(in);
+	if (count == 0 || count > static_cast<uint64_t>(EscapeSymbol) + 1) {
+		throw HuffmanException("Malformed Huffman Table");
+	}
+
+	std::vector<std::pair<int, HuffmanCode>> loaded;
+	int64_t previous = -1;
+	unsigned longest = 0;
+	for (uint64_t i = 0; i < count; ++i) {
+		uint64_t delta = huffmanReadVarint(in);
+		int length = in.get();
+		if (delta > static_cast<uint64_t>(EscapeSymbol) || previous + 1 + static_cast<int64_t>(delta) > EscapeSymbol
+				|| length < 0 || length > 64) {
+			throw HuffmanException("Malformed Huffman Table");
+		}
+		previous += 1 + static_cast<int64_t>(delta);
+		loaded.push_back(std::make_pair(static_cast<int>(previous), HuffmanCode{0, static_cast<unsigned>(length)}));
+		longest = std::max(longest, static_cast<unsigned>(length));
+	}
+	// only the escape code may sit above the last code point
+	if ((previous == EscapeSymbol) != newEscape) {
+		throw HuffmanException("Malformed Huffman Table");
+	}
+
+	std::map<int,uint64_t> weights;
+	HuffmanHistogram newHistogram;
+	for (const auto &i : loaded) {
+		uint64_t weight = longest - i.second.length < 64 ? uint64_t{1} << (longest - i.second.length) : UINT64_MAX;
+		weights.emplace(i.first, weight);
+		if (i.first != EscapeSymbol) {
+			newHistogram.add(i.first, weight);
+		}
+	}
+	assignCanonicalCodes(loaded);
+	rebuildFromCodes(loaded, weights);
+	charFrequency = newHistogram;
+	lengthPrefixed = newLengthPrefixed;
+	escape = newEscape;
+}
+
+void HuffmanTable::makeCanonical() {
+	if (!root) {
+		throw HuffmanException("Tried to reassign codes of non-existant tree");
+	}
+	std::vector<std::pair<int, HuffmanCode>> current;
+	std::map<int,uint64_t> weights;
+	for (size_t i = 0; i < codes.size(); ++i) {
+		current.push_back(std::make_pair(symbols[i], codes[i]));
+		weights.emplace(symbols[i], charFrequency.count(symbols[i]));
+	}
+	if (escape) {
+		current.push_back(std::make_pair(static_cast<int>(EscapeSymbol), escapeCode));
+		weights.emplace(EscapeSymbol, 1);
+	}
+	assignCanonicalCodes(current);
+	rebuildFromCodes(current, weights);
+}
@@ -1,11 +1,22 @@
 #ifndef HUFFMAN_H
 #define HUFFMAN_H
 
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
 #include <iosfwd>
+#include <iterator>
 #include <map>
+#include <memory>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <type_traits>
 #include <vector>
 
+#include "huffman_histogram.h"
+#include "huffman_symbols.h"
+
 /**
  * General exception class for exceptions that occur within this library.
  */
@@ -22,6 +33,53 @@ private:
     std::string message;
 };
 
+/**
+ * The code assigned to a single character by a built Huffman table.
+ */
+struct HuffmanCode {
+	/** The bits of the code, right aligned. */
+	uint64_t bits;
+	/** The number of bits in the code. */
+	unsigned length;
+};
+
+/**
+ * How well the text a table's frequencies were gathered from would compress.
+ * See HuffmanTable::estimateCost().
+ */
+struct HuffmanCostEstimate {
+	/** The number of coded symbols: characters, plus end markers unless the
+	 *  table is length-prefixed. */
+	uint64_t symbols;
+	/** The number of UTF-8 bytes of text the frequencies were gathered from. */
+	uint64_t inputBytes;
+	/** The Shannon entropy of the symbols, in bits per symbol. */
+	double entropy;
+	/** The exact number of bits an optimal Huffman code needs for every
+	 *  symbol. */
+	uint64_t huffmanBits;
+
+	/** @return The Shannon lower bound for all symbols, in bits. */
+	double entropyBits() const {
+		return entropy * symbols;
+	}
+	/** @return huffmanBits relative to the size of the input. */
+	double ratio() const {
+		return inputBytes ? huffmanBits / (8.0 * inputBytes) : 0.0;
+	}
+};
+
+/**
+ * Compute optimal Huffman code lengths directly from a list of weights,
+ * without building a tree. The total cost matches that of the tree built by
+ * HuffmanTable::buildTree() for the same weights, though ties may give
+ * individual symbols different lengths.
+ * @param weights The weight of every symbol.
+ * @return The code length of every symbol, in the same order. A single
+ *         symbol gets a length of zero.
+ */
+std::vector<unsigned> huffmanCodeLengths(const std::vector<uint64_t> &weights);
+
 /**
  * Base class for all nodes that occur in the Huffman table.
  */
@@ -32,18 +90,19 @@ public:
 		Branch = 0,
 		End = 1,
 		SingleChar = 2,
+		Escape = 3,
 	};
 
-	explicit HuffmanNode(int weight = 0, NodeType type = HuffmanNode::BadType)
+	explicit HuffmanNode(uint64_t weight = 0, NodeType type = HuffmanNode::BadType)
 		: _weight(weight), _type(type)
 	{ }
 	virtual ~HuffmanNode() {
 	}
 
-	int getWeight() const {
+	uint64_t getWeight() const {
 		return _weight;
 	}
-	void setWeight(int weight) {
+	void setWeight(uint64_t weight) {
 		_weight = weight;
 	}
 
@@ -57,7 +116,7 @@ public:
 	virtual void dump(std::ostream &out, std::string s) const = 0;
 	virtual bool contains(int character) const = 0;
 private:
-	int _weight;
+	uint64_t _weight;
 	NodeType _type;
 };
 
@@ -66,15 +125,29 @@ private:
  */
 class HuffmanLeafChar : public HuffmanNode {
 public:
-	explicit HuffmanLeafChar(int character = 0, int weight = 0)
-	: HuffmanNode(weight, HuffmanNode::SingleChar), _character(character)
-	{ }
+	explicit HuffmanLeafChar(int character = 0, uint64_t weight = 0)
+	: HuffmanNode(weight, HuffmanNode::SingleChar)
+	{
+		setCharacter(character);
+	}
 
 	int getCharacter() const {
 		return _character;
 	}
-	void setCharacter(int character) {
-		_character = character;
+	void setCharacter(int character);
+
+	/**
+	 * @return The UTF-8 encoding of the character, precomputed so decoding
+	 *         only needs to copy it. This is not NUL terminated.
+	 */
+	const char* getUtf8() const {
+		return _utf8;
+	}
+	/**
+	 * @return The length in bytes of the UTF-8 encoding of the character.
+	 */
+	size_t getUtf8Length() const {
+		return _utf8Length;
 	}
 
 	virtual bool contains(int character) const {
@@ -84,6 +157,8 @@ public:
 	virtual void dump(std::ostream &out, std::string s) const;
 private:
 	int _character;
+	char _utf8[4];
+	unsigned char _utf8Length;
 };
 
 /**
@@ -91,7 +166,7 @@ private:
  */
 class HuffmanLeafEnd : public HuffmanNode {
 public:
-	explicit HuffmanLeafEnd(int weight = 0)
+	explicit HuffmanLeafEnd(uint64_t weight = 0)
 	: HuffmanNode(weight, HuffmanNode::End)
 	{ }
 
@@ -102,16 +177,41 @@ public:
 };
 
 /**
- * General branch node for Huffman table.
+ * Leaf-node for Huffman table repersenting an escaped character, whose code
+ * point follows the code as a raw HuffmanTable::EscapeBits bit number.
+ */
+class HuffmanLeafEscape : public HuffmanNode {
+public:
+	explicit HuffmanLeafEscape(uint64_t weight = 0)
+	: HuffmanNode(weight, HuffmanNode::Escape)
+	{ }
+
+	virtual bool contains(int) const {
+		return false;
+	}
+	virtual void dump(std::ostream &out, std::string s) const;
+};
+
+/**
+ * General branch node for Huffman table. A branch owns its children and
+ * deletes them with itself.
  */
 class HuffmanBranch : public HuffmanNode {
 public:
 	HuffmanBranch(HuffmanNode *left, HuffmanNode *right)
 	 : HuffmanNode(0, HuffmanNode::Branch), _left(left), _right(right)
 	{
-		setWeight(_left->getWeight() + _right->getWeight());
+		// saturate like HuffmanHistogram counts, rather than wrapping
+		setWeight(_left->getWeight() + std::min(_right->getWeight(), UINT64_MAX - _left->getWeight()));
+	}
+	virtual ~HuffmanBranch() {
+		delete _left;
+		delete _right;
 	}
 
+	HuffmanBranch(const HuffmanBranch&) = delete;
+	HuffmanBranch& operator=(const HuffmanBranch&) = delete;
+
 	HuffmanNode* nextNode(bool right) {
 		if (right) {
 			return _right;
@@ -146,12 +246,101 @@ private:
 	HuffmanNode *_left, *_right;
 };
 
+class HuffmanTable;
+
+/**
+ * A forward iterator over the code points of a packed encoded string. Each
+ * character is decoded only when the iterator is advanced to it, so reading
+ * the first few characters of a long string costs only those characters.
+ * Obtained from HuffmanTable::codePoints(); the table and the data must
+ * outlive it. A default constructed iterator is the end iterator.
+ */
+class HuffmanCodePointIterator {
+public:
+	using iterator_category = std::forward_iterator_tag;
+	using value_type = int;
+	using difference_type = std::ptrdiff_t;
+	using pointer = const int*;
+	using reference = const int&;
+
+	HuffmanCodePointIterator() = default;
+
+	reference operator*() const {
+		return character;
+	}
+
+    /**
+     * Decode the next character.
+     * @throw HuffmanException Thrown if the data is truncated or corrupt.
+     */
+	HuffmanCodePointIterator& operator++();
+
+	HuffmanCodePointIterator operator++(int) {
+		HuffmanCodePointIterator old = *this;
+		++*this;
+		return old;
+	}
+
+	bool operator==(const HuffmanCodePointIterator &other) const {
+		return table == other.table && data == other.data && pos == other.pos;
+	}
+	bool operator!=(const HuffmanCodePointIterator &other) const {
+		return !(*this == other);
+	}
+
+    /** @return The number of bits read so far, including the character
+     *          the iterator points at. */
+	size_t getBitPosition() const {
+		return pos;
+	}
+
+private:
+	friend class HuffmanTable;
+	HuffmanCodePointIterator(const HuffmanTable &table, const unsigned char *data, size_t bitLength);
+
+	const HuffmanTable *table = nullptr;
+	const unsigned char *data = nullptr;
+	size_t bitLength = 0;
+	size_t pos = 0;
+	// bytes left to decode in length-prefixed strings
+	size_t remaining = 0;
+	int character = 0;
+};
+
+/**
+ * The code points of a packed encoded string, for use in range-based for
+ * loops and standard algorithms. See HuffmanTable::codePoints().
+ */
+class HuffmanCodePointRange {
+public:
+	explicit HuffmanCodePointRange(HuffmanCodePointIterator first)
+	: first(first)
+	{ }
+
+	HuffmanCodePointIterator begin() const {
+		return first;
+	}
+	HuffmanCodePointIterator end() const {
+		return HuffmanCodePointIterator();
+	}
+
+private:
+	HuffmanCodePointIterator first;
+};
+
 /**
  * Main class for the Huffman table. Handles building the table as well as
- * encoding and decoding strings.
+ * encoding and decoding strings. A table owns its tree; copying a table
+ * copies the tree, and moving one moves it.
  */
 class HuffmanTable {
 public:
+	HuffmanTable() = default;
+	HuffmanTable(const HuffmanTable &other);
+	HuffmanTable(HuffmanTable&&) = default;
+	HuffmanTable& operator=(const HuffmanTable &other);
+	HuffmanTable& operator=(HuffmanTable&&) = default;
+
     /**
      * Encode a string into a block of binary data.
      * @param text The text to encode.
@@ -159,7 +348,76 @@ public:
      * @throw HuffmanException Thrown if an error occurs during the encoding
      *                         process.
      */
-	std::vector<bool> encode(const std::string &text) const;
+	std::vector<bool> encode(std::string_view text) const;
+
+    /**
+     * Encode the text in the range [first, last) into a block of binary data.
+     * @param first Pointer to the start of the text to encode.
+     * @param last Pointer one past the end of the text to encode.
+     * @return The encoded version of the string.
+     * @throw HuffmanException Thrown if an error occurs during the encoding
+     *                         process.
+     */
+	std::vector<bool> encode(const char *first, const char *last) const {
+		return encode(std::string_view(first, last - first));
+	}
+
+    /**
+     * Encode only the code words for the characters of a string, with neither
+     * an end marker nor a length header. The decoded length must be stored
+     * out of band (for example in a string bank index) and passed to
+     * decode(const std::vector<bool>&, size_t).
+     * @param text The text to encode.
+     * @return The encoded version of the string.
+     * @throw HuffmanException Thrown if an error occurs during the encoding
+     *                         process.
+     */
+	std::vector<bool> encodeSymbols(std::string_view text) const;
+
+    /**
+     * Encode only the code words for the characters of a string into a caller
+     * supplied buffer, packed most significant bit first. See
+     * encodeSymbols(std::string_view).
+     * @param text The text to encode.
+     * @param out The buffer to write the encoded bits into.
+     * @param outSize The size of the buffer in bytes.
+     * @return The number of bits written.
+     * @throw HuffmanException Thrown if an error occurs during the encoding
+     *                         process or the buffer is too small.
+     */
+	size_t encodeSymbols(std::string_view text, unsigned char *out, size_t outSize) const;
+
+    /**
+     * Calculate the number of bits encodeSymbols() will produce for a string.
+     * @param text The text to measure.
+     * @return The encoded length in bits.
+     * @throw HuffmanException Thrown if the text contains a character that is
+     *                         not in the table.
+     */
+	size_t symbolsBitLength(std::string_view text) const;
+
+    /**
+     * Encode a string into a caller supplied buffer, packed most significant
+     * bit first. Use encodedBitLength() to size the buffer exactly.
+     * @param text The text to encode.
+     * @param out The buffer to write the encoded bits into.
+     * @param outSize The size of the buffer in bytes.
+     * @return The number of bits written.
+     * @throw HuffmanException Thrown if an error occurs during the encoding
+     *                         process or the buffer is too small.
+     */
+	size_t encode(std::string_view text, unsigned char *out, size_t outSize) const;
+
+    /**
+     * Calculate the number of bits encode() will produce for a string using
+     * only the code length table.
+     * @param text The text to measure.
+     * @return The encoded length in bits, including the end marker or length
+     *         header.
+     * @throw HuffmanException Thrown if the text contains a character that is
+     *                         not in the table.
+     */
+	size_t encodedBitLength(std::string_view text) const;
 
     /**
      * Decode an encoded string back into a block of text.
@@ -170,13 +428,234 @@ public:
      */
 	std::string decode(const std::vector<bool> &data) const;
 
+    /**
+     * Decode a string produced by encodeSymbols() whose decoded length is
+     * already known. The output is allocated once up front and no end marker
+     * is needed.
+     * @param data The encoded string to decode.
+     * @param byteLength The length of the decoded string in bytes.
+     * @return The unencoded version of the string.
+     * @throw HuffmanException Thrown if an error occurs during the decoding
+     *                         process.
+     */
+	std::string decode(const std::vector<bool> &data, size_t byteLength) const;
+
+    /**
+     * Decode a packed string produced by encodeSymbols() whose decoded length
+     * is already known into a caller supplied buffer.
+     * @param data The encoded string, packed most significant bit first.
+     * @param bitLength The number of valid bits in data.
+     * @param out The buffer to write the decoded text into.
+     * @param byteLength The length of the decoded string in bytes; out must
+     *                   be at least this large.
+     * @return The number of bytes written, which is always byteLength.
+     * @throw HuffmanException Thrown if an error occurs during the decoding
+     *                         process.
+     */
+	size_t decodeSymbols(const unsigned char *data, size_t bitLength, char *out, size_t byteLength) const;
+
+    /**
+     * Decode a packed encoded string into a caller supplied buffer. The output
+     * is not NUL terminated. Use decodedByteLength() to size the buffer
+     * exactly.
+     * @param data The encoded string, packed most significant bit first.
+     * @param bitLength The number of valid bits in data.
+     * @param out The buffer to write the decoded text into.
+     * @param outSize The size of the output buffer in bytes.
+     * @return The number of bytes written.
+     * @throw HuffmanException Thrown if an error occurs during the decoding
+     *                         process or the buffer is too small.
+     */
+	size_t decode(const unsigned char *data, size_t bitLength, char *out, size_t outSize) const;
+
+    /**
+     * Decode an encoded string, writing the UTF-8 bytes of the text to an
+     * output iterator rather than building a string. Each character is
+     * copied from the bytes precomputed in its leaf. Integer arguments
+     * select decode(const std::vector<bool>&, size_t) instead.
+     * @param data The encoded string to decode.
+     * @param out The output iterator to write the decoded bytes to.
+     * @return The output iterator after the last byte written.
+     * @throw HuffmanException Thrown if an error occurs during the decoding
+     *                         process.
+     */
+	template<class OutputIt, class = std::enable_if_t<!std::is_integral_v<OutputIt>>>
+	OutputIt decode(const std::vector<bool> &data, OutputIt out) const {
+		size_t pos = 0;
+		size_t remaining = lengthPrefixed ? readLengthHeader(data, pos) : 0;
+		HuffmanLeafChar escaped;
+		while (!lengthPrefixed || remaining > 0) {
+			const HuffmanLeafChar *leaf = nextLeaf(data, pos, escaped);
+			if (!leaf) {
+				if (lengthPrefixed) {
+					throw HuffmanException("Bad Decode Path");
+				}
+				return out;
+			}
+			if (lengthPrefixed) {
+				if (leaf->getUtf8Length() > remaining) {
+					throw HuffmanException("Decoded Length Mismatch");
+				}
+				remaining -= leaf->getUtf8Length();
+			}
+			out = std::copy_n(leaf->getUtf8(), leaf->getUtf8Length(), out);
+		}
+		return out;
+	}
+
+    /**
+     * Calculate the number of bytes decode() will produce for an encoded
+     * string. For length-prefixed tables this only reads the header;
+     * otherwise the codes are walked without producing any output.
+     * @param data The encoded string to measure.
+     * @return The decoded length in bytes.
+     * @throw HuffmanException Thrown if the data is truncated or corrupt.
+     */
+	size_t decodedByteLength(const std::vector<bool> &data) const;
+
+    /**
+     * Calculate the number of bytes decode() will produce for a packed
+     * encoded string.
+     * @param data The encoded string, packed most significant bit first.
+     * @param bitLength The number of valid bits in data.
+     * @return The decoded length in bytes.
+     * @throw HuffmanException Thrown if the data is truncated or corrupt.
+     */
+	size_t decodedByteLength(const unsigned char *data, size_t bitLength) const;
+
+    /**
+     * Iterate over the code points of a packed encoded string, decoding each
+     * character only when it is reached. The first character is decoded
+     * here; errors in the data are reported as the iterator reaches them.
+     * @param data The encoded string, packed most significant bit first.
+     * @param bitLength The number of valid bits in data.
+     * @return The range of code points.
+     * @throw HuffmanException Thrown if the data is truncated or corrupt.
+     */
+	HuffmanCodePointRange codePoints(const unsigned char *data, size_t bitLength) const {
+		return HuffmanCodePointRange(HuffmanCodePointIterator(*this, data, bitLength));
+	}
+
+    /**
+     * Decode at most the first maxChars characters of a packed encoded
+     * string, for previews and comparisons that stop early. Only the codes
+     * of those characters are read.
+     * @param data The encoded string, packed most significant bit first.
+     * @param bitLength The number of valid bits in data.
+     * @param maxChars The most characters (code points) to decode.
+     * @return The decoded prefix.
+     * @throw HuffmanException Thrown if the part of the data read is
+     *                         truncated or corrupt.
+     */
+	std::string decodePrefix(const unsigned char *data, size_t bitLength, size_t maxChars) const;
+
+    /**
+     * Selects how the end of an encoded string is found. By default encode()
+     * appends the end marker code. In length-prefixed mode the end marker is
+     * left out of the tree entirely and encode() instead writes the decoded
+     * length in bytes as a varint header (groups of a continuation bit
+     * followed by seven value bits, least significant group first). This
+     * must be set before calling buildTree().
+     * @param lengthPrefixed True to use length-prefixed strings.
+     */
+	void setLengthPrefixed(bool lengthPrefixed) {
+		this->lengthPrefixed = lengthPrefixed;
+	}
+
+    /**
+     * @return True if this table uses length-prefixed strings rather than an
+     *         end marker.
+     */
+	bool isLengthPrefixed() const {
+		return lengthPrefixed;
+	}
+
+    /**
+     * Selects whether the tree has an escape code. Characters that are not
+     * in the table are then encoded as the escape code followed by their
+     * code point as a raw EscapeBits bit number, rather than making the
+     * encoder throw. The escape code is given the smallest possible weight,
+     * so it costs the other characters very little. This must be set before
+     * calling buildTree().
+     * @param escape True to add an escape code.
+     */
+	void setEscape(bool escape) {
+		this->escape = escape;
+	}
+
+    /**
+     * @return True if this table has an escape code.
+     */
+	bool hasEscape() const {
+		return escape;
+	}
+
+    /**
+     * Makes buildTree() build from a copy of the frequencies rescaled with
+     * HuffmanHistogram::rescale(), so tables trained on corpora of very
+     * different sizes are built from weights of the same size, and no code
+     * is longer than the total allows. The frequencies themselves, which
+     * save() stores and the cost estimates use, keep their exact counts.
+     * This must be set before calling buildTree().
+     * @param total The total to rescale to, or zero to build from the exact
+     *              counts, which is the default.
+     */
+	void setRescaleTotal(uint64_t total) {
+		rescaleTotal = total;
+	}
+
+    /**
+     * @return The total buildTree() rescales the frequencies to, or zero.
+     */
+	uint64_t getRescaleTotal() const {
+		return rescaleTotal;
+	}
+
+    /**
+     * @return The escape code of the built table.
+     * @throw HuffmanException Thrown if the table has no escape code.
+     */
+	const HuffmanCode& getEscapeCode() const;
+
+    /** The number of bits of code point that follow the escape code. */
+	static constexpr unsigned EscapeBits = 21;
+
+    /** The character the escape code is stored under by save(). */
+	static constexpr int EscapeSymbol = 0x110000;
+
     /**
      * Use the provided text to add to the frequencies data used to build the
      * Huffman table. This does not actually build the table; see buildTree()
      * for that.
      * @param  text  The text to add the frequencies of.
      */
-	void addFrequencies(const std::string &text);
+	void addFrequencies(std::string_view text);
+
+    /**
+     * Add to the frequency of a single character. A character of 0 adds to
+     * the frequency of the end marker.
+     * @param character The code point to add the frequency of.
+     * @param count The amount to add.
+     */
+	void addFrequency(int character, uint64_t count = 1) {
+		charFrequency.add(character, count);
+	}
+
+    /**
+     * Merge frequencies gathered elsewhere, for example by HuffmanHistogram
+     * objects filled on other machines and loaded from disk.
+     * @param histogram The frequencies to add.
+     */
+	void addFrequencies(const HuffmanHistogram &histogram) {
+		charFrequency.merge(histogram);
+	}
+
+    /**
+     * @return The frequencies gathered so far, or loaded with the table.
+     */
+	const HuffmanHistogram& getFrequencies() const {
+		return charFrequency;
+	}
 
     /**
      * Makes sure every standard ascii character has a frequency of at least
@@ -192,6 +671,30 @@ public:
      */
 	void dumpFrequencies(std::ostream &out) const;
 
+    /**
+     * Estimate how well the text given to addFrequencies() would compress,
+     * without building the tree. Code lengths are computed directly from the
+     * sorted weights, so this is cheap enough to call for many candidate
+     * corpora. Length headers are not included, as they depend on the
+     * lengths of the individual strings.
+     * @return The entropy and the exact Huffman cost of the frequencies.
+     */
+	HuffmanCostEstimate estimateCost() const;
+
+    /**
+     * Calculate the number of bits needed to encode the text given to
+     * addFrequencies() using the codes of another built table, which may be
+     * this one. Only the code length table of the other table is used.
+     * @param table The table whose codes to price the frequencies with.
+     * @return The cost in bits, or NotEncodable if the text contains a
+     *         character that table cannot encode and it has no escape code.
+     * @throw HuffmanException Thrown if the other table has not been built.
+     */
+	uint64_t costWith(const HuffmanTable &table) const;
+
+    /** Returned by costWith() for text that the table cannot encode. */
+	static constexpr uint64_t NotEncodable = UINT64_MAX;
+
     /**
      * Use previously gathered frequency data to build the Huffman
      * encoding/decoding tree.
@@ -199,15 +702,157 @@ public:
 	void buildTree();
 
     /**
-     * Dumps a Graphviz DOT file containing a graph of the Huffman encoding
-     * tree to std::cout
+     * Dumps a plain text listing of the code for every leaf of the Huffman
+     * tree, one per line. See writeDot() for a graph of the tree.
 	 * @param out The output stream to dump the Huffman tree data to.
      */
 	void dumpTree(std::ostream &out) const;
 
+    /**
+     * Writes a Graphviz DOT graph of the Huffman tree. Branches show their
+     * weight, leaves their character, weight and code length, and edges the
+     * bit that selects them.
+	 * @param out The output stream to write the graph to.
+     */
+	void writeDot(std::ostream &out) const;
+
+    /**
+     * Writes the table as a JSON object holding its options and an array
+     * with the character, weight and code of every symbol, in rank order.
+     * The end marker and escape code appear as "end" and "escape" symbols.
+	 * @param out The output stream to write the JSON to.
+     */
+	void writeJson(std::ostream &out) const;
+
+    /**
+     * @return The number of codes of each length, indexed by length, for
+     *         every symbol including the end marker and escape code.
+     */
+	std::vector<size_t> getCodeLengthCounts() const;
+
+    /**
+     * Dumps a summary of the code lengths: the number of symbols, the
+     * shortest, longest and weighted average code, and how many codes there
+     * are of each length.
+	 * @param out The output stream to dump the summary to.
+     */
+	void dumpCodeLengths(std::ostream &out) const;
+
+    /**
+     * Writes a self-contained C++ header containing an encoder and decoder
+     * specialized to this table. The decoder looks up eight bits at a time
+     * in generated tables, much as HuffmanDecodeTable does, and the encoder
+     * uses tables sized exactly to this alphabet. Both work on caller
+     * supplied buffers with the encoded data packed most significant bit
+     * first into bytes.
+     * @param out The output stream to write the generated source to.
+     * @param name The namespace to place the generated code in.
+     * @throw HuffmanException Thrown if the tree has not been built, has a
+     *                         code longer than 64 bits, has no end marker
+     *                         because it is length-prefixed, or has an
+     *                         escape code.
+     */
+	void writeDecoderSource(std::ostream &out, const std::string &name) const;
+
+    /**
+     * Writes the built table to a binary stream. Every symbol is stored with
+     * its weight and its code, so load() restores exactly the same codes
+     * without having to rebuild the tree from the frequencies.
+     * @param out The stream to write the table to.
+     * @throw HuffmanException Thrown if the tree has not been built.
+     */
+	void save(std::ostream &out) const;
+
+    /**
+     * Replaces this table with one previously written by save().
+     * @param in The stream to read the table from.
+     * @throw HuffmanException Thrown if the data is not a valid table.
+     */
+	void load(std::istream &in);
+
+    /**
+     * Writes the built table compactly, for the header of data encoded with
+     * it. Only the code length of each symbol is stored, after the distance
+     * from the previous symbol's code point; weights and codes are left out,
+     * and loadCodeLengths() assigns the codes canonically. Call
+     * makeCanonical() before encoding with a table saved this way.
+     * @param out The stream to write the table to.
+     * @throw HuffmanException Thrown if the tree has not been built.
+     */
+	void saveCodeLengths(std::ostream &out) const;
+
+    /**
+     * Replaces this table with one previously written by saveCodeLengths(),
+     * with canonical codes. Weights are not stored, so each symbol is given
+     * the weight 2^(longest code length - its code length), which builds
+     * codes of the same lengths.
+     * @param in The stream to read the table from.
+     * @throw HuffmanException Thrown if the data is not a valid table.
+     */
+	void loadCodeLengths(std::istream &in);
+
+    /**
+     * Reassigns the codes canonically, keeping the length of each: shorter
+     * codes come first, and codes of the same length are in order of code
+     * point, with the escape code last. The frequencies are kept.
+     * @throw HuffmanException Thrown if the tree has not been built.
+     */
+	void makeCanonical();
+
+    /**
+     * @return The characters of the built table in ascending order, which
+     *         gives each its rank. The end marker, if any, is stored as 0
+     *         and so always has rank 0.
+     */
+	const std::vector<int>& getSymbols() const {
+		return symbols;
+	}
+
+    /**
+     * @return The code assigned to every character of the built table,
+     *         indexed by rank.
+     */
+	const std::vector<HuffmanCode>& getCodes() const {
+		return codes;
+	}
+
+    /**
+     * @return The index mapping the characters of the built table to their
+     *         ranks.
+     */
+	const HuffmanSymbolIndex& getSymbolIndex() const {
+		return symbolIndex;
+	}
+
 private:
-	HuffmanNode *root;
-	std::map<int,int> charFrequency;
+	void buildCodes();
+	void rebuildFromCodes(std::vector<std::pair<int, HuffmanCode>> &loaded, const std::map<int,uint64_t> &weights);
+	size_t readLengthHeader(const std::vector<bool> &data, size_t &pos) const;
+	const HuffmanLeafChar* nextLeaf(const std::vector<bool> &data, size_t &pos, HuffmanLeafChar &escaped) const;
+	friend class HuffmanCodePointIterator;
+	friend class HuffmanTableCache;
+	const HuffmanLeafChar* nextLeaf(const unsigned char *data, size_t bitLength, size_t &pos, size_t &remaining,
+	                                HuffmanLeafChar &escaped) const;
+	const HuffmanCode& missingCode(int c) const;
+	const HuffmanCode& endCode() const;
+	template<class Write>
+	void writeCode(int c, Write write) const;
+	template<class Bits>
+	const HuffmanLeafChar* readCharacter(const Bits &data, size_t &pos, HuffmanLeafChar &escaped) const;
+	template<class Bits>
+	size_t measureCharacters(const Bits &data, size_t pos) const;
+	template<class Bits>
+	size_t decodeCharacters(const Bits &data, size_t &pos, char *out, size_t outSize, bool untilEnd) const;
+
+	std::unique_ptr<HuffmanNode> root;
+	HuffmanHistogram charFrequency;
+	std::vector<int> symbols;
+	std::vector<HuffmanCode> codes;
+	HuffmanSymbolIndex symbolIndex;
+	HuffmanCode escapeCode = HuffmanCode{0, 0};
+	uint64_t rescaleTotal = 0;
+	bool lengthPrefixed = false;
+	bool escape = false;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,138 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "huffman.h"
+
+
+static unsigned utf8Length(int codePoint) {
+	return codePoint < 0x80 ? 1 : codePoint < 0x800 ? 2 : codePoint < 0x10000 ? 3 : 4;
+}
+
+static bool isEndMarker(int codePoint) {
+	// buildTree() turns both of these into the end marker leaf
+	return codePoint == 0 || codePoint == 1;
+}
+
+
+/* ***************************************************************************
+ * Computing code lengths without a tree
+ */
+
+std::vector<unsigned> huffmanCodeLengths(const std::vector<uint64_t> &weights) {
+	size_t n = weights.size();
+	std::vector<unsigned> lengths(n, 0);
+	if (n < 2) {
+		return lengths;
+	}
+
+	/*
+	 * Huffman's algorithm on sorted weights needs no priority queue: merged
+	 * nodes are created in order of weight, so the two smallest nodes are
+	 * always at the front of either the leaves or the merged nodes. Every
+	 * node records its parent, and code lengths are the depths of the leaves.
+	 */
+	std::vector<size_t> order(n);
+	for (size_t i = 0; i < n; ++i) {
+		order[i] = i;
+	}
+	std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+		return weights[a] < weights[b];
+	});
+
+	std::vector<uint64_t> merged(n - 1);
+	std::vector<size_t> parent(2 * n - 1);
+	size_t nextLeaf = 0, nextMerged = 0;
+	auto take = [&](size_t created) {
+		if (nextLeaf < n && (nextMerged == created || weights[order[nextLeaf]] <= merged[nextMerged])) {
+			size_t leaf = nextLeaf++;
+			return std::make_pair(leaf, weights[order[leaf]]);
+		}
+		size_t node = nextMerged++;
+		return std::make_pair(n + node, merged[node]);
+	};
+	for (size_t i = 0; i < n - 1; ++i) {
+		auto first = take(i);
+		auto second = take(i);
+		merged[i] = first.second + second.second;
+		parent[first.first] = parent[second.first] = n + i;
+	}
+
+	std::vector<unsigned> depth(2 * n - 1, 0);
+	for (size_t i = 2 * n - 2; i-- > 0; ) {
+		depth[i] = depth[parent[i]] + 1;
+	}
+	for (size_t i = 0; i < n; ++i) {
+		lengths[order[i]] = depth[i];
+	}
+	return lengths;
+}
+
+
+/* ***************************************************************************
+ * Bodies for methods estimating the cost of encoding
+ */
+
+HuffmanCostEstimate HuffmanTable::estimateCost() const {
+	HuffmanCostEstimate estimate{0, 0, 0.0, 0};
+	std::vector<uint64_t> weights;
+	weights.reserve(charFrequency.size());
+	for (const auto &i : charFrequency) {
+		if (i.second == 0 || (isEndMarker(i.first) && lengthPrefixed)) {
+			continue;
+		}
+		if (!isEndMarker(i.first)) {
+			estimate.inputBytes += i.second * utf8Length(i.first);
+		}
+		weights.push_back(i.second);
+		estimate.symbols += i.second;
+	}
+	if (escape) {
+		// shapes the tree like buildTree(), but is never used by the text
+		weights.push_back(1);
+	}
+	size_t used = weights.size() - (escape ? 1 : 0);
+	if (weights.size() < 2 || used == 0) {
+		// a single symbol gets an empty code, just as in buildTree()
+		return estimate;
+	}
+	for (size_t i = 0; i < used; ++i) {
+		estimate.entropy += weights[i] * std::log2(static_cast<double>(estimate.symbols) / weights[i]);
+	}
+	estimate.entropy /= estimate.symbols;
+
+	std::vector<unsigned> lengths = huffmanCodeLengths(weights);
+	for (size_t i = 0; i < used; ++i) {
+		estimate.huffmanBits += weights[i] * lengths[i];
+	}
+	return estimate;
+}
+
+uint64_t HuffmanTable::costWith(const HuffmanTable &table) const {
+	if (table.codes.empty()) {
+		throw HuffmanException("Tried to estimate cost with non-existant tree");
+	}
+	uint64_t bits = 0;
+	for (const auto &i : charFrequency) {
+		if (i.second == 0) {
+			continue;
+		}
+		if (isEndMarker(i.first)) {
+			if (table.lengthPrefixed) {
+				continue;
+			}
+			bits += i.second * table.endCode().length;
+			continue;
+		}
+		uint32_t rank = table.symbolIndex.rank(i.first);
+		if (rank == HuffmanSymbolIndex::NoSymbol) {
+			if (!table.escape) {
+				return NotEncodable;
+			}
+			bits += i.second * (table.escapeCode.length + EscapeBits);
+			continue;
+		}
+		bits += i.second * table.codes[rank].length;
+	}
+	return bits;
+}
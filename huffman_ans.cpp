@@ -0,0 +1,511 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "huffman.h"
+#include "huffman_ans.h"
+#include "huffman_bits.h"
+#include "huffman_utf8.h"
+
+
+/* ***************************************************************************
+ * Building the tables
+ */
+
+namespace {
+	unsigned highBit(uint32_t value) {
+		unsigned bit = 0;
+		while (value >>= 1) {
+			++bit;
+		}
+		return bit;
+	}
+
+	/*
+	 * Scale counts so they sum to exactly total, giving every symbol at least
+	 * one. Rounding errors are corrected one state at a time, each time
+	 * picking the change that costs the fewest extra bits over the counts.
+	 */
+	std::vector<uint32_t> normalize(const std::vector<uint64_t> &counts, uint32_t total) {
+		double sum = 0;
+		for (uint64_t count : counts) {
+			sum += static_cast<double>(count);
+		}
+		std::vector<uint32_t> norm(counts.size());
+		int64_t assigned = 0;
+		for (size_t i = 0; i < counts.size(); ++i) {
+			double share = std::round(static_cast<double>(counts[i]) * total / sum);
+			norm[i] = std::max<uint32_t>(1, static_cast<uint32_t>(std::min<double>(share, total)));
+			assigned += norm[i];
+		}
+
+		typedef std::pair<double, size_t> Change;
+		if (assigned > total) {
+			// remove states where they cost the least
+			auto cost = [&](size_t i) {
+				return static_cast<double>(counts[i]) * std::log2(norm[i] / (norm[i] - 1.0));
+			};
+			std::priority_queue<Change, std::vector<Change>, std::greater<Change>> cheapest;
+			for (size_t i = 0; i < norm.size(); ++i) {
+				if (norm[i] > 1) {
+					cheapest.emplace(cost(i), i);
+				}
+			}
+			for (; assigned > total; --assigned) {
+				size_t i = cheapest.top().second;
+				cheapest.pop();
+				if (--norm[i] > 1) {
+					cheapest.emplace(cost(i), i);
+				}
+			}
+		} else if (assigned < total) {
+			// add states where they save the most
+			auto saving = [&](size_t i) {
+				return static_cast<double>(counts[i]) * std::log2((norm[i] + 1.0) / norm[i]);
+			};
+			std::priority_queue<Change> best;
+			for (size_t i = 0; i < norm.size(); ++i) {
+				best.emplace(saving(i), i);
+			}
+			for (; assigned < total; ++assigned) {
+				size_t i = best.top().second;
+				best.pop();
+				++norm[i];
+				best.emplace(saving(i), i);
+			}
+		}
+		return norm;
+	}
+}
+
+HuffmanAnsTable::HuffmanAnsTable(const HuffmanTable &table, unsigned tableLog)
+: lengthPrefixed(table.isLengthPrefixed())
+{
+	build(table.getFrequencies(), tableLog);
+}
+
+void HuffmanAnsTable::build(const HuffmanHistogram &frequencies, unsigned requestedLog) {
+	std::vector<int> symbols;
+	std::vector<uint64_t> counts;
+	for (const auto &i : frequencies) {
+		if (i.second == 0 || i.first < 0 || i.first > HuffmanSymbolIndex::MaxCodePoint || (i.first == 0 && lengthPrefixed)) {
+			continue;
+		}
+		symbols.push_back(i.first);
+		counts.push_back(i.second);
+	}
+	if (symbols.empty() || (symbols.size() == 1 && symbols[0] == 0)) {
+		throw HuffmanException("No Frequency Data to Build Table From");
+	}
+	if (!lengthPrefixed && symbols[0] != 0) {
+		symbols.insert(symbols.begin(), 0);
+		counts.insert(counts.begin(), 1);
+	}
+	if (symbols.size() > (size_t(1) << MaxTableLog)) {
+		throw HuffmanException("Too Many Symbols for ANS Table");
+	}
+
+	// leave at least two states per symbol where possible
+	unsigned log = std::max(MinTableLog, std::min(requestedLog, MaxTableLog));
+	while (log < MaxTableLog && (size_t(1) << log) < 2 * symbols.size()) {
+		++log;
+	}
+	uint32_t states = uint32_t(1) << log;
+	std::vector<uint32_t> norm = normalize(counts, states);
+
+	// spread each symbol's states across the table
+	std::vector<uint32_t> spread(states);
+	uint32_t step = (states >> 1) + (states >> 3) + 3;
+	uint32_t position = 0;
+	for (size_t s = 0; s < norm.size(); ++s) {
+		for (uint32_t i = 0; i < norm[s]; ++i) {
+			spread[position] = static_cast<uint32_t>(s);
+			position = (position + step) & (states - 1);
+		}
+	}
+
+	std::vector<Entry> newDecodeTable(states);
+	std::vector<uint32_t> next(norm);
+	for (uint32_t state = 0; state < states; ++state) {
+		uint32_t s = spread[state];
+		uint32_t n = next[s]++;
+		Entry &entry = newDecodeTable[state];
+		entry.bits = static_cast<uint8_t>(log - highBit(n));
+		entry.base = (n << entry.bits) - states;
+		entry.kind = symbols[s] == 0 ? End : Character;
+		entry.value = 0;
+		entry.utf8Length = 0;
+		if (symbols[s] != 0) {
+			char bytes[4];
+			entry.utf8Length = static_cast<uint8_t>(utf8::append(symbols[s], bytes) - bytes);
+			std::memcpy(&entry.value, bytes, entry.utf8Length);
+		}
+	}
+
+	// A state that reads no bits always moves to a lower state unless there
+	// is only one symbol, so runs of characters decoded without consuming
+	// input are bounded; find the longest to sanity check length headers.
+	std::vector<uint32_t> chain(states, 1);
+	uint32_t longestRun = 1;
+	for (uint32_t state = 0; state < states; ++state) {
+		const Entry &entry = newDecodeTable[state];
+		if (entry.bits == 0) {
+			uint32_t previous = entry.base < state ? chain[entry.base] : UINT32_MAX;
+			chain[state] = previous == UINT32_MAX ? UINT32_MAX : previous + 1;
+			longestRun = std::max(longestRun, chain[state]);
+		}
+	}
+
+	std::vector<uint32_t> newEncodeStates(states);
+	std::vector<Transform> newTransforms(norm.size());
+	std::vector<uint32_t> slot(norm.size());
+	uint32_t cumulative = 0;
+	for (size_t s = 0; s < norm.size(); ++s) {
+		uint32_t count = norm[s];
+		unsigned maxBits = count > 1 ? log - highBit(count - 1) : log;
+		newTransforms[s].deltaBits = (uint64_t(maxBits) << 32) - (uint64_t(count) << maxBits);
+		newTransforms[s].deltaState = static_cast<int32_t>(cumulative) - static_cast<int32_t>(count);
+		newTransforms[s].count = count;
+		slot[s] = cumulative;
+		cumulative += count;
+	}
+	for (uint32_t state = 0; state < states; ++state) {
+		newEncodeStates[slot[spread[state]]++] = states + state;
+	}
+
+	decodeTable.swap(newDecodeTable);
+	encodeStates.swap(newEncodeStates);
+	transforms.swap(newTransforms);
+	symbolIndex.build(symbols);
+	tableLog = log;
+	maxRun = longestRun;
+}
+
+uint32_t HuffmanAnsTable::getNormalizedCount(int character) const {
+	uint32_t rank = symbolIndex.rank(character);
+	return rank == HuffmanSymbolIndex::NoSymbol ? 0 : transforms[rank].count;
+}
+
+
+/* ***************************************************************************
+ * Encoding
+ */
+
+/*
+ * Encode a string, passing the bits to write(bits, length) in decoding
+ * order. The symbols are encoded last to first, so the bits for each are
+ * buffered and written out in reverse once the final state is known. The
+ * bits of the arbitrary starting state are never needed by the decoder and
+ * are left out.
+ */
+template<class Write>
+void HuffmanAnsTable::encodeWith(std::string_view text, bool framed, Write write) const {
+	if (decodeTable.empty()) {
+		throw HuffmanException("Tried to encode with non-existant table");
+	}
+	std::vector<uint32_t> ranks;
+	ranks.reserve(text.size() + 1);
+	auto iter = text.begin();
+	while (iter != text.end()) {
+		unsigned char byte = static_cast<unsigned char>(*iter);
+		int c = byte;
+		if (byte < 0x80) {
+			++iter;
+		} else {
+			c = utf8::next(iter, text.end());
+		}
+		uint32_t rank = symbolIndex.rank(c);
+		// the end marker is stored under 0, so a NUL in the text can never match it
+		if (rank == HuffmanSymbolIndex::NoSymbol || c == 0) {
+			std::stringstream ss;
+			ss << "Character (0x" << std::hex << c << ") Not in ANS Table";
+			throw HuffmanException(ss.str());
+		}
+		ranks.push_back(rank);
+	}
+
+	if (framed && lengthPrefixed) {
+		size_t value = text.size();
+		do {
+			write((value >= 0x80 ? 0x80u : 0u) | (value & 0x7F), 8);
+			value >>= 7;
+		} while (value > 0);
+	} else if (framed) {
+		ranks.push_back(symbolIndex.rank(0));
+	}
+	if (ranks.empty()) {
+		return;
+	}
+
+	uint64_t states = uint64_t(1) << tableLog;
+	uint64_t state = states;
+	// each chunk holds the bits shifted left by five, and their count
+	std::vector<uint64_t> chunks;
+	chunks.reserve(ranks.size());
+	for (size_t i = ranks.size(); i-- > 0; ) {
+		const Transform &transform = transforms[ranks[i]];
+		unsigned bits = static_cast<unsigned>((state + transform.deltaBits) >> 32);
+		if (i + 1 != ranks.size()) {
+			chunks.push_back(((state & ((uint64_t(1) << bits) - 1)) << 5) | bits);
+		}
+		state = encodeStates[(state >> bits) + transform.deltaState];
+	}
+	write(state - states, tableLog);
+	for (auto chunk = chunks.rbegin(); chunk != chunks.rend(); ++chunk) {
+		write(*chunk >> 5, static_cast<unsigned>(*chunk & 31));
+	}
+}
+
+std::vector<bool> HuffmanAnsTable::encode(std::string_view text) const {
+	std::vector<bool> result;
+	encodeWith(text, true, [&result](uint64_t bits, unsigned length) {
+		while (length > 0) {
+			--length;
+			result.push_back((bits >> length) & 1);
+		}
+	});
+	return result;
+}
+
+size_t HuffmanAnsTable::encode(std::string_view text, unsigned char *out, size_t outSize) const {
+	HuffmanBitWriter writer(out, outSize);
+	encodeWith(text, true, [&writer](uint64_t bits, unsigned length) {
+		writer.write(bits, length);
+	});
+	return writer.size();
+}
+
+std::vector<bool> HuffmanAnsTable::encodeSymbols(std::string_view text) const {
+	std::vector<bool> result;
+	encodeWith(text, false, [&result](uint64_t bits, unsigned length) {
+		while (length > 0) {
+			--length;
+			result.push_back((bits >> length) & 1);
+		}
+	});
+	return result;
+}
+
+size_t HuffmanAnsTable::encodeSymbols(std::string_view text, unsigned char *out, size_t outSize) const {
+	HuffmanBitWriter writer(out, outSize);
+	encodeWith(text, false, [&writer](uint64_t bits, unsigned length) {
+		writer.write(bits, length);
+	});
+	return writer.size();
+}
+
+size_t HuffmanAnsTable::encodedBitLength(std::string_view text) const {
+	size_t total = 0;
+	encodeWith(text, true, [&total](uint64_t, unsigned length) {
+		total += length;
+	});
+	return total;
+}
+
+size_t HuffmanAnsTable::symbolsBitLength(std::string_view text) const {
+	size_t total = 0;
+	encodeWith(text, false, [&total](uint64_t, unsigned length) {
+		total += length;
+	});
+	return total;
+}
+
+
+/* ***************************************************************************
+ * Decoding
+ */
+
+static std::vector<unsigned char> packBits(const std::vector<bool> &data) {
+	std::vector<unsigned char> packed((data.size() + 7) / 8);
+	for (size_t i = 0; i < data.size(); ++i) {
+		if (data[i]) {
+			packed[i >> 3] |= static_cast<unsigned char>(0x80 >> (i & 7));
+		}
+	}
+	return packed;
+}
+
+uint32_t HuffmanAnsTable::readState(const unsigned char *data, size_t bitLength, size_t &pos) const {
+	if (decodeTable.empty()) {
+		throw HuffmanException("Tried to decode with non-existant table");
+	}
+	if (bitLength - pos < tableLog) {
+		throw HuffmanException("Unexpected End of Data");
+	}
+	HuffmanBitWindow bits(data, bitLength);
+	uint32_t state = static_cast<uint32_t>(bits.load(pos) >> (64 - tableLog));
+	pos += tableLog;
+	return state;
+}
+
+size_t HuffmanAnsTable::readHeader(const unsigned char *data, size_t bitLength, size_t &pos) const {
+	HuffmanBitWindow bits(data, bitLength);
+	size_t value = 0;
+	for (unsigned shift = 0; ; shift += 7) {
+		if (pos + 8 > bitLength) {
+			throw HuffmanException("Unexpected End of Data");
+		}
+		if (shift > 8 * sizeof(size_t) - 7) {
+			throw HuffmanException("Malformed Length Header");
+		}
+		unsigned group = static_cast<unsigned>(bits.load(pos) >> 56);
+		pos += 8;
+		value |= static_cast<size_t>(group & 0x7F) << shift;
+		if (!(group & 0x80)) {
+			return value;
+		}
+	}
+}
+
+/*
+ * Decode characters starting from state until the end marker when
+ * untilEnd is set, or until exactly outSize bytes have been written. When
+ * decoding until the end marker and the next character does not fit, this
+ * returns early without setting finished, leaving pos and state ready to
+ * carry on with more room.
+ */
+size_t HuffmanAnsTable::run(const unsigned char *data, size_t bitLength, size_t &position, uint32_t &state,
+                            char *out, size_t outSize, bool untilEnd, bool &finished) const {
+	HuffmanBitWindow bits(data, bitLength);
+	const Entry *table = decodeTable.data();
+	size_t written = 0;
+	size_t pos = position;
+	uint32_t current = state;
+
+	uint64_t window = bits.load(pos);
+	unsigned available = 64 - (pos & 7);
+	finished = false;
+
+	for (;;) {
+		const Entry &entry = table[current];
+		if (entry.kind != Character) {
+			if (!untilEnd) {
+				throw HuffmanException("Bad Decode Path");
+			}
+			finished = true;
+			break;
+		}
+		if (outSize - written < 4) {
+			if (outSize - written < entry.utf8Length) {
+				if (!untilEnd) {
+					throw HuffmanException("Decoded Length Mismatch");
+				}
+				break;
+			}
+			std::memcpy(out + written, &entry.value, entry.utf8Length);
+		} else {
+			std::memcpy(out + written, &entry.value, 4);
+		}
+		written += entry.utf8Length;
+		if (!untilEnd && written == outSize) {
+			finished = true;
+			break;
+		}
+
+		if (available < MaxTableLog) {
+			window = bits.load(pos);
+			available = 64 - (pos & 7);
+		}
+		pos += entry.bits;
+		if (pos > bitLength) {
+			throw HuffmanException("Unexpected End of Data");
+		}
+		// shifting in two steps keeps a zero bit read well defined
+		current = entry.base + static_cast<uint32_t>((window >> 1) >> (63 - entry.bits));
+		window <<= entry.bits;
+		available -= entry.bits;
+	}
+	position = pos;
+	state = current;
+	return written;
+}
+
+/*
+ * Decode a terminated string whose length is unknown. A very common
+ * character can cost less than a bit, so the output cannot be sized from
+ * the input and is grown as needed instead.
+ */
+std::string HuffmanAnsTable::decodeGrowing(const unsigned char *data, size_t bitLength) const {
+	size_t pos = 0;
+	uint32_t state = readState(data, bitLength, pos);
+	std::string result(std::max<size_t>(16, bitLength / 2), '\0');
+	size_t written = 0;
+	bool finished = false;
+	for (;;) {
+		written += run(data, bitLength, pos, state, &result[written], result.size() - written, true, finished);
+		if (finished) {
+			break;
+		}
+		result.resize(result.size() * 2);
+	}
+	result.resize(written);
+	return result;
+}
+
+std::string HuffmanAnsTable::decode(const unsigned char *data, size_t bitLength) const {
+	if (!lengthPrefixed) {
+		return decodeGrowing(data, bitLength);
+	}
+	size_t pos = 0;
+	size_t length = readHeader(data, bitLength, pos);
+	if (length == 0) {
+		return std::string();
+	}
+	// at most maxRun characters are decoded per bit read, plus the last
+	if (length / 4 / maxRun > bitLength - pos) {
+		throw HuffmanException("Malformed Length Header");
+	}
+	std::string result(length, '\0');
+	uint32_t state = readState(data, bitLength, pos);
+	bool finished;
+	run(data, bitLength, pos, state, &result[0], length, false, finished);
+	return result;
+}
+
+size_t HuffmanAnsTable::decode(const unsigned char *data, size_t bitLength, char *out, size_t outSize) const {
+	size_t pos = 0;
+	bool finished;
+	if (lengthPrefixed) {
+		size_t length = readHeader(data, bitLength, pos);
+		if (length > outSize) {
+			throw HuffmanException("Output Buffer Too Small");
+		}
+		if (length == 0) {
+			return 0;
+		}
+		uint32_t state = readState(data, bitLength, pos);
+		return run(data, bitLength, pos, state, out, length, false, finished);
+	}
+	uint32_t state = readState(data, bitLength, pos);
+	size_t written = run(data, bitLength, pos, state, out, outSize, true, finished);
+	if (!finished) {
+		throw HuffmanException("Output Buffer Too Small");
+	}
+	return written;
+}
+
+size_t HuffmanAnsTable::decodeSymbols(const unsigned char *data, size_t bitLength, char *out, size_t byteLength) const {
+	if (byteLength == 0) {
+		return 0;
+	}
+	size_t pos = 0;
+	uint32_t state = readState(data, bitLength, pos);
+	bool finished;
+	return run(data, bitLength, pos, state, out, byteLength, false, finished);
+}
+
+std::string HuffmanAnsTable::decode(const std::vector<bool> &data) const {
+	std::vector<unsigned char> packed = packBits(data);
+	return decode(packed.data(), data.size());
+}
+
+std::string HuffmanAnsTable::decode(const std::vector<bool> &data, size_t byteLength) const {
+	std::vector<unsigned char> packed = packBits(data);
+	std::string result(byteLength, '\0');
+	decodeSymbols(packed.data(), data.size(), &result[0], byteLength);
+	return result;
+}
@@ -0,0 +1,183 @@
+#ifndef HUFFMAN_ANS_H
+#define HUFFMAN_ANS_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "huffman_histogram.h"
+#include "huffman_symbols.h"
+
+class HuffmanTable;
+
+/**
+ * An alternative entropy coder built from the same character frequencies as
+ * a HuffmanTable, using table-based asymmetric numeral systems (tANS, as in
+ * FSE). Huffman codes spend a whole number of bits on every character, which
+ * wastes space when a few symbols such as the space or the end marker are
+ * very common; tANS spends fractional bits, so it gets close to the entropy
+ * of the frequencies.
+ *
+ * The frequencies are normalized to a table of 2^tableLog states. Decoding
+ * is one lookup per character in a flat table whose entries carry the UTF-8
+ * bytes of the character, the number of bits to read and the base of the
+ * next state, with no per-bit branches. Encoding runs over the text
+ * backwards, so the encoder buffers the bits of one string before writing
+ * them in decoding order.
+ *
+ * Each encoded string starts with the decoder's initial state, which costs
+ * tableLog bits, so the gain over Huffman coding grows with the length of
+ * the string. Apart from that, the encode and decode methods mirror the
+ * matching HuffmanTable methods, including the length-prefixed and bare
+ * symbol modes, and produce the same errors. Characters that were never
+ * counted cannot be encoded; there is no escape code.
+ */
+class HuffmanAnsTable {
+public:
+	/** Default log2 of the number of states. */
+	static constexpr unsigned DefaultTableLog = 11;
+	static constexpr unsigned MinTableLog = 5;
+	static constexpr unsigned MaxTableLog = 20;
+
+	HuffmanAnsTable() {
+	}
+
+	/**
+	 * Build a coder from the frequencies gathered by a HuffmanTable, using
+	 * the same length-prefixed setting.
+	 * @param table The table whose frequencies to use. It need not be built.
+	 * @param tableLog See build().
+	 * @throw HuffmanException Thrown if there are no frequencies.
+	 */
+	explicit HuffmanAnsTable(const HuffmanTable &table, unsigned tableLog = DefaultTableLog);
+
+	/**
+	 * Build the coding tables from character frequencies. In terminated mode
+	 * the end marker is always given a state, even if it was never counted.
+	 * @param frequencies The counts to normalize.
+	 * @param tableLog The log2 of the number of states, from MinTableLog to
+	 *                 MaxTableLog. More states follow the frequencies more
+	 *                 closely but cost more memory and a longer initial
+	 *                 state. It is raised if needed to give every symbol at
+	 *                 least one state.
+	 * @throw HuffmanException Thrown if there are no frequencies or too many
+	 *                         symbols.
+	 */
+	void build(const HuffmanHistogram &frequencies, unsigned tableLog = DefaultTableLog);
+
+	/**
+	 * Selects length-prefixed strings instead of an end marker, as
+	 * HuffmanTable::setLengthPrefixed(). This must be set before calling
+	 * build().
+	 */
+	void setLengthPrefixed(bool prefixed) {
+		lengthPrefixed = prefixed;
+	}
+	bool isLengthPrefixed() const {
+		return lengthPrefixed;
+	}
+
+	/** @return The log2 of the number of states actually used. */
+	unsigned getTableLog() const {
+		return tableLog;
+	}
+
+	/**
+	 * @param character The code point to look up, or 0 for the end marker.
+	 * @return The number of states given to the character, or zero if it
+	 *         cannot be encoded.
+	 */
+	uint32_t getNormalizedCount(int character) const;
+
+	/** See HuffmanTable::encode(std::string_view). */
+	std::vector<bool> encode(std::string_view text) const;
+
+	/** See HuffmanTable::encode(std::string_view, unsigned char*, size_t). */
+	size_t encode(std::string_view text, unsigned char *out, size_t outSize) const;
+
+	/** See HuffmanTable::encodeSymbols(std::string_view). */
+	std::vector<bool> encodeSymbols(std::string_view text) const;
+
+	/** See HuffmanTable::encodeSymbols(std::string_view, unsigned char*, size_t). */
+	size_t encodeSymbols(std::string_view text, unsigned char *out, size_t outSize) const;
+
+	/**
+	 * Calculate the number of bits encode() will produce for a string. Unlike
+	 * Huffman codes this cannot be summed per character, so the string is
+	 * encoded without writing the result.
+	 */
+	size_t encodedBitLength(std::string_view text) const;
+
+	/** As encodedBitLength(), for encodeSymbols(). */
+	size_t symbolsBitLength(std::string_view text) const;
+
+	/** See HuffmanTable::decode(const std::vector<bool>&). */
+	std::string decode(const std::vector<bool> &data) const;
+
+	/** See HuffmanTable::decode(const std::vector<bool>&, size_t). */
+	std::string decode(const std::vector<bool> &data, size_t byteLength) const;
+
+	/**
+	 * Decode a packed encoded string into a new string.
+	 * @param data The encoded string, packed most significant bit first.
+	 * @param bitLength The number of valid bits in data.
+	 * @return The decoded text.
+	 * @throw HuffmanException Thrown if the data is truncated or corrupt.
+	 */
+	std::string decode(const unsigned char *data, size_t bitLength) const;
+
+	/** See HuffmanTable::decode(const unsigned char*, size_t, char*, size_t). */
+	size_t decode(const unsigned char *data, size_t bitLength, char *out, size_t outSize) const;
+
+	/** See HuffmanTable::decodeSymbols(). */
+	size_t decodeSymbols(const unsigned char *data, size_t bitLength, char *out, size_t byteLength) const;
+
+private:
+	enum EntryKind : uint8_t {
+		Character,
+		End,
+	};
+
+	/**
+	 * One decoder state. value holds the UTF-8 bytes of the character; the
+	 * next state is base plus the next bits of input.
+	 */
+	struct Entry {
+		uint32_t value;
+		uint32_t base;
+		uint8_t bits;
+		uint8_t kind;
+		uint8_t utf8Length;
+	};
+
+	/**
+	 * Per-symbol encoder constants, as in FSE: the bits to write for state x
+	 * are (x + deltaBits) >> 32, and the next state is found at
+	 * (x >> bits) + deltaState in encodeStates.
+	 */
+	struct Transform {
+		uint64_t deltaBits;
+		int32_t deltaState;
+		uint32_t count;
+	};
+
+	template<class Write>
+	void encodeWith(std::string_view text, bool framed, Write write) const;
+	uint32_t readState(const unsigned char *data, size_t bitLength, size_t &pos) const;
+	size_t readHeader(const unsigned char *data, size_t bitLength, size_t &pos) const;
+	size_t run(const unsigned char *data, size_t bitLength, size_t &pos, uint32_t &state,
+	           char *out, size_t outSize, bool untilEnd, bool &finished) const;
+	std::string decodeGrowing(const unsigned char *data, size_t bitLength) const;
+
+	std::vector<Entry> decodeTable;
+	std::vector<uint32_t> encodeStates;
+	std::vector<Transform> transforms;
+	HuffmanSymbolIndex symbolIndex;
+	unsigned tableLog = 0;
+	// the most characters decoded in a row without reading any bits
+	uint32_t maxRun = 1;
+	bool lengthPrefixed = false;
+};
+
+#endif
@@ -0,0 +1,210 @@
+#include <algorithm>
+#include <numeric>
+#include <string>
+#include <vector>
+
+#include "huffman.h"
+#include "huffman_bank.h"
+#include "huffman_bits.h"
+#include "huffman_decoder.h"
+
+
+/* ***************************************************************************
+ * Comparing and hashing encoded strings
+ */
+
+namespace {
+	// a window load holds at least this many bits at any bit position
+	constexpr size_t ChunkBits = 56;
+
+	/*
+	 * The ChunkBits bits starting at pos, with any at or past end cleared.
+	 */
+	inline uint64_t loadBits(const HuffmanBitWindow &window, size_t pos, size_t end) {
+		size_t count = std::min(end - pos, ChunkBits);
+		return window.load(pos) & ~(~uint64_t(0) >> count);
+	}
+
+	bool bitsEqual(const HuffmanBitWindow &a, size_t aPos, const HuffmanBitWindow &b, size_t bPos, size_t bits) {
+		for (size_t i = 0; i < bits; i += ChunkBits) {
+			if (loadBits(a, aPos + i, aPos + bits) != loadBits(b, bPos + i, bPos + bits)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	uint64_t hashBits(const HuffmanBitWindow &window, size_t pos, size_t bits) {
+		uint64_t hash = (bits + 1) * 0x9E3779B97F4A7C15ull;
+		for (size_t i = 0; i < bits; i += ChunkBits) {
+			hash = (hash ^ loadBits(window, pos + i, pos + bits)) * 0xFF51AFD7ED558CCDull;
+			hash ^= hash >> 32;
+		}
+		return hash;
+	}
+
+	/*
+	 * Compare the first bits of two byte aligned, zero padded bit strings,
+	 * returning a negative, zero or positive result like memcmp().
+	 */
+	int compareBits(const unsigned char *a, const unsigned char *b, size_t bits) {
+		for (size_t i = 0; i < bits; i += 64) {
+			uint64_t x = huffmanLoadBigEndian(a + i / 8), y = huffmanLoadBigEndian(b + i / 8);
+			if (bits - i < 64) {
+				uint64_t mask = ~(~uint64_t(0) >> (bits - i));
+				x &= mask;
+				y &= mask;
+			}
+			if (x != y) {
+				return x < y ? -1 : 1;
+			}
+		}
+		return 0;
+	}
+
+	/*
+	 * Lexicographic order, with a string sorting before any longer string it
+	 * starts.
+	 */
+	bool bitsLess(const unsigned char *a, size_t aBits, const unsigned char *b, size_t bBits) {
+		int order = compareBits(a, b, std::min(aBits, bBits));
+		return order < 0 || (order == 0 && aBits < bBits);
+	}
+
+	bool bitsStart(const unsigned char *prefix, size_t prefixBits, const unsigned char *data, size_t bits) {
+		return prefixBits <= bits && compareBits(prefix, data, prefixBits) == 0;
+	}
+}
+
+bool huffmanEncodedEqual(const unsigned char *a, size_t aBits, const unsigned char *b, size_t bBits) {
+	if (aBits != bBits) {
+		return false;
+	}
+	return bitsEqual(HuffmanBitWindow(a, aBits), 0, HuffmanBitWindow(b, bBits), 0, aBits);
+}
+
+uint64_t huffmanEncodedHash(const unsigned char *data, size_t bitLength) {
+	return hashBits(HuffmanBitWindow(data, bitLength), 0, bitLength);
+}
+
+
+/* ***************************************************************************
+ * String banks
+ */
+
+std::string HuffmanStringBank::decode(size_t index, const HuffmanDecodeTable &decoder) const {
+	const Entry &entry = entries.at(index);
+	size_t pos = entry.bitOffset;
+	return decoder.decode(data.data(), entry.bitOffset + entry.bitLength, pos);
+}
+
+uint64_t HuffmanStringBank::hash(size_t index) const {
+	const Entry &entry = entries.at(index);
+	return hashBits(HuffmanBitWindow(data.data(), bitLength), entry.bitOffset, entry.bitLength);
+}
+
+HuffmanStringBankBuilder::HuffmanStringBankBuilder(const HuffmanTable &table)
+: table(table)
+{ }
+
+size_t HuffmanStringBankBuilder::add(std::string_view text) {
+	scratch.resize((table.encodedBitLength(text) + 7) / 8);
+	size_t bits = table.encode(text, scratch.data(), scratch.size());
+	return add(scratch.data(), bits);
+}
+
+size_t HuffmanStringBankBuilder::add(const unsigned char *data, size_t bitLength) {
+	uint64_t hash = huffmanEncodedHash(data, bitLength);
+	auto range = byHash.equal_range(hash);
+	for (auto iter = range.first; iter != range.second; ++iter) {
+		const Unique &candidate = unique[iter->second];
+		if (huffmanEncodedEqual(pending.data() + candidate.offset, candidate.bitLength, data, bitLength)) {
+			indices.push_back(iter->second);
+			return indices.size() - 1;
+		}
+	}
+
+	size_t offset = pending.size();
+	size_t bytes = (bitLength + 7) / 8;
+	pending.insert(pending.end(), data, data + bytes);
+	if (bitLength % 8) {
+		pending.back() &= static_cast<unsigned char>(0xFF << (8 - bitLength % 8));
+	}
+	byHash.emplace(hash, unique.size());
+	indices.push_back(unique.size());
+	unique.push_back(Unique{offset, bitLength});
+	return indices.size() - 1;
+}
+
+HuffmanStringBank HuffmanStringBankBuilder::build() {
+	// every string reversed bit by bit, so a string that ends another starts
+	// its reversal, padded so words can be loaded past the end
+	std::vector<unsigned char> reversed;
+	std::vector<size_t> reversedOffsets;
+	for (const Unique &string : unique) {
+		reversedOffsets.push_back(reversed.size());
+		reversed.resize(reversed.size() + (string.bitLength + 7) / 8, 0);
+		unsigned char *out = reversed.data() + reversedOffsets.back();
+		const unsigned char *in = pending.data() + string.offset;
+		for (size_t i = 0; i < string.bitLength; ++i) {
+			size_t from = string.bitLength - 1 - i;
+			if ((in[from / 8] >> (7 - from % 8)) & 1) {
+				out[i / 8] |= static_cast<unsigned char>(0x80 >> (i % 8));
+			}
+		}
+	}
+	reversed.resize(reversed.size() + 8, 0);
+	pending.resize(pending.size() + 8, 0);
+
+	std::vector<size_t> order(unique.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+		return bitsLess(reversed.data() + reversedOffsets[a], unique[a].bitLength,
+		                reversed.data() + reversedOffsets[b], unique[b].bitLength);
+	});
+
+	// a string whose reversal starts the next one's is stored as its tail;
+	// anything it could be the tail of sorts after it, starting with that one
+	std::vector<size_t> positions(unique.size());
+	std::vector<bool> owner(unique.size(), true);
+	size_t totalBits = 0;
+	for (size_t i = order.size(); i-- > 0; ) {
+		size_t string = order[i];
+		if (i + 1 < order.size()) {
+			size_t next = order[i + 1];
+			if (bitsStart(reversed.data() + reversedOffsets[string], unique[string].bitLength,
+			              reversed.data() + reversedOffsets[next], unique[next].bitLength)) {
+				positions[string] = positions[next] + unique[next].bitLength - unique[string].bitLength;
+				owner[string] = false;
+				continue;
+			}
+		}
+		positions[string] = totalBits;
+		totalBits += unique[string].bitLength;
+	}
+
+	HuffmanStringBank bank;
+	bank.bitLength = totalBits;
+	bank.data.assign((totalBits + 7) / 8, 0);
+	HuffmanBitWriter writer(bank.data.data(), bank.data.size());
+	for (size_t i = order.size(); i-- > 0; ) {
+		size_t string = order[i];
+		if (!owner[string]) {
+			continue;
+		}
+		const unsigned char *in = pending.data() + unique[string].offset;
+		for (size_t bit = 0; bit < unique[string].bitLength; bit += 64) {
+			unsigned count = static_cast<unsigned>(std::min<size_t>(64, unique[string].bitLength - bit));
+			writer.write(huffmanLoadBigEndian(in + bit / 8) >> (64 - count), count);
+		}
+	}
+	for (size_t index : indices) {
+		bank.entries.push_back(HuffmanStringBank::Entry{positions[index], unique[index].bitLength});
+	}
+
+	pending.clear();
+	unique.clear();
+	indices.clear();
+	byHash.clear();
+	return bank;
+}
@@ -0,0 +1,165 @@
+#ifndef HUFFMAN_BANK_H
+#define HUFFMAN_BANK_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+class HuffmanDecodeTable;
+class HuffmanTable;
+
+/**
+ * Compare two packed encoded strings without decoding them. Strings encoded
+ * with the same table are equal exactly when their bits are, so this
+ * compares the bits a machine word at a time.
+ * @param a The first string, packed most significant bit first.
+ * @param aBits The number of valid bits in a.
+ * @param b The second string, packed most significant bit first.
+ * @param bBits The number of valid bits in b.
+ * @return Whether the strings are equal.
+ */
+bool huffmanEncodedEqual(const unsigned char *a, size_t aBits, const unsigned char *b, size_t bBits);
+
+/**
+ * Hash a packed encoded string without decoding it, a word at a time. Any
+ * bits past bitLength in the last byte are ignored, so equal strings always
+ * hash equally.
+ * @param data The encoded string, packed most significant bit first.
+ * @param bitLength The number of valid bits in data.
+ * @return The hash.
+ */
+uint64_t huffmanEncodedHash(const unsigned char *data, size_t bitLength);
+
+/**
+ * A read-only bank of encoded strings packed end to end into one bit
+ * stream, built by HuffmanStringBankBuilder. Each string added to the
+ * builder keeps its index, but duplicates share the same bits, and a string
+ * whose encoding ends another string's is stored as the tail of that one.
+ * Decoding reads only a string's own bits, so a shared tail decodes the
+ * same as it would on its own.
+ */
+class HuffmanStringBank {
+public:
+	struct Entry {
+		size_t bitOffset;
+		size_t bitLength;
+	};
+
+	/** @return The number of strings in the bank, counting duplicates. */
+	size_t size() const {
+		return entries.size();
+	}
+
+	const Entry& getEntry(size_t index) const {
+		return entries.at(index);
+	}
+
+	/** @return The packed bits of every distinct string. */
+	const std::vector<unsigned char>& getData() const {
+		return data;
+	}
+
+	/** @return The number of bits of getData() in use. */
+	size_t getBitLength() const {
+		return bitLength;
+	}
+
+	/**
+	 * Decode one string of the bank.
+	 * @param index The index the string was added with.
+	 * @param decoder A decoder for the table the bank was built with.
+	 * @return The decoded text.
+	 * @throw HuffmanException Thrown if the data is corrupt.
+	 */
+	std::string decode(size_t index, const HuffmanDecodeTable &decoder) const;
+
+	/**
+	 * Compare two strings of the bank. Duplicates share storage, so this
+	 * only compares their positions.
+	 */
+	bool equal(size_t a, size_t b) const {
+		const Entry &first = entries.at(a), &second = entries.at(b);
+		return first.bitOffset == second.bitOffset && first.bitLength == second.bitLength;
+	}
+
+	/**
+	 * @return The hash of one string, the same as huffmanEncodedHash() gives
+	 *         for it encoded on its own.
+	 */
+	uint64_t hash(size_t index) const;
+
+private:
+	friend class HuffmanStringBankBuilder;
+
+	std::vector<unsigned char> data;
+	std::vector<Entry> entries;
+	size_t bitLength = 0;
+};
+
+/**
+ * Collects encoded strings for a HuffmanStringBank, finding duplicates by
+ * hashing and comparing their bits, so strings that arrive already encoded
+ * never need to be decoded. When the bank is built, distinct strings are
+ * sorted by their bits read backwards, which puts every string next to the
+ * strings it ends, and each is stored as the tail of the longest one it
+ * ends, at whatever bit position that falls on.
+ *
+ * With terminated tables a string ends another exactly when its text does,
+ * so banks of messages sharing endings shrink. Length-prefixed strings
+ * begin with their length, so for them only duplicates are shared.
+ */
+class HuffmanStringBankBuilder {
+public:
+	/**
+	 * @param table The built table to encode text with. It must outlive the
+	 *              builder.
+	 */
+	explicit HuffmanStringBankBuilder(const HuffmanTable &table);
+
+	/**
+	 * Encode and add a string.
+	 * @param text The text to add.
+	 * @return The index of the string in the bank.
+	 * @throw HuffmanException Thrown if the text cannot be encoded.
+	 */
+	size_t add(std::string_view text);
+
+	/**
+	 * Add a string already encoded with the table.
+	 * @param data The encoded string, packed most significant bit first.
+	 * @param bitLength The number of valid bits in data.
+	 * @return The index of the string in the bank.
+	 */
+	size_t add(const unsigned char *data, size_t bitLength);
+
+	/** @return The number of distinct strings added so far. */
+	size_t getUniqueCount() const {
+		return unique.size();
+	}
+
+	/**
+	 * Lay out the distinct strings, sharing tails, and return the bank. The
+	 * builder is left empty.
+	 * @return The finished bank.
+	 */
+	HuffmanStringBank build();
+
+private:
+	struct Unique {
+		size_t offset;
+		size_t bitLength;
+	};
+
+	const HuffmanTable &table;
+	// the distinct strings, each starting at a byte boundary of pending
+	std::vector<unsigned char> pending;
+	std::vector<Unique> unique;
+	// for each string added, the index of its distinct string
+	std::vector<size_t> indices;
+	std::unordered_multimap<uint64_t, size_t> byHash;
+	std::vector<unsigned char> scratch;
+};
+
+#endif
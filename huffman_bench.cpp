@@ -0,0 +1,407 @@
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "codegen_table.h"
+#include "huffman.h"
+#include "huffman_ans.h"
+#include "huffman_blocks.h"
+#include "huffman_decoded_cache.h"
+#include "huffman_decoder.h"
+#include "huffman_encoder.h"
+#include "huffman_lz.h"
+#include "huffman_search.h"
+
+/*
+ * Compares the Huffman and ANS backends, and the LZ front end at a few
+ * effort levels, on the same corpora. Each file is
+ * measured twice: as a bank of short strings, one per line, and as a single
+ * long string. Both backends are trained from the same frequencies, and each
+ * string is encoded on its own into a byte aligned slot; the table decoder
+ * is run both one string at a time and as a batch, and into new strings
+ * with and without a cache in front, and the fast encoder
+ * against HuffmanTable::encode(). Finally the Huffman
+ * coded strings are filtered for a common word, once by decoding each and
+ * searching the text and once by searching the encoded data directly.
+ * Last, all the corpora are joined into one long text that is encoded and
+ * decoded as a block stream on 1, 2, 4, 8 and 16 threads.
+ *
+ * Files given with -g are the corpus codegen_table.h was generated from;
+ * their lines are decoded by the tree, the table decoder and the generated
+ * decoder.
+ */
+
+namespace {
+    struct Encoded {
+        std::vector<unsigned char> data;
+        std::vector<size_t> offsets;
+        std::vector<size_t> bits;
+        size_t totalBits = 0;
+    };
+
+    template<class Fn>
+    double secondsPer(Fn fn) {
+        auto start = std::chrono::steady_clock::now();
+        size_t runs = 0;
+        double elapsed = 0;
+        do {
+            fn();
+            ++runs;
+            elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        } while (elapsed < 0.25);
+        return elapsed / runs;
+    }
+
+    template<class Length, class Encode>
+    Encoded encodeAll(const std::vector<std::string> &strings, Length length, Encode encode) {
+        Encoded result;
+        for (const std::string &text : strings) {
+            result.offsets.push_back(result.data.size());
+            result.data.resize(result.data.size() + (length(text) + 7) / 8);
+        }
+        result.data.resize(result.data.size() + 8);
+        for (size_t i = 0; i < strings.size(); ++i) {
+            size_t bits = encode(strings[i], &result.data[result.offsets[i]], result.data.size() - result.offsets[i]);
+            result.bits.push_back(bits);
+            result.totalBits += bits;
+        }
+        return result;
+    }
+
+    void report(const char *backend, size_t bytes, size_t bits, double encodeSeconds, double decodeSeconds) {
+        std::cout << "  " << std::left << std::setw(14) << backend << std::right;
+        std::cout << std::setw(10) << bits << std::fixed << std::setprecision(3) << std::setw(8) << (bits / 8.0) / bytes;
+        std::cout << std::setprecision(1) << std::setw(13) << bytes / encodeSeconds / 1e6;
+        std::cout << std::setw(13) << bytes / decodeSeconds / 1e6 << '\n';
+        std::cout.unsetf(std::ios::fixed);
+    }
+
+    void bench(const std::string &name, const std::vector<std::string> &strings) {
+        HuffmanTable ht;
+        size_t bytes = 0;
+        for (const std::string &text : strings) {
+            ht.addFrequencies(text);
+            bytes += text.size();
+        }
+        ht.buildTree();
+        HuffmanDecodeTable decoder(ht);
+        HuffmanAnsTable ans(ht);
+
+        std::cout << name << ": " << strings.size() << " strings, " << bytes << " bytes, ";
+        std::cout << (1u << ans.getTableLog()) << " ANS states\n";
+        std::cout << "  backend             bits   ratio  encode MB/s  decode MB/s\n";
+
+        auto huffmanEncode = [&ht](const std::string &text, unsigned char *out, size_t size) {
+            return ht.encode(text, out, size);
+        };
+        auto huffmanLength = [&ht](const std::string &text) {
+            return ht.encodedBitLength(text);
+        };
+        auto ansEncode = [&ans](const std::string &text, unsigned char *out, size_t size) {
+            return ans.encode(text, out, size);
+        };
+        auto ansLength = [&ans](const std::string &text) {
+            return ans.encodedBitLength(text);
+        };
+        Encoded huffmanData = encodeAll(strings, huffmanLength, huffmanEncode);
+        Encoded ansData = encodeAll(strings, ansLength, ansEncode);
+        double huffmanEncodeSeconds = secondsPer([&]() {
+            encodeAll(strings, huffmanLength, huffmanEncode);
+        });
+        double ansEncodeSeconds = secondsPer([&]() {
+            encodeAll(strings, ansLength, ansEncode);
+        });
+
+        HuffmanEncodeTable encoder(ht);
+        auto fastLength = [&encoder](const std::string &text) {
+            return encoder.maxEncodedBytes(text.size()) * 8;
+        };
+        auto fastEncode = [&encoder](const std::string &text, unsigned char *out, size_t size) {
+            return encoder.encode(text, out, size);
+        };
+        auto scalarEncode = [&encoder](const std::string &text, unsigned char *out, size_t size) {
+            return encoder.encodeScalar(text, out, size);
+        };
+        if (encodeAll(strings, fastLength, fastEncode).bits != huffmanData.bits) {
+            throw HuffmanException("Benchmark Fast Encoding Mismatch");
+        }
+        double fastEncodeSeconds = secondsPer([&]() {
+            encodeAll(strings, fastLength, fastEncode);
+        });
+        double scalarEncodeSeconds = secondsPer([&]() {
+            encodeAll(strings, fastLength, scalarEncode);
+        });
+
+        std::vector<char> out(bytes + 4);
+        auto decodeAll = [&](const Encoded &encoded, auto decode) {
+            size_t written = 0;
+            for (size_t i = 0; i < strings.size(); ++i) {
+                written += decode(&encoded.data[encoded.offsets[i]], encoded.bits[i], &out[written], out.size() - written);
+            }
+            if (written != bytes) {
+                throw HuffmanException("Benchmark Round Trip Failed");
+            }
+        };
+        double treeSeconds = secondsPer([&]() {
+            decodeAll(huffmanData, [&ht](const unsigned char *data, size_t bits, char *to, size_t size) {
+                return ht.decode(data, bits, to, size);
+            });
+        });
+        double tableSeconds = secondsPer([&]() {
+            decodeAll(huffmanData, [&decoder](const unsigned char *data, size_t bits, char *to, size_t size) {
+                return decoder.decode(data, bits, to, size);
+            });
+        });
+        std::vector<HuffmanBatchString> batch;
+        for (size_t i = 0, written = 0; i < strings.size(); ++i) {
+            batch.push_back(HuffmanBatchString{&huffmanData.data[huffmanData.offsets[i]], huffmanData.bits[i],
+                                               &out[written], out.size() - written, 0});
+            written += strings[i].size();
+        }
+        double batchSeconds = secondsPer([&]() {
+            decoder.decodeBatch(batch.data(), batch.size());
+        });
+        for (size_t i = 0; i < strings.size(); ++i) {
+            if (batch[i].written != strings[i].size()) {
+                throw HuffmanException("Benchmark Round Trip Failed");
+            }
+        }
+        size_t stringBytes = 0;
+        double stringSeconds = secondsPer([&]() {
+            stringBytes = 0;
+            for (size_t i = 0; i < strings.size(); ++i) {
+                stringBytes += decoder.decode(&huffmanData.data[huffmanData.offsets[i]], huffmanData.bits[i]).size();
+            }
+        });
+        HuffmanDecodedCache cache(decoder, 2 * (bytes + strings.size() * HuffmanDecodedCache::EntryOverhead), 1);
+        double cacheSeconds = secondsPer([&]() {
+            stringBytes = 0;
+            for (size_t i = 0; i < strings.size(); ++i) {
+                stringBytes += cache.decode(i, &huffmanData.data[huffmanData.offsets[i]], huffmanData.bits[i])->size();
+            }
+        });
+        if (stringBytes != bytes) {
+            throw HuffmanException("Benchmark Round Trip Failed");
+        }
+        double ansSeconds = secondsPer([&]() {
+            decodeAll(ansData, [&ans](const unsigned char *data, size_t bits, char *to, size_t size) {
+                return ans.decode(data, bits, to, size);
+            });
+        });
+
+        report("huffman tree", bytes, huffmanData.totalBits, huffmanEncodeSeconds, treeSeconds);
+        report("huffman table", bytes, huffmanData.totalBits, huffmanEncodeSeconds, tableSeconds);
+        report("huffman batch", bytes, huffmanData.totalBits, huffmanEncodeSeconds, batchSeconds);
+        report("ans", bytes, ansData.totalBits, ansEncodeSeconds, ansSeconds);
+
+        for (unsigned level : { HuffmanLz::MinLevel, HuffmanLz::DefaultLevel, HuffmanLz::MaxLevel }) {
+            HuffmanLz lz(level);
+            lz.train(strings);
+            auto lzEncodeAll = [&]() {
+                Encoded result;
+                for (const std::string &text : strings) {
+                    result.offsets.push_back(result.data.size());
+                    result.bits.push_back(lz.encode(text, result.data));
+                    result.totalBits += result.bits.back();
+                }
+                result.data.resize(result.data.size() + 8);
+                return result;
+            };
+            Encoded lzData = lzEncodeAll();
+            double lzEncodeSeconds = secondsPer(lzEncodeAll);
+            double lzSeconds = secondsPer([&]() {
+                decodeAll(lzData, [&lz](const unsigned char *data, size_t bits, char *to, size_t size) {
+                    return lz.decode(data, bits, to, size);
+                });
+            });
+            std::string name = "lz level " + std::to_string(level);
+            report(name.c_str(), bytes, lzData.totalBits, lzEncodeSeconds, lzSeconds);
+        }
+
+        const char *word = "the";
+        HuffmanSearch search(ht, word);
+        size_t decodedMatches = 0, searchedMatches = 0;
+        double decodeSearchSeconds = secondsPer([&]() {
+            decodedMatches = 0;
+            for (size_t i = 0; i < strings.size(); ++i) {
+                size_t length = decoder.decode(&huffmanData.data[huffmanData.offsets[i]], huffmanData.bits[i], out.data(), out.size());
+                decodedMatches += std::string_view(out.data(), length).find(word) != std::string_view::npos;
+            }
+        });
+        double searchSeconds = secondsPer([&]() {
+            searchedMatches = 0;
+            for (size_t i = 0; i < strings.size(); ++i) {
+                searchedMatches += search.contains(&huffmanData.data[huffmanData.offsets[i]], huffmanData.bits[i]);
+            }
+        });
+        if (decodedMatches != searchedMatches) {
+            throw HuffmanException("Benchmark Search Mismatch");
+        }
+        std::cout << "  strings/s: " << std::fixed << std::setprecision(2) << strings.size() / tableSeconds / 1e6;
+        std::cout << "M looping over decode, " << strings.size() / batchSeconds / 1e6 << "M batched";
+        std::cout << (HuffmanDecodeTable::hasVectorBatch() ? " (AVX2)\n" : " (scalar)\n");
+        std::cout << "  strings/s: " << strings.size() / stringSeconds / 1e6 << "M decoding to std::string, ";
+        std::cout << strings.size() / cacheSeconds / 1e6 << "M from a warm HuffmanDecodedCache\n";
+        std::cout << "  encode MB/s: " << bytes / huffmanEncodeSeconds / 1e6 << " HuffmanTable, ";
+        std::cout << bytes / scalarEncodeSeconds / 1e6 << " scalar blocks, " << bytes / fastEncodeSeconds / 1e6;
+        std::cout << (HuffmanEncodeTable::hasVectorEncode() ? " AVX2 blocks\n" : " scalar blocks\n");
+        std::cout << "  search \"" << word << "\": " << searchedMatches << " strings match, " << std::fixed << std::setprecision(1);
+        std::cout << bytes / decodeSearchSeconds / 1e6 << " MB/s decoding, " << bytes / searchSeconds / 1e6 << " MB/s encoded\n";
+        std::cout.unsetf(std::ios::fixed);
+    }
+
+    /*
+     * Decode the lines the generated decoder was made from with it and with
+     * the library decoders of the same table.
+     */
+    void benchGenerated(const std::vector<std::string> &lines) {
+        HuffmanTable ht;
+        size_t bytes = 0;
+        for (const std::string &line : lines) {
+            ht.addFrequencies(line);
+            bytes += line.size();
+        }
+        ht.buildTree();
+        HuffmanDecodeTable decoder(ht);
+        Encoded encoded = encodeAll(lines, [&ht](const std::string &text) {
+            return ht.encodedBitLength(text);
+        }, [&ht](const std::string &text, unsigned char *out, size_t size) {
+            return ht.encode(text, out, size);
+        });
+
+        std::vector<char> out(bytes + 4);
+        auto decodeAll = [&](auto decode) {
+            size_t written = 0;
+            for (size_t i = 0; i < lines.size(); ++i) {
+                written += decode(&encoded.data[encoded.offsets[i]], encoded.bits[i], &out[written], out.size() - written);
+            }
+            if (written != bytes) {
+                throw HuffmanException("Benchmark Round Trip Failed");
+            }
+        };
+        double treeSeconds = secondsPer([&]() {
+            decodeAll([&ht](const unsigned char *data, size_t bits, char *to, size_t size) {
+                return ht.decode(data, bits, to, size);
+            });
+        });
+        double tableSeconds = secondsPer([&]() {
+            decodeAll([&decoder](const unsigned char *data, size_t bits, char *to, size_t size) {
+                return decoder.decode(data, bits, to, size);
+            });
+        });
+        double generatedSeconds = 0;
+        try {
+            generatedSeconds = secondsPer([&]() {
+                decodeAll(codegen_table::decode);
+            });
+        } catch (std::runtime_error &e) {
+            throw HuffmanException(std::string("Generated Decoder Failed: ") + e.what());
+        }
+
+        std::cout << "generated decoder: " << lines.size() << " strings, " << bytes << " bytes\n";
+        std::cout << "  decoder      decode MB/s\n" << std::fixed << std::setprecision(1);
+        std::cout << "  tree        " << std::setw(12) << bytes / treeSeconds / 1e6 << '\n';
+        std::cout << "  table       " << std::setw(12) << bytes / tableSeconds / 1e6 << '\n';
+        std::cout << "  generated   " << std::setw(12) << bytes / generatedSeconds / 1e6 << '\n';
+        std::cout.unsetf(std::ios::fixed);
+    }
+
+    /*
+     * Encode and decode one long text as a block stream on 1 to 16 threads,
+     * to show how the block stream scales with cores.
+     */
+    void benchThreads(const std::string &corpus) {
+        std::string text;
+        while (text.size() < (size_t(64) << 20)) {
+            text += corpus;
+        }
+        HuffmanTable ht;
+        ht.addFrequencies(corpus);
+        ht.buildTree();
+        std::vector<char> out(text.size());
+        std::cout << "block stream (" << (text.size() >> 20) << " MB, " << std::thread::hardware_concurrency()
+                  << " hardware threads)\n";
+        std::cout << "  threads  encode MB/s  decode MB/s  decode speedup\n";
+        double singleSeconds = 0;
+        for (unsigned threads : { 1, 2, 4, 8, 16 }) {
+            HuffmanBlockStream stream;
+            double encodeSeconds = secondsPer([&]() {
+                stream.encode(ht, text, HuffmanBlockStream::DefaultBlockSize, threads);
+            });
+            double decodeSeconds = secondsPer([&]() {
+                stream.decode(ht, out.data(), out.size(), threads);
+            });
+            if (std::string_view(out.data(), out.size()) != text) {
+                throw HuffmanException("Benchmark Round Trip Failed");
+            }
+            if (threads == 1) {
+                singleSeconds = decodeSeconds;
+            }
+            std::cout << std::fixed << std::setprecision(1) << std::setw(9) << threads;
+            std::cout << std::setw(13) << text.size() / encodeSeconds / 1e6 << std::setw(13) << text.size() / decodeSeconds / 1e6;
+            std::cout << std::setprecision(2) << std::setw(15) << singleSeconds / decodeSeconds << "x\n";
+            std::cout.unsetf(std::ios::fixed);
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " [-g generated-corpus]... corpus...\n";
+        return 2;
+    }
+    try {
+        std::string all;
+        std::vector<std::string> generatedLines;
+        for (int i = 1; i < argc; ++i) {
+            if (std::string(argv[i]) == "-g" && i + 1 < argc) {
+                std::ifstream corpus(argv[++i]);
+                if (!corpus) {
+                    std::cerr << "ERROR: cannot open " << argv[i] << "\n";
+                    return 1;
+                }
+                std::string line;
+                while (std::getline(corpus, line)) {
+                    if (!line.empty()) {
+                        generatedLines.push_back(line);
+                    }
+                }
+                continue;
+            }
+            std::ifstream corpus(argv[i], std::ios::binary);
+            if (!corpus) {
+                std::cerr << "ERROR: cannot open " << argv[i] << "\n";
+                return 1;
+            }
+            std::stringstream whole;
+            whole << corpus.rdbuf();
+            all += whole.str();
+
+            std::vector<std::string> lines;
+            std::istringstream in(whole.str());
+            std::string line;
+            while (std::getline(in, line)) {
+                if (!line.empty()) {
+                    lines.push_back(line);
+                }
+            }
+            bench(std::string(argv[i]) + " (lines)", lines);
+            bench(std::string(argv[i]) + " (whole)", std::vector<std::string>{whole.str()});
+        }
+        if (!generatedLines.empty()) {
+            benchGenerated(generatedLines);
+        }
+        benchThreads(all);
+    } catch (HuffmanException &e) {
+        std::cerr << "ERROR: " << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,111 @@
+#ifndef HUFFMAN_BITS_H
+#define HUFFMAN_BITS_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "huffman.h"
+
+/*
+ * Helpers shared by the encoders and table-driven decoders for packed bit
+ * streams, which are always packed most significant bit first.
+ */
+
+/*
+ * Writes bits into a caller supplied buffer, most significant bit first.
+ */
+class HuffmanBitWriter {
+public:
+	HuffmanBitWriter(unsigned char *out, size_t outSize)
+	: out(out), outSize(outSize), bitPos(0)
+	{ }
+
+	void write(uint64_t bits, unsigned length) {
+		if (length > outSize * 8 - bitPos) {
+			throw HuffmanException("Output Buffer Too Small");
+		}
+		while (length > 0) {
+			unsigned used = bitPos & 7;
+			unsigned count = std::min(length, 8 - used);
+			unsigned chunk = static_cast<unsigned>((bits >> (length - count)) & ((1u << count) - 1));
+			unsigned char &byte = out[bitPos >> 3];
+			if (used == 0) {
+				byte = 0;
+			}
+			byte |= static_cast<unsigned char>(chunk << (8 - used - count));
+			bitPos += count;
+			length -= count;
+		}
+	}
+	size_t size() const {
+		return bitPos;
+	}
+private:
+	unsigned char *out;
+	size_t outSize;
+	size_t bitPos;
+};
+
+/*
+ * Throw the error for a character that is neither in a table nor escaped.
+ */
+[[noreturn]] void huffmanMissingCharacter(int c);
+
+inline uint64_t huffmanLoadBigEndian(const unsigned char *p) {
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	uint64_t value;
+	std::memcpy(&value, p, sizeof(value));
+	return __builtin_bswap64(value);
+#else
+	uint64_t value = 0;
+	for (int i = 0; i < 8; ++i) {
+		value = (value << 8) | p[i];
+	}
+	return value;
+#endif
+}
+
+inline void huffmanStoreBigEndian(unsigned char *p, uint64_t value) {
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	value = __builtin_bswap64(value);
+	std::memcpy(p, &value, sizeof(value));
+#else
+	for (int i = 0; i < 8; ++i) {
+		p[i] = static_cast<unsigned char>(value >> (56 - 8 * i));
+	}
+#endif
+}
+
+/*
+ * Supplies the 64 bits of input starting at any bit position. Loads that
+ * would run past the end of the caller's buffer are served from a zero
+ * padded copy of its last few bytes, so callers only need to make sure
+ * the position itself stays within a couple of bytes of the end.
+ */
+class HuffmanBitWindow {
+public:
+	HuffmanBitWindow(const unsigned char *data, size_t bitLength)
+	: data(data), tail{}
+	{
+		size_t bytes = (bitLength + 7) / 8;
+		fastLimit = bytes >= 8 ? bytes - 7 : 0;
+		if (bytes > fastLimit) {
+			std::memcpy(tail, data + fastLimit, bytes - fastLimit);
+		}
+	}
+
+	uint64_t load(size_t pos) const {
+		size_t byte = pos >> 3;
+		uint64_t raw = byte < fastLimit ? huffmanLoadBigEndian(data + byte) : huffmanLoadBigEndian(tail + (byte - fastLimit));
+		return raw << (pos & 7);
+	}
+
+private:
+	const unsigned char *data;
+	size_t fastLimit;
+	unsigned char tail[32];
+};
+
+#endif
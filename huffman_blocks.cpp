@@ -0,0 +1,145 @@
+#include <algorithm>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "huffman.h"
+#include "huffman_blocks.h"
+#include "huffman_io.h"
+#include "huffman_parallel.h"
+
+
+/* ***************************************************************************
+ * Encoding and decoding blocks
+ */
+
+void HuffmanBlockStream::encode(const HuffmanTable &table, std::string_view text, size_t blockSize, unsigned threads) {
+	if (blockSize == 0) {
+		throw HuffmanException("Block Size Must Be Positive");
+	}
+
+	// split at UTF-8 lead bytes so every block is valid text on its own
+	blocks.clear();
+	uint64_t start = 0;
+	while (start < text.size()) {
+		uint64_t end = std::min<uint64_t>(start + blockSize, text.size());
+		while (end < text.size() && end > start && (static_cast<unsigned char>(text[end]) & 0xC0) == 0x80) {
+			--end;
+		}
+		if (end == start) {
+			end = std::min<uint64_t>(start + blockSize, text.size());
+		}
+		blocks.push_back(HuffmanBlock{0, 0, start, end - start});
+		start = end;
+	}
+	decodedSize = text.size();
+
+	huffmanParallelFor(blocks.size(), threads, [&](size_t i) {
+		blocks[i].bitLength = table.symbolsBitLength(text.substr(blocks[i].outputOffset, blocks[i].outputLength));
+	});
+
+	uint64_t offset = 0;
+	for (HuffmanBlock &block : blocks) {
+		block.bitOffset = offset;
+		offset += (block.bitLength + 7) & ~static_cast<uint64_t>(7);
+	}
+	data.assign(offset / 8, 0);
+
+	huffmanParallelFor(blocks.size(), threads, [&](size_t i) {
+		const HuffmanBlock &block = blocks[i];
+		table.encodeSymbols(text.substr(block.outputOffset, block.outputLength),
+		                    data.data() + block.bitOffset / 8, (block.bitLength + 7) / 8);
+	});
+}
+
+/*
+ * The index may come from an untrusted stream, so before anything is sized
+ * from it, check that no block claims more text than its bits can decode
+ * to: at most four bytes per shortest code. A table with a single symbol
+ * codes it in no bits at all, so then any length is possible.
+ */
+static void checkBlockLengths(const HuffmanTable &table, const std::vector<HuffmanBlock> &blocks) {
+	unsigned shortest = 64;
+	for (const HuffmanCode &code : table.getCodes()) {
+		shortest = std::min(shortest, code.length);
+	}
+	if (shortest == 0) {
+		return;
+	}
+	for (const HuffmanBlock &block : blocks) {
+		if (block.outputLength / 4 > block.bitLength / shortest) {
+			throw HuffmanException("Malformed Block Index");
+		}
+	}
+}
+
+std::string HuffmanBlockStream::decode(const HuffmanTable &table, unsigned threads) const {
+	checkBlockLengths(table, blocks);
+	std::string result(decodedSize, '\0');
+	decode(table, &result[0], result.size(), threads);
+	return result;
+}
+
+void HuffmanBlockStream::decode(const HuffmanTable &table, char *out, size_t outSize, unsigned threads) const {
+	if (outSize < decodedSize) {
+		throw HuffmanException("Output Buffer Too Small");
+	}
+	checkBlockLengths(table, blocks);
+	huffmanParallelFor(blocks.size(), threads, [&](size_t i) {
+		const HuffmanBlock &block = blocks[i];
+		table.decodeSymbols(data.data() + block.bitOffset / 8, block.bitLength,
+		                    out + block.outputOffset, block.outputLength);
+	});
+}
+
+
+/* ***************************************************************************
+ * Saving and loading
+ */
+
+void HuffmanBlockStream::save(std::ostream &out) const {
+	huffmanWriteU64(out, decodedSize);
+	huffmanWriteU64(out, blocks.size());
+	for (const HuffmanBlock &block : blocks) {
+		huffmanWriteU64(out, block.bitLength);
+		huffmanWriteU64(out, block.outputLength);
+	}
+	out.write(reinterpret_cast<const char*>(data.data()), data.size());
+}
+
+void HuffmanBlockStream::load(std::istream &in) {
+	uint64_t size = huffmanReadU64(in);
+	uint64_t count = huffmanReadU64(in);
+	std::vector<HuffmanBlock> newBlocks;
+	uint64_t bitOffset = 0, outputOffset = 0;
+	for (uint64_t i = 0; i < count; ++i) {
+		HuffmanBlock block{bitOffset, huffmanReadU64(in), outputOffset, huffmanReadU64(in)};
+		if (block.bitLength > UINT64_MAX - 7 - bitOffset || block.outputLength > size - outputOffset) {
+			throw HuffmanException("Malformed Block Index");
+		}
+		bitOffset += (block.bitLength + 7) & ~static_cast<uint64_t>(7);
+		outputOffset += block.outputLength;
+		newBlocks.push_back(block);
+	}
+	if (outputOffset != size) {
+		throw HuffmanException("Malformed Block Index");
+	}
+
+	// read the data in pieces, so an index claiming far more than the
+	// stream holds fails at its end rather than allocating it all up front
+	std::vector<unsigned char> newData;
+	for (uint64_t remaining = bitOffset / 8; remaining > 0; ) {
+		size_t piece = static_cast<size_t>(std::min<uint64_t>(remaining, 1 << 20));
+		size_t start = newData.size();
+		newData.resize(start + piece);
+		if (!in.read(reinterpret_cast<char*>(newData.data() + start), piece)) {
+			throw HuffmanException("Malformed Block Index");
+		}
+		remaining -= piece;
+	}
+	blocks.swap(newBlocks);
+	data.swap(newData);
+	decodedSize = size;
+}
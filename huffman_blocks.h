@@ -0,0 +1,115 @@
+#ifndef HUFFMAN_BLOCKS_H
+#define HUFFMAN_BLOCKS_H
+
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class HuffmanTable;
+
+/**
+ * Location of a single block within a HuffmanBlockStream.
+ */
+struct HuffmanBlock {
+	/** Offset of the first bit of the block in the encoded data. Always a
+	 *  multiple of eight. */
+	uint64_t bitOffset;
+	/** Number of encoded bits in the block. */
+	uint64_t bitLength;
+	/** Offset of the block's text in the decoded output. */
+	uint64_t outputOffset;
+	/** Number of bytes of decoded text in the block. */
+	uint64_t outputLength;
+};
+
+/**
+ * Container for one long text encoded as a series of independent blocks.
+ * Each block starts on a byte boundary and records where its bits and its
+ * decoded text live, so the blocks can be decoded in any order, on any
+ * number of threads, directly into their slice of one output buffer.
+ *
+ * Blocks hold only code words (see HuffmanTable::encodeSymbols()); neither
+ * end markers nor length headers are used, so any table may be used whether
+ * or not it is length-prefixed.
+ */
+class HuffmanBlockStream {
+public:
+	/** Default number of input bytes per block. */
+	static const size_t DefaultBlockSize = 64 * 1024;
+
+	/**
+	 * Encode text into blocks, replacing any current contents. Block
+	 * boundaries are moved back as needed so that no UTF-8 sequence is split.
+	 * @param table The table to encode with.
+	 * @param text The text to encode.
+	 * @param blockSize The approximate number of input bytes per block.
+	 * @param threads The number of threads to encode with; zero uses one per
+	 *                hardware thread.
+	 * @throw HuffmanException Thrown if an error occurs during the encoding
+	 *                         process.
+	 */
+	void encode(const HuffmanTable &table, std::string_view text,
+	            size_t blockSize = DefaultBlockSize, unsigned threads = 0);
+
+	/**
+	 * Decode every block into a newly allocated string.
+	 * @param table The table the stream was encoded with.
+	 * @param threads The number of threads to decode with; zero uses one per
+	 *                hardware thread.
+	 * @return The decoded text.
+	 * @throw HuffmanException Thrown if an error occurs during the decoding
+	 *                         process, or a block claims more text than its
+	 *                         bits can decode to.
+	 */
+	std::string decode(const HuffmanTable &table, unsigned threads = 0) const;
+
+	/**
+	 * Decode every block into a caller supplied buffer of at least
+	 * getDecodedSize() bytes. Each block is written directly into its own
+	 * slice of the buffer.
+	 * @param table The table the stream was encoded with.
+	 * @param out The buffer to write the decoded text into.
+	 * @param outSize The size of the output buffer in bytes.
+	 * @param threads The number of threads to decode with; zero uses one per
+	 *                hardware thread.
+	 * @throw HuffmanException Thrown if an error occurs during the decoding
+	 *                         process, a block claims more text than its
+	 *                         bits can decode to, or the buffer is too small.
+	 */
+	void decode(const HuffmanTable &table, char *out, size_t outSize, unsigned threads = 0) const;
+
+	/**
+	 * Write the block index and encoded data to a stream.
+	 * @param out The stream to write to.
+	 */
+	void save(std::ostream &out) const;
+
+	/**
+	 * Replace the contents of this stream with data written by save(). The
+	 * index is not trusted: the data it describes is read in pieces, so an
+	 * index claiming more than the stream holds fails without allocating it.
+	 * Block lengths are checked against the table when decoding.
+	 * @param in The stream to read from.
+	 * @throw HuffmanException Thrown if the data is malformed.
+	 */
+	void load(std::istream &in);
+
+	const std::vector<HuffmanBlock>& getBlocks() const {
+		return blocks;
+	}
+	const std::vector<unsigned char>& getData() const {
+		return data;
+	}
+	uint64_t getDecodedSize() const {
+		return decodedSize;
+	}
+
+private:
+	std::vector<HuffmanBlock> blocks;
+	std::vector<unsigned char> data;
+	uint64_t decodedSize = 0;
+};
+
+#endif
@@ -0,0 +1,216 @@
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define HUFFMAN_HAVE_MMAP 1
+#endif
+
+#include "huffman.h"
+#include "huffman_cache.h"
+#include "huffman_io.h"
+
+/*
+ * Cache entries are named by a 128-bit hash of their key, in hex, and hold
+ * the key followed by the table:
+ *
+ *     "HUFC" u32 version, u32 flags, u64 rescale total, histogram
+ *     table (see HuffmanTable::save())
+ *
+ * where the flags are 1 for length-prefixed and 2 for an escape code, and
+ * the histogram is the table's frequencies (see HuffmanHistogram::save()).
+ */
+
+static const char cacheMagic[4] = { 'H', 'U', 'F', 'C' };
+static const uint32_t cacheVersion = 1;
+
+
+/* ***************************************************************************
+ * Keys
+ */
+
+namespace {
+	std::string cacheKey(const HuffmanTable &table) {
+		std::ostringstream out;
+		out.write(cacheMagic, sizeof(cacheMagic));
+		huffmanWriteU32(out, cacheVersion);
+		huffmanWriteU32(out, (table.isLengthPrefixed() ? 1 : 0) | (table.hasEscape() ? 2 : 0));
+		huffmanWriteU64(out, table.getRescaleTotal());
+		table.getFrequencies().save(out);
+		return out.str();
+	}
+
+	/*
+	 * FNV-1a with a final mix, so differently seeded runs give two
+	 * independent halves of the name.
+	 */
+	uint64_t hashKey(std::string_view key, uint64_t seed) {
+		uint64_t hash = seed;
+		for (unsigned char byte : key) {
+			hash = (hash ^ byte) * 0x100000001B3ull;
+		}
+		hash ^= hash >> 33;
+		hash *= 0xFF51AFD7ED558CCDull;
+		return hash ^ (hash >> 33);
+	}
+
+	void appendHex(std::string &out, uint64_t value) {
+		static const char digits[] = "0123456789abcdef";
+		for (int shift = 60; shift >= 0; shift -= 4) {
+			out += digits[(value >> shift) & 0xF];
+		}
+	}
+
+	std::string entryPath(const std::string &directory, const std::string &key) {
+		std::string name;
+		appendHex(name, hashKey(key, 0xCBF29CE484222325ull));
+		appendHex(name, hashKey(key, 0x84222325CBF29CE4ull));
+		return (std::filesystem::path(directory) / (name + ".htab")).string();
+	}
+}
+
+HuffmanTableCache::HuffmanTableCache(std::string directory)
+: directory(std::move(directory))
+{ }
+
+std::string HuffmanTableCache::getPath(const HuffmanTable &table) const {
+	return entryPath(directory, cacheKey(table));
+}
+
+
+/* ***************************************************************************
+ * Loading and storing entries
+ */
+
+namespace {
+	/*
+	 * Load the table of an entry if its key matches, leaving the table
+	 * untouched otherwise.
+	 */
+	bool loadEntry(const std::string &path, const std::string &key, HuffmanTable &table) {
+		auto load = [&](std::string_view entry) {
+			if (entry.size() < key.size() || std::memcmp(entry.data(), key.data(), key.size()) != 0) {
+				return false;
+			}
+			HuffmanMemoryStreamBuf buffer(entry.substr(key.size()));
+			std::istream in(&buffer);
+			try {
+				table.load(in);
+			} catch (HuffmanException&) {
+				return false;
+			}
+			return true;
+		};
+
+#ifdef HUFFMAN_HAVE_MMAP
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			return false;
+		}
+		struct stat info;
+		if (fstat(fd, &info) != 0 || info.st_size == 0) {
+			close(fd);
+			return false;
+		}
+		size_t size = static_cast<size_t>(info.st_size);
+		void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (mapping == MAP_FAILED) {
+			return false;
+		}
+		bool loaded = load(std::string_view(static_cast<const char*>(mapping), size));
+		munmap(mapping, size);
+		return loaded;
+#else
+		std::ifstream in(path, std::ios::binary);
+		if (!in) {
+			return false;
+		}
+		std::ostringstream contents;
+		contents << in.rdbuf();
+		return load(contents.str());
+#endif
+	}
+
+	bool writeFile(const std::string &path, const std::string &contents) {
+#ifdef HUFFMAN_HAVE_MMAP
+		int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (fd < 0) {
+			return false;
+		}
+		size_t written = 0;
+		while (written < contents.size()) {
+			ssize_t result = write(fd, contents.data() + written, contents.size() - written);
+			if (result < 0 && errno == EINTR) {
+				continue;
+			} else if (result < 0) {
+				close(fd);
+				return false;
+			}
+			written += static_cast<size_t>(result);
+		}
+		// the entry must be on disk before the rename makes it visible
+		bool synced = fsync(fd) == 0;
+		return close(fd) == 0 && synced;
+#else
+		std::ofstream out(path, std::ios::binary);
+		out.write(contents.data(), contents.size());
+		out.close();
+		return static_cast<bool>(out);
+#endif
+	}
+
+	/*
+	 * Write an entry under a name no other writer will pick, then rename it
+	 * into place, so readers never see part of an entry.
+	 */
+	void storeEntry(const std::string &directory, const std::string &path, const std::string &key, const HuffmanTable &table) {
+		std::ostringstream entry;
+		entry << key;
+		table.save(entry);
+
+		std::error_code error;
+		std::filesystem::create_directories(directory, error);
+		std::random_device random;
+		uint64_t unique = (static_cast<uint64_t>(random()) << 32) ^ random()
+		                  ^ static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+		std::string temporary = path + ".tmp";
+		appendHex(temporary, unique);
+		if (!writeFile(temporary, entry.str())) {
+			std::filesystem::remove(temporary, error);
+			return;
+		}
+		std::filesystem::rename(temporary, path, error);
+		if (error) {
+			std::filesystem::remove(temporary, error);
+		}
+	}
+}
+
+bool HuffmanTableCache::buildTree(HuffmanTable &table) const {
+	std::string key = cacheKey(table);
+	std::string path = entryPath(directory, key);
+	// load() keeps only the weights of symbols in the tree, so put back the
+	// exact frequencies the key was made from
+	HuffmanHistogram frequencies = table.getFrequencies();
+	if (loadEntry(path, key, table)) {
+		table.charFrequency = frequencies;
+		return true;
+	}
+	table.buildTree();
+	storeEntry(directory, path, key, table);
+	return false;
+}
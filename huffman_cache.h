@@ -0,0 +1,56 @@
+#ifndef HUFFMAN_CACHE_H
+#define HUFFMAN_CACHE_H
+
+#include <string>
+
+class HuffmanTable;
+
+/**
+ * A directory of built tables shared by every program that builds tables
+ * from the same frequencies. Each table is stored under a hash of its
+ * frequencies and of the options that affect building it (length-prefixed,
+ * escape code and rescale total), so a program that gathers the same
+ * histogram as an earlier one maps the saved table rather than building the
+ * tree again.
+ *
+ * Each entry also holds the frequencies and options it was built from in
+ * full, and is only used if they match exactly, so hash collisions and
+ * corrupt entries just mean building again. Entries are written to a
+ * temporary file and renamed into place, so several processes can share a
+ * directory: readers see a whole entry or none, and writers racing to
+ * store the same table all store the same bits.
+ */
+class HuffmanTableCache {
+public:
+	/**
+	 * @param directory The directory holding the cache. It is created when
+	 *                  the first table is stored.
+	 */
+	explicit HuffmanTableCache(std::string directory);
+
+	/**
+	 * Build the table's tree as HuffmanTable::buildTree() does, loading it
+	 * from the cache if it holds a table built from the same frequencies and
+	 * options, and storing it there otherwise. Failing to store the table
+	 * is not an error; it is simply built again next time.
+	 * @param table The table to build, with its frequencies and options set.
+	 * @return Whether the table was loaded from the cache.
+	 * @throw HuffmanException Thrown if the tree cannot be built.
+	 */
+	bool buildTree(HuffmanTable &table) const;
+
+	/**
+	 * @param table A table with its frequencies and options set.
+	 * @return The file a table built from them is stored in.
+	 */
+	std::string getPath(const HuffmanTable &table) const;
+
+	const std::string& getDirectory() const {
+		return directory;
+	}
+
+private:
+	std::string directory;
+};
+
+#endif
@@ -0,0 +1,700 @@
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define HUFFMAN_HAVE_MMAP 1
+#endif
+
+#include "huffman.h"
+#include "huffman_cache.h"
+#include "huffman_decoder.h"
+#include "huffman_encoder.h"
+#include "huffman_histogram.h"
+#include "huffman_io.h"
+
+/*
+ * Command line front end for compressing whole files. Compressed files start
+ * with a header saying how the rest is stored:
+ *
+ *     "HUFZ" u32 version, u8 storage
+ *
+ * Files that coding would not shrink, empty files included, are stored as
+ * they are, and the rest of the file is the input. Coded files hold the
+ * table followed by a series of independently coded chunks:
+ *
+ *     table (see HuffmanTable::saveCodeLengths())
+ *     { u64 decoded length, u64 bit length, encoded bytes }*
+ *     u64 0, u64 0
+ */
+
+static const char fileMagic[4] = { 'H', 'U', 'F', 'Z' };
+static const uint32_t fileVersion = 2;
+
+enum FileStorage {
+	StoredFile = 0,
+	CodedFile = 1,
+};
+
+
+/* ***************************************************************************
+ * Input files, mapped into memory where possible
+ */
+
+class InputFile {
+public:
+	explicit InputFile(const std::string &filename) {
+#ifdef HUFFMAN_HAVE_MMAP
+		int fd = open(filename.c_str(), O_RDONLY);
+		struct stat info;
+		if (fd >= 0 && fstat(fd, &info) == 0 && S_ISREG(info.st_mode)) {
+			size = info.st_size;
+			if (size == 0) {
+				close(fd);
+				return;
+			}
+			void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			close(fd);
+			if (mapping != MAP_FAILED) {
+				madvise(mapping, size, MADV_SEQUENTIAL);
+				mapped = static_cast<const char*>(mapping);
+				return;
+			}
+		} else if (fd >= 0) {
+			close(fd);
+		}
+#endif
+		std::ifstream in(filename, std::ios::binary);
+		if (!in) {
+			throw HuffmanException("Could not open " + filename);
+		}
+		std::ostringstream buffer;
+		buffer << in.rdbuf();
+		contents = buffer.str();
+		size = contents.size();
+	}
+	~InputFile() {
+#ifdef HUFFMAN_HAVE_MMAP
+		if (mapped) {
+			munmap(const_cast<char*>(mapped), size);
+		}
+#endif
+	}
+	InputFile(const InputFile&) = delete;
+	InputFile& operator=(const InputFile&) = delete;
+
+	std::string_view text() const {
+		return mapped ? std::string_view(mapped, size) : std::string_view(contents);
+	}
+
+private:
+	const char *mapped = nullptr;
+	size_t size = 0;
+	std::string contents;
+};
+
+
+/* ***************************************************************************
+ * Pipeline plumbing
+ */
+
+/*
+ * A queue with a fixed capacity. push() blocks while the queue is full and
+ * pop() blocks while it is empty, until close() is called.
+ */
+template<class T>
+class BoundedQueue {
+public:
+	explicit BoundedQueue(size_t capacity)
+	: capacity(capacity)
+	{ }
+
+	void push(T item) {
+		std::unique_lock<std::mutex> lock(mutex);
+		notFull.wait(lock, [this]() { return items.size() < capacity || closed; });
+		if (!closed) {
+			items.push_back(std::move(item));
+			notEmpty.notify_one();
+		}
+	}
+	bool pop(T &item) {
+		std::unique_lock<std::mutex> lock(mutex);
+		notEmpty.wait(lock, [this]() { return !items.empty() || closed; });
+		if (items.empty()) {
+			return false;
+		}
+		item = std::move(items.front());
+		items.pop_front();
+		notFull.notify_one();
+		return true;
+	}
+	void close() {
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+		notEmpty.notify_all();
+		notFull.notify_all();
+	}
+
+private:
+	size_t capacity;
+	bool closed = false;
+	std::deque<T> items;
+	std::mutex mutex;
+	std::condition_variable notEmpty, notFull;
+};
+
+struct Chunk {
+	size_t index;
+	uint64_t decodedLength;
+	uint64_t bitLength;
+	std::string_view text;
+	std::vector<unsigned char> encoded;
+	std::string decoded;
+};
+
+/*
+ * Runs a reader -> workers -> writer pipeline. The reader produces chunks in
+ * order, the workers transform them in any order, and the writer receives
+ * them back in their original order. The queues are bounded so no more than
+ * a few chunks per thread are ever held in memory.
+ */
+template<class Reader, class Worker, class Writer>
+static void runPipeline(unsigned threads, Reader reader, Worker worker, Writer writer) {
+	BoundedQueue<std::unique_ptr<Chunk>> pending(threads * 2), done(threads * 2);
+	std::exception_ptr error;
+	std::mutex errorLock;
+	auto guard = [&](auto fn) {
+		return [&, fn]() {
+			try {
+				fn();
+			} catch (...) {
+				std::lock_guard<std::mutex> lock(errorLock);
+				if (!error) {
+					error = std::current_exception();
+				}
+				pending.close();
+				done.close();
+			}
+		};
+	};
+
+	std::thread readThread(guard([&]() {
+		std::unique_ptr<Chunk> chunk;
+		while ((chunk = reader())) {
+			pending.push(std::move(chunk));
+		}
+		pending.close();
+	}));
+	std::vector<std::thread> workers;
+	std::mutex finishedLock;
+	unsigned running = threads;
+	for (unsigned i = 0; i < threads; ++i) {
+		workers.emplace_back(guard([&]() {
+			std::unique_ptr<Chunk> chunk;
+			while (pending.pop(chunk)) {
+				worker(*chunk);
+				done.push(std::move(chunk));
+			}
+			std::lock_guard<std::mutex> lock(finishedLock);
+			if (--running == 0) {
+				done.close();
+			}
+		}));
+	}
+
+	guard([&]() {
+		std::map<size_t, std::unique_ptr<Chunk>> waiting;
+		size_t next = 0;
+		std::unique_ptr<Chunk> chunk;
+		while (done.pop(chunk)) {
+			size_t index = chunk->index;
+			waiting[index] = std::move(chunk);
+			for (auto i = waiting.find(next); i != waiting.end(); i = waiting.find(next)) {
+				writer(*i->second);
+				waiting.erase(i);
+				++next;
+			}
+		}
+	})();
+
+	readThread.join();
+	for (std::thread &thread : workers) {
+		thread.join();
+	}
+	if (error) {
+		std::rethrow_exception(error);
+	}
+}
+
+class OutputFile {
+public:
+	explicit OutputFile(const std::string &filename)
+	: file(std::fopen(filename.c_str(), "wb")), buffer(1 << 20)
+	{
+		if (!file) {
+			throw HuffmanException("Could not create " + filename);
+		}
+		std::setvbuf(file, buffer.data(), _IOFBF, buffer.size());
+	}
+	~OutputFile() {
+		if (file) {
+			std::fclose(file);
+		}
+	}
+	OutputFile(const OutputFile&) = delete;
+	OutputFile& operator=(const OutputFile&) = delete;
+
+	void write(const void *data, size_t size) {
+		if (std::fwrite(data, 1, size, file) != size) {
+			throw HuffmanException("Error Writing Output");
+		}
+		written += size;
+	}
+	void writeU64(uint64_t value) {
+		unsigned char bytes[8];
+		for (int i = 0; i < 8; ++i) {
+			bytes[i] = static_cast<unsigned char>(value >> (8 * i));
+		}
+		write(bytes, sizeof(bytes));
+	}
+	void finish() {
+		if (std::fclose(file) != 0) {
+			file = nullptr;
+			throw HuffmanException("Error Writing Output");
+		}
+		file = nullptr;
+	}
+	uint64_t size() const {
+		return written;
+	}
+
+private:
+	std::FILE *file;
+	std::vector<char> buffer;
+	uint64_t written = 0;
+};
+
+
+/* ***************************************************************************
+ * Commands
+ */
+
+struct Options {
+	std::string tableFile;
+	std::string outputFile;
+	unsigned threads = 0;
+	size_t chunkSize = 4 << 20;
+	uint64_t rescaleTotal = 0;
+	std::string cacheDirectory;
+	std::string format = "text";
+	std::vector<std::string> files;
+};
+
+static void reportThroughput(const char *action, uint64_t in, uint64_t out, std::chrono::steady_clock::time_point start) {
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::cerr << action << ' ' << in << " => " << out << " bytes";
+	if (in > 0) {
+		std::cerr << " (" << (out * 100 / in) << "%)";
+	}
+	std::cerr << " in " << seconds << "s, " << (std::max(in, out) / 1048576.0 / std::max(seconds, 1e-9)) << " MB/s\n";
+}
+
+/*
+ * Split text into chunks of about chunkSize bytes without splitting any
+ * UTF-8 sequence.
+ */
+static size_t chunkEnd(std::string_view text, size_t start, size_t chunkSize) {
+	size_t end = std::min(start + chunkSize, text.size());
+	while (end < text.size() && end > start && (static_cast<unsigned char>(text[end]) & 0xC0) == 0x80) {
+		--end;
+	}
+	return end > start ? end : std::min(start + chunkSize, text.size());
+}
+
+/*
+ * Count the characters of text files, merging in any files that hold
+ * histograms saved by the count command instead.
+ */
+static void gatherFrequencies(HuffmanHistogram &histogram, const std::vector<std::string> &files, size_t chunkSize) {
+	for (const std::string &filename : files) {
+		InputFile input(filename);
+		std::string_view text = input.text();
+		if (text.substr(0, 4) == "HUFH") {
+			HuffmanMemoryStreamBuf buffer(text);
+			std::istream in(&buffer);
+			HuffmanHistogram partial;
+			partial.load(in);
+			histogram.merge(partial);
+			continue;
+		}
+		for (size_t start = 0; start < text.size(); start = chunkEnd(text, start, chunkSize)) {
+			histogram.add(text.substr(start, chunkEnd(text, start, chunkSize) - start));
+		}
+	}
+}
+
+static void trainTable(HuffmanTable &table, const std::vector<std::string> &files, const Options &options) {
+	HuffmanHistogram histogram;
+	gatherFrequencies(histogram, files, options.chunkSize);
+	table.setLengthPrefixed(true);
+	table.setEscape(true);
+	table.setRescaleTotal(options.rescaleTotal);
+	table.addFrequencies(histogram);
+	if (options.cacheDirectory.empty()) {
+		table.buildTree();
+	} else {
+		HuffmanTableCache(options.cacheDirectory).buildTree(table);
+	}
+}
+
+static int commandCount(const Options &options) {
+	if (options.files.empty() || options.outputFile.empty()) {
+		std::cerr << "count needs -o <histogram> and at least one input file\n";
+		return 1;
+	}
+	HuffmanHistogram histogram;
+	gatherFrequencies(histogram, options.files, options.chunkSize);
+	std::ofstream out(options.outputFile, std::ios::binary);
+	histogram.save(out);
+	return out ? 0 : 1;
+}
+
+static int commandTrain(const Options &options) {
+	if (options.files.empty() || options.outputFile.empty()) {
+		std::cerr << "train needs -o <table> and at least one input file\n";
+		return 1;
+	}
+	HuffmanTable table;
+	trainTable(table, options.files, options);
+	std::ofstream out(options.outputFile, std::ios::binary);
+	table.save(out);
+	return out ? 0 : 1;
+}
+
+static const size_t storedHeaderSize = sizeof(fileMagic) + 4 + 1;
+
+static void writeStored(OutputFile &output, std::string_view text) {
+	std::ostringstream header;
+	header.write(fileMagic, sizeof(fileMagic));
+	huffmanWriteU32(header, fileVersion);
+	header.put(static_cast<char>(StoredFile));
+	output.write(header.str().data(), header.str().size());
+	output.write(text.data(), text.size());
+	output.finish();
+}
+
+static int commandCompress(const Options &options) {
+	if (options.files.size() != 2) {
+		std::cerr << "compress needs an input and an output file\n";
+		return 1;
+	}
+	auto start = std::chrono::steady_clock::now();
+	InputFile input(options.files[0]);
+	std::string_view text = input.text();
+	if (text.empty()) {
+		// there is nothing to train a table on or to code
+		OutputFile output(options.files[1]);
+		writeStored(output, text);
+		reportThroughput("compressed", 0, output.size(), start);
+		return 0;
+	}
+
+	HuffmanTable table;
+	if (options.tableFile.empty()) {
+		trainTable(table, { options.files[0] }, options);
+	} else {
+		std::ifstream in(options.tableFile, std::ios::binary);
+		table.load(in);
+	}
+
+	// the header only holds code lengths, so code with the codes they give
+	table.makeCanonical();
+	HuffmanEncodeTable encoder(table);
+
+	std::unique_ptr<OutputFile> output(new OutputFile(options.files[1]));
+	std::ostringstream header;
+	header.write(fileMagic, sizeof(fileMagic));
+	huffmanWriteU32(header, fileVersion);
+	header.put(static_cast<char>(CodedFile));
+	table.saveCodeLengths(header);
+	output->write(header.str().data(), header.str().size());
+
+	size_t position = 0, index = 0;
+	unsigned threads = options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+	runPipeline(threads, [&]() {
+		std::unique_ptr<Chunk> chunk;
+		if (position < text.size()) {
+			size_t end = chunkEnd(text, position, options.chunkSize);
+			chunk.reset(new Chunk{index++, end - position, 0, text.substr(position, end - position), {}, {}});
+			position = end;
+		}
+		return chunk;
+	}, [&](Chunk &chunk) {
+		// the worst case can be several times the text with escape codes, so
+		// encode into a per-worker buffer and keep only the bytes used
+		thread_local std::vector<unsigned char> scratch;
+		scratch.resize(encoder.maxEncodedBytes(chunk.text.size()));
+		chunk.bitLength = encoder.encodeSymbols(chunk.text, scratch.data(), scratch.size());
+		chunk.encoded.assign(scratch.begin(), scratch.begin() + (chunk.bitLength + 7) / 8);
+	}, [&](Chunk &chunk) {
+		output->writeU64(chunk.decodedLength);
+		output->writeU64(chunk.bitLength);
+		output->write(chunk.encoded.data(), chunk.encoded.size());
+	});
+	output->writeU64(0);
+	output->writeU64(0);
+	output->finish();
+
+	if (output->size() >= storedHeaderSize + text.size()) {
+		// coding did not pay for the table, so start over and store the input
+		output.reset(new OutputFile(options.files[1]));
+		writeStored(*output, text);
+	}
+
+	reportThroughput("compressed", text.size(), output->size(), start);
+	return 0;
+}
+
+/*
+ * Reads the header of a compressed file, leaving offset at the first chunk of
+ * a coded file or at the input of a stored one.
+ */
+static FileStorage readCompressedHeader(std::string_view data, HuffmanTable &table, size_t &offset) {
+	HuffmanMemoryStreamBuf buffer(data);
+	std::istream in(&buffer);
+	char magic[sizeof(fileMagic)];
+	if (!in.read(magic, sizeof(magic)) || std::memcmp(magic, fileMagic, sizeof(magic)) != 0) {
+		throw HuffmanException("Not a Compressed File");
+	}
+	if (huffmanReadU32(in) != fileVersion) {
+		throw HuffmanException("Unsupported Compressed File Version");
+	}
+	int storage = in.get();
+	if (storage == CodedFile) {
+		table.loadCodeLengths(in);
+	} else if (storage != StoredFile) {
+		throw HuffmanException("Unknown Compressed File Storage");
+	}
+	offset = static_cast<size_t>(in.tellg());
+	return static_cast<FileStorage>(storage);
+}
+
+static uint64_t readChunkU64(std::string_view data, size_t &offset) {
+	if (data.size() - offset < 8) {
+		throw HuffmanException("Unexpected End of File");
+	}
+	uint64_t value = 0;
+	for (int i = 7; i >= 0; --i) {
+		value = (value << 8) | static_cast<unsigned char>(data[offset + i]);
+	}
+	offset += 8;
+	return value;
+}
+
+static int commandDecompress(const Options &options) {
+	if (options.files.size() != 2) {
+		std::cerr << "decompress needs an input and an output file\n";
+		return 1;
+	}
+	auto start = std::chrono::steady_clock::now();
+	InputFile input(options.files[0]);
+	std::string_view data = input.text();
+	HuffmanTable table;
+	size_t offset = 0;
+	if (readCompressedHeader(data, table, offset) == StoredFile) {
+		OutputFile output(options.files[1]);
+		output.write(data.data() + offset, data.size() - offset);
+		output.finish();
+		reportThroughput("decompressed", data.size(), output.size(), start);
+		return 0;
+	}
+
+	HuffmanDecodeTable decoder(table);
+	// every code decodes to at most four bytes, which bounds what a chunk
+	// of a given bit length can hold before anything is allocated for it
+	unsigned shortest = 64;
+	for (const HuffmanCode &code : table.getCodes()) {
+		shortest = std::min(shortest, code.length);
+	}
+	shortest = std::max(shortest, 1u);
+	OutputFile output(options.files[1]);
+	size_t index = 0;
+	bool finished = false;
+	unsigned threads = options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+	runPipeline(threads, [&]() {
+		std::unique_ptr<Chunk> chunk;
+		if (!finished) {
+			uint64_t decodedLength = readChunkU64(data, offset);
+			uint64_t bitLength = readChunkU64(data, offset);
+			if (decodedLength == 0) {
+				finished = true;
+				return chunk;
+			}
+			uint64_t byteLength = (bitLength + 7) / 8;
+			if (bitLength > UINT64_MAX - 7 || data.size() - offset < byteLength) {
+				throw HuffmanException("Unexpected End of File");
+			}
+			if (decodedLength / 4 > bitLength / shortest) {
+				throw HuffmanException("Malformed Chunk");
+			}
+			chunk.reset(new Chunk{index++, decodedLength, bitLength, data.substr(offset, byteLength), {}, {}});
+			offset += byteLength;
+		}
+		return chunk;
+	}, [&](Chunk &chunk) {
+		chunk.decoded.resize(chunk.decodedLength);
+		decoder.decodeSymbols(reinterpret_cast<const unsigned char*>(chunk.text.data()), chunk.bitLength,
+		                      &chunk.decoded[0], chunk.decoded.size());
+	}, [&](Chunk &chunk) {
+		output.write(chunk.decoded.data(), chunk.decoded.size());
+	});
+	output.finish();
+
+	reportThroughput("decompressed", data.size(), output.size(), start);
+	return 0;
+}
+
+static int commandInspect(const Options &options) {
+	if (options.files.size() != 1) {
+		std::cerr << "inspect needs exactly one file\n";
+		return 1;
+	}
+	InputFile input(options.files[0]);
+	std::string_view data = input.text();
+	HuffmanTable table;
+	if (data.substr(0, sizeof(fileMagic)) == std::string_view(fileMagic, sizeof(fileMagic))) {
+		size_t offset = 0;
+		if (readCompressedHeader(data, table, offset) == StoredFile) {
+			std::cout << "stored file: " << data.size() - offset << " bytes stored as they are, ";
+			std::cout << data.size() << " bytes total\n";
+			return 0;
+		}
+		uint64_t chunks = 0, decoded = 0, bits = 0;
+		while (true) {
+			uint64_t decodedLength = readChunkU64(data, offset);
+			uint64_t bitLength = readChunkU64(data, offset);
+			if (decodedLength == 0) {
+				break;
+			}
+			if (data.size() - offset < (bitLength + 7) / 8) {
+				throw HuffmanException("Unexpected End of File");
+			}
+			offset += (bitLength + 7) / 8;
+			++chunks;
+			decoded += decodedLength;
+			bits += bitLength;
+		}
+		std::cout << "compressed file: " << chunks << " chunks, " << decoded << " bytes decoded, ";
+		std::cout << (bits + 7) / 8 << " bytes of codes, " << data.size() << " bytes total\n\n";
+	} else {
+		HuffmanMemoryStreamBuf buffer(data);
+		std::istream in(&buffer);
+		table.load(in);
+	}
+	if (options.format == "dot") {
+		table.writeDot(std::cout);
+	} else if (options.format == "json") {
+		table.writeJson(std::cout);
+	} else if (options.format == "summary" || options.format == "text") {
+		table.dumpCodeLengths(std::cout);
+		if (options.format == "text") {
+			std::cout << '\n';
+			table.dumpFrequencies(std::cout);
+			std::cout << '\n';
+			table.dumpTree(std::cout);
+		}
+	} else {
+		std::cerr << "unknown format " << options.format << "\n";
+		return 1;
+	}
+	return 0;
+}
+
+static void usage(const char *program) {
+	std::cerr << "USAGE: " << program << " <command> [options] files...\n\n"
+	          << "  count -o <histogram> <files...>   count the characters of text files\n"
+	          << "  train -o <table> <files...>       build a table from text files and histograms\n"
+	          << "  compress [-t <table>] <in> <out>  compress a file, training on it if no table is given\n"
+	          << "  decompress <in> <out>             decompress a file\n"
+	          << "  inspect [-f <format>] <file>      show the table of a compressed file or table\n\n"
+	          << "options:\n"
+	          << "  -f <format>   inspect output: summary, text (default), dot or json\n"
+	          << "  -j <threads>  number of worker threads (default: one per hardware thread)\n"
+	          << "  -c <kb>       chunk size in kilobytes (default: 4096)\n"
+	          << "  -r <total>    build tables from counts rescaled to this total (default: exact counts)\n"
+	          << "  -d <dir>      reuse tables built from the same counts, cached in this directory\n";
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 2) {
+		usage(argv[0]);
+		return 1;
+	}
+	std::string command = argv[1];
+	Options options;
+	int i = 2;
+	try {
+		for (; i < argc; ++i) {
+			std::string arg = argv[i];
+			if ((arg == "-o" || arg == "-t" || arg == "-j" || arg == "-c" || arg == "-f" || arg == "-r" || arg == "-d") && i + 1 < argc) {
+				std::string value = argv[++i];
+				if (arg == "-f") {
+					options.format = value;
+				} else if (arg == "-o") {
+					options.outputFile = value;
+				} else if (arg == "-t") {
+					options.tableFile = value;
+				} else if (arg == "-d") {
+					options.cacheDirectory = value;
+				} else if (arg == "-r") {
+					options.rescaleTotal = std::stoull(value);
+				} else if (arg == "-j") {
+					options.threads = std::stoul(value);
+				} else {
+					options.chunkSize = std::max<size_t>(1, std::stoul(value)) * 1024;
+				}
+			} else {
+				options.files.push_back(arg);
+			}
+		}
+	} catch (std::logic_error&) {
+		// std::invalid_argument and std::out_of_range from the number options
+		std::cerr << "ERROR: bad number for " << argv[i - 1] << ": " << argv[i] << "\n\n";
+		usage(argv[0]);
+		return 1;
+	}
+
+	try {
+		if (command == "count") {
+			return commandCount(options);
+		} else if (command == "train") {
+			return commandTrain(options);
+		} else if (command == "compress") {
+			return commandCompress(options);
+		} else if (command == "decompress") {
+			return commandDecompress(options);
+		} else if (command == "inspect") {
+			return commandInspect(options);
+		}
+	} catch (std::exception &e) {
+		std::cerr << "ERROR: " << e.what() << "\n";
+		return 1;
+	}
+	usage(argv[0]);
+	return 1;
+}
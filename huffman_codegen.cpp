@@ -0,0 +1,295 @@
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "huffman.h"
+
+
+/* ***************************************************************************
+ * Gathering the shape of the tree for code generation
+ */
+
+namespace {
+	struct GeneratedSymbol {
+		int character;
+		uint64_t code;
+		int length;
+	};
+
+	/*
+	 * Collect the code for every character of the tree.
+	 */
+	void collectSymbols(const HuffmanNode *node, uint64_t code, int length, std::vector<GeneratedSymbol> &symbols) {
+		if (length > 64) {
+			throw HuffmanException("Code Too Long for Generated Source");
+		}
+		if (node->getType() == HuffmanNode::Branch) {
+			const HuffmanBranch *branch = static_cast<const HuffmanBranch*>(node);
+			collectSymbols(branch->getLeft(), code << 1, length + 1, symbols);
+			collectSymbols(branch->getRight(), (code << 1) | 1, length + 1, symbols);
+		} else if (node->getType() == HuffmanNode::SingleChar) {
+			const HuffmanLeafChar *leaf = static_cast<const HuffmanLeafChar*>(node);
+			symbols.push_back(GeneratedSymbol{leaf->getCharacter(), code, length});
+		} else {
+			symbols.push_back(GeneratedSymbol{0, code, length});
+		}
+	}
+
+	/*
+	 * One entry of the generated decoding tables: the bits it uses and what
+	 * they decode to, which is a character with its UTF-8 bytes packed into
+	 * value, the end marker, or a branch deeper in the tree whose own table
+	 * value holds the index of.
+	 */
+	struct GeneratedEntry {
+		uint32_t value;
+		unsigned bits;
+		unsigned kind;
+		unsigned length;
+	};
+
+	enum GeneratedKind {
+		GeneratedChar = 0,
+		GeneratedBranch = 1,
+		GeneratedEnd = 2,
+	};
+
+	// the generated decode() reads windows of exactly this many bits
+	const unsigned GeneratedLookupBits = 8;
+
+	/*
+	 * Build a table of every value of the next GeneratedLookupBits bits for
+	 * each state, where a state is the root or a branch that a code passes
+	 * through after a whole number of lookups. Each entry follows its bits
+	 * from the state's node until they reach a leaf or run out.
+	 */
+	std::vector<std::vector<GeneratedEntry>> buildDecodeTables(const HuffmanNode *root) {
+		std::vector<const HuffmanNode*> states = { root };
+		std::vector<std::vector<GeneratedEntry>> tables;
+		for (size_t state = 0; state < states.size(); ++state) {
+			std::vector<GeneratedEntry> table;
+			for (unsigned window = 0; window < (1u << GeneratedLookupBits); ++window) {
+				const HuffmanNode *node = states[state];
+				unsigned bits = 0;
+				while (node->getType() == HuffmanNode::Branch && bits < GeneratedLookupBits) {
+					bool right = (window >> (GeneratedLookupBits - 1 - bits)) & 1;
+					node = static_cast<const HuffmanBranch*>(node)->nextNode(right);
+					++bits;
+				}
+				if (node->getType() == HuffmanNode::Branch) {
+					// the deeper tables are found in the order they are first needed
+					size_t next = std::find(states.begin(), states.end(), node) - states.begin();
+					if (next == states.size()) {
+						states.push_back(node);
+					}
+					table.push_back(GeneratedEntry{static_cast<uint32_t>(next), bits, GeneratedBranch, 0});
+				} else if (node->getType() == HuffmanNode::SingleChar) {
+					const HuffmanLeafChar *leaf = static_cast<const HuffmanLeafChar*>(node);
+					uint32_t value = 0;
+					for (size_t i = 0; i < leaf->getUtf8Length(); ++i) {
+						value |= static_cast<uint32_t>(static_cast<unsigned char>(leaf->getUtf8()[i])) << (8 * i);
+					}
+					table.push_back(GeneratedEntry{value, bits, GeneratedChar, static_cast<unsigned>(leaf->getUtf8Length())});
+				} else {
+					table.push_back(GeneratedEntry{0, bits, GeneratedEnd, 0});
+				}
+			}
+			tables.push_back(table);
+		}
+		return tables;
+	}
+
+	void writeHex(std::ostream &out, uint64_t value) {
+		out << "0x" << std::hex << std::uppercase << value << std::dec << "u";
+	}
+}
+
+
+/* ***************************************************************************
+ * Source generation
+ */
+
+void HuffmanTable::writeDecoderSource(std::ostream &out, const std::string &name) const {
+	if (!root) {
+		throw HuffmanException("Tried to generate source for non-existant tree");
+	}
+	if (escape) {
+		throw HuffmanException("Escape Codes Not Supported in Generated Source");
+	}
+
+	std::vector<GeneratedSymbol> symbols;
+	collectSymbols(root.get(), 0, 0, symbols);
+	std::sort(symbols.begin(), symbols.end(),
+	          [](const GeneratedSymbol &lhs, const GeneratedSymbol &rhs) {
+		return lhs.character < rhs.character;
+	});
+	if (symbols.empty() || symbols[0].character != 0) {
+		throw HuffmanException("Tree has no End Marker");
+	}
+
+	std::string guard = name + "_HUFFMAN_GENERATED_H";
+	std::transform(guard.begin(), guard.end(), guard.begin(), ::toupper);
+
+	out << "// Generated by HuffmanTable::writeDecoderSource; do not edit.\n";
+	out << "#ifndef " << guard << "\n#define " << guard << "\n\n";
+	out << "#include <cstddef>\n#include <cstdint>\n#include <stdexcept>\n\n";
+	out << "namespace " << name << " {\n\n";
+
+	// encoding tables, excluding the end marker which is kept separately
+	size_t count = symbols.size() - 1;
+	out << "static const std::size_t symbolCount = " << count << ";\n";
+	out << "static const std::uint64_t endCode = ";
+	writeHex(out, symbols[0].code);
+	out << ";\nstatic const unsigned endLength = " << symbols[0].length << ";\n";
+	out << "static const std::int32_t characters[" << std::max<size_t>(count, 1) << "] = {";
+	for (size_t i = 1; i < symbols.size(); ++i) {
+		out << (i % 8 == 1 ? "\n\t" : " ") << symbols[i].character << ',';
+	}
+	out << "\n};\nstatic const std::uint64_t codes[" << std::max<size_t>(count, 1) << "] = {";
+	for (size_t i = 1; i < symbols.size(); ++i) {
+		out << (i % 6 == 1 ? "\n\t" : " ");
+		writeHex(out, symbols[i].code);
+		out << ',';
+	}
+	out << "\n};\nstatic const unsigned char lengths[" << std::max<size_t>(count, 1) << "] = {";
+	for (size_t i = 1; i < symbols.size(); ++i) {
+		out << (i % 16 == 1 ? "\n\t" : " ") << symbols[i].length << ',';
+	}
+	out << "\n};\n\n";
+
+	out << R"(/**
+ * Encode UTF-8 text into out, packed most significant bit first. Returns the
+ * number of bits written, including the end marker.
+ */
+inline std::size_t encode(const char *text, std::size_t length, unsigned char *out, std::size_t outSize) {
+	std::size_t pos = 0, bitPos = 0;
+	while (true) {
+		std::uint64_t code = endCode;
+		unsigned codeLength = endLength;
+		bool atEnd = (pos >= length);
+		if (!atEnd) {
+			unsigned char lead = static_cast<unsigned char>(text[pos++]);
+			std::int32_t c = lead;
+			int extra = lead < 0x80 ? 0 : lead < 0xC0 ? -1 : lead < 0xE0 ? 1 : lead < 0xF0 ? 2 : lead < 0xF8 ? 3 : -1;
+			if (extra < 0) {
+				throw std::runtime_error("Invalid UTF-8 Lead Byte");
+			}
+			const std::int32_t smallest[] = {0, 0x80, 0x800, 0x10000};
+			std::int32_t minimum = smallest[extra];
+			if (extra) {
+				c &= 0x3F >> extra;
+			}
+			for (; extra > 0; --extra) {
+				if (pos >= length) {
+					throw std::runtime_error("Truncated UTF-8 Sequence");
+				}
+				unsigned char next = static_cast<unsigned char>(text[pos++]);
+				if ((next & 0xC0) != 0x80) {
+					throw std::runtime_error("Invalid UTF-8 Continuation Byte");
+				}
+				c = (c << 6) | (next & 0x3F);
+			}
+			if (c < minimum || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF)) {
+				throw std::runtime_error("Invalid UTF-8 Code Point");
+			}
+			std::size_t low = 0, high = symbolCount;
+			while (low < high) {
+				std::size_t mid = (low + high) / 2;
+				if (characters[mid] < c) {
+					low = mid + 1;
+				} else {
+					high = mid;
+				}
+			}
+			if (low == symbolCount || characters[low] != c) {
+				throw std::runtime_error("Not in Huffman Table");
+			}
+			code = codes[low];
+			codeLength = lengths[low];
+		}
+		if (bitPos + codeLength > outSize * 8) {
+			throw std::runtime_error("Output Buffer Too Small");
+		}
+		for (unsigned bit = codeLength; bit > 0; --bit, ++bitPos) {
+			if ((bitPos & 7) == 0) {
+				out[bitPos >> 3] = 0;
+			}
+			if ((code >> (bit - 1)) & 1) {
+				out[bitPos >> 3] |= static_cast<unsigned char>(0x80 >> (bitPos & 7));
+			}
+		}
+		if (atEnd) {
+			return bitPos;
+		}
+	}
+}
+
+/*
+ * Decoding looks up the next eight bits at a time in the table of the
+ * current state, which gives a character and the bits its code used, the end
+ * marker, or the state to continue in for codes longer than one lookup.
+ */
+struct DecodeEntry {
+	std::uint32_t value;
+	unsigned char bits;
+	unsigned char kind;
+	unsigned char length;
+};
+
+enum { DecodeChar = 0, DecodeBranch = 1, DecodeEnd = 2 };
+
+)";
+
+	std::vector<std::vector<GeneratedEntry>> tables = buildDecodeTables(root.get());
+	out << "static const DecodeEntry decodeTables[" << tables.size() << "][" << (1u << GeneratedLookupBits) << "] = {\n";
+	for (const std::vector<GeneratedEntry> &table : tables) {
+		out << "\t{";
+		for (size_t i = 0; i < table.size(); ++i) {
+			out << (i % 4 == 0 ? "\n\t\t" : " ") << "{ ";
+			writeHex(out, table[i].value);
+			out << ", " << table[i].bits << ", " << table[i].kind << ", " << table[i].length << " },";
+		}
+		out << "\n\t},\n";
+	}
+	out << "};\n\n";
+
+	out << R"(/**
+ * Decode bitLength bits of data into out. Returns the number of bytes
+ * written; the output is not NUL terminated.
+ */
+inline std::size_t decode(const unsigned char *data, std::size_t bitLength, char *out, std::size_t outSize) {
+	std::size_t pos = 0, written = 0, byteLength = (bitLength + 7) / 8;
+	unsigned state = 0;
+	while (true) {
+		// bits past the end read as zero; an entry that uses them is truncated
+		std::size_t index = pos >> 3;
+		unsigned window = index < byteLength ? static_cast<unsigned>(data[index]) << 8 : 0;
+		if (index + 1 < byteLength) {
+			window |= data[index + 1];
+		}
+		const DecodeEntry &entry = decodeTables[state][(window >> (8 - (pos & 7))) & 0xFF];
+		if (entry.bits > bitLength - pos) {
+			throw std::runtime_error("Unexpected End of Data");
+		}
+		pos += entry.bits;
+		if (entry.kind == DecodeBranch) {
+			state = entry.value;
+			continue;
+		} else if (entry.kind == DecodeEnd) {
+			return written;
+		}
+		if (outSize - written < entry.length) {
+			throw std::runtime_error("Output Buffer Too Small");
+		}
+		for (unsigned i = 0; i < entry.length; ++i) {
+			out[written++] = static_cast<char>(entry.value >> (8 * i));
+		}
+		state = 0;
+	}
+}
+
+} // namespace )" << name << "\n\n#endif\n";
+}
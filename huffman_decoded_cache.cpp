@@ -0,0 +1,154 @@
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "huffman.h"
+#include "huffman_bank.h"
+#include "huffman_decoded_cache.h"
+#include "huffman_decoder.h"
+
+
+/* ***************************************************************************
+ * Shards
+ */
+
+HuffmanDecodedCache::HuffmanDecodedCache(const HuffmanDecodeTable &decoder, size_t maxBytes, unsigned shardCount)
+: decoder(decoder)
+{
+	shardCount = std::max(1u, shardCount);
+	shardBytes = maxBytes / shardCount;
+	for (unsigned i = 0; i < shardCount; ++i) {
+		shards.emplace_back(new Shard());
+	}
+}
+
+HuffmanDecodedCache::Shard& HuffmanDecodedCache::shardFor(uint64_t key, bool byBits) {
+	// IDs are often small and sequential, so mix them before picking
+	uint64_t mixed = (key ^ (byBits ? 0xD6E8FEB86659FD93ull : 0)) * 0x9E3779B97F4A7C15ull;
+	return *shards[(mixed >> 32) % shards.size()];
+}
+
+bool HuffmanDecodedCache::matches(const Entry &entry, const unsigned char *data, size_t bitLength) {
+	return huffmanEncodedEqual(entry.bits.data(), entry.bitLength, data, bitLength);
+}
+
+void HuffmanDecodedCache::evict(Shard &shard, size_t slot) {
+	Entry &entry = shard.entries[slot];
+	(entry.byBits ? shard.byHash : shard.byId).erase(entry.key);
+	shard.bytes -= entry.bytes;
+	entry = Entry();
+	shard.free.push_back(slot);
+	++shard.evictions;
+}
+
+HuffmanDecodedCache::Stats HuffmanDecodedCache::getStats() const {
+	Stats stats = Stats{0, 0, 0, 0, 0};
+	for (const auto &shard : shards) {
+		std::lock_guard<std::mutex> guard(shard->lock);
+		stats.hits += shard->hits;
+		stats.misses += shard->misses;
+		stats.evictions += shard->evictions;
+		stats.entries += shard->byId.size() + shard->byHash.size();
+		stats.bytes += shard->bytes;
+	}
+	return stats;
+}
+
+void HuffmanDecodedCache::clear() {
+	for (const auto &shard : shards) {
+		std::lock_guard<std::mutex> guard(shard->lock);
+		shard->entries.clear();
+		shard->free.clear();
+		shard->hand = 0;
+		shard->byId.clear();
+		shard->byHash.clear();
+		shard->bytes = 0;
+	}
+}
+
+
+/* ***************************************************************************
+ * Lookups
+ */
+
+HuffmanDecodedCache::Handle HuffmanDecodedCache::decode(uint64_t id, const unsigned char *data, size_t bitLength) {
+	return lookup(id, false, data, 0, bitLength);
+}
+
+HuffmanDecodedCache::Handle HuffmanDecodedCache::decode(const unsigned char *data, size_t bitLength) {
+	return lookup(huffmanEncodedHash(data, bitLength), true, data, 0, bitLength);
+}
+
+HuffmanDecodedCache::Handle HuffmanDecodedCache::decode(const HuffmanStringBank &bank, size_t index) {
+	const HuffmanStringBank::Entry &entry = bank.getEntry(index);
+	return lookup(index, false, bank.getData().data(), entry.bitOffset, entry.bitLength);
+}
+
+HuffmanDecodedCache::Handle HuffmanDecodedCache::lookup(uint64_t key, bool byBits, const unsigned char *data,
+                                                        size_t bitOffset, size_t bitLength) {
+	Shard &shard = shardFor(key, byBits);
+	std::unordered_map<uint64_t, size_t> &index = byBits ? shard.byHash : shard.byId;
+	{
+		std::lock_guard<std::mutex> guard(shard.lock);
+		auto found = index.find(key);
+		if (found != index.end() && (!byBits || matches(shard.entries[found->second], data, bitLength))) {
+			Entry &entry = shard.entries[found->second];
+			entry.referenced = true;
+			++shard.hits;
+			return entry.text;
+		}
+		++shard.misses;
+	}
+
+	// decode without holding the lock, so other lookups in the shard go on
+	size_t pos = bitOffset;
+	Handle text = std::make_shared<const std::string>(decoder.decode(data, bitOffset + bitLength, pos));
+	Entry added;
+	added.bytes = text->size() + EntryOverhead;
+	if (byBits) {
+		added.bits.assign(data, data + (bitLength + 7) / 8);
+		added.bytes += added.bits.size();
+	}
+	if (added.bytes > shardBytes) {
+		return text;
+	}
+
+	std::lock_guard<std::mutex> guard(shard.lock);
+	auto found = index.find(key);
+	if (found != index.end()) {
+		Entry &existing = shard.entries[found->second];
+		if (!byBits || matches(existing, data, bitLength)) {
+			// another thread decoded the same string first
+			return existing.text;
+		}
+		// a different string with the same hash; the newer one wins
+		evict(shard, found->second);
+	}
+	while (shard.bytes + added.bytes > shardBytes) {
+		Entry &candidate = shard.entries[shard.hand];
+		if (candidate.text && candidate.referenced) {
+			candidate.referenced = false;
+		} else if (candidate.text) {
+			evict(shard, shard.hand);
+		}
+		shard.hand = (shard.hand + 1) % shard.entries.size();
+	}
+
+	size_t slot = shard.entries.size();
+	if (shard.free.empty()) {
+		shard.entries.emplace_back();
+	} else {
+		slot = shard.free.back();
+		shard.free.pop_back();
+	}
+	added.text = text;
+	added.bitLength = bitLength;
+	added.key = key;
+	added.byBits = byBits;
+	shard.bytes += added.bytes;
+	shard.entries[slot] = std::move(added);
+	index.emplace(key, slot);
+	return text;
+}
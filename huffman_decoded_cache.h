@@ -0,0 +1,136 @@
+#ifndef HUFFMAN_DECODED_CACHE_H
+#define HUFFMAN_DECODED_CACHE_H
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class HuffmanDecodeTable;
+class HuffmanStringBank;
+
+/**
+ * A size bounded cache of decoded strings in front of a HuffmanDecodeTable,
+ * for programs that decode the same few strings over and over. Strings are
+ * looked up either by an ID the caller chooses, such as their index in a
+ * HuffmanStringBank, or by their encoded bits, which are hashed with
+ * huffmanEncodedHash() and compared in full, so strings that only share a
+ * hash are never confused.
+ *
+ * The cache is split into shards, each with its own lock, and every key
+ * belongs to one shard, so threads looking up different strings rarely
+ * wait for each other. Each shard evicts with the CLOCK algorithm: a hit
+ * only marks its entry as referenced, and when room is needed a hand
+ * sweeps the shard, clearing marks and evicting the first entry it finds
+ * unmarked. New entries start unmarked, so strings decoded only once are
+ * evicted before strings that have been looked up again.
+ *
+ * Strings are handed out as shared handles, so a hit never copies the
+ * string, and a string evicted while in use stays valid until its last
+ * handle is released.
+ */
+class HuffmanDecodedCache {
+public:
+	typedef std::shared_ptr<const std::string> Handle;
+
+	/** A snapshot of the counters of every shard. */
+	struct Stats {
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t evictions;
+		/** The number of strings held. */
+		size_t entries;
+		/** The bytes charged against the budget by the strings held. */
+		size_t bytes;
+	};
+
+	/** The bytes charged for each entry on top of its text and bits. */
+	static constexpr size_t EntryOverhead = 128;
+
+	/**
+	 * @param decoder The decoder to decode misses with. It must outlive the
+	 *                cache.
+	 * @param maxBytes The most memory the cached strings may use, split
+	 *                 evenly between the shards. A string too big for its
+	 *                 shard is decoded but never cached.
+	 * @param shardCount The number of shards; at least one is used.
+	 */
+	HuffmanDecodedCache(const HuffmanDecodeTable &decoder, size_t maxBytes, unsigned shardCount = 16);
+
+	HuffmanDecodedCache(const HuffmanDecodedCache&) = delete;
+	HuffmanDecodedCache& operator=(const HuffmanDecodedCache&) = delete;
+
+	/**
+	 * Look up a string by an ID, decoding and caching it if it is missing.
+	 * The same ID must always be given the same string.
+	 * @param id The ID of the string.
+	 * @param data The encoded string, packed most significant bit first.
+	 * @param bitLength The number of valid bits in data.
+	 * @return The decoded text.
+	 * @throw HuffmanException Thrown if the data is truncated or corrupt.
+	 */
+	Handle decode(uint64_t id, const unsigned char *data, size_t bitLength);
+
+	/**
+	 * Look up a string by its encoded bits, decoding and caching it if it is
+	 * missing.
+	 * @param data The encoded string, packed most significant bit first.
+	 * @param bitLength The number of valid bits in data.
+	 * @return The decoded text.
+	 * @throw HuffmanException Thrown if the data is truncated or corrupt.
+	 */
+	Handle decode(const unsigned char *data, size_t bitLength);
+
+	/**
+	 * Look up a string of a bank, using its index as its ID. IDs of
+	 * different banks are not told apart, so a cache should only be used
+	 * with one bank.
+	 * @param bank The bank holding the string.
+	 * @param index The index of the string in the bank.
+	 * @return The decoded text.
+	 * @throw HuffmanException Thrown if the data is corrupt.
+	 */
+	Handle decode(const HuffmanStringBank &bank, size_t index);
+
+	/** @return The counters, summed over the shards. */
+	Stats getStats() const;
+
+	/** Evict every string, leaving the counters as they are. */
+	void clear();
+
+private:
+	struct Entry {
+		Handle text;
+		// the encoded bits, for entries looked up by them
+		std::vector<unsigned char> bits;
+		size_t bitLength = 0;
+		uint64_t key = 0;
+		size_t bytes = 0;
+		bool byBits = false;
+		bool referenced = false;
+	};
+
+	struct Shard {
+		std::mutex lock;
+		// the clock; empty slots have no text and are listed in free
+		std::vector<Entry> entries;
+		std::vector<size_t> free;
+		size_t hand = 0;
+		std::unordered_map<uint64_t, size_t> byId, byHash;
+		size_t bytes = 0;
+		uint64_t hits = 0, misses = 0, evictions = 0;
+	};
+
+	Handle lookup(uint64_t key, bool byBits, const unsigned char *data, size_t bitOffset, size_t bitLength);
+	Shard& shardFor(uint64_t key, bool byBits);
+	static bool matches(const Entry &entry, const unsigned char *data, size_t bitLength);
+	static void evict(Shard &shard, size_t slot);
+
+	const HuffmanDecodeTable &decoder;
+	size_t shardBytes;
+	std::vector<std::unique_ptr<Shard>> shards;
+};
+
+#endif
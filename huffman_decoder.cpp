@@ -0,0 +1,537 @@
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "huffman.h"
+#include "huffman_bits.h"
+#include "huffman_decoder.h"
+#include "huffman_memory.h"
+#include "huffman_utf8.h"
+
+
+/* ***************************************************************************
+ * Building the lookup tables
+ */
+
+HuffmanDecodeTable::HuffmanDecodeTable(const HuffmanTable &table, unsigned lookupBits,
+                                       HuffmanTableAllocator *allocator, bool replicatePerNode)
+: allocator(allocator ? allocator : &HuffmanTableAllocator::heap()), entryCount(0), lookupBits(std::max(1u, std::min(lookupBits, 16u))), rootBits(0), minCodeLength(64), maxBytesPerBit(0),
+  lengthPrefixed(table.isLengthPrefixed())
+{
+	const std::vector<HuffmanCode> &codes = table.getCodes();
+	if (codes.empty()) {
+		throw HuffmanException("Tried to build decoder for non-existant tree");
+	}
+
+	std::vector<Symbol> symbols;
+	for (size_t i = 0; i < codes.size(); ++i) {
+		symbols.push_back(Symbol{table.getSymbols()[i], codes[i].bits, codes[i].length});
+		minCodeLength = std::min(minCodeLength, codes[i].length);
+		if (codes[i].length > 0) {
+			maxBytesPerBit = std::max(maxBytesPerBit, 4.0 / codes[i].length);
+		}
+	}
+	if (table.hasEscape()) {
+		const HuffmanCode &code = table.getEscapeCode();
+		symbols.push_back(Symbol{HuffmanTable::EscapeSymbol, code.bits, code.length});
+		minCodeLength = std::min(minCodeLength, code.length + HuffmanTable::EscapeBits);
+		maxBytesPerBit = std::max(maxBytesPerBit, 4.0 / (code.length + HuffmanTable::EscapeBits));
+	}
+	std::vector<Entry> entries;
+	buildLevel(entries, symbols, 0, rootBits);
+	freeze(entries, replicatePerNode);
+}
+
+HuffmanDecodeTable::~HuffmanDecodeTable() {
+	for (Entry *replica : replicas) {
+		if (replica) {
+			allocator->deallocate(replica, getTableBytes());
+		}
+	}
+}
+
+size_t HuffmanDecodeTable::buildLevel(std::vector<Entry> &entries, const std::vector<Symbol> &symbols, unsigned consumed, unsigned &bits) {
+	unsigned longest = 0;
+	for (const Symbol &symbol : symbols) {
+		longest = std::max(longest, symbol.length - consumed);
+	}
+	bits = std::min(lookupBits, longest);
+
+	size_t base = entries.size();
+	entries.resize(base + (size_t(1) << bits), Entry{0, 0, Invalid, 0, 0});
+
+	std::map<size_t, std::vector<Symbol>> groups;
+	for (const Symbol &symbol : symbols) {
+		unsigned remaining = symbol.length - consumed;
+		uint64_t rest = remaining < 64 ? symbol.code & ((uint64_t(1) << remaining) - 1) : symbol.code;
+		if (remaining > bits) {
+			groups[static_cast<size_t>(rest >> (remaining - bits))].push_back(symbol);
+			continue;
+		}
+
+		Entry entry{0, static_cast<uint8_t>(remaining), End, 0, 0};
+		if (symbol.character == HuffmanTable::EscapeSymbol) {
+			entry.kind = Escape;
+		} else if (symbol.character != 0) {
+			char bytes[4];
+			entry.kind = Character;
+			entry.utf8Length = static_cast<uint8_t>(utf8::append(symbol.character, bytes) - bytes);
+			std::memcpy(&entry.value, bytes, entry.utf8Length);
+		}
+		size_t first = static_cast<size_t>(rest) << (bits - remaining);
+		std::fill_n(entries.begin() + base + first, size_t(1) << (bits - remaining), entry);
+	}
+
+	for (const auto &group : groups) {
+		unsigned subBits = 0;
+		size_t sub = buildLevel(entries, group.second, consumed + bits, subBits);
+		entries[base + group.first] = Entry{static_cast<uint32_t>(sub), static_cast<uint8_t>(bits), Subtable,
+		                                    static_cast<uint8_t>(subBits), 0};
+	}
+	return base;
+}
+
+/*
+ * Copy the finished lookup tables into allocator memory. Replicas are filled
+ * by a thread running on their own node, so the kernel's first-touch policy
+ * places their pages there.
+ */
+void HuffmanDecodeTable::freeze(const std::vector<Entry> &entries, bool replicatePerNode) {
+	entryCount = entries.size();
+	unsigned nodes = replicatePerNode ? huffmanNumaNodeCount() : 1;
+	replicas.assign(nodes, nullptr);
+	try {
+		for (unsigned node = 0; node < nodes; ++node) {
+			Entry *replica = static_cast<Entry*>(allocator->allocate(getTableBytes()));
+			replicas[node] = replica;
+			auto fill = [&]() {
+				std::memcpy(replica, entries.data(), getTableBytes());
+			};
+			if (nodes > 1) {
+				huffmanRunOnNumaNode(node, fill);
+			} else {
+				fill();
+			}
+		}
+	} catch (...) {
+		for (Entry *replica : replicas) {
+			if (replica) {
+				allocator->deallocate(replica, getTableBytes());
+			}
+		}
+		throw;
+	}
+}
+
+const HuffmanDecodeTable::Entry* HuffmanDecodeTable::localEntries() const {
+	if (replicas.size() == 1) {
+		return replicas[0];
+	}
+	unsigned node = huffmanCurrentNumaNode();
+	return replicas[node < replicas.size() ? node : 0];
+}
+
+
+/* ***************************************************************************
+ * Decoding
+ */
+
+size_t HuffmanDecodeTable::run(const unsigned char *data, size_t bitLength, size_t &position, char *out, size_t outSize, bool untilEnd) const {
+	HuffmanBitWindow bits(data, bitLength);
+	const Entry *table = localEntries();
+	size_t written = 0;
+	size_t pos = position;
+
+	// window holds the next available bits of input, most significant first
+	uint64_t window = bits.load(pos);
+	unsigned available = 64 - (pos & 7);
+
+	while (untilEnd || written < outSize) {
+		if (available < 16) {
+			window = bits.load(pos);
+			available = 64 - (pos & 7);
+		}
+		const Entry *entry = table + (rootBits ? window >> (64 - rootBits) : 0);
+		while (entry->kind == Subtable) {
+			pos += entry->length;
+			if (pos > bitLength) {
+				throw HuffmanException("Unexpected End of Data");
+			}
+			window = bits.load(pos);
+			available = 64 - (pos & 7);
+			entry = table + entry->value + (window >> (64 - entry->extra));
+		}
+		pos += entry->length;
+		window <<= entry->length;
+		available -= entry->length;
+		if (pos > bitLength) {
+			throw HuffmanException("Unexpected End of Data");
+		}
+
+		if (entry->kind != Character) {
+			if (entry->kind == End && untilEnd) {
+				position = pos;
+				return written;
+			} else if (entry->kind != Escape) {
+				throw HuffmanException("Bad Decode Path");
+			}
+			if (bitLength - pos < HuffmanTable::EscapeBits) {
+				throw HuffmanException("Unexpected End of Data");
+			}
+			if (available < HuffmanTable::EscapeBits) {
+				window = bits.load(pos);
+				available = 64 - (pos & 7);
+			}
+			written += writeEscaped(window, out + written, outSize - written, untilEnd);
+			pos += HuffmanTable::EscapeBits;
+			window <<= HuffmanTable::EscapeBits;
+			available -= HuffmanTable::EscapeBits;
+			continue;
+		}
+		if (outSize - written < 4) {
+			if (outSize - written < entry->utf8Length) {
+				throw HuffmanException(untilEnd ? "Output Buffer Too Small" : "Decoded Length Mismatch");
+			}
+			std::memcpy(out + written, &entry->value, entry->utf8Length);
+		} else {
+			std::memcpy(out + written, &entry->value, 4);
+		}
+		written += entry->utf8Length;
+	}
+	position = pos;
+	return written;
+}
+
+/*
+ * Write the character whose code point is in the top bits of window.
+ */
+size_t HuffmanDecodeTable::writeEscaped(uint64_t window, char *out, size_t outSize, bool untilEnd) {
+	uint32_t c = static_cast<uint32_t>(window >> (64 - HuffmanTable::EscapeBits));
+	if (c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF)) {
+		throw HuffmanException("Bad Escaped Character");
+	}
+	char bytes[4];
+	size_t length = utf8::append(c, bytes) - bytes;
+	if (outSize < length) {
+		throw HuffmanException(untilEnd ? "Output Buffer Too Small" : "Decoded Length Mismatch");
+	}
+	std::memcpy(out, bytes, length);
+	return length;
+}
+
+size_t HuffmanDecodeTable::readHeader(const unsigned char *data, size_t bitLength, size_t &pos) const {
+	HuffmanBitWindow bits(data, bitLength);
+	size_t value = 0;
+	for (unsigned shift = 0; ; shift += 7) {
+		if (pos + 8 > bitLength) {
+			throw HuffmanException("Unexpected End of Data");
+		}
+		if (shift > 8 * sizeof(size_t) - 7) {
+			throw HuffmanException("Malformed Length Header");
+		}
+		unsigned group = static_cast<unsigned>(bits.load(pos) >> 56);
+		pos += 8;
+		value |= static_cast<size_t>(group & 0x7F) << shift;
+		if (!(group & 0x80)) {
+			return value;
+		}
+	}
+}
+
+size_t HuffmanDecodeTable::decode(const unsigned char *data, size_t bitLength, char *out, size_t outSize) const {
+	size_t pos = 0;
+	return decode(data, bitLength, pos, out, outSize);
+}
+
+std::string HuffmanDecodeTable::decode(const unsigned char *data, size_t bitLength) const {
+	size_t pos = 0;
+	return decode(data, bitLength, pos);
+}
+
+size_t HuffmanDecodeTable::decode(const unsigned char *data, size_t bitLength, size_t &pos, char *out, size_t outSize) const {
+	if (lengthPrefixed) {
+		size_t length = readHeader(data, bitLength, pos);
+		if (length > outSize) {
+			throw HuffmanException("Output Buffer Too Small");
+		}
+		return run(data, bitLength, pos, out, length, false);
+	}
+	return run(data, bitLength, pos, out, outSize, true);
+}
+
+std::string HuffmanDecodeTable::decode(const unsigned char *data, size_t bitLength, size_t &pos) const {
+	std::string result;
+	if (lengthPrefixed) {
+		size_t length = readHeader(data, bitLength, pos);
+		if (minCodeLength > 0 && length / 4 > bitLength - pos) {
+			throw HuffmanException("Malformed Length Header");
+		}
+		result.resize(length);
+		run(data, bitLength, pos, &result[0], length, false);
+		return result;
+	}
+
+	// no character produces more than maxBytesPerBit bytes per bit consumed
+	result.resize(static_cast<size_t>((bitLength - std::min(pos, bitLength)) * maxBytesPerBit) + 4);
+	result.resize(run(data, bitLength, pos, &result[0], result.size(), true));
+	return result;
+}
+
+size_t HuffmanDecodeTable::decodeSymbols(const unsigned char *data, size_t bitLength, char *out, size_t byteLength) const {
+	size_t pos = 0;
+	return run(data, bitLength, pos, out, byteLength, false);
+}
+
+size_t HuffmanDecodeTable::decodeSymbols(const unsigned char *data, size_t bitLength, size_t &pos, char *out, size_t byteLength) const {
+	return run(data, bitLength, pos, out, byteLength, false);
+}
+
+
+/* ***************************************************************************
+ * Batch decoding
+ */
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HUFFMAN_HAVE_AVX2_BATCH 1
+#include <immintrin.h>
+#endif
+
+bool HuffmanDecodeTable::hasVectorBatch() {
+#ifdef HUFFMAN_HAVE_AVX2_BATCH
+	static const bool avx2 = __builtin_cpu_supports("avx2");
+	return avx2;
+#else
+	return false;
+#endif
+}
+
+void HuffmanDecodeTable::decodeBatch(HuffmanBatchString *strings, size_t count) const {
+	if (hasVectorBatch() && count >= 8) {
+		decodeBatchVector(strings, count);
+		return;
+	}
+	for (size_t i = 0; i < count; ++i) {
+		strings[i].written = decode(strings[i].data, strings[i].bitLength, strings[i].out, strings[i].outSize);
+	}
+}
+
+#ifdef HUFFMAN_HAVE_AVX2_BATCH
+/*
+ * Each lane's state is kept as addresses, so all lanes can be advanced with
+ * the same vector arithmetic: the bit address of the next code (the byte
+ * address of the data times eight plus the bit position), the bit address
+ * below which a word can be loaded, the bit address of the end of the data,
+ * the output pointer, and the output pointer below which there is room for a
+ * four byte store. Limits of zero keep idle lanes from ever being ready.
+ *
+ * A step decodes one code by root lookup in every lane, and a lane moves on
+ * only if the code fits in its data. When a lane reaches the last word of
+ * its buffer, the last few bytes are copied into a zero padded scratch area,
+ * as HuffmanBitWindow does, and the lane carries on there. Subtable codes
+ * and escapes are decoded for the lane on its own, terminated strings end
+ * in the vector loop, and anything else is left to run(), which finishes
+ * the string and raises the usual errors.
+ */
+namespace {
+	__attribute__((target("avx2")))
+	inline __m256i loadLanes(const uint64_t *lanes) {
+		return _mm256_load_si256(reinterpret_cast<const __m256i*>(lanes));
+	}
+}
+
+__attribute__((target("avx2")))
+void HuffmanDecodeTable::decodeBatchVector(HuffmanBatchString *strings, size_t count) const {
+	constexpr size_t Lanes = 16;
+	constexpr size_t Idle = SIZE_MAX;
+	const Entry *table = localEntries();
+
+	alignas(32) uint64_t bitAddress[Lanes] = {}, fastLimit[Lanes] = {}, bitEnd[Lanes] = {}, out[Lanes] = {}, outLimit[Lanes] = {};
+	// the bit address of bit position origin of the string
+	uint64_t base[Lanes];
+	size_t origin[Lanes], current[Lanes], limit[Lanes];
+	bool tailed[Lanes];
+	alignas(32) unsigned char scratch[Lanes][32];
+	size_t next = 0;
+
+	auto setEnds = [&](size_t lane, size_t safeBytes) {
+		size_t bits = strings[current[lane]].bitLength - origin[lane];
+		bitEnd[lane] = base[lane] + bits;
+		fastLimit[lane] = 0;
+		if (bits > 0 && safeBytes >= 8) {
+			fastLimit[lane] = base[lane] + std::min<uint64_t>(bits, 8 * (safeBytes - 7));
+		}
+	};
+	// start the next string in a lane, returning false once there are none
+	auto start = [&](size_t lane) {
+		current[lane] = Idle;
+		fastLimit[lane] = 0;
+		outLimit[lane] = 0;
+		if (next == count) {
+			return false;
+		}
+		HuffmanBatchString &string = strings[next];
+		current[lane] = next++;
+		size_t pos = 0;
+		limit[lane] = string.outSize;
+		if (lengthPrefixed) {
+			limit[lane] = readHeader(string.data, string.bitLength, pos);
+			if (limit[lane] > string.outSize) {
+				throw HuffmanException("Output Buffer Too Small");
+			}
+		}
+		base[lane] = reinterpret_cast<uintptr_t>(string.data) * 8;
+		origin[lane] = 0;
+		tailed[lane] = false;
+		bitAddress[lane] = base[lane] + pos;
+		setEnds(lane, (string.bitLength + 7) / 8);
+		out[lane] = reinterpret_cast<uintptr_t>(string.out);
+		if (limit[lane] >= 4) {
+			outLimit[lane] = out[lane] + limit[lane] - 3;
+		}
+		return true;
+	};
+	// move a lane that has reached the last word of its buffer onto a copy of
+	// the bytes left, returning false if it already has
+	auto tail = [&](size_t lane) {
+		const HuffmanBatchString &string = strings[current[lane]];
+		size_t pos = origin[lane] + (bitAddress[lane] - base[lane]);
+		size_t first = pos / 8, bytes = (string.bitLength + 7) / 8;
+		if (tailed[lane] || first > bytes || bytes - first > sizeof(scratch[lane]) - 8) {
+			return false;
+		}
+		std::memset(scratch[lane], 0, sizeof(scratch[lane]));
+		if (bytes > first) {
+			std::memcpy(scratch[lane], string.data + first, bytes - first);
+		}
+		tailed[lane] = true;
+		origin[lane] = first * 8;
+		base[lane] = reinterpret_cast<uintptr_t>(scratch[lane]) * 8;
+		bitAddress[lane] = base[lane] + pos % 8;
+		setEnds(lane, sizeof(scratch[lane]));
+		return bitAddress[lane] < fastLimit[lane];
+	};
+	// take one step that a root lookup cannot, a code in a subtable or an
+	// escape, returning false to leave anything else to run()
+	auto step = [&](size_t lane) {
+		const HuffmanBatchString &string = strings[current[lane]];
+		HuffmanBitWindow bits(string.data, string.bitLength);
+		size_t pos = origin[lane] + (bitAddress[lane] - base[lane]);
+		const Entry *entry = table + (rootBits ? bits.load(pos) >> (64 - rootBits) : 0);
+		while (entry->kind == Subtable) {
+			pos += entry->length;
+			if (pos > string.bitLength) {
+				return false;
+			}
+			entry = table + entry->value + (bits.load(pos) >> (64 - entry->extra));
+		}
+		pos += entry->length;
+		if (pos > string.bitLength) {
+			return false;
+		}
+		if (entry->kind == Character) {
+			std::memcpy(reinterpret_cast<char*>(out[lane]), &entry->value, 4);
+			out[lane] += entry->utf8Length;
+		} else if (entry->kind == Escape && string.bitLength - pos >= HuffmanTable::EscapeBits) {
+			out[lane] += writeEscaped(bits.load(pos), reinterpret_cast<char*>(out[lane]), 4, true);
+			pos += HuffmanTable::EscapeBits;
+		} else {
+			return false;
+		}
+		bitAddress[lane] = base[lane] + (pos - origin[lane]);
+		return true;
+	};
+	auto finish = [&](size_t lane) {
+		HuffmanBatchString &string = strings[current[lane]];
+		size_t pos = origin[lane] + (bitAddress[lane] - base[lane]);
+		size_t written = out[lane] - reinterpret_cast<uintptr_t>(string.out);
+		string.written = written + run(string.data, string.bitLength, pos, string.out + written, limit[lane] - written,
+		                               !lengthPrefixed);
+	};
+
+	// once too few lanes are left busy, the rest are finished one at a time
+	size_t active = 0;
+	for (size_t lane = 0; lane < Lanes; ++lane) {
+		active += start(lane);
+	}
+
+	const __m256i reverseBytes = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+	                                              7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+	const __m256i seven = _mm256_set1_epi64x(7);
+	const __m256i byteMask = _mm256_set1_epi64x(0xFF);
+	const __m256i kindMask = _mm256_set1_epi64x(int64_t(0xFF) << 40);
+	const __m256i characterKind = _mm256_set1_epi64x(int64_t(Character) << 40);
+	// in terminated strings the end code ends the string where it is
+	const __m256i endKind = _mm256_set1_epi64x(lengthPrefixed ? -1 : int64_t(End) << 40);
+	const __m128i rootShift = _mm_cvtsi32_si128(64 - static_cast<int>(rootBits));
+
+	while (active > Lanes / 4) {
+		uint32_t stalled = 0, ended = 0;
+		for (size_t group = 0; group < Lanes; group += 4) {
+			__m256i address = loadLanes(bitAddress + group);
+			__m256i output = loadLanes(out + group);
+			__m256i ready = _mm256_and_si256(_mm256_cmpgt_epi64(loadLanes(fastLimit + group), address),
+			                                 _mm256_cmpgt_epi64(loadLanes(outLimit + group), output));
+
+			// the 64 bits at each lane's position, most significant first
+			__m256i raw = _mm256_mask_i64gather_epi64(_mm256_setzero_si256(), static_cast<const long long*>(nullptr),
+			                                          _mm256_srli_epi64(address, 3), ready, 1);
+			__m256i window = _mm256_sllv_epi64(_mm256_shuffle_epi8(raw, reverseBytes), _mm256_and_si256(address, seven));
+			__m256i entry = _mm256_mask_i64gather_epi64(_mm256_setzero_si256(), reinterpret_cast<const long long*>(table),
+			                                            _mm256_srl_epi64(window, rootShift), ready, 8);
+
+			__m256i kind = _mm256_and_si256(entry, kindMask);
+			__m256i end = _mm256_cmpeq_epi64(kind, endKind);
+			__m256i advanced = _mm256_add_epi64(address, _mm256_and_si256(_mm256_srli_epi64(entry, 32), byteMask));
+			ready = _mm256_andnot_si256(_mm256_cmpgt_epi64(advanced, loadLanes(bitEnd + group)), ready);
+			ready = _mm256_and_si256(ready, _mm256_or_si256(_mm256_cmpeq_epi64(kind, characterKind), end));
+
+			alignas(32) uint64_t entries[4];
+			_mm256_store_si256(reinterpret_cast<__m256i*>(entries), entry);
+			unsigned readyLanes = static_cast<unsigned>(_mm256_movemask_pd(_mm256_castsi256_pd(ready)));
+			for (size_t lane = 0; lane < 4; ++lane) {
+				if (readyLanes & (1u << lane)) {
+					uint32_t bytes = static_cast<uint32_t>(entries[lane]);
+					std::memcpy(reinterpret_cast<char*>(out[group + lane]), &bytes, 4);
+				}
+			}
+
+			address = _mm256_blendv_epi8(address, advanced, ready);
+			output = _mm256_add_epi64(output, _mm256_and_si256(_mm256_srli_epi64(entry, 56), ready));
+			_mm256_store_si256(reinterpret_cast<__m256i*>(bitAddress + group), address);
+			_mm256_store_si256(reinterpret_cast<__m256i*>(out + group), output);
+			stalled |= (~readyLanes & 0xFu) << group;
+			ended |= (readyLanes & static_cast<unsigned>(_mm256_movemask_pd(_mm256_castsi256_pd(end)))) << group;
+		}
+
+		for (uint32_t lanes = stalled | ended; lanes; lanes &= lanes - 1) {
+			size_t lane = static_cast<size_t>(__builtin_ctz(lanes));
+			if (current[lane] == Idle) {
+				continue;
+			}
+			if (ended & (1u << lane)) {
+				HuffmanBatchString &string = strings[current[lane]];
+				string.written = out[lane] - reinterpret_cast<uintptr_t>(string.out);
+			} else if (out[lane] < outLimit[lane] && (bitAddress[lane] < fastLimit[lane] ? step(lane) : tail(lane))) {
+				continue;
+			} else {
+				finish(lane);
+			}
+			active -= !start(lane);
+		}
+	}
+
+	for (size_t lane = 0; lane < Lanes; ++lane) {
+		if (current[lane] != Idle) {
+			finish(lane);
+		}
+	}
+}
+#else
+void HuffmanDecodeTable::decodeBatchVector(HuffmanBatchString *strings, size_t count) const {
+	for (size_t i = 0; i < count; ++i) {
+		strings[i].written = decode(strings[i].data, strings[i].bitLength, strings[i].out, strings[i].outSize);
+	}
+}
+#endif
@@ -0,0 +1,234 @@
+#ifndef HUFFMAN_DECODER_H
+#define HUFFMAN_DECODER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "huffman_memory.h"
+
+class HuffmanTable;
+
+/**
+ * One string of a batch for HuffmanDecodeTable::decodeBatch().
+ */
+struct HuffmanBatchString {
+	/** The encoded string, packed most significant bit first. */
+	const unsigned char *data;
+	/** The number of valid bits in data. */
+	size_t bitLength;
+	/** The buffer to write the decoded text into. */
+	char *out;
+	/** The size of the output buffer in bytes. */
+	size_t outSize;
+	/** Set to the number of bytes written. */
+	size_t written;
+};
+
+/**
+ * A frozen, table-driven decoder built from a HuffmanTable. Rather than
+ * walking the tree one bit at a time, it looks up several bits at once in a
+ * flat multi-level table whose entries carry the UTF-8 bytes of their
+ * character, so each character costs one or two table lookups and a four
+ * byte copy.
+ *
+ * Input is read a 64-bit word at a time. Only the last few bytes of a buffer
+ * are copied to a zero padded scratch area, so the inner loop never checks
+ * bounds per bit; instead the bit position is checked once per character and
+ * truncated or corrupt streams are rejected before anything past the end of
+ * the data can be used. Decoding produces exactly the same results and
+ * errors as the matching HuffmanTable::decode() overloads.
+ *
+ * The decoder is independent of the HuffmanTable it was built from, which
+ * may be changed or destroyed afterwards. Once built, the lookup tables are
+ * copied into memory from a HuffmanTableAllocator, which may place them on
+ * huge pages. On NUMA servers they can also be replicated once per node, so
+ * each decoding thread reads the copy local to the CPU it is running on.
+ */
+class HuffmanDecodeTable {
+public:
+	/** Default number of bits looked up per table level. */
+	static const unsigned DefaultLookupBits = 10;
+
+	/**
+	 * Build a decoder for a table.
+	 * @param table The built table to decode for.
+	 * @param lookupBits The maximum number of bits looked up per level, from
+	 *                   1 to 16. Larger values use more memory but need fewer
+	 *                   lookups for long codes.
+	 * @param allocator Where to allocate the lookup tables, or null for the
+	 *                  heap. It must outlive the decoder.
+	 * @param replicatePerNode Whether to keep a copy of the lookup tables on
+	 *                         every NUMA node. Has no effect on machines
+	 *                         with a single node.
+	 * @throw HuffmanException Thrown if the table has not been built.
+	 */
+	explicit HuffmanDecodeTable(const HuffmanTable &table, unsigned lookupBits = DefaultLookupBits,
+	                            HuffmanTableAllocator *allocator = nullptr, bool replicatePerNode = false);
+	~HuffmanDecodeTable();
+
+	HuffmanDecodeTable(const HuffmanDecodeTable&) = delete;
+	HuffmanDecodeTable& operator=(const HuffmanDecodeTable&) = delete;
+
+	/**
+	 * Decode a packed encoded string into a caller supplied buffer. See
+	 * HuffmanTable::decode(const unsigned char*, size_t, char*, size_t).
+	 * @param data The encoded string, packed most significant bit first.
+	 * @param bitLength The number of valid bits in data.
+	 * @param out The buffer to write the decoded text into.
+	 * @param outSize The size of the output buffer in bytes.
+	 * @return The number of bytes written.
+	 * @throw HuffmanException Thrown if the data is truncated or corrupt, or
+	 *                         the buffer is too small.
+	 */
+	size_t decode(const unsigned char *data, size_t bitLength, char *out, size_t outSize) const;
+
+	/**
+	 * Decode a packed encoded string into a new string.
+	 * @param data The encoded string, packed most significant bit first.
+	 * @param bitLength The number of valid bits in data.
+	 * @return The decoded text.
+	 * @throw HuffmanException Thrown if the data is truncated or corrupt.
+	 */
+	std::string decode(const unsigned char *data, size_t bitLength) const;
+
+	/**
+	 * Decode an encoded string that starts part way through a buffer, such
+	 * as one packed into a string bank at a bit offset.
+	 * @param data The encoded data, packed most significant bit first.
+	 * @param bitLength The number of valid bits in data.
+	 * @param pos The bit position the string starts at; on return, the
+	 *            position just after it.
+	 * @param out The buffer to write the decoded text into.
+	 * @param outSize The size of the output buffer in bytes.
+	 * @return The number of bytes written.
+	 * @throw HuffmanException Thrown if the data is truncated or corrupt, or
+	 *                         the buffer is too small.
+	 */
+	size_t decode(const unsigned char *data, size_t bitLength, size_t &pos, char *out, size_t outSize) const;
+
+	/**
+	 * Decode an encoded string that starts part way through a buffer into a
+	 * new string.
+	 * @param data The encoded data, packed most significant bit first.
+	 * @param bitLength The number of valid bits in data.
+	 * @param pos The bit position the string starts at; on return, the
+	 *            position just after it.
+	 * @return The decoded text.
+	 * @throw HuffmanException Thrown if the data is truncated or corrupt.
+	 */
+	std::string decode(const unsigned char *data, size_t bitLength, size_t &pos) const;
+
+	/**
+	 * Decode a packed string of bare code words whose decoded length is
+	 * known. See HuffmanTable::decodeSymbols().
+	 * @param data The encoded string, packed most significant bit first.
+	 * @param bitLength The number of valid bits in data.
+	 * @param out The buffer to write the decoded text into.
+	 * @param byteLength The length of the decoded string in bytes.
+	 * @return The number of bytes written, which is always byteLength.
+	 * @throw HuffmanException Thrown if the data is truncated or corrupt.
+	 */
+	size_t decodeSymbols(const unsigned char *data, size_t bitLength, char *out, size_t byteLength) const;
+
+	/**
+	 * Decode bare code words starting part way through a buffer, for formats
+	 * that interleave them with other data.
+	 * @param data The encoded data, packed most significant bit first.
+	 * @param bitLength The number of valid bits in data.
+	 * @param pos The bit position to start at; on return, the position just
+	 *            after the last code word read.
+	 * @param out The buffer to write the decoded text into.
+	 * @param byteLength The number of bytes to decode.
+	 * @return The number of bytes written, which is always byteLength.
+	 * @throw HuffmanException Thrown if the data is truncated or corrupt.
+	 */
+	size_t decodeSymbols(const unsigned char *data, size_t bitLength, size_t &pos, char *out, size_t byteLength) const;
+
+	/**
+	 * Decode many independent strings, each exactly as decode() would. On
+	 * x86-64 CPUs with AVX2, sixteen strings are decoded in lockstep, each in
+	 * its own vector lane with its own bit position and output pointer, and
+	 * every lane looks up its next character with a gather. Subtable codes
+	 * and escapes are decoded for a lane on its own, and the last few bytes
+	 * of a length-prefixed string by the scalar decoder. A lane picks up the
+	 * next string as soon as it finishes one. Elsewhere, or for fewer than
+	 * eight strings, they are simply decoded one after another.
+	 * @param strings The strings to decode.
+	 * @param count The number of strings.
+	 * @throw HuffmanException Thrown if any string is truncated or corrupt, or
+	 *                         a buffer is too small. Which of the other
+	 *                         strings have been decoded is then unspecified.
+	 */
+	void decodeBatch(HuffmanBatchString *strings, size_t count) const;
+
+	/** @return Whether decodeBatch() uses vector lanes on this CPU. */
+	static bool hasVectorBatch();
+
+	/** @return The size of one copy of the lookup tables in bytes. */
+	size_t getTableBytes() const {
+		return entryCount * sizeof(Entry);
+	}
+
+	/** @return The number of copies of the lookup tables, one per NUMA node
+	 *          when replicated and otherwise one. */
+	size_t getReplicaCount() const {
+		return replicas.size();
+	}
+
+private:
+	enum EntryKind : uint8_t {
+		Character,
+		End,
+		Subtable,
+		Escape,
+		Invalid,
+	};
+
+	/**
+	 * One table slot. For characters, value holds the UTF-8 bytes of the
+	 * character; for subtables it holds the index of the subtable and extra
+	 * holds the number of bits it looks up. length is the number of bits
+	 * consumed at this level.
+	 */
+	struct Entry {
+		uint32_t value;
+		uint8_t length;
+		uint8_t kind;
+		uint8_t extra;
+		uint8_t utf8Length;
+	};
+	// decodeBatchVector() gathers entries as 64-bit words and picks these
+	// fields out by bit position: length at 32, kind at 40, utf8Length at 56
+	static_assert(sizeof(Entry) == 8, "Entry must be one 64-bit word");
+	static_assert(offsetof(Entry, value) == 0 && offsetof(Entry, length) == 4 && offsetof(Entry, kind) == 5
+	              && offsetof(Entry, extra) == 6 && offsetof(Entry, utf8Length) == 7,
+	              "decodeBatchVector() depends on the layout of Entry");
+
+	struct Symbol {
+		int character;
+		uint64_t code;
+		unsigned length;
+	};
+
+	size_t buildLevel(std::vector<Entry> &entries, const std::vector<Symbol> &symbols, unsigned consumed, unsigned &bits);
+	void freeze(const std::vector<Entry> &entries, bool replicatePerNode);
+	const Entry* localEntries() const;
+	size_t run(const unsigned char *data, size_t bitLength, size_t &pos, char *out, size_t outSize, bool untilEnd) const;
+	size_t readHeader(const unsigned char *data, size_t bitLength, size_t &pos) const;
+	void decodeBatchVector(HuffmanBatchString *strings, size_t count) const;
+	static size_t writeEscaped(uint64_t window, char *out, size_t outSize, bool untilEnd);
+
+	HuffmanTableAllocator *allocator;
+	// one copy of the lookup tables per NUMA node, indexed by node
+	std::vector<Entry*> replicas;
+	size_t entryCount;
+	unsigned lookupBits;
+	unsigned rootBits;
+	unsigned minCodeLength;
+	double maxBytesPerBit;
+	bool lengthPrefixed;
+};
+
+#endif
@@ -0,0 +1,350 @@
+#include <algorithm>
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+#include "huffman.h"
+#include "huffman_bits.h"
+#include "huffman_encoder.h"
+#include "huffman_utf8.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HUFFMAN_HAVE_AVX2_ENCODE 1
+#include <immintrin.h>
+#endif
+
+
+namespace {
+	// byteCodes entry for a byte that is not a short ASCII code
+	constexpr uint32_t SlowByte = 0xFFu << 16;
+	// set in any entry that is SlowByte, and in no other
+	constexpr uint32_t SlowBit = 0x80u << 16;
+
+	/*
+	 * Join the codes of four characters into one, the first character's code
+	 * highest, with the shifts the running sum of the code lengths after it.
+	 */
+	inline uint64_t joinCodes(const uint32_t *entries, unsigned &length) {
+		unsigned length1 = entries[1] >> 16, length2 = entries[2] >> 16, length3 = entries[3] >> 16;
+		uint64_t code = entries[0] & 0xFFFF;
+		code = (code << length1) | (entries[1] & 0xFFFF);
+		code = (code << length2) | (entries[2] & 0xFFFF);
+		code = (code << length3) | (entries[3] & 0xFFFF);
+		length = (entries[0] >> 16) + length1 + length2 + length3;
+		return code;
+	}
+}
+
+
+/* ***************************************************************************
+ * Writing whole words
+ */
+
+/*
+ * Collects bits most significant first in a 64-bit window and stores the
+ * whole window after every append, then keeps only the bits of the last,
+ * partly filled byte. Near the end of the buffer only the bytes needed are
+ * stored, so nothing is written past outSize.
+ */
+class HuffmanEncodeTable::Writer {
+public:
+	Writer(unsigned char *out, size_t outSize)
+	: out(out), outSize(outSize), byte(0), window(0), count(0)
+	{ }
+
+	/*
+	 * Append from 1 to 56 bits. At most seven bits are held over between
+	 * appends, so they always fit in the window.
+	 */
+	void put(uint64_t bits, unsigned length) {
+		window |= bits << (64 - count - length);
+		count += length;
+		if (outSize - byte >= 8) {
+			huffmanStoreBigEndian(out + byte, window);
+		} else {
+			storeTail();
+		}
+		byte += count >> 3;
+		window <<= count & ~7u;
+		count &= 7;
+	}
+
+	/*
+	 * Append two codes of 1 to 56 bits each, as a single append when the
+	 * pair is short enough, which for text it nearly always is.
+	 */
+	void putJoined(uint64_t first, unsigned firstLength, uint64_t second, unsigned secondLength) {
+		if (firstLength + secondLength <= 56) {
+			put((first << secondLength) | second, firstLength + secondLength);
+		} else {
+			put(first, firstLength);
+			put(second, secondLength);
+		}
+	}
+
+	/*
+	 * Append from 0 to 64 bits.
+	 */
+	void putWide(uint64_t bits, unsigned length) {
+		if (length > 32) {
+			put(bits >> 32, length - 32);
+			bits &= 0xFFFFFFFFu;
+			length = 32;
+		}
+		if (length > 0) {
+			put(bits, length);
+		}
+	}
+
+	size_t size() const {
+		return byte * 8 + count;
+	}
+
+private:
+	void storeTail() {
+		size_t bytes = (count + 7) / 8;
+		if (bytes > outSize - byte) {
+			throw HuffmanException("Output Buffer Too Small");
+		}
+		for (size_t i = 0; i < bytes; ++i) {
+			out[byte + i] = static_cast<unsigned char>(window >> (56 - 8 * i));
+		}
+	}
+
+	unsigned char *out;
+	size_t outSize;
+	size_t byte;
+	uint64_t window;
+	unsigned count;
+};
+
+
+/* ***************************************************************************
+ * Building the encoder
+ */
+
+HuffmanEncodeTable::HuffmanEncodeTable(const HuffmanTable &table)
+: byteCodes(256, SlowByte), symbolIndex(table.getSymbolIndex()), codes(table.getCodes()), escapeCode{0, 0}, endCode{0, 0},
+  maxBitsPerByte(0), endMarker(false), escape(table.hasEscape()), lengthPrefixed(table.isLengthPrefixed())
+{
+	if (codes.empty()) {
+		throw HuffmanException("Tried to build encoder for non-existant tree");
+	}
+	const std::vector<int> &symbols = table.getSymbols();
+	// the end marker sorts first, so it always has rank 0
+	if (symbols[0] == 0) {
+		endMarker = true;
+		endCode = codes[0];
+	}
+
+	for (size_t i = endMarker ? 1 : 0; i < symbols.size(); ++i) {
+		char bytes[4];
+		unsigned length = static_cast<unsigned>(utf8::append(static_cast<uint32_t>(symbols[i]), bytes) - bytes);
+		maxBitsPerByte = std::max(maxBitsPerByte, (codes[i].length + length - 1) / length);
+		if (symbols[i] < 0x80 && codes[i].length > 0 && codes[i].length <= FastCodeBits) {
+			byteCodes[symbols[i]] = (codes[i].length << 16) | static_cast<uint32_t>(codes[i].bits);
+		}
+	}
+	if (escape) {
+		escapeCode = table.getEscapeCode();
+		// an escaped character may be a single byte
+		maxBitsPerByte = std::max(maxBitsPerByte, escapeCode.length + HuffmanTable::EscapeBits);
+	}
+}
+
+size_t HuffmanEncodeTable::maxEncodedBytes(size_t textBytes) const {
+	size_t headerBits = endCode.length;
+	if (lengthPrefixed) {
+		headerBits = 8;
+		for (size_t value = textBytes; value >= 0x80; value >>= 7) {
+			headerBits += 8;
+		}
+	}
+	return (headerBits + textBytes * maxBitsPerByte + 7) / 8;
+}
+
+
+/* ***************************************************************************
+ * Encoding
+ */
+
+size_t HuffmanEncodeTable::encode(std::string_view text, unsigned char *out, size_t outSize) const {
+	return run(text, out, outSize, true, hasVectorEncode());
+}
+
+size_t HuffmanEncodeTable::encodeSymbols(std::string_view text, unsigned char *out, size_t outSize) const {
+	return run(text, out, outSize, false, hasVectorEncode());
+}
+
+size_t HuffmanEncodeTable::encodeScalar(std::string_view text, unsigned char *out, size_t outSize) const {
+	return run(text, out, outSize, true, false);
+}
+
+/*
+ * Encode text, with its length header or end marker if framed is set. Runs
+ * of short ASCII codes are encoded in blocks, and whatever stops a run is
+ * encoded as a single character.
+ */
+size_t HuffmanEncodeTable::run(std::string_view text, unsigned char *out, size_t outSize, bool framed, bool vector) const {
+	Writer writer(out, outSize);
+	if (framed && lengthPrefixed) {
+		size_t value = text.size();
+		do {
+			writer.put((value >= 0x80 ? 0x80u : 0u) | (value & 0x7F), 8);
+			value >>= 7;
+		} while (value > 0);
+	}
+
+	size_t pos = 0;
+	while (pos < text.size()) {
+		pos = vector ? encodeVectorBlocks(text, pos, writer) : encodeScalarBlocks(text, pos, writer);
+		if (pos < text.size()) {
+			pos = encodeCharacter(text, pos, writer);
+		}
+	}
+
+	if (framed && !lengthPrefixed) {
+		if (!endMarker) {
+			throw HuffmanException("End Marker Not in Huffman Table");
+		}
+		writer.putWide(endCode.bits, endCode.length);
+	}
+	return writer.size();
+}
+
+/*
+ * Encode eight bytes at a time for as long as they are all short ASCII
+ * codes, then any such bytes before the next one that is not. Returns the
+ * position of that byte, or the end of the text.
+ */
+size_t HuffmanEncodeTable::encodeScalarBlocks(std::string_view text, size_t pos, Writer &output) const {
+	const unsigned char *data = reinterpret_cast<const unsigned char*>(text.data());
+	const uint32_t *table = byteCodes.data();
+	// a local copy, which the stores through its output pointer cannot alias
+	Writer writer = output;
+	while (text.size() - pos >= 8) {
+		uint32_t entries[8];
+		uint32_t slow = 0;
+		for (size_t i = 0; i < 8; ++i) {
+			entries[i] = table[data[pos + i]];
+			slow |= entries[i];
+		}
+		if (slow & SlowBit) {
+			break;
+		}
+		unsigned firstLength, secondLength;
+		uint64_t first = joinCodes(entries, firstLength), second = joinCodes(entries + 4, secondLength);
+		writer.putJoined(first, firstLength, second, secondLength);
+		pos += 8;
+	}
+	for (; pos < text.size() && !(table[data[pos]] & SlowBit); ++pos) {
+		writer.put(table[data[pos]] & 0xFFFF, table[data[pos]] >> 16);
+	}
+	output = writer;
+	return pos;
+}
+
+/*
+ * Encode one character of any kind, returning the position after it. Well
+ * formed two and three byte UTF-8 sequences are decoded here; anything else
+ * goes through utf8::next(), so malformed text raises the same errors as
+ * HuffmanTable::encode().
+ */
+size_t HuffmanEncodeTable::encodeCharacter(std::string_view text, size_t pos, Writer &writer) const {
+	const unsigned char *p = reinterpret_cast<const unsigned char*>(text.data()) + pos;
+	size_t left = text.size() - pos;
+	int c;
+	if (p[0] < 0x80) {
+		c = p[0];
+		++pos;
+	} else if (left >= 2 && p[0] >= 0xC2 && p[0] < 0xE0 && (p[1] & 0xC0) == 0x80) {
+		c = ((p[0] & 0x1F) << 6) | (p[1] & 0x3F);
+		pos += 2;
+	} else if (left >= 3 && (p[0] & 0xF0) == 0xE0 && (p[1] & 0xC0) == 0x80 && (p[2] & 0xC0) == 0x80 &&
+	           (c = ((p[0] & 0x0F) << 12) | ((p[1] & 0x3F) << 6) | (p[2] & 0x3F)) >= 0x800 &&
+	           (c < 0xD800 || c > 0xDFFF)) {
+		pos += 3;
+	} else {
+		auto iter = text.begin() + pos;
+		c = static_cast<int>(utf8::next(iter, text.end()));
+		pos = iter - text.begin();
+	}
+
+	uint32_t rank = symbolIndex.rank(c);
+	// the end marker is stored under 0, so a NUL in the text can never match it
+	if (rank != HuffmanSymbolIndex::NoSymbol && c != 0) {
+		writer.putWide(codes[rank].bits, codes[rank].length);
+	} else if (escape) {
+		writer.putWide(escapeCode.bits, escapeCode.length);
+		writer.put(static_cast<uint64_t>(c), HuffmanTable::EscapeBits);
+	} else {
+		huffmanMissingCharacter(c);
+	}
+	return pos;
+}
+
+
+/* ***************************************************************************
+ * Vector blocks
+ */
+
+bool HuffmanEncodeTable::hasVectorEncode() {
+#ifdef HUFFMAN_HAVE_AVX2_ENCODE
+	static const bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2");
+	return avx2;
+#else
+	return false;
+#endif
+}
+
+#ifdef HUFFMAN_HAVE_AVX2_ENCODE
+/*
+ * The same as encodeScalarBlocks(), with the eight lookups done by one
+ * gather. Each 64-bit lane then holds the entries of two neighbouring
+ * characters, which are joined in place, and the pairs are joined again
+ * with their neighbours in the same 128-bit half, leaving the codes of
+ * characters 0 to 3 and 4 to 7 in the first and third lanes.
+ */
+__attribute__((target("avx2,bmi2")))
+size_t HuffmanEncodeTable::encodeVectorBlocks(std::string_view text, size_t pos, Writer &output) const {
+	const unsigned char *data = reinterpret_cast<const unsigned char*>(text.data());
+	const uint32_t *table = byteCodes.data();
+	Writer writer = output;
+	const __m256i slowBits = _mm256_set1_epi32(static_cast<int>(SlowBit));
+	const __m256i codeMask = _mm256_set1_epi64x(0xFFFF);
+	const __m256i lengthMask = _mm256_set1_epi64x(0xFF);
+
+	while (text.size() - pos >= 8) {
+		__m256i bytes = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(data + pos)));
+		__m256i entries = _mm256_i32gather_epi32(reinterpret_cast<const int*>(table), bytes, 4);
+		if (!_mm256_testz_si256(entries, slowBits)) {
+			break;
+		}
+
+		__m256i firstCode = _mm256_and_si256(entries, codeMask);
+		__m256i firstLength = _mm256_and_si256(_mm256_srli_epi64(entries, 16), lengthMask);
+		__m256i secondCode = _mm256_and_si256(_mm256_srli_epi64(entries, 32), codeMask);
+		__m256i secondLength = _mm256_srli_epi64(entries, 48);
+		__m256i pairs = _mm256_or_si256(_mm256_sllv_epi64(firstCode, secondLength), secondCode);
+		__m256i pairLengths = _mm256_add_epi64(firstLength, secondLength);
+
+		__m256i quads = _mm256_or_si256(_mm256_sllv_epi64(pairs, _mm256_unpackhi_epi64(pairLengths, pairLengths)),
+		                                _mm256_unpackhi_epi64(pairs, pairs));
+		__m256i quadLengths = _mm256_add_epi64(pairLengths, _mm256_unpackhi_epi64(pairLengths, pairLengths));
+		__m128i low = _mm256_castsi256_si128(quads), high = _mm256_extracti128_si256(quads, 1);
+		__m128i lowLengths = _mm256_castsi256_si128(quadLengths), highLengths = _mm256_extracti128_si256(quadLengths, 1);
+		writer.putJoined(static_cast<uint64_t>(_mm_cvtsi128_si64(low)), static_cast<unsigned>(_mm_cvtsi128_si64(lowLengths)),
+		                 static_cast<uint64_t>(_mm_cvtsi128_si64(high)), static_cast<unsigned>(_mm_cvtsi128_si64(highLengths)));
+		pos += 8;
+	}
+	for (; pos < text.size() && !(table[data[pos]] & SlowBit); ++pos) {
+		writer.put(table[data[pos]] & 0xFFFF, table[data[pos]] >> 16);
+	}
+	output = writer;
+	return pos;
+}
+#else
+size_t HuffmanEncodeTable::encodeVectorBlocks(std::string_view text, size_t pos, Writer &writer) const {
+	return encodeScalarBlocks(text, pos, writer);
+}
+#endif
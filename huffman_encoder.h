@@ -0,0 +1,109 @@
+#ifndef HUFFMAN_ENCODER_H
+#define HUFFMAN_ENCODER_H
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+#include "huffman.h"
+#include "huffman_symbols.h"
+
+/**
+ * A frozen, table-driven encoder built from a HuffmanTable, for encoding
+ * large amounts of text quickly. Its output is bit for bit the same as the
+ * matching HuffmanTable::encode() overloads, and it raises the same errors.
+ *
+ * Text is read eight bytes at a time. Printable ASCII with short codes is
+ * looked up eight characters at once in a 256 entry table, and the eight
+ * codes are joined pairwise into two words whose shifts are a running sum
+ * of the code lengths, so only two appends to the output are serial. On
+ * x86-64 CPUs with AVX2 the lookups are a single gather and the joins are
+ * vector shifts; elsewhere the same joins are done four codes at a time in
+ * ordinary registers. Other characters are decoded from UTF-8 one at a time
+ * and looked up by code point.
+ *
+ * Output is written a 64-bit word at a time, so encode() may write zeros to
+ * up to eight bytes of the buffer past the last byte it returns, but never
+ * past outSize.
+ *
+ * The encoder is independent of the HuffmanTable it was built from, which
+ * may be changed or destroyed afterwards.
+ */
+class HuffmanEncodeTable {
+public:
+	/** The longest code looked up with the block tables. */
+	static constexpr unsigned FastCodeBits = 14;
+
+	/**
+	 * Build an encoder for a table.
+	 * @param table The built table to encode with.
+	 * @throw HuffmanException Thrown if the table has not been built.
+	 */
+	explicit HuffmanEncodeTable(const HuffmanTable &table);
+
+	/**
+	 * Encode text into a caller supplied buffer, exactly as
+	 * HuffmanTable::encode(std::string_view, unsigned char*, size_t) does.
+	 * @param text The text to encode.
+	 * @param out The buffer to write the encoded bits into.
+	 * @param outSize The size of the output buffer in bytes.
+	 * @return The number of bits written.
+	 * @throw HuffmanException Thrown if the text cannot be encoded or the
+	 *                         buffer is too small.
+	 */
+	size_t encode(std::string_view text, unsigned char *out, size_t outSize) const;
+
+	/**
+	 * Encode text with no end marker or length header, exactly as
+	 * HuffmanTable::encodeSymbols(std::string_view, unsigned char*, size_t)
+	 * does.
+	 * @param text The text to encode.
+	 * @param out The buffer to write the encoded bits into.
+	 * @param outSize The size of the output buffer in bytes.
+	 * @return The number of bits written.
+	 * @throw HuffmanException Thrown if the text cannot be encoded or the
+	 *                         buffer is too small.
+	 */
+	size_t encodeSymbols(std::string_view text, unsigned char *out, size_t outSize) const;
+
+	/**
+	 * The same as encode(), but never using vector instructions, so the two
+	 * can be checked against each other on any machine.
+	 */
+	size_t encodeScalar(std::string_view text, unsigned char *out, size_t outSize) const;
+
+	/**
+	 * An upper bound on the buffer size encode() or encodeSymbols() needs for
+	 * text of a given length, found without reading the text.
+	 * @param textBytes The length of the text in bytes.
+	 * @return The buffer size in bytes.
+	 */
+	size_t maxEncodedBytes(size_t textBytes) const;
+
+	/** @return Whether encode() uses AVX2 on this CPU. */
+	static bool hasVectorEncode();
+
+private:
+	class Writer;
+
+	size_t run(std::string_view text, unsigned char *out, size_t outSize, bool framed, bool vector) const;
+	size_t encodeScalarBlocks(std::string_view text, size_t pos, Writer &writer) const;
+	size_t encodeVectorBlocks(std::string_view text, size_t pos, Writer &writer) const;
+	size_t encodeCharacter(std::string_view text, size_t pos, Writer &writer) const;
+
+	/*
+	 * For each byte, the code of the ASCII character in the low 16 bits and
+	 * its length above them, or SlowByte if it needs encodeCharacter().
+	 */
+	std::vector<uint32_t> byteCodes;
+	HuffmanSymbolIndex symbolIndex;
+	std::vector<HuffmanCode> codes;
+	HuffmanCode escapeCode;
+	HuffmanCode endCode;
+	unsigned maxBitsPerByte;
+	bool endMarker;
+	bool escape;
+	bool lengthPrefixed;
+};
+
+#endif
@@ -0,0 +1,362 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "huffman.h"
+#include "huffman_ans.h"
+#include "huffman_decoder.h"
+#include "huffman_encoder.h"
+#include "huffman_lz.h"
+#include "huffman_search.h"
+#include "huffman_utf8.h"
+
+/*
+ * libFuzzer target for the encoders and decoders. The first input byte
+ * selects the table and what to do with the rest of the input:
+ *
+ *   bit 0  use the length-prefixed table, which also has an escape code,
+ *          rather than the terminated one
+ *   bit 1  treat the rest as encoded data rather than as text
+ *
+ * Text must survive an encode/decode round trip through every decoder, and
+ * through the ANS coder built from the same frequencies. The fast encoder,
+ * with and without vector blocks, must write exactly the table's bits, and
+ * fail exactly when it does. Encoded data may be garbage, but every Huffman
+ * decoder must either reject it with a HuffmanException or agree with
+ * HuffmanTable::decode() on the result; the ANS and LZ decoders must only
+ * fail cleanly. Compressed-domain search must agree with searching the
+ * decoded text, and fail exactly when decoding does. Malformed LZ data is
+ * decoded both into a fixed buffer and by the growing decoder, whose output
+ * bound must turn a corrupt match length into a HuffmanException rather than
+ * a huge allocation.
+ *
+ * Build with `make fuzz` (clang, -fsanitize=fuzzer,address,undefined), or
+ * with `make fuzz_standalone`, which links a small driver that runs files
+ * given on the command line, or random inputs if there are none.
+ */
+
+namespace {
+	struct Tables {
+		Tables() {
+			const char *corpus[] = {
+				"The quick brown fox jumps over the lazy dog.\n",
+				"Pack my box with five dozen liquor jugs! 0123456789",
+				"引阜ハモ展勝ヒヨユト奪手き人年ヱレオル毎東フぐか迎作",
+				"Ünïcödé façade — naïve “quotes” €100",
+			};
+			prefixed.setLengthPrefixed(true);
+			prefixed.setEscape(true);
+			for (const char *text : corpus) {
+				terminated.addFrequencies(text);
+				prefixed.addFrequencies(text);
+			}
+			terminated.buildTree();
+			prefixed.buildTree();
+			terminatedDecoder.reset(new HuffmanDecodeTable(terminated, 4));
+			prefixedDecoder.reset(new HuffmanDecodeTable(prefixed, 4));
+			terminatedEncoder.reset(new HuffmanEncodeTable(terminated));
+			prefixedEncoder.reset(new HuffmanEncodeTable(prefixed));
+			terminatedAns.reset(new HuffmanAnsTable(terminated, HuffmanAnsTable::MinTableLog));
+			prefixedAns.reset(new HuffmanAnsTable(prefixed, HuffmanAnsTable::MinTableLog));
+			terminatedSearch.reset(new HuffmanSearch(terminated, "o ", 4));
+			prefixedSearch.reset(new HuffmanSearch(prefixed, "o ", 4));
+			lz.setDictionary(corpus[0]);
+			lz.train(std::vector<std::string>(std::begin(corpus), std::end(corpus)));
+		}
+
+		HuffmanTable terminated, prefixed;
+		std::unique_ptr<HuffmanDecodeTable> terminatedDecoder, prefixedDecoder;
+		std::unique_ptr<HuffmanEncodeTable> terminatedEncoder, prefixedEncoder;
+		std::unique_ptr<HuffmanAnsTable> terminatedAns, prefixedAns;
+		std::unique_ptr<HuffmanSearch> terminatedSearch, prefixedSearch;
+		HuffmanLz lz;
+	};
+
+	void check(bool condition, const char *message) {
+		if (!condition) {
+			std::cerr << "FUZZ FAILURE: " << message << "\n";
+			std::abort();
+		}
+	}
+
+	void searchAgrees(const HuffmanDecodeTable &decoder, const HuffmanSearch &search,
+	                  const unsigned char *data, size_t bitLength) {
+		std::string text;
+		bool decoded = true;
+		try {
+			text = decoder.decode(data, bitLength);
+		} catch (HuffmanException&) {
+			decoded = false;
+		}
+		size_t matches = 0;
+		bool searched = true;
+		try {
+			matches = search.count(data, bitLength);
+		} catch (HuffmanException&) {
+			searched = false;
+		}
+		check(decoded == searched, "search disagrees with decoder on validity");
+		if (!decoded) {
+			return;
+		}
+		size_t expected = 0;
+		for (size_t at = text.find(search.getPattern()); at != std::string::npos; at = text.find(search.getPattern(), at + 1)) {
+			++expected;
+		}
+		size_t first = text.find(search.getPattern());
+		check(matches == expected, "search count disagrees with decoded text");
+		check(search.find(data, bitLength) == (first == std::string::npos ? HuffmanSearch::NotFound : first),
+		      "search offset disagrees with decoded text");
+	}
+
+	void fastEncodeAgrees(const HuffmanEncodeTable &encoder, const std::string &text,
+	                      const std::vector<unsigned char> *expected, size_t bitLength) {
+		std::vector<unsigned char> out(encoder.maxEncodedBytes(text.size()));
+		for (bool vector : {true, false}) {
+			bool encoded = true;
+			size_t written = 0;
+			try {
+				written = vector ? encoder.encode(text, out.data(), out.size())
+				                 : encoder.encodeScalar(text, out.data(), out.size());
+			} catch (HuffmanException&) {
+				encoded = false;
+			}
+			check(encoded == (expected != nullptr), "fast encoder disagrees with table on validity");
+			if (expected) {
+				check(written == bitLength && std::equal(expected->begin(), expected->end(), out.begin()),
+				      "fast encode bits");
+			}
+		}
+	}
+
+	void roundTrip(const HuffmanTable &table, const HuffmanDecodeTable &decoder, const HuffmanEncodeTable &encoder,
+	               const HuffmanSearch &search, const std::string &text) {
+		if (!utf8::is_valid(text.begin(), text.end())) {
+			return;
+		}
+		std::vector<bool> bits;
+		try {
+			bits = table.encode(text);
+		} catch (HuffmanException&) {
+			fastEncodeAgrees(encoder, text, nullptr, 0);
+			return;
+		}
+
+		size_t bitLength = table.encodedBitLength(text);
+		check(bitLength == bits.size(), "encodedBitLength disagrees with encode");
+		std::vector<unsigned char> packed((bitLength + 7) / 8);
+		check(table.encode(text, packed.data(), packed.size()) == bitLength, "packed encode length");
+		for (size_t i = 0; i < bits.size(); ++i) {
+			check(bits[i] == (((packed[i / 8] >> (7 - i % 8)) & 1) != 0), "packed encode bits");
+		}
+
+		fastEncodeAgrees(encoder, text, &packed, bitLength);
+
+		check(table.decode(bits) == text, "vector decode round trip");
+		check(table.decodedByteLength(packed.data(), bitLength) == text.size(), "decodedByteLength");
+		std::string out(text.size(), '\0');
+		check(table.decode(packed.data(), bitLength, &out[0], out.size()) == text.size() && out == text,
+		      "packed decode round trip");
+		check(decoder.decode(packed.data(), bitLength) == text, "fast decode round trip");
+		check(table.decodePrefix(packed.data(), bitLength, SIZE_MAX) == text, "prefix decode round trip");
+		std::string lazy;
+		for (int c : table.codePoints(packed.data(), bitLength)) {
+			utf8::append(static_cast<uint32_t>(c), std::back_inserter(lazy));
+		}
+		check(lazy == text, "code point iterator round trip");
+		std::vector<std::string> outputs(8, std::string(text.size(), '\0'));
+		std::vector<HuffmanBatchString> batch;
+		for (std::string &output : outputs) {
+			batch.push_back(HuffmanBatchString{packed.data(), bitLength, &output[0], output.size(), 0});
+		}
+		decoder.decodeBatch(batch.data(), batch.size());
+		for (size_t i = 0; i < batch.size(); ++i) {
+			check(batch[i].written == text.size() && outputs[i] == text, "batch decode round trip");
+		}
+		searchAgrees(decoder, search, packed.data(), bitLength);
+	}
+
+	void ansRoundTrip(const HuffmanAnsTable &ans, const std::string &text) {
+		if (!utf8::is_valid(text.begin(), text.end())) {
+			return;
+		}
+		std::vector<bool> bits;
+		try {
+			bits = ans.encode(text);
+		} catch (HuffmanException&) {
+			return;
+		}
+
+		size_t bitLength = ans.encodedBitLength(text);
+		check(bitLength == bits.size(), "ANS encodedBitLength disagrees with encode");
+		std::vector<unsigned char> packed((bitLength + 7) / 8);
+		check(ans.encode(text, packed.data(), packed.size()) == bitLength, "ANS packed encode length");
+		check(ans.decode(bits) == text, "ANS vector decode round trip");
+		std::string out(text.size(), '\0');
+		check(ans.decode(packed.data(), bitLength, &out[0], out.size()) == text.size() && out == text,
+		      "ANS packed decode round trip");
+		check(ans.decode(ans.encodeSymbols(text), text.size()) == text, "ANS symbols round trip");
+	}
+
+	void lzRoundTrip(const HuffmanLz &lz, const std::string &text) {
+		if (!utf8::is_valid(text.begin(), text.end())) {
+			return;
+		}
+		std::vector<unsigned char> packed;
+		size_t bitLength = lz.encode(text, packed);
+		check(packed.size() == (bitLength + 7) / 8, "LZ encode length");
+		check(lz.decode(packed.data(), bitLength) == text, "LZ decode round trip");
+		std::string out(text.size(), '\0');
+		check(lz.decode(packed.data(), bitLength, &out[0], out.size()) == text.size() && out == text,
+		      "LZ buffer decode round trip");
+	}
+
+	void malformed(const HuffmanTable &table, const HuffmanDecodeTable &decoder, const HuffmanAnsTable &ans,
+	               const HuffmanLz &lz, const HuffmanSearch &search, const uint8_t *data, size_t size) {
+		// an exact size copy, so any read past the end is caught by ASan
+		std::vector<unsigned char> packed(data, data + size);
+		size_t bitLength = size * 8;
+		if (size > 0) {
+			bitLength -= data[0] & 7;
+		}
+
+		std::string expected(64, '\0'), actual(64, '\0');
+		size_t expectedLength = 0, actualLength = 0;
+		bool expectedOk = true, actualOk = true;
+		try {
+			expectedLength = table.decode(packed.data(), bitLength, &expected[0], expected.size());
+		} catch (HuffmanException&) {
+			expectedOk = false;
+		}
+		try {
+			actualLength = decoder.decode(packed.data(), bitLength, &actual[0], actual.size());
+		} catch (HuffmanException&) {
+			actualOk = false;
+		}
+		check(expectedOk == actualOk, "fast decoder disagrees on validity");
+		check(!expectedOk || (expectedLength == actualLength && expected == actual), "fast decoder disagrees on output");
+		searchAgrees(decoder, search, packed.data(), bitLength);
+
+		// enough copies to take the vector path, all of which must agree
+		std::vector<std::string> outputs(8, std::string(64, '\0'));
+		std::vector<HuffmanBatchString> batch;
+		for (std::string &output : outputs) {
+			batch.push_back(HuffmanBatchString{packed.data(), bitLength, &output[0], output.size(), 0});
+		}
+		bool batchOk = true;
+		try {
+			decoder.decodeBatch(batch.data(), batch.size());
+		} catch (HuffmanException&) {
+			batchOk = false;
+		}
+		check(batchOk == expectedOk, "batch decoder disagrees on validity");
+		for (size_t i = 0; batchOk && i < batch.size(); ++i) {
+			check(batch[i].written == expectedLength && outputs[i] == expected, "batch decoder disagrees on output");
+		}
+
+		std::vector<bool> bits;
+		for (size_t i = 0; i < bitLength; ++i) {
+			bits.push_back((packed[i / 8] >> (7 - i % 8)) & 1);
+		}
+		try {
+			table.decode(bits);
+		} catch (HuffmanException&) {
+		}
+		try {
+			decoder.decode(packed.data(), bitLength);
+		} catch (HuffmanException&) {
+		}
+		try {
+			std::string prefix = table.decodePrefix(packed.data(), bitLength, size % 16);
+			check(!expectedOk || expected.compare(0, prefix.size(), prefix) == 0, "prefix disagrees with decode");
+			for (auto iter = table.codePoints(packed.data(), bitLength).begin(); iter != HuffmanCodePointIterator(); ++iter) {
+			}
+		} catch (HuffmanException&) {
+		}
+		try {
+			ans.decode(packed.data(), bitLength);
+		} catch (HuffmanException&) {
+		}
+		try {
+			ans.decode(packed.data(), bitLength, &actual[0], actual.size());
+		} catch (HuffmanException&) {
+		}
+		try {
+			ans.decodeSymbols(packed.data(), bitLength, &actual[0], size % actual.size());
+		} catch (HuffmanException&) {
+		}
+		try {
+			lz.decode(packed.data(), bitLength, &actual[0], actual.size());
+		} catch (HuffmanException&) {
+		}
+		try {
+			lz.decode(packed.data(), bitLength);
+		} catch (HuffmanException&) {
+		}
+	}
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	static Tables tables;
+	if (size == 0) {
+		return 0;
+	}
+	const HuffmanTable &table = (data[0] & 1) ? tables.prefixed : tables.terminated;
+	const HuffmanDecodeTable &decoder = (data[0] & 1) ? *tables.prefixedDecoder : *tables.terminatedDecoder;
+	const HuffmanEncodeTable &encoder = (data[0] & 1) ? *tables.prefixedEncoder : *tables.terminatedEncoder;
+	const HuffmanAnsTable &ans = (data[0] & 1) ? *tables.prefixedAns : *tables.terminatedAns;
+	const HuffmanSearch &search = (data[0] & 1) ? *tables.prefixedSearch : *tables.terminatedSearch;
+	if (data[0] & 2) {
+		malformed(table, decoder, ans, tables.lz, search, data + 1, size - 1);
+	} else {
+		std::string text(reinterpret_cast<const char*>(data + 1), size - 1);
+		roundTrip(table, decoder, encoder, search, text);
+		ansRoundTrip(ans, text);
+		lzRoundTrip(tables.lz, text);
+	}
+	return 0;
+}
+
+#ifdef HUFFMAN_FUZZ_STANDALONE
+int main(int argc, char *argv[]) {
+	if (argc > 1) {
+		for (int i = 1; i < argc; ++i) {
+			std::ifstream in(argv[i], std::ios::binary);
+			std::string input((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+			LLVMFuzzerTestOneInput(reinterpret_cast<const uint8_t*>(input.data()), input.size());
+		}
+		return 0;
+	}
+
+	// without a corpus, mutate text from the training alphabet at random
+	const std::string text = "The quick brown fox 引阜ハモ Ünïcödé — €!\n";
+	std::vector<std::string> alphabet;
+	for (auto iter = text.begin(); iter != text.end(); ) {
+		auto start = iter;
+		utf8::next(iter, text.end());
+		alphabet.push_back(std::string(start, iter));
+	}
+	srand(1);
+	for (int run = 0; run < 200000; ++run) {
+		std::string input(1, static_cast<char>(rand() & 3));
+		size_t length = rand() % 48;
+		for (size_t i = 0; i < length; ++i) {
+			if (input[0] & 2 || rand() % 8 == 0) {
+				input += static_cast<char>(rand());
+			} else {
+				input += alphabet[rand() % alphabet.size()];
+			}
+		}
+		LLVMFuzzerTestOneInput(reinterpret_cast<const uint8_t*>(input.data()), input.size());
+	}
+	std::cout << "fuzz: 200000 random inputs passed\n";
+	return 0;
+}
+#endif
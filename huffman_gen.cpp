@@ -0,0 +1,41 @@
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "huffman.h"
+
+/*
+ * Builds a Huffman table from one or more corpus files, treating each line as
+ * a separate string, and writes a specialized encoder and decoder for it.
+ */
+int main(int argc, char *argv[]) {
+    if (argc < 4) {
+        std::cerr << "USAGE: " << argv[0] << " <output header> <namespace> <corpus files...>\n";
+        return 1;
+    }
+
+    HuffmanTable ht;
+    for (int i = 3; i < argc; ++i) {
+        std::ifstream corpus(argv[i]);
+        if (!corpus) {
+            std::cerr << "ERROR: could not open " << argv[i] << "\n";
+            return 1;
+        }
+        std::string line;
+        while (std::getline(corpus, line)) {
+            if (!line.empty()) {
+                ht.addFrequencies(line);
+            }
+        }
+    }
+    ht.buildTree();
+
+    std::ofstream out(argv[1]);
+    try {
+        ht.writeDecoderSource(out, argv[2]);
+    } catch (HuffmanException &e) {
+        std::cerr << "ERROR: " << e.what() << "\n";
+        return 1;
+    }
+    return out ? 0 : 1;
+}
@@ -0,0 +1,200 @@
+#include <algorithm>
+#include <functional>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "huffman.h"
+#include "huffman_histogram.h"
+#include "huffman_io.h"
+#include "huffman_utf8.h"
+
+
+/* ***************************************************************************
+ * Counting
+ */
+
+void HuffmanHistogram::add(std::string_view text) {
+	// gather the counts for the whole string first, so a sketch sees each
+	// symbol once per string rather than once per occurrence
+	uint64_t ascii[128] = {};
+	std::map<int, uint64_t> other;
+	auto iter = text.begin();
+	while (iter != text.end()) {
+		unsigned char byte = static_cast<unsigned char>(*iter);
+		if (byte < 0x80) {
+			++ascii[byte];
+			++iter;
+		} else {
+			++other[utf8::next(iter, text.end())];
+		}
+	}
+	for (int i = 0; i < 128; ++i) {
+		if (ascii[i]) {
+			add(i, ascii[i]);
+		}
+	}
+	for (const auto &i : other) {
+		add(i.first, i.second);
+	}
+	add(0, 1);
+}
+
+void HuffmanHistogram::add(int character, uint64_t count) {
+	if (count == 0) {
+		return;
+	}
+	auto i = counts.find(character);
+	if (!maxSymbols) {
+		if (i == counts.end()) {
+			counts.emplace(character, count);
+		} else {
+			i->second += std::min(count, UINT64_MAX - i->second);
+		}
+		return;
+	}
+
+	if (i != counts.end()) {
+		byCount.erase(std::make_pair(i->second, character));
+		i->second += std::min(count, UINT64_MAX - i->second);
+		byCount.emplace(i->second, character);
+		return;
+	}
+	if (counts.size() >= maxSymbols) {
+		// space-saving: the newcomer takes over the smallest count
+		auto smallest = byCount.begin();
+		count += std::min(smallest->first, UINT64_MAX - count);
+		counts.erase(smallest->second);
+		byCount.erase(smallest);
+	}
+	counts.emplace(character, count);
+	byCount.emplace(count, character);
+}
+
+void HuffmanHistogram::merge(const HuffmanHistogram &other) {
+	for (const auto &i : other.counts) {
+		uint64_t &count = counts[i.first];
+		count += std::min(i.second, UINT64_MAX - count);
+	}
+	truncate();
+}
+
+void HuffmanHistogram::truncate() {
+	if (!maxSymbols) {
+		return;
+	}
+	byCount.clear();
+	for (const auto &i : counts) {
+		byCount.emplace(i.second, i.first);
+	}
+	while (byCount.size() > maxSymbols) {
+		counts.erase(byCount.begin()->second);
+		byCount.erase(byCount.begin());
+	}
+}
+
+void HuffmanHistogram::rescale(uint64_t total) {
+	if (total < counts.size()) {
+		throw HuffmanException("Rescale Total Smaller than Symbol Count");
+	}
+	if (counts.empty()) {
+		return;
+	}
+
+	// round every share down, or up to one, remembering what each lost
+	double scale = static_cast<double>(total) / static_cast<double>(this->total());
+	std::vector<std::pair<double, int>> fractions;
+	uint64_t assigned = 0;
+	for (auto &i : counts) {
+		double share = static_cast<double>(i.second) * scale;
+		uint64_t rounded = share >= static_cast<double>(total) ? total : static_cast<uint64_t>(share);
+		rounded = std::max<uint64_t>(rounded, 1);
+		fractions.emplace_back(share - static_cast<double>(rounded), i.first);
+		i.second = rounded;
+		assigned += rounded;
+	}
+
+	if (assigned < total) {
+		// hand out what rounding down left over, largest fractions first
+		std::sort(fractions.begin(), fractions.end(), std::greater<std::pair<double, int>>());
+		for (size_t i = 0; assigned < total; ++i, ++assigned) {
+			++counts[fractions[i % fractions.size()].second];
+		}
+	} else if (assigned > total) {
+		// take back what rounding up to one added, from the largest counts
+		std::vector<std::pair<uint64_t, int>> largest;
+		for (const auto &i : counts) {
+			largest.emplace_back(i.second, i.first);
+		}
+		std::sort(largest.begin(), largest.end(), std::greater<std::pair<uint64_t, int>>());
+		for (size_t i = 0; assigned > total; ++i) {
+			uint64_t &count = counts[largest[i % largest.size()].second];
+			if (count > 1) {
+				--count;
+				--assigned;
+			}
+		}
+	}
+	truncate();
+}
+
+uint64_t HuffmanHistogram::total() const {
+	uint64_t sum = 0;
+	for (const auto &i : counts) {
+		sum += std::min(i.second, UINT64_MAX - sum);
+	}
+	return sum;
+}
+
+
+/* ***************************************************************************
+ * Saving and loading
+ */
+
+static const char histogramMagic[4] = { 'H', 'U', 'F', 'H' };
+static const uint32_t histogramVersion = 1;
+
+void HuffmanHistogram::save(std::ostream &out) const {
+	out.write(histogramMagic, sizeof(histogramMagic));
+	huffmanWriteU32(out, histogramVersion);
+	huffmanWriteVarint(out, maxSymbols);
+	huffmanWriteVarint(out, counts.size());
+	int previous = -1;
+	for (const auto &i : counts) {
+		huffmanWriteVarint(out, static_cast<uint64_t>(i.first - previous - 1));
+		huffmanWriteVarint(out, i.second);
+		previous = i.first;
+	}
+}
+
+void HuffmanHistogram::load(std::istream &in) {
+	char magic[sizeof(histogramMagic)];
+	if (!in.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), histogramMagic)) {
+		throw HuffmanException("Not a Huffman Histogram");
+	}
+	if (huffmanReadU32(in) != histogramVersion) {
+		throw HuffmanException("Unsupported Huffman Histogram Version");
+	}
+	uint64_t newMaxSymbols = huffmanReadVarint(in);
+	uint64_t size = huffmanReadVarint(in);
+	if (size > 0x110000) {
+		throw HuffmanException("Malformed Huffman Histogram");
+	}
+
+	std::map<int, uint64_t> newCounts;
+	int64_t previous = -1;
+	for (uint64_t i = 0; i < size; ++i) {
+		uint64_t delta = huffmanReadVarint(in);
+		uint64_t count = huffmanReadVarint(in);
+		if (delta > 0x10FFFF || previous + 1 + static_cast<int64_t>(delta) > 0x10FFFF) {
+			throw HuffmanException("Malformed Huffman Histogram");
+		}
+		previous += 1 + static_cast<int64_t>(delta);
+		newCounts.emplace_hint(newCounts.end(), static_cast<int>(previous), count);
+	}
+
+	counts.swap(newCounts);
+	maxSymbols = static_cast<size_t>(newMaxSymbols);
+	truncate();
+}
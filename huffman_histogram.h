@@ -0,0 +1,130 @@
+#ifndef HUFFMAN_HISTOGRAM_H
+#define HUFFMAN_HISTOGRAM_H
+
+#include <cstdint>
+#include <iosfwd>
+#include <map>
+#include <set>
+#include <string_view>
+#include <utility>
+
+/**
+ * Character frequencies gathered from text, kept apart from any table so
+ * that partial histograms can be gathered wherever the text lives, saved in
+ * a compact form, and merged before building a table. Counts are keyed by
+ * code point; every string added also counts one end marker under 0.
+ *
+ * Merging adds counts, so exact histograms merge associatively and in any
+ * order. For very large alphabets a histogram can instead be limited to its
+ * most frequent symbols, using the space-saving sketch: when a new symbol
+ * arrives at a full histogram it replaces the least frequent one and
+ * inherits its count. Counts then overestimate by at most the smallest
+ * count kept, and merging keeps the largest combined counts, so the result
+ * depends slightly on how the text was split.
+ */
+class HuffmanHistogram {
+public:
+	typedef std::map<int, uint64_t>::const_iterator const_iterator;
+
+	/**
+	 * @param maxSymbols The largest number of symbols to keep, or zero to
+	 *                   count every symbol exactly.
+	 */
+	explicit HuffmanHistogram(size_t maxSymbols = 0)
+	: maxSymbols(maxSymbols)
+	{ }
+
+	/**
+	 * Count every character of a string and one end marker.
+	 * @param text The text to count.
+	 */
+	void add(std::string_view text);
+
+	/**
+	 * Add to the count of a single character. A character of 0 adds to the
+	 * count of the end marker.
+	 * @param character The code point to count.
+	 * @param count The amount to add.
+	 */
+	void add(int character, uint64_t count = 1);
+
+	/**
+	 * Add the counts of another histogram to this one.
+	 * @param other The histogram to merge in.
+	 */
+	void merge(const HuffmanHistogram &other);
+
+	/**
+	 * @param character The code point to look up.
+	 * @return The count of the character, or zero if it was never seen.
+	 */
+	uint64_t count(int character) const {
+		auto i = counts.find(character);
+		return i == counts.end() ? 0 : i->second;
+	}
+
+	/**
+	 * Scale every count so they sum to exactly total, rounding each to the
+	 * nearest whole number but keeping every counted symbol at a count of at
+	 * least one, so nothing seen becomes unencodable. Counts of any size
+	 * can be brought down to a fixed total this way before building a
+	 * table, which bounds how long its codes can be: an n bit code needs a
+	 * total of at least the (n + 3)th Fibonacci number less one, so a total
+	 * of 2^20 keeps every code to 27 bits or fewer.
+	 * @param total The total to scale to.
+	 * @throw HuffmanException Thrown if total is less than the number of
+	 *                         symbols.
+	 */
+	void rescale(uint64_t total);
+
+	/** @return The sum of all counts. */
+	uint64_t total() const;
+
+	/** @return The number of distinct symbols counted. */
+	size_t size() const {
+		return counts.size();
+	}
+	bool empty() const {
+		return counts.empty();
+	}
+	void clear() {
+		counts.clear();
+		byCount.clear();
+	}
+	size_t getMaxSymbols() const {
+		return maxSymbols;
+	}
+
+	/** Iterate over (code point, count) pairs in order of code point. */
+	const_iterator begin() const {
+		return counts.begin();
+	}
+	const_iterator end() const {
+		return counts.end();
+	}
+
+	/**
+	 * Write the histogram to a binary stream. Code points are delta coded
+	 * and both they and the counts are stored as varints, so a histogram of
+	 * ordinary text takes a few bytes per symbol.
+	 * @param out The stream to write to.
+	 */
+	void save(std::ostream &out) const;
+
+	/**
+	 * Replace this histogram with one previously written by save().
+	 * @param in The stream to read from.
+	 * @throw HuffmanException Thrown if the data is not a valid histogram.
+	 */
+	void load(std::istream &in);
+
+private:
+	void truncate();
+
+	std::map<int, uint64_t> counts;
+	// (count, character) for every symbol, kept only when sketching
+	std::set<std::pair<uint64_t, int>> byCount;
+	size_t maxSymbols;
+};
+
+#endif
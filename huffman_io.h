@@ -0,0 +1,101 @@
+#ifndef HUFFMAN_IO_H
+#define HUFFMAN_IO_H
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <streambuf>
+#include <string_view>
+
+#include "huffman.h"
+
+/*
+ * Helpers shared by the on-disk formats. All integers are stored little
+ * endian. Varints are stored seven bits per byte, least significant group
+ * first, with the top bit set on every byte but the last.
+ */
+
+inline void huffmanWriteU64(std::ostream &out, uint64_t value) {
+	unsigned char bytes[8];
+	for (int i = 0; i < 8; ++i) {
+		bytes[i] = static_cast<unsigned char>(value >> (8 * i));
+	}
+	out.write(reinterpret_cast<const char*>(bytes), 8);
+}
+
+inline void huffmanWriteU32(std::ostream &out, uint32_t value) {
+	unsigned char bytes[4];
+	for (int i = 0; i < 4; ++i) {
+		bytes[i] = static_cast<unsigned char>(value >> (8 * i));
+	}
+	out.write(reinterpret_cast<const char*>(bytes), 4);
+}
+
+inline uint64_t huffmanReadU64(std::istream &in) {
+	unsigned char bytes[8];
+	if (!in.read(reinterpret_cast<char*>(bytes), 8)) {
+		throw HuffmanException("Unexpected End of File");
+	}
+	uint64_t value = 0;
+	for (int i = 7; i >= 0; --i) {
+		value = (value << 8) | bytes[i];
+	}
+	return value;
+}
+
+inline uint32_t huffmanReadU32(std::istream &in) {
+	unsigned char bytes[4];
+	if (!in.read(reinterpret_cast<char*>(bytes), 4)) {
+		throw HuffmanException("Unexpected End of File");
+	}
+	return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (static_cast<uint32_t>(bytes[3]) << 24);
+}
+
+inline void huffmanWriteVarint(std::ostream &out, uint64_t value) {
+	unsigned char bytes[10];
+	int length = 0;
+	do {
+		bytes[length++] = static_cast<unsigned char>((value & 0x7F) | (value > 0x7F ? 0x80 : 0));
+		value >>= 7;
+	} while (value);
+	out.write(reinterpret_cast<const char*>(bytes), length);
+}
+
+inline uint64_t huffmanReadVarint(std::istream &in) {
+	uint64_t value = 0;
+	for (unsigned shift = 0; ; shift += 7) {
+		int byte = in.get();
+		if (byte == std::char_traits<char>::eof()) {
+			throw HuffmanException("Unexpected End of File");
+		}
+		if (shift > 63 || (shift == 63 && (byte & 0x7E))) {
+			throw HuffmanException("Malformed Varint");
+		}
+		value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+		if (!(byte & 0x80)) {
+			return value;
+		}
+	}
+}
+
+/*
+ * Lets the stream based loaders read straight out of memory, such as a
+ * mapped file, without copying it.
+ */
+class HuffmanMemoryStreamBuf : public std::streambuf {
+public:
+	explicit HuffmanMemoryStreamBuf(std::string_view data) {
+		char *start = const_cast<char*>(data.data());
+		setg(start, start, start + data.size());
+	}
+
+protected:
+	pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode) override {
+		if (off != 0 || dir != std::ios_base::cur) {
+			return pos_type(off_type(-1));
+		}
+		return pos_type(gptr() - eback());
+	}
+};
+
+#endif
@@ -0,0 +1,463 @@
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "huffman.h"
+#include "huffman_bits.h"
+#include "huffman_lz.h"
+#include "huffman_utf8.h"
+
+
+/* ***************************************************************************
+ * Effort levels and token values
+ */
+
+namespace {
+	struct Effort {
+		// the most earlier positions tried per match
+		unsigned chain;
+		// a match at least this long is taken without looking further
+		size_t nice;
+		// whether to look one character ahead for a longer match
+		bool lazy;
+	};
+
+	const Effort efforts[HuffmanLz::MaxLevel] = {
+		{ 2, 8, false },
+		{ 4, 16, false },
+		{ 8, 32, false },
+		{ 16, 32, true },
+		{ 32, 64, true },
+		{ 64, 128, true },
+		{ 256, 256, true },
+		{ 1024, 1024, true },
+		{ 4096, SIZE_MAX, true },
+	};
+
+	/*
+	 * Lengths and distances are coded as a bucket and extra bits. Values
+	 * below DirectValues are their own bucket; larger ones are bucketed by
+	 * their highest bit, and the bits below it follow raw.
+	 */
+	const unsigned DirectValues = 16;
+	const unsigned MaxValueBits = 48;
+	const unsigned MaxBucket = DirectValues + MaxValueBits - 5;
+	// code points 0 and 1 both stand for the end marker in a HuffmanTable
+	const int FirstSymbol = 2;
+
+	struct Bucket {
+		unsigned bucket;
+		unsigned extraBits;
+		uint64_t extra;
+	};
+
+	Bucket bucketOf(uint64_t value) {
+		if (value < DirectValues) {
+			return Bucket{static_cast<unsigned>(value), 0, 0};
+		}
+		if (value >> MaxValueBits) {
+			throw HuffmanException("Text Too Long for LZ Coding");
+		}
+		unsigned bit = 0;
+		while (value >> (bit + 1)) {
+			++bit;
+		}
+		return Bucket{DirectValues + bit - 4, bit, value - (uint64_t(1) << bit)};
+	}
+
+	inline bool isBoundary(char c) {
+		return (static_cast<unsigned char>(c) & 0xC0) != 0x80;
+	}
+
+	inline uint32_t hash4(const char *p, unsigned bits) {
+		uint32_t value;
+		std::memcpy(&value, p, sizeof(value));
+		return (value * 2654435761u) >> (32 - bits);
+	}
+}
+
+HuffmanLz::HuffmanLz(unsigned level)
+: level(std::max(MinLevel, std::min(level, MaxLevel)))
+{ }
+
+
+/* ***************************************************************************
+ * Match finding
+ */
+
+/*
+ * Size the chains for a text of the given length and add its first limit
+ * positions. Only positions that start a character are added, so every
+ * match starts on a character boundary.
+ */
+void HuffmanLz::buildChains(HashChains &chains, std::string_view text, size_t limit) {
+	chains.hashBits = 8;
+	while (chains.hashBits < 16 && (size_t(1) << chains.hashBits) < text.size()) {
+		++chains.hashBits;
+	}
+	chains.head.assign(size_t(1) << chains.hashBits, -1);
+	chains.previous.assign(text.size(), -1);
+	for (size_t i = 0; i < limit && i + MinMatch <= text.size(); ++i) {
+		if (isBoundary(text[i])) {
+			uint32_t h = hash4(text.data() + i, chains.hashBits);
+			chains.previous[i] = chains.head[h];
+			chains.head[h] = static_cast<int32_t>(i);
+		}
+	}
+}
+
+void HuffmanLz::setDictionary(std::string newDictionary) {
+	if (newDictionary.size() > INT32_MAX) {
+		throw HuffmanException("Dictionary Too Large");
+	}
+	dictionary.swap(newDictionary);
+	buildChains(dictionaryChains, dictionary, dictionary.size());
+}
+
+/*
+ * Find the longest match for the text at pos among the earlier positions in
+ * the local chains, then the dictionary. Ties go to the nearest match.
+ */
+void HuffmanLz::findMatch(std::string_view text, const HashChains &local, size_t pos, size_t &length, size_t &distance) const {
+	const Effort &effort = efforts[level - 1];
+	length = 0;
+	distance = 0;
+	if (pos + MinMatch > text.size()) {
+		return;
+	}
+	const char *current = text.data() + pos;
+	size_t remaining = text.size() - pos;
+
+	auto consider = [&](const char *candidate, size_t available, size_t candidateDistance) {
+		size_t limit = std::min(remaining, available);
+		if (limit <= length || candidate[length] != current[length]) {
+			return;
+		}
+		size_t matched = 0;
+		while (matched < limit && candidate[matched] == current[matched]) {
+			++matched;
+		}
+		// end on a character boundary so the next literal run is whole characters
+		while (matched > 0 && matched < remaining && !isBoundary(current[matched])) {
+			--matched;
+		}
+		if (matched > length && matched >= MinMatch) {
+			length = matched;
+			distance = candidateDistance;
+		}
+	};
+
+	unsigned tries = effort.chain;
+	for (int32_t c = local.head[hash4(current, local.hashBits)]; c >= 0 && tries > 0 && length < effort.nice;
+	     c = local.previous[c], --tries) {
+		// an overlapping match may read on into the text being matched
+		consider(text.data() + c, text.size() - c, pos - c);
+	}
+	if (dictionary.size() >= MinMatch) {
+		tries = effort.chain;
+		for (int32_t d = dictionaryChains.head[hash4(current, dictionaryChains.hashBits)];
+		     d >= 0 && tries > 0 && length < effort.nice; d = dictionaryChains.previous[d], --tries) {
+			consider(dictionary.data() + d, dictionary.size() - d, pos + dictionary.size() - d);
+		}
+	}
+}
+
+void HuffmanLz::parse(std::string_view text, std::vector<Sequence> &sequences) const {
+	const Effort &effort = efforts[level - 1];
+	HashChains local;
+	buildChains(local, text, 0);
+	size_t inserted = 0;
+	auto insertUpTo = [&](size_t end) {
+		for (; inserted < end; ++inserted) {
+			if (inserted + MinMatch <= text.size() && isBoundary(text[inserted])) {
+				uint32_t h = hash4(text.data() + inserted, local.hashBits);
+				local.previous[inserted] = local.head[h];
+				local.head[h] = static_cast<int32_t>(inserted);
+			}
+		}
+	};
+	auto nextCharacter = [&](size_t pos) {
+		do {
+			++pos;
+		} while (pos < text.size() && !isBoundary(text[pos]));
+		return pos;
+	};
+
+	sequences.clear();
+	size_t literalStart = 0;
+	size_t pos = 0;
+	while (pos < text.size()) {
+		insertUpTo(pos);
+		size_t length, distance;
+		findMatch(text, local, pos, length, distance);
+		if (length > 0 && effort.lazy && length < effort.nice) {
+			size_t next = nextCharacter(pos);
+			insertUpTo(next);
+			size_t nextLength, nextDistance;
+			findMatch(text, local, next, nextLength, nextDistance);
+			if (nextLength > length) {
+				pos = next;
+				continue;
+			}
+		}
+		if (length == 0) {
+			pos = nextCharacter(pos);
+			continue;
+		}
+		sequences.push_back(Sequence{literalStart, pos - literalStart, length, distance});
+		pos += length;
+		literalStart = pos;
+	}
+	sequences.push_back(Sequence{literalStart, text.size() - literalStart, 0, 0});
+}
+
+
+/* ***************************************************************************
+ * Training and encoding
+ */
+
+void HuffmanLz::train(const std::vector<std::string> &strings) {
+	HuffmanTable newLiterals, newLiteralLengths, newMatchLengths, newDistances;
+	newLiterals.setLengthPrefixed(true);
+	newLiterals.setEscape(true);
+	for (HuffmanTable *table : { &newLiteralLengths, &newMatchLengths, &newDistances }) {
+		// every value stays encodable, whatever the sample held
+		table->setLengthPrefixed(true);
+		for (unsigned bucket = 0; bucket <= MaxBucket; ++bucket) {
+			table->addFrequency(FirstSymbol + bucket);
+		}
+	}
+
+	std::vector<Sequence> sequences;
+	for (const std::string &text : strings) {
+		parse(text, sequences);
+		for (const Sequence &sequence : sequences) {
+			auto iter = text.begin() + sequence.literalStart;
+			auto end = iter + sequence.literalLength;
+			while (iter != end) {
+				newLiterals.addFrequency(utf8::next(iter, end));
+			}
+			newLiteralLengths.addFrequency(FirstSymbol + bucketOf(sequence.literalLength).bucket);
+			if (sequence.matchLength == 0) {
+				newMatchLengths.addFrequency(FirstSymbol);
+			} else {
+				newMatchLengths.addFrequency(FirstSymbol + bucketOf(sequence.matchLength - MinMatch + 1).bucket);
+				newDistances.addFrequency(FirstSymbol + bucketOf(sequence.distance - 1).bucket);
+			}
+		}
+	}
+
+	newLiterals.buildTree();
+	newLiteralLengths.buildTree();
+	newMatchLengths.buildTree();
+	newDistances.buildTree();
+	literalDecoder.reset(new HuffmanDecodeTable(newLiterals));
+	literalLengthDecoder.reset(new HuffmanDecodeTable(newLiteralLengths));
+	matchLengthDecoder.reset(new HuffmanDecodeTable(newMatchLengths));
+	distanceDecoder.reset(new HuffmanDecodeTable(newDistances));
+	literals = std::move(newLiterals);
+	literalLengths = std::move(newLiteralLengths);
+	matchLengths = std::move(newMatchLengths);
+	distances = std::move(newDistances);
+}
+
+namespace {
+	template<class Write>
+	void writeValue(const HuffmanTable &table, uint64_t value, Write &write) {
+		Bucket bucket = bucketOf(value);
+		const HuffmanCode &code = table.getCodes()[table.getSymbolIndex().rank(FirstSymbol + bucket.bucket)];
+		write(code.bits, code.length);
+		if (bucket.extraBits) {
+			write(bucket.extra, bucket.extraBits);
+		}
+	}
+
+	template<class Write>
+	void writeLiterals(const HuffmanTable &table, std::string_view text, Write &write) {
+		auto iter = text.begin();
+		while (iter != text.end()) {
+			int c = utf8::next(iter, text.end());
+			uint32_t rank = table.getSymbolIndex().rank(c);
+			if (rank != HuffmanSymbolIndex::NoSymbol && c > 1) {
+				write(table.getCodes()[rank].bits, table.getCodes()[rank].length);
+			} else {
+				const HuffmanCode &escape = table.getEscapeCode();
+				write(escape.bits, escape.length);
+				write(static_cast<uint64_t>(c), HuffmanTable::EscapeBits);
+			}
+		}
+	}
+}
+
+size_t HuffmanLz::encode(std::string_view text, std::vector<unsigned char> &out) const {
+	if (!literalDecoder) {
+		throw HuffmanException("Tried to encode with untrained LZ coder");
+	}
+	std::vector<Sequence> sequences;
+	parse(text, sequences);
+
+	// measure first, then write into exactly enough room
+	auto emit = [&](auto &write) {
+		for (const Sequence &sequence : sequences) {
+			writeValue(literalLengths, sequence.literalLength, write);
+			writeLiterals(literals, text.substr(sequence.literalStart, sequence.literalLength), write);
+			if (sequence.matchLength == 0) {
+				writeValue(matchLengths, 0, write);
+			} else {
+				writeValue(matchLengths, sequence.matchLength - MinMatch + 1, write);
+				writeValue(distances, sequence.distance - 1, write);
+			}
+		}
+	};
+	size_t bits = 0;
+	auto count = [&bits](uint64_t, unsigned length) {
+		bits += length;
+	};
+	emit(count);
+
+	size_t start = out.size();
+	out.resize(start + (bits + 7) / 8);
+	HuffmanBitWriter writer(out.data() + start, out.size() - start);
+	auto write = [&writer](uint64_t value, unsigned length) {
+		writer.write(value, length);
+	};
+	emit(write);
+	return bits;
+}
+
+
+/* ***************************************************************************
+ * Decoding
+ */
+
+/*
+ * Walk the sequences of an encoded string, passing each literal run and
+ * match to decode.literals(count, pos) and decode.match(length, distance).
+ */
+template<class Decode>
+void HuffmanLz::run(const unsigned char *data, size_t bitLength, Decode &decode) const {
+	HuffmanBitWindow bits(data, bitLength);
+	size_t pos = 0;
+	auto readValue = [&](const HuffmanDecodeTable &table) {
+		char symbol;
+		table.decodeSymbols(data, bitLength, pos, &symbol, 1);
+		unsigned bucket = static_cast<unsigned char>(symbol) - FirstSymbol;
+		if (bucket > MaxBucket) {
+			throw HuffmanException("Bad LZ Token");
+		}
+		if (bucket < DirectValues) {
+			return uint64_t(bucket);
+		}
+		unsigned extraBits = bucket - DirectValues + 4;
+		if (bitLength - pos < extraBits) {
+			throw HuffmanException("Unexpected End of Data");
+		}
+		uint64_t extra = bits.load(pos) >> (64 - extraBits);
+		pos += extraBits;
+		return (uint64_t(1) << extraBits) + extra;
+	};
+
+	for (;;) {
+		uint64_t literalLength = readValue(*literalLengthDecoder);
+		if (literalLength > 0) {
+			decode.literals(static_cast<size_t>(literalLength), pos);
+		}
+		uint64_t matchLength = readValue(*matchLengthDecoder);
+		if (matchLength == 0) {
+			return;
+		}
+		uint64_t distance = readValue(*distanceDecoder) + 1;
+		decode.match(static_cast<size_t>(matchLength + MinMatch - 1), static_cast<size_t>(distance));
+	}
+}
+
+namespace {
+	/*
+	 * Decodes into a buffer, which may be grown up to maxSize bytes when
+	 * there is no caller supplied one.
+	 */
+	struct LzOutput {
+		const HuffmanDecodeTable &literalDecoder;
+		const std::string &dictionary;
+		const unsigned char *data;
+		size_t bitLength;
+		char *out;
+		size_t outSize;
+		std::string *growable;
+		size_t maxSize;
+		size_t written;
+
+		void reserve(size_t length) {
+			if (length <= outSize - written) {
+				return;
+			}
+			if (!growable) {
+				throw HuffmanException("Output Buffer Too Small");
+			}
+			if (length > maxSize - written) {
+				throw HuffmanException("Decoded Text Too Long");
+			}
+			growable->resize(std::min(std::max(written + length, growable->size() * 2), maxSize));
+			out = &(*growable)[0];
+			outSize = growable->size();
+		}
+
+		void literals(size_t length, size_t &pos) {
+			// every literal character costs at least one bit
+			if (length / 4 > bitLength - pos) {
+				throw HuffmanException("Unexpected End of Data");
+			}
+			reserve(length);
+			literalDecoder.decodeSymbols(data, bitLength, pos, out + written, length);
+			written += length;
+		}
+
+		void match(size_t length, size_t distance) {
+			if (distance > written + dictionary.size()) {
+				throw HuffmanException("Bad LZ Match Distance");
+			}
+			reserve(length);
+			char *to = out + written;
+			if (distance > written) {
+				// starts in the dictionary, and may run on into the output
+				size_t from = dictionary.size() - (distance - written);
+				size_t fromDictionary = std::min(length, dictionary.size() - from);
+				std::memcpy(to, dictionary.data() + from, fromDictionary);
+				for (size_t i = fromDictionary; i < length; ++i) {
+					to[i] = out[i - fromDictionary];
+				}
+			} else if (distance >= length) {
+				std::memcpy(to, to - distance, length);
+			} else {
+				// overlapping copies repeat the last distance bytes
+				for (size_t i = 0; i < length; ++i) {
+					to[i] = to[i - distance];
+				}
+			}
+			written += length;
+		}
+	};
+}
+
+size_t HuffmanLz::decode(const unsigned char *data, size_t bitLength, char *out, size_t outSize) const {
+	if (!literalDecoder) {
+		throw HuffmanException("Tried to decode with untrained LZ coder");
+	}
+	LzOutput output{*literalDecoder, dictionary, data, bitLength, out, outSize, nullptr, outSize, 0};
+	run(data, bitLength, output);
+	return output.written;
+}
+
+std::string HuffmanLz::decode(const unsigned char *data, size_t bitLength, size_t maxSize) const {
+	if (!literalDecoder) {
+		throw HuffmanException("Tried to decode with untrained LZ coder");
+	}
+	maxSize = std::min(maxSize, std::string().max_size());
+	std::string result(std::min(std::max<size_t>(16, bitLength / 2), maxSize), '\0');
+	LzOutput output{*literalDecoder, dictionary, data, bitLength, &result[0], result.size(), &result, maxSize, 0};
+	run(data, bitLength, output);
+	result.resize(output.written);
+	return result;
+}
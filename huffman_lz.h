@@ -0,0 +1,156 @@
+#ifndef HUFFMAN_LZ_H
+#define HUFFMAN_LZ_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "huffman.h"
+#include "huffman_decoder.h"
+
+/**
+ * An LZ77 stage in front of Huffman coding, for text that repeats whole
+ * phrases. A hash-chain match finder splits the text into sequences of a
+ * run of literal characters followed by a copy of earlier text. Literals
+ * are coded with a HuffmanTable over characters, and literal lengths, match
+ * lengths and match distances each with a HuffmanTable of their own, so
+ * every part is coded with the existing machinery and decoded with
+ * HuffmanDecodeTable.
+ *
+ * Matches can reach back into the string being encoded and into an
+ * optional dictionary, which is treated as if it came just before every
+ * string. Giving a string bank a dictionary of its own typical text lets
+ * short strings share phrases while each can still be decoded on its own.
+ *
+ * The effort level sets how hard the match finder searches: how many
+ * earlier positions with the same hash it tries, how long a match must be
+ * to stop early, and whether it looks one character ahead for a better
+ * match before committing (lazy matching). Decoding speed does not depend
+ * on the level.
+ *
+ * Lengths and distances are counted in bytes, but matches always start and
+ * end on character boundaries, so literal runs are always whole UTF-8
+ * characters.
+ */
+class HuffmanLz {
+public:
+	/** The shortest match worth coding. */
+	static constexpr unsigned MinMatch = 4;
+	static constexpr unsigned MinLevel = 1;
+	static constexpr unsigned MaxLevel = 9;
+	static constexpr unsigned DefaultLevel = 5;
+	/** The longest text decode() returns unless given a larger bound. */
+	static constexpr size_t DefaultMaxDecodedSize = size_t(64) << 20;
+
+	/**
+	 * @param level The match finder effort, from MinLevel to MaxLevel.
+	 */
+	explicit HuffmanLz(unsigned level = DefaultLevel);
+
+	/**
+	 * Set the text matches may refer to in addition to the string itself.
+	 * This must be set before calling train(), and the same dictionary must
+	 * be used to decode.
+	 * @param dictionary The shared text.
+	 */
+	void setDictionary(std::string dictionary);
+	const std::string& getDictionary() const {
+		return dictionary;
+	}
+
+	unsigned getLevel() const {
+		return level;
+	}
+
+	/**
+	 * Parse sample text with the match finder and build the four tables from
+	 * the literals and matches found. Every length and distance can be
+	 * encoded afterwards, and characters not seen in training are escaped.
+	 * @param strings The sample strings.
+	 * @throw HuffmanException Thrown if the tables cannot be built.
+	 */
+	void train(const std::vector<std::string> &strings);
+
+	/**
+	 * Encode a string, appending the packed bits to a buffer starting at a
+	 * byte boundary.
+	 * @param text The text to encode.
+	 * @param out The buffer to append to.
+	 * @return The number of bits written.
+	 * @throw HuffmanException Thrown if the coder has not been trained.
+	 */
+	size_t encode(std::string_view text, std::vector<unsigned char> &out) const;
+
+	/**
+	 * Decode a string produced by encode(). The encoded form does not hold
+	 * the length of the text, and a single corrupt match can claim terabytes
+	 * of it, so the text is only grown up to a bound.
+	 * @param data The encoded string, packed most significant bit first.
+	 * @param bitLength The number of valid bits in data.
+	 * @param maxSize The longest text to accept.
+	 * @return The decoded text.
+	 * @throw HuffmanException Thrown if the data is truncated or corrupt, or
+	 *                         decodes to more than maxSize bytes.
+	 */
+	std::string decode(const unsigned char *data, size_t bitLength, size_t maxSize = DefaultMaxDecodedSize) const;
+
+	/**
+	 * Decode a string produced by encode() into a caller supplied buffer.
+	 * @param data The encoded string, packed most significant bit first.
+	 * @param bitLength The number of valid bits in data.
+	 * @param out The buffer to write the decoded text into.
+	 * @param outSize The size of the output buffer in bytes.
+	 * @return The number of bytes written.
+	 * @throw HuffmanException Thrown if the data is truncated or corrupt, or
+	 *                         the buffer is too small.
+	 */
+	size_t decode(const unsigned char *data, size_t bitLength, char *out, size_t outSize) const;
+
+	/**
+	 * The tables for literal characters, literal run lengths, match lengths
+	 * and match distances. Lengths and distances are coded as a bucket
+	 * symbol, stored as the character (bucket + 2), and extra raw bits.
+	 */
+	const HuffmanTable& getLiteralTable() const {
+		return literals;
+	}
+	const HuffmanTable& getLiteralLengthTable() const {
+		return literalLengths;
+	}
+	const HuffmanTable& getMatchLengthTable() const {
+		return matchLengths;
+	}
+	const HuffmanTable& getDistanceTable() const {
+		return distances;
+	}
+
+private:
+	struct Sequence {
+		size_t literalStart;
+		size_t literalLength;
+		size_t matchLength;
+		size_t distance;
+	};
+
+	struct HashChains {
+		std::vector<int32_t> head;
+		std::vector<int32_t> previous;
+		unsigned hashBits = 0;
+	};
+
+	static void buildChains(HashChains &chains, std::string_view text, size_t limit);
+	void parse(std::string_view text, std::vector<Sequence> &sequences) const;
+	void findMatch(std::string_view text, const HashChains &local, size_t pos, size_t &length, size_t &distance) const;
+	template<class Decode>
+	void run(const unsigned char *data, size_t bitLength, Decode &decode) const;
+
+	unsigned level;
+	std::string dictionary;
+	HashChains dictionaryChains;
+	HuffmanTable literals, literalLengths, matchLengths, distances;
+	std::unique_ptr<HuffmanDecodeTable> literalDecoder, literalLengthDecoder, matchLengthDecoder, distanceDecoder;
+};
+
+#endif
@@ -0,0 +1,204 @@
+#include <algorithm>
+#include <cstdint>
+#include <exception>
+#include <fstream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "huffman_memory.h"
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#define HUFFMAN_HAVE_NUMA 1
+#define HUFFMAN_HAVE_MMAP 1
+#elif defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#define HUFFMAN_HAVE_MMAP 1
+#endif
+
+
+/* ***************************************************************************
+ * Heap and huge page allocators
+ */
+
+namespace {
+	class HeapAllocator : public HuffmanTableAllocator {
+	public:
+		virtual void* allocate(size_t bytes) override {
+			return ::operator new(bytes, std::align_val_t(64));
+		}
+		virtual void deallocate(void *memory, size_t) override {
+			::operator delete(memory, std::align_val_t(64));
+		}
+	};
+}
+
+HuffmanTableAllocator& HuffmanTableAllocator::heap() {
+	static HeapAllocator allocator;
+	return allocator;
+}
+
+#ifdef HUFFMAN_HAVE_MMAP
+static size_t roundToHugePage(size_t bytes) {
+	size_t size = HuffmanHugePageAllocator::HugePageSize;
+	return (bytes + size - 1) / size * size;
+}
+#endif
+
+void* HuffmanHugePageAllocator::allocate(size_t bytes) {
+#ifdef HUFFMAN_HAVE_MMAP
+	size_t length = roundToHugePage(std::max<size_t>(bytes, 1));
+#ifdef MAP_HUGETLB
+	void *memory = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (memory != MAP_FAILED) {
+		return memory;
+	}
+#endif
+
+	// map an extra huge page so the table can start on a huge page boundary,
+	// then give back the unused ends
+	void *mapping = mmap(nullptr, length + HugePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mapping == MAP_FAILED) {
+		throw std::bad_alloc();
+	}
+	uintptr_t start = reinterpret_cast<uintptr_t>(mapping);
+	uintptr_t aligned = (start + HugePageSize - 1) / HugePageSize * HugePageSize;
+	if (aligned > start) {
+		munmap(mapping, aligned - start);
+	}
+	if (aligned + length < start + length + HugePageSize) {
+		munmap(reinterpret_cast<void*>(aligned + length), start + HugePageSize - aligned);
+	}
+#ifdef MADV_HUGEPAGE
+	madvise(reinterpret_cast<void*>(aligned), length, MADV_HUGEPAGE);
+#endif
+	return reinterpret_cast<void*>(aligned);
+#else
+	return heap().allocate(bytes);
+#endif
+}
+
+void HuffmanHugePageAllocator::deallocate(void *memory, size_t bytes) {
+#ifdef HUFFMAN_HAVE_MMAP
+	munmap(memory, roundToHugePage(std::max<size_t>(bytes, 1)));
+#else
+	heap().deallocate(memory, bytes);
+#endif
+}
+
+
+/* ***************************************************************************
+ * NUMA topology, read from sysfs so no NUMA library is needed
+ */
+
+#ifdef HUFFMAN_HAVE_NUMA
+namespace {
+	/*
+	 * Parse a sysfs CPU list such as "0-15,32-47".
+	 */
+	std::vector<unsigned> parseCpuList(const std::string &list) {
+		std::vector<unsigned> cpus;
+		std::stringstream in(list);
+		std::string range;
+		while (std::getline(in, range, ',')) {
+			unsigned first = 0, last = 0;
+			char dash = 0;
+			std::stringstream parts(range);
+			if (!(parts >> first)) {
+				continue;
+			}
+			last = (parts >> dash >> last) && dash == '-' ? last : first;
+			for (unsigned cpu = first; cpu <= last; ++cpu) {
+				cpus.push_back(cpu);
+			}
+		}
+		return cpus;
+	}
+
+	struct Topology {
+		Topology() {
+			for (unsigned node = 0; ; ++node) {
+				std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+				std::string list;
+				if (!in || !std::getline(in, list)) {
+					break;
+				}
+				nodeCpus.push_back(parseCpuList(list));
+				for (unsigned cpu : nodeCpus.back()) {
+					if (cpuNode.size() <= cpu) {
+						cpuNode.resize(cpu + 1, 0);
+					}
+					cpuNode[cpu] = node;
+				}
+			}
+		}
+
+		std::vector<std::vector<unsigned>> nodeCpus;
+		std::vector<unsigned> cpuNode;
+	};
+
+	const Topology& topology() {
+		static Topology instance;
+		return instance;
+	}
+}
+#endif
+
+unsigned huffmanNumaNodeCount() {
+#ifdef HUFFMAN_HAVE_NUMA
+	return std::max<unsigned>(1, static_cast<unsigned>(topology().nodeCpus.size()));
+#else
+	return 1;
+#endif
+}
+
+unsigned huffmanCurrentNumaNode() {
+#ifdef HUFFMAN_HAVE_NUMA
+	const Topology &nodes = topology();
+	int cpu = sched_getcpu();
+	if (cpu < 0 || static_cast<size_t>(cpu) >= nodes.cpuNode.size()) {
+		return 0;
+	}
+	return nodes.cpuNode[cpu];
+#else
+	return 0;
+#endif
+}
+
+void huffmanRunOnNumaNode(unsigned node, const std::function<void()> &fn) {
+#ifdef HUFFMAN_HAVE_NUMA
+	const Topology &nodes = topology();
+	if (node >= nodes.nodeCpus.size() || nodes.nodeCpus.size() < 2) {
+		fn();
+		return;
+	}
+	std::exception_ptr error;
+	std::thread worker([&]() {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		for (unsigned cpu : nodes.nodeCpus[node]) {
+			if (cpu < CPU_SETSIZE) {
+				CPU_SET(cpu, &cpus);
+			}
+		}
+		pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+		try {
+			fn();
+		} catch (...) {
+			error = std::current_exception();
+		}
+	});
+	worker.join();
+	if (error) {
+		std::rethrow_exception(error);
+	}
+#else
+	(void)node;
+	fn();
+#endif
+}
@@ -0,0 +1,73 @@
+#ifndef HUFFMAN_MEMORY_H
+#define HUFFMAN_MEMORY_H
+
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+/**
+ * Supplies the memory for frozen lookup tables such as HuffmanDecodeTable.
+ * Tables are allocated once and then only read, so implementations can
+ * trade allocation speed for placement: huge pages to cut TLB misses, or
+ * memory on a particular NUMA node. An allocator must outlive every table
+ * allocated from it, and must be safe to call from several threads.
+ */
+class HuffmanTableAllocator {
+public:
+	virtual ~HuffmanTableAllocator() {
+	}
+
+	/**
+	 * @param bytes The number of bytes needed.
+	 * @return Memory aligned to at least 64 bytes.
+	 * @throw std::bad_alloc Thrown if no memory is available.
+	 */
+	virtual void* allocate(size_t bytes) = 0;
+
+	/**
+	 * @param memory Memory returned by allocate().
+	 * @param bytes The size passed to allocate().
+	 */
+	virtual void deallocate(void *memory, size_t bytes) = 0;
+
+	/** @return An allocator using the ordinary heap. */
+	static HuffmanTableAllocator& heap();
+};
+
+/**
+ * Allocates tables on huge pages. Explicit huge pages (MAP_HUGETLB) are used
+ * when the system has some reserved; otherwise the memory is aligned to a
+ * huge page boundary and transparent huge pages are requested with
+ * madvise(). Where neither is supported this falls back to the heap.
+ */
+class HuffmanHugePageAllocator : public HuffmanTableAllocator {
+public:
+	/** The huge page size assumed for alignment and rounding. */
+	static constexpr size_t HugePageSize = 2 * 1024 * 1024;
+
+	virtual void* allocate(size_t bytes) override;
+	virtual void deallocate(void *memory, size_t bytes) override;
+};
+
+/**
+ * @return The number of NUMA nodes in the system, or 1 if it cannot be
+ *         determined.
+ */
+unsigned huffmanNumaNodeCount();
+
+/**
+ * @return The NUMA node of the CPU the calling thread is running on, or 0
+ *         if it cannot be determined.
+ */
+unsigned huffmanCurrentNumaNode();
+
+/**
+ * Run a function on a thread bound to the CPUs of one NUMA node, so that
+ * memory it touches first is placed on that node by the kernel's default
+ * first-touch policy. If the thread cannot be bound the function still runs.
+ * @param node The NUMA node to run on.
+ * @param fn The function to run.
+ */
+void huffmanRunOnNumaNode(unsigned node, const std::function<void()> &fn);
+
+#endif
@@ -0,0 +1,317 @@
+#include <algorithm>
+#include <istream>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "huffman.h"
+#include "huffman_io.h"
+#include "huffman_multi.h"
+#include "huffman_parallel.h"
+#include "huffman_utf8.h"
+
+
+/* ***************************************************************************
+ * Training
+ */
+
+namespace {
+	/*
+	 * Character counts of one string of the corpus, indexed by position in
+	 * the alphabet of the whole corpus.
+	 */
+	typedef std::vector<std::pair<uint32_t, uint32_t>> Histogram;
+
+	/*
+	 * Code lengths for the alphabet computed from the counts of a cluster.
+	 * Every character gets one extra count, so every table can encode every
+	 * string of the corpus. The end marker is the last entry.
+	 */
+	std::vector<unsigned> clusterLengths(const std::vector<uint64_t> &counts) {
+		std::vector<uint64_t> weights(counts);
+		for (uint64_t &weight : weights) {
+			++weight;
+		}
+		return huffmanCodeLengths(weights);
+	}
+
+	uint64_t stringCost(const Histogram &histogram, const std::vector<unsigned> &lengths, bool lengthPrefixed) {
+		uint64_t bits = lengthPrefixed ? 0 : lengths.back();
+		for (const auto &i : histogram) {
+			bits += static_cast<uint64_t>(i.second) * lengths[i.first];
+		}
+		return bits;
+	}
+}
+
+void HuffmanMultiTable::train(const std::vector<std::string_view> &corpus, unsigned tableCount,
+                              unsigned iterations, unsigned threads) {
+	if (corpus.empty()) {
+		throw HuffmanException("No Frequency Data to Build Tree From");
+	}
+	if (tableCount == 0 || tableCount > MaxTables) {
+		throw HuffmanException("Table Count Out of Range");
+	}
+	size_t k = std::min<size_t>(tableCount, corpus.size());
+
+	// count the characters of each string, then number the whole alphabet
+	std::vector<std::map<int, uint32_t>> counted(corpus.size());
+	huffmanParallelFor(corpus.size(), threads, [&](size_t i) {
+		auto iter = corpus[i].begin();
+		while (iter != corpus[i].end()) {
+			++counted[i][utf8::next(iter, corpus[i].end())];
+		}
+	});
+	std::map<int, uint32_t> alphabet;
+	for (const auto &string : counted) {
+		for (const auto &i : string) {
+			alphabet.emplace(i.first, 0);
+		}
+	}
+	uint32_t symbols = 0;
+	for (auto &i : alphabet) {
+		i.second = symbols++;
+	}
+	std::vector<Histogram> histograms(corpus.size());
+	huffmanParallelFor(corpus.size(), threads, [&](size_t i) {
+		for (const auto &c : counted[i]) {
+			histograms[i].push_back(std::make_pair(alphabet.find(c.first)->second, c.second));
+		}
+	});
+	counted.clear();
+
+	auto countsOf = [&](const std::vector<size_t> &members) {
+		std::vector<uint64_t> counts(symbols + 1, 0);
+		for (size_t member : members) {
+			for (const auto &i : histograms[member]) {
+				counts[i.first] += i.second;
+			}
+		}
+		counts[symbols] = members.size();
+		return counts;
+	};
+
+	// seed with the longest string, then repeatedly with the string that the
+	// existing seeds encode worst for its length
+	std::vector<std::vector<unsigned>> lengths;
+	std::vector<size_t> seeds;
+	std::vector<double> worst(corpus.size(), 0.0);
+	seeds.push_back(std::max_element(corpus.begin(), corpus.end(), [](std::string_view a, std::string_view b) {
+		return a.size() < b.size();
+	}) - corpus.begin());
+	while (true) {
+		lengths.push_back(clusterLengths(countsOf(std::vector<size_t>(1, seeds.back()))));
+		if (seeds.size() == k) {
+			break;
+		}
+		huffmanParallelFor(corpus.size(), threads, [&](size_t i) {
+			double cost = static_cast<double>(stringCost(histograms[i], lengths.back(), lengthPrefixed)) / (corpus[i].size() + 1);
+			worst[i] = lengths.size() == 1 ? cost : std::min(worst[i], cost);
+		});
+		for (size_t seed : seeds) {
+			worst[seed] = -1.0;
+		}
+		seeds.push_back(std::max_element(worst.begin(), worst.end()) - worst.begin());
+	}
+
+	// k-means: move each string to its cheapest table, then rebuild the tables
+	std::vector<uint32_t> assignment(corpus.size(), 0);
+	for (unsigned iteration = 0; iteration < iterations; ++iteration) {
+		std::vector<char> changed(corpus.size(), 0);
+		huffmanParallelFor(corpus.size(), threads, [&](size_t i) {
+			uint32_t best = 0;
+			uint64_t bestCost = UINT64_MAX;
+			for (uint32_t table = 0; table < k; ++table) {
+				uint64_t cost = stringCost(histograms[i], lengths[table], lengthPrefixed);
+				if (cost < bestCost) {
+					best = table;
+					bestCost = cost;
+				}
+			}
+			changed[i] = iteration == 0 || assignment[i] != best;
+			assignment[i] = best;
+		});
+		if (std::find(changed.begin(), changed.end(), 1) == changed.end()) {
+			break;
+		}
+
+		std::vector<std::vector<size_t>> members(k);
+		for (size_t i = 0; i < corpus.size(); ++i) {
+			members[assignment[i]].push_back(i);
+		}
+		huffmanParallelFor(k, threads, [&](size_t table) {
+			// an empty cluster keeps its previous table
+			if (!members[table].empty()) {
+				lengths[table] = clusterLengths(countsOf(members[table]));
+			}
+		});
+	}
+
+	// build the real tables from the final clusters
+	std::vector<std::vector<size_t>> members(k);
+	for (size_t i = 0; i < corpus.size(); ++i) {
+		members[assignment[i]].push_back(i);
+	}
+	std::vector<HuffmanTable> newTables(k);
+	huffmanParallelFor(k, threads, [&](size_t table) {
+		std::vector<uint64_t> counts = countsOf(members[table]);
+		HuffmanTable &t = newTables[table];
+		t.setLengthPrefixed(lengthPrefixed);
+		for (const auto &i : alphabet) {
+			t.addFrequency(i.first, counts[i.second] + 1);
+		}
+		t.addFrequency(0, counts[symbols] + 1);
+		t.buildTree();
+	});
+	tables.swap(newTables);
+	prepare();
+}
+
+void HuffmanMultiTable::prepare() {
+	decoders.clear();
+	endLengths.clear();
+	size_t k = tables.size();
+	std::vector<int> symbols;
+	for (const HuffmanTable &table : tables) {
+		decoders.emplace_back(new HuffmanDecodeTable(table));
+		const std::vector<int> &tableSymbols = table.getSymbols();
+		bool hasEnd = !tableSymbols.empty() && tableSymbols[0] == 0;
+		endLengths.push_back(hasEnd ? table.getCodes()[0].length : 0);
+		symbols.insert(symbols.end(), tableSymbols.begin() + (hasEnd ? 1 : 0), tableSymbols.end());
+	}
+	std::sort(symbols.begin(), symbols.end());
+	symbols.erase(std::unique(symbols.begin(), symbols.end()), symbols.end());
+	symbolRows.build(symbols);
+
+	// 0xFF marks a character that a table cannot encode
+	codeLengths.assign(symbols.size() * k, 0xFF);
+	for (size_t t = 0; t < k; ++t) {
+		const std::vector<int> &tableSymbols = tables[t].getSymbols();
+		const std::vector<HuffmanCode> &codes = tables[t].getCodes();
+		for (size_t i = 0; i < tableSymbols.size(); ++i) {
+			uint32_t row = symbolRows.rank(tableSymbols[i]);
+			if (row != HuffmanSymbolIndex::NoSymbol) {
+				codeLengths[row * k + t] = static_cast<uint8_t>(codes[i].length);
+			}
+		}
+	}
+}
+
+
+/* ***************************************************************************
+ * Encoding and decoding
+ */
+
+unsigned HuffmanMultiTable::selectTable(std::string_view text) const {
+	if (tables.empty()) {
+		throw HuffmanException("Tried to encode with non-existant tree");
+	}
+	size_t k = tables.size();
+	std::vector<uint64_t> costs(k, 0);
+	std::vector<bool> usable(k, true);
+	for (size_t t = 0; t < k; ++t) {
+		costs[t] = lengthPrefixed ? 0 : endLengths[t];
+	}
+
+	auto iter = text.begin();
+	while (iter != text.end()) {
+		int c = utf8::next(iter, text.end());
+		uint32_t row = symbolRows.rank(c);
+		if (row == HuffmanSymbolIndex::NoSymbol) {
+			// no table has this character, so let one report it by name
+			tables[0].symbolsBitLength(text);
+			throw HuffmanException("Character Not in Huffman Table");
+		}
+		const uint8_t *lengths = &codeLengths[row * k];
+		for (size_t t = 0; t < k; ++t) {
+			usable[t] = usable[t] && lengths[t] != 0xFF;
+			costs[t] += lengths[t];
+		}
+	}
+
+	unsigned best = MaxTables;
+	for (size_t t = 0; t < k; ++t) {
+		if (usable[t] && (best == MaxTables || costs[t] < costs[best])) {
+			best = static_cast<unsigned>(t);
+		}
+	}
+	if (best == MaxTables) {
+		throw HuffmanException("No Table Can Encode Text");
+	}
+	return best;
+}
+
+size_t HuffmanMultiTable::encodedBitLength(std::string_view text) const {
+	return 8 + tables[selectTable(text)].encodedBitLength(text);
+}
+
+size_t HuffmanMultiTable::encode(std::string_view text, unsigned char *out, size_t outSize) const {
+	unsigned table = selectTable(text);
+	if (outSize < 1) {
+		throw HuffmanException("Output Buffer Too Small");
+	}
+	out[0] = static_cast<unsigned char>(table);
+	return 8 + tables[table].encode(text, out + 1, outSize - 1);
+}
+
+size_t HuffmanMultiTable::decode(const unsigned char *data, size_t bitLength, char *out, size_t outSize) const {
+	if (bitLength < 8) {
+		throw HuffmanException("Unexpected End of Data");
+	}
+	if (data[0] >= decoders.size()) {
+		throw HuffmanException("Unknown Table in Header");
+	}
+	return decoders[data[0]]->decode(data + 1, bitLength - 8, out, outSize);
+}
+
+std::string HuffmanMultiTable::decode(const unsigned char *data, size_t bitLength) const {
+	if (bitLength < 8) {
+		throw HuffmanException("Unexpected End of Data");
+	}
+	if (data[0] >= decoders.size()) {
+		throw HuffmanException("Unknown Table in Header");
+	}
+	return decoders[data[0]]->decode(data + 1, bitLength - 8);
+}
+
+
+/* ***************************************************************************
+ * Saving and loading
+ */
+
+void HuffmanMultiTable::save(std::ostream &out) const {
+	if (tables.empty()) {
+		throw HuffmanException("Tried to save non-existant tree");
+	}
+	out.write("HUFM", 4);
+	huffmanWriteU32(out, 1);
+	huffmanWriteU32(out, static_cast<uint32_t>(tables.size()));
+	for (const HuffmanTable &table : tables) {
+		table.save(out);
+	}
+}
+
+void HuffmanMultiTable::load(std::istream &in) {
+	char magic[4];
+	if (!in.read(magic, 4) || std::string(magic, 4) != "HUFM") {
+		throw HuffmanException("Not a Huffman Table Set");
+	}
+	if (huffmanReadU32(in) != 1) {
+		throw HuffmanException("Unsupported Huffman Table Set Version");
+	}
+	uint32_t count = huffmanReadU32(in);
+	if (count == 0 || count > MaxTables) {
+		throw HuffmanException("Table Count Out of Range");
+	}
+	std::vector<HuffmanTable> newTables(count);
+	for (HuffmanTable &table : newTables) {
+		table.load(in);
+		if (table.isLengthPrefixed() != newTables[0].isLengthPrefixed()) {
+			throw HuffmanException("Mixed Length-Prefixed and Terminated Tables");
+		}
+	}
+	tables.swap(newTables);
+	lengthPrefixed = tables[0].isLengthPrefixed();
+	prepare();
+}
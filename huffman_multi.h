@@ -0,0 +1,141 @@
+#ifndef HUFFMAN_MULTI_H
+#define HUFFMAN_MULTI_H
+
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "huffman.h"
+#include "huffman_decoder.h"
+
+/**
+ * A set of Huffman tables trained on different clusters of a corpus, for
+ * content that mixes languages or styles that a single table fits poorly.
+ * Each string is encoded with whichever table gives the shortest code,
+ * after a one byte header holding the number of that table, and decoded
+ * with a table-driven decoder for that table.
+ *
+ * Tables are trained by k-means over the strings of the corpus: each string
+ * is assigned to the table that encodes it in the fewest bits, each table is
+ * rebuilt from the strings assigned to it, and this is repeated until the
+ * assignment settles. Every table keeps a weight of at least one for every
+ * character of the corpus, so any table can encode any string that a single
+ * table trained on the whole corpus could.
+ */
+class HuffmanMultiTable {
+public:
+	/** The largest number of tables that fits in the header. */
+	static constexpr unsigned MaxTables = 256;
+
+	/**
+	 * Train a new set of tables, replacing any current ones.
+	 * @param corpus The strings to train on.
+	 * @param tableCount The number of tables to train, from 1 to MaxTables.
+	 *                   Fewer are trained if the corpus has fewer strings.
+	 * @param iterations The maximum number of k-means iterations.
+	 * @param threads The number of threads to train with; zero uses one per
+	 *                hardware thread.
+	 * @throw HuffmanException Thrown if the corpus is empty or tableCount is
+	 *                         out of range.
+	 */
+	void train(const std::vector<std::string_view> &corpus, unsigned tableCount,
+	           unsigned iterations = 16, unsigned threads = 0);
+
+	/**
+	 * Selects whether the tables use length-prefixed strings. See
+	 * HuffmanTable::setLengthPrefixed(). This must be set before train().
+	 * @param lengthPrefixed True to use length-prefixed strings.
+	 */
+	void setLengthPrefixed(bool lengthPrefixed) {
+		this->lengthPrefixed = lengthPrefixed;
+	}
+
+	/**
+	 * Pick the table that encodes a string in the fewest bits, using only
+	 * the precomputed code lengths of every table.
+	 * @param text The text to encode.
+	 * @return The number of the table.
+	 * @throw HuffmanException Thrown if no table can encode the text.
+	 */
+	unsigned selectTable(std::string_view text) const;
+
+	/**
+	 * Calculate the number of bits encode() will produce for a string,
+	 * including the header.
+	 * @param text The text to measure.
+	 * @return The encoded length in bits.
+	 * @throw HuffmanException Thrown if no table can encode the text.
+	 */
+	size_t encodedBitLength(std::string_view text) const;
+
+	/**
+	 * Encode a string with the cheapest table into a caller supplied buffer,
+	 * packed most significant bit first. The first byte holds the number of
+	 * the table.
+	 * @param text The text to encode.
+	 * @param out The buffer to write the encoded bits into.
+	 * @param outSize The size of the buffer in bytes.
+	 * @return The number of bits written.
+	 * @throw HuffmanException Thrown if no table can encode the text or the
+	 *                         buffer is too small.
+	 */
+	size_t encode(std::string_view text, unsigned char *out, size_t outSize) const;
+
+	/**
+	 * Decode a string produced by encode() into a caller supplied buffer.
+	 * @param data The encoded string, packed most significant bit first.
+	 * @param bitLength The number of valid bits in data.
+	 * @param out The buffer to write the decoded text into.
+	 * @param outSize The size of the output buffer in bytes.
+	 * @return The number of bytes written.
+	 * @throw HuffmanException Thrown if the data is truncated or corrupt, or
+	 *                         the buffer is too small.
+	 */
+	size_t decode(const unsigned char *data, size_t bitLength, char *out, size_t outSize) const;
+
+	/**
+	 * Decode a string produced by encode() into a new string.
+	 * @param data The encoded string, packed most significant bit first.
+	 * @param bitLength The number of valid bits in data.
+	 * @return The decoded text.
+	 * @throw HuffmanException Thrown if the data is truncated or corrupt.
+	 */
+	std::string decode(const unsigned char *data, size_t bitLength) const;
+
+	/**
+	 * Write every table to a binary stream.
+	 * @param out The stream to write to.
+	 * @throw HuffmanException Thrown if no tables have been trained.
+	 */
+	void save(std::ostream &out) const;
+
+	/**
+	 * Replace the tables with ones previously written by save().
+	 * @param in The stream to read from.
+	 * @throw HuffmanException Thrown if the data is not a valid table set.
+	 */
+	void load(std::istream &in);
+
+	size_t getTableCount() const {
+		return tables.size();
+	}
+	const HuffmanTable& getTable(unsigned id) const {
+		return tables.at(id);
+	}
+
+private:
+	void prepare();
+
+	std::vector<HuffmanTable> tables;
+	std::vector<std::unique_ptr<HuffmanDecodeTable>> decoders;
+	// code lengths of every table for each character, one row per character
+	HuffmanSymbolIndex symbolRows;
+	std::vector<uint8_t> codeLengths;
+	std::vector<uint32_t> endLengths;
+	bool lengthPrefixed = false;
+};
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef HUFFMAN_PARALLEL_H
+#define HUFFMAN_PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Run fn(i) for every i in [0, count) on a pool of threads. Work items are
+ * handed out one at a time from a shared counter, so uneven items still
+ * balance across threads. If any call throws, the remaining items are
+ * abandoned and the first exception is rethrown on the calling thread.
+ * @param count The number of work items.
+ * @param threads The number of threads to use; zero uses one per hardware
+ *                thread. No more threads than work items are started.
+ * @param fn The function to call for each work item.
+ */
+template<class Fn>
+void huffmanParallelFor(size_t count, unsigned threads, Fn fn) {
+	if (threads == 0) {
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	}
+	threads = static_cast<unsigned>(std::min<size_t>(threads, count));
+	if (threads <= 1) {
+		for (size_t i = 0; i < count; ++i) {
+			fn(i);
+		}
+		return;
+	}
+
+	std::atomic<size_t> next(0);
+	std::exception_ptr error;
+	std::mutex errorLock;
+	auto worker = [&]() {
+		try {
+			for (size_t i = next++; i < count; i = next++) {
+				fn(i);
+			}
+		} catch (...) {
+			std::lock_guard<std::mutex> lock(errorLock);
+			if (!error) {
+				error = std::current_exception();
+			}
+			next = count;
+		}
+	};
+
+	std::vector<std::thread> pool;
+	for (unsigned i = 1; i < threads; ++i) {
+		pool.emplace_back(worker);
+	}
+	worker();
+	for (std::thread &thread : pool) {
+		thread.join();
+	}
+	if (error) {
+		std::rethrow_exception(error);
+	}
+}
+
+#endif
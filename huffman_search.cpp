@@ -0,0 +1,254 @@
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "huffman.h"
+#include "huffman_bits.h"
+#include "huffman_search.h"
+#include "huffman_utf8.h"
+
+
+/* ***************************************************************************
+ * Compiling the pattern
+ */
+
+HuffmanSearch::HuffmanSearch(const HuffmanTable &table, std::string_view pattern, unsigned lookupBits)
+: pattern(pattern), acceptState(0), patternBytes(pattern.size()), lookupBits(std::max(1u, std::min(lookupBits, 16u))), rootBits(0),
+  lengthPrefixed(table.isLengthPrefixed()), unencodable(false)
+{
+	const std::vector<HuffmanCode> &codes = table.getCodes();
+	if (codes.empty()) {
+		throw HuffmanException("Tried to search with non-existant tree");
+	}
+	if (!utf8::is_valid(pattern.begin(), pattern.end())) {
+		throw HuffmanException("Invalid UTF-8 in Search Pattern");
+	}
+
+	std::vector<int> characters;
+	for (auto iter = pattern.begin(); iter != pattern.end(); ) {
+		int c = static_cast<int>(utf8::next(iter, pattern.end()));
+		characters.push_back(c);
+		if (std::find(classes.begin(), classes.end(), c) == classes.end()) {
+			classes.push_back(c);
+		}
+		// matches HuffmanTable::writeCode(): a NUL is never the end marker
+		bool inTable = c != 0 && table.getSymbolIndex().rank(c) != HuffmanSymbolIndex::NoSymbol;
+		if (!inTable && !table.hasEscape()) {
+			unencodable = true;
+		}
+	}
+	buildAutomaton(characters);
+
+	std::vector<Symbol> symbols;
+	for (size_t i = 0; i < codes.size(); ++i) {
+		symbols.push_back(Symbol{table.getSymbols()[i], codes[i].bits, codes[i].length});
+	}
+	if (table.hasEscape()) {
+		const HuffmanCode &code = table.getEscapeCode();
+		symbols.push_back(Symbol{HuffmanTable::EscapeSymbol, code.bits, code.length});
+	}
+	buildLevel(symbols, 0, rootBits);
+}
+
+/*
+ * Build the string matching automaton: a Knuth-Morris-Pratt automaton with
+ * every failure link followed in advance, so each character is one lookup.
+ * State i means the last i characters read match the start of the pattern.
+ */
+void HuffmanSearch::buildAutomaton(const std::vector<int> &characters) {
+	size_t width = classes.size() + 1;
+	acceptState = static_cast<uint32_t>(characters.size());
+	automaton.assign((characters.size() + 1) * width, 0);
+	if (characters.empty()) {
+		return;
+	}
+
+	automaton[classOf(characters[0])] = 1;
+	uint32_t restart = 0;
+	for (size_t state = 1; state <= characters.size(); ++state) {
+		std::copy_n(automaton.begin() + restart * width, width, automaton.begin() + state * width);
+		if (state < characters.size()) {
+			uint32_t c = classOf(characters[state]);
+			automaton[state * width + c] = static_cast<uint32_t>(state + 1);
+			restart = automaton[restart * width + c];
+		}
+	}
+}
+
+uint32_t HuffmanSearch::classOf(int character) const {
+	auto iter = std::find(classes.begin(), classes.end(), character);
+	return iter == classes.end() ? 0 : static_cast<uint32_t>(iter - classes.begin() + 1);
+}
+
+size_t HuffmanSearch::buildLevel(const std::vector<Symbol> &symbols, unsigned consumed, unsigned &bits) {
+	unsigned longest = 0;
+	for (const Symbol &symbol : symbols) {
+		longest = std::max(longest, symbol.length - consumed);
+	}
+	bits = std::min(lookupBits, longest);
+
+	size_t base = entries.size();
+	entries.resize(base + (size_t(1) << bits), Entry{0, 0, Invalid, 0, 0});
+
+	std::map<size_t, std::vector<Symbol>> groups;
+	for (const Symbol &symbol : symbols) {
+		unsigned remaining = symbol.length - consumed;
+		uint64_t rest = remaining < 64 ? symbol.code & ((uint64_t(1) << remaining) - 1) : symbol.code;
+		if (remaining > bits) {
+			groups[static_cast<size_t>(rest >> (remaining - bits))].push_back(symbol);
+			continue;
+		}
+
+		Entry entry{0, static_cast<uint8_t>(remaining), End, 0, 0};
+		if (symbol.character == HuffmanTable::EscapeSymbol) {
+			entry.kind = Escape;
+		} else if (symbol.character != 0) {
+			char bytes[4];
+			entry.kind = Character;
+			entry.value = classOf(symbol.character);
+			entry.utf8Length = static_cast<uint8_t>(utf8::append(symbol.character, bytes) - bytes);
+		}
+		size_t first = static_cast<size_t>(rest) << (bits - remaining);
+		std::fill_n(entries.begin() + base + first, size_t(1) << (bits - remaining), entry);
+	}
+
+	for (const auto &group : groups) {
+		unsigned subBits = 0;
+		size_t sub = buildLevel(group.second, consumed + bits, subBits);
+		entries[base + group.first] = Entry{static_cast<uint32_t>(sub), static_cast<uint8_t>(bits), Subtable,
+		                                    static_cast<uint8_t>(subBits), 0};
+	}
+	return base;
+}
+
+
+/* ***************************************************************************
+ * Scanning
+ */
+
+/*
+ * Run the automaton over an encoded string, returning the number of matches
+ * and setting first to the byte offset of the first. Unless all is set, the
+ * scan stops there.
+ */
+size_t HuffmanSearch::scan(const unsigned char *data, size_t bitLength, bool all, size_t &first) const {
+	HuffmanBitWindow bits(data, bitLength);
+	const Entry *table = entries.data();
+	const uint32_t *transitions = automaton.data();
+	const size_t width = classes.size() + 1;
+	size_t pos = 0;
+	size_t remaining = lengthPrefixed ? readHeader(data, bitLength, pos) : 0;
+	size_t written = 0;
+	size_t matches = 0;
+	uint32_t state = 0;
+
+	first = NotFound;
+	if (state == acceptState) {
+		first = 0;
+		if (!all) {
+			return 1;
+		}
+		++matches;
+	}
+
+	uint64_t window = bits.load(pos);
+	unsigned available = 64 - (pos & 7);
+	while (!lengthPrefixed || written < remaining) {
+		if (available < 16) {
+			window = bits.load(pos);
+			available = 64 - (pos & 7);
+		}
+		const Entry *entry = table + (rootBits ? window >> (64 - rootBits) : 0);
+		while (entry->kind == Subtable) {
+			pos += entry->length;
+			if (pos > bitLength) {
+				throw HuffmanException("Unexpected End of Data");
+			}
+			window = bits.load(pos);
+			available = 64 - (pos & 7);
+			entry = table + entry->value + (window >> (64 - entry->extra));
+		}
+		pos += entry->length;
+		window <<= entry->length;
+		available -= entry->length;
+		if (pos > bitLength) {
+			throw HuffmanException("Unexpected End of Data");
+		}
+
+		uint32_t input = entry->value;
+		size_t length = entry->utf8Length;
+		if (entry->kind != Character) {
+			if (entry->kind == End && !lengthPrefixed) {
+				break;
+			} else if (entry->kind != Escape) {
+				throw HuffmanException("Bad Decode Path");
+			}
+			if (bitLength - pos < HuffmanTable::EscapeBits) {
+				throw HuffmanException("Unexpected End of Data");
+			}
+			if (available < HuffmanTable::EscapeBits) {
+				window = bits.load(pos);
+				available = 64 - (pos & 7);
+			}
+			uint32_t c = static_cast<uint32_t>(window >> (64 - HuffmanTable::EscapeBits));
+			if (c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF)) {
+				throw HuffmanException("Bad Escaped Character");
+			}
+			char bytes[4];
+			input = classOf(static_cast<int>(c));
+			length = utf8::append(c, bytes) - bytes;
+			pos += HuffmanTable::EscapeBits;
+			window <<= HuffmanTable::EscapeBits;
+			available -= HuffmanTable::EscapeBits;
+		}
+		if (lengthPrefixed && length > remaining - written) {
+			throw HuffmanException("Decoded Length Mismatch");
+		}
+		written += length;
+
+		state = transitions[state * width + input];
+		if (state == acceptState) {
+			if (matches++ == 0) {
+				first = written - patternBytes;
+				if (!all) {
+					return matches;
+				}
+			}
+		}
+	}
+	return matches;
+}
+
+size_t HuffmanSearch::readHeader(const unsigned char *data, size_t bitLength, size_t &pos) const {
+	HuffmanBitWindow bits(data, bitLength);
+	size_t value = 0;
+	for (unsigned shift = 0; ; shift += 7) {
+		if (pos + 8 > bitLength) {
+			throw HuffmanException("Unexpected End of Data");
+		}
+		if (shift > 8 * sizeof(size_t) - 7) {
+			throw HuffmanException("Malformed Length Header");
+		}
+		unsigned group = static_cast<unsigned>(bits.load(pos) >> 56);
+		pos += 8;
+		value |= static_cast<size_t>(group & 0x7F) << shift;
+		if (!(group & 0x80)) {
+			return value;
+		}
+	}
+}
+
+size_t HuffmanSearch::find(const unsigned char *data, size_t bitLength) const {
+	if (unencodable) {
+		return NotFound;
+	}
+	size_t first = NotFound;
+	scan(data, bitLength, false, first);
+	return first;
+}
+
+size_t HuffmanSearch::count(const unsigned char *data, size_t bitLength) const {
+	size_t first = NotFound;
+	return scan(data, bitLength, true, first);
+}
@@ -0,0 +1,131 @@
+#ifndef HUFFMAN_SEARCH_H
+#define HUFFMAN_SEARCH_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "huffman_decoder.h"
+
+class HuffmanTable;
+
+/**
+ * Searches encoded strings for a fixed pattern without decoding them. The
+ * pattern is compiled once into a string matching automaton over the
+ * characters it contains, and the table's codes into a lookup table that
+ * maps each code word straight to the automaton input for its character:
+ * the character itself if it occurs in the pattern, or a single "other"
+ * class if it does not. Scanning a string is then one or two table lookups
+ * and one automaton step per character, with no text written anywhere and
+ * no memory allocated, so a whole bank of strings can be filtered at about
+ * the speed of reading it.
+ *
+ * Matches are found on character boundaries, which for valid UTF-8 is the
+ * same as a byte substring search. Offsets are reported in bytes of the
+ * decoded text.
+ *
+ * Truncated or corrupt data is rejected with the same errors as decoding,
+ * but only the bits read are checked: find() and contains() stop at the
+ * first match.
+ */
+class HuffmanSearch {
+public:
+	/** Returned by find() when the pattern does not occur. */
+	static constexpr size_t NotFound = SIZE_MAX;
+
+	/**
+	 * Compile a pattern for strings encoded with a table.
+	 * @param table The built table the strings were encoded with.
+	 * @param pattern The UTF-8 text to search for.
+	 * @param lookupBits The maximum number of bits looked up per table level.
+	 * @throw HuffmanException Thrown if the table has not been built or the
+	 *                         pattern is not valid UTF-8.
+	 */
+	HuffmanSearch(const HuffmanTable &table, std::string_view pattern,
+	              unsigned lookupBits = HuffmanDecodeTable::DefaultLookupBits);
+
+	/**
+	 * Find the first occurrence of the pattern in an encoded string.
+	 * @param data The encoded string, packed most significant bit first.
+	 * @param bitLength The number of valid bits in data.
+	 * @return The byte offset of the match in the decoded text, or NotFound.
+	 * @throw HuffmanException Thrown if the data is truncated or corrupt.
+	 */
+	size_t find(const unsigned char *data, size_t bitLength) const;
+
+	/**
+	 * @param data The encoded string, packed most significant bit first.
+	 * @param bitLength The number of valid bits in data.
+	 * @return Whether the decoded text contains the pattern.
+	 * @throw HuffmanException Thrown if the data is truncated or corrupt.
+	 */
+	bool contains(const unsigned char *data, size_t bitLength) const {
+		return find(data, bitLength) != NotFound;
+	}
+
+	/**
+	 * Count the occurrences of the pattern in an encoded string, including
+	 * overlapping ones. The whole string is read and checked. An empty
+	 * pattern matches at every character boundary.
+	 * @param data The encoded string, packed most significant bit first.
+	 * @param bitLength The number of valid bits in data.
+	 * @return The number of matches.
+	 * @throw HuffmanException Thrown if the data is truncated or corrupt.
+	 */
+	size_t count(const unsigned char *data, size_t bitLength) const;
+
+	const std::string& getPattern() const {
+		return pattern;
+	}
+
+private:
+	enum EntryKind : uint8_t {
+		Character,
+		End,
+		Subtable,
+		Escape,
+		Invalid,
+	};
+
+	/**
+	 * One lookup table slot, laid out like the decoder's. For characters,
+	 * value holds the automaton input class; for subtables it holds the
+	 * index of the subtable and extra the number of bits it looks up.
+	 */
+	struct Entry {
+		uint32_t value;
+		uint8_t length;
+		uint8_t kind;
+		uint8_t extra;
+		uint8_t utf8Length;
+	};
+
+	struct Symbol {
+		int character;
+		uint64_t code;
+		unsigned length;
+	};
+
+	size_t buildLevel(const std::vector<Symbol> &symbols, unsigned consumed, unsigned &bits);
+	void buildAutomaton(const std::vector<int> &characters);
+	uint32_t classOf(int character) const;
+	size_t scan(const unsigned char *data, size_t bitLength, bool all, size_t &first) const;
+	size_t readHeader(const unsigned char *data, size_t bitLength, size_t &pos) const;
+
+	std::string pattern;
+	// the distinct characters of the pattern; class i + 1 is classes[i]
+	std::vector<int> classes;
+	// transitions, indexed by state * (classes.size() + 1) + class
+	std::vector<uint32_t> automaton;
+	std::vector<Entry> entries;
+	uint32_t acceptState;
+	size_t patternBytes;
+	unsigned lookupBits;
+	unsigned rootBits;
+	bool lengthPrefixed;
+	// a pattern character that no string can contain
+	bool unencodable;
+};
+
+#endif
@@ -0,0 +1,405 @@
+#ifndef HUFFMAN_STATIC_H
+#define HUFFMAN_STATIC_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#include "huffman.h"
+
+/**
+ * A single entry in the frequency list used to build a StaticHuffmanTable.
+ * The end-of-string marker is represented by a character value of 0.
+ */
+struct HuffmanStaticSymbol {
+	int character;
+	int weight;
+};
+
+namespace huffman_static_detail {
+
+	/**
+	 * Longest code a static table may contain. Tables whose frequencies would
+	 * produce longer codes are rejected while building.
+	 */
+	constexpr int MaxCodeLength = 32;
+
+	constexpr int nextCodePoint(std::string_view text, size_t &pos) {
+		unsigned char lead = static_cast<unsigned char>(text[pos++]);
+		int length = 0;
+		int codePoint = 0;
+		if (lead < 0x80) {
+			return lead;
+		} else if ((lead >> 5) == 0x6) {
+			length = 1;
+			codePoint = lead & 0x1F;
+		} else if ((lead >> 4) == 0xE) {
+			length = 2;
+			codePoint = lead & 0x0F;
+		} else if ((lead >> 3) == 0x1E) {
+			length = 3;
+			codePoint = lead & 0x07;
+		} else {
+			throw HuffmanException("Invalid UTF-8 Lead Byte");
+		}
+		for (int i = 0; i < length; ++i) {
+			if (pos >= text.size()) {
+				throw HuffmanException("Truncated UTF-8 Sequence");
+			}
+			codePoint = (codePoint << 6) | (static_cast<unsigned char>(text[pos++]) & 0x3F);
+		}
+		return codePoint;
+	}
+
+	constexpr size_t appendCodePoint(int codePoint, char *out) {
+		if (codePoint < 0x80) {
+			out[0] = static_cast<char>(codePoint);
+			return 1;
+		} else if (codePoint < 0x800) {
+			out[0] = static_cast<char>(0xC0 | (codePoint >> 6));
+			out[1] = static_cast<char>(0x80 | (codePoint & 0x3F));
+			return 2;
+		} else if (codePoint < 0x10000) {
+			out[0] = static_cast<char>(0xE0 | (codePoint >> 12));
+			out[1] = static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F));
+			out[2] = static_cast<char>(0x80 | (codePoint & 0x3F));
+			return 3;
+		}
+		out[0] = static_cast<char>(0xF0 | (codePoint >> 18));
+		out[1] = static_cast<char>(0x80 | ((codePoint >> 12) & 0x3F));
+		out[2] = static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F));
+		out[3] = static_cast<char>(0x80 | (codePoint & 0x3F));
+		return 4;
+	}
+
+	constexpr size_t utf8Length(int codePoint) {
+		return codePoint < 0x80 ? 1 : codePoint < 0x800 ? 2 : codePoint < 0x10000 ? 3 : 4;
+	}
+}
+
+/**
+ * Count the number of distinct symbols (including the end-of-string marker)
+ * that occur in a corpus. Use this to size the result of
+ * huffmanStaticFrequencies(). This is quadratic in the length of the corpus
+ * and so is only intended for short, compile-time corpora.
+ * @param corpus The UTF-8 text to count the symbols in.
+ * @return The number of distinct symbols in the corpus.
+ */
+constexpr size_t huffmanStaticSymbolCount(std::string_view corpus) {
+	size_t count = 1;
+	size_t pos = 0;
+	while (pos < corpus.size()) {
+		size_t start = pos;
+		int c = huffman_static_detail::nextCodePoint(corpus, pos);
+		bool seen = (c == 0);
+		size_t other = 0;
+		while (!seen && other < start) {
+			seen = (huffman_static_detail::nextCodePoint(corpus, other) == c);
+		}
+		if (!seen) {
+			++count;
+		}
+	}
+	return count;
+}
+
+/**
+ * Build a frequency list from a corpus at compile time. The corpus is
+ * treated as a single string, so the end-of-string marker is given a weight
+ * of one.
+ * @tparam N The number of distinct symbols in the corpus, as returned by
+ *           huffmanStaticSymbolCount().
+ * @param corpus The UTF-8 text to gather frequencies from.
+ * @return The frequency list, suitable for building a StaticHuffmanTable.
+ */
+template<size_t N>
+constexpr std::array<HuffmanStaticSymbol, N> huffmanStaticFrequencies(std::string_view corpus) {
+	std::array<HuffmanStaticSymbol, N> result{};
+	result[0] = HuffmanStaticSymbol{0, 1};
+	size_t used = 1;
+	size_t pos = 0;
+	while (pos < corpus.size()) {
+		int c = huffman_static_detail::nextCodePoint(corpus, pos);
+		size_t i = 0;
+		while (i < used && result[i].character != c) {
+			++i;
+		}
+		if (i == used) {
+			if (used == N) {
+				throw HuffmanException("Too Many Symbols for Static Table");
+			}
+			result[used++] = HuffmanStaticSymbol{c, 0};
+		}
+		++result[i].weight;
+	}
+	if (used != N) {
+		throw HuffmanException("Too Few Symbols for Static Table");
+	}
+	return result;
+}
+
+/**
+ * A Huffman table with a fixed alphabet that is built entirely at compile
+ * time. The encoding and decoding tables are stored inline, so a table
+ * declared as `static constexpr` lives in read-only data and needs no heap
+ * allocation or runtime build step.
+ *
+ * Codes are assigned canonically, so the codes produced will generally not
+ * match those of a HuffmanTable built from the same frequencies. Encoded data
+ * is packed most significant bit first into bytes.
+ * @tparam N The number of symbols in the table, including the end-of-string
+ *           marker (character 0).
+ */
+template<size_t N>
+class StaticHuffmanTable {
+public:
+	/**
+	 * Build the table from a list of symbol frequencies. The list must contain
+	 * an entry for the end-of-string marker (character 0) and every weight
+	 * must be positive.
+	 * @param frequencies The symbol frequencies to build the table from.
+	 * @throw HuffmanException Thrown if the frequency list is invalid or would
+	 *                         produce a code longer than 32 bits. In a
+	 *                         constant expression this is a compile error.
+	 */
+	constexpr explicit StaticHuffmanTable(const std::array<HuffmanStaticSymbol, N> &frequencies)
+	: characters{}, codes{}, lengths{}, decodeSymbols{}, firstCode{}, firstIndex{}, lengthCount{}, longestCode(0)
+	{
+		static_assert(N > 0, "Static Huffman table must contain at least one symbol");
+
+		// sort symbols by character so encoding can binary search them
+		for (size_t i = 0; i < N; ++i) {
+			if (frequencies[i].weight <= 0) {
+				throw HuffmanException("Non-positive Weight in Static Table");
+			}
+			characters[i] = frequencies[i].character;
+		}
+		for (size_t i = 1; i < N; ++i) {
+			for (size_t j = i; j > 0 && characters[j - 1] > characters[j]; --j) {
+				int tmp = characters[j];
+				characters[j] = characters[j - 1];
+				characters[j - 1] = tmp;
+			}
+		}
+		for (size_t i = 1; i < N; ++i) {
+			if (characters[i] == characters[i - 1]) {
+				throw HuffmanException("Duplicate Character in Static Table");
+			}
+		}
+		if (characters[0] != 0) {
+			throw HuffmanException("No End Marker in Static Table");
+		}
+
+		computeLengths(frequencies);
+		assignCodes();
+	}
+
+	/**
+	 * @return The length of the longest code in the table.
+	 */
+	constexpr int maxCodeLength() const {
+		return longestCode;
+	}
+
+	/**
+	 * Calculate the number of bits encode() will produce for a string.
+	 * @param text The text to measure.
+	 * @return The encoded length in bits, including the end-of-string marker.
+	 * @throw HuffmanException Thrown if the text contains a character that is
+	 *                         not in the table.
+	 */
+	constexpr size_t encodedBitLength(std::string_view text) const {
+		size_t bits = lengths[0];
+		size_t pos = 0;
+		while (pos < text.size()) {
+			bits += lengths[find(huffman_static_detail::nextCodePoint(text, pos))];
+		}
+		return bits;
+	}
+
+	/**
+	 * Encode a string into a caller supplied buffer.
+	 * @param text The text to encode.
+	 * @param out The buffer to write the encoded bits into.
+	 * @param outSize The size of the buffer in bytes.
+	 * @return The number of bits written.
+	 * @throw HuffmanException Thrown if the text contains a character that is
+	 *                         not in the table or the buffer is too small.
+	 */
+	constexpr size_t encode(std::string_view text, unsigned char *out, size_t outSize) const {
+		size_t bitPos = 0;
+		size_t pos = 0;
+		while (true) {
+			size_t index = 0;
+			if (pos < text.size()) {
+				index = find(huffman_static_detail::nextCodePoint(text, pos));
+			}
+			for (int bit = lengths[index] - 1; bit >= 0; --bit) {
+				size_t byte = bitPos / 8;
+				if (byte >= outSize) {
+					throw HuffmanException("Output Buffer Too Small");
+				}
+				if (bitPos % 8 == 0) {
+					out[byte] = 0;
+				}
+				if ((codes[index] >> bit) & 1) {
+					out[byte] |= static_cast<unsigned char>(0x80 >> (bitPos % 8));
+				}
+				++bitPos;
+			}
+			if (index == 0) {
+				return bitPos;
+			}
+		}
+	}
+
+	/**
+	 * Decode an encoded string into a caller supplied buffer. The output is
+	 * not NUL terminated.
+	 * @param data The encoded string to decode.
+	 * @param bitLength The number of valid bits in data.
+	 * @param out The buffer to write the decoded text into.
+	 * @param outSize The size of the output buffer in bytes.
+	 * @return The number of bytes written.
+	 * @throw HuffmanException Thrown if the data is truncated or corrupt, or
+	 *                         the output buffer is too small.
+	 */
+	constexpr size_t decode(const unsigned char *data, size_t bitLength, char *out, size_t outSize) const {
+		size_t bitPos = 0;
+		size_t written = 0;
+		while (true) {
+			uint32_t code = 0;
+			int length = 0;
+			size_t index = N;
+			while (index == N) {
+				if (length == longestCode) {
+					throw HuffmanException("Bad Decode Path");
+				}
+				if (bitPos >= bitLength) {
+					throw HuffmanException("Unexpected End of Data");
+				}
+				code = (code << 1) | ((data[bitPos / 8] >> (7 - bitPos % 8)) & 1);
+				++bitPos;
+				++length;
+				if (code - firstCode[length] < lengthCount[length]) {
+					index = firstIndex[length] + (code - firstCode[length]);
+				}
+			}
+
+			int c = decodeSymbols[index];
+			if (c == 0) {
+				return written;
+			}
+			if (outSize - written < huffman_static_detail::utf8Length(c)) {
+				throw HuffmanException("Output Buffer Too Small");
+			}
+			written += huffman_static_detail::appendCodePoint(c, out + written);
+		}
+	}
+
+private:
+	constexpr size_t find(int character) const {
+		size_t low = 0, high = N;
+		while (low < high) {
+			size_t mid = (low + high) / 2;
+			if (characters[mid] < character) {
+				low = mid + 1;
+			} else {
+				high = mid;
+			}
+		}
+		if (low == N || characters[low] != character || character == 0) {
+			throw HuffmanException("Not in Huffman Table");
+		}
+		return low;
+	}
+
+	/**
+	 * Calculate code lengths by repeatedly merging the two lightest nodes.
+	 * This is quadratic, but only ever runs at compile time.
+	 */
+	constexpr void computeLengths(const std::array<HuffmanStaticSymbol, N> &frequencies) {
+		if (N == 1) {
+			lengths[0] = 1;
+			longestCode = 1;
+			return;
+		}
+
+		long long weight[2 * N] = {};
+		size_t parent[2 * N] = {};
+		bool merged[2 * N] = {};
+		for (size_t i = 0; i < N; ++i) {
+			for (size_t j = 0; j < N; ++j) {
+				if (frequencies[j].character == characters[i]) {
+					weight[i] = frequencies[j].weight;
+				}
+			}
+		}
+
+		for (size_t next = N; next < 2 * N - 1; ++next) {
+			size_t first = 2 * N, second = 2 * N;
+			for (size_t i = 0; i < next; ++i) {
+				if (merged[i]) {
+					continue;
+				}
+				if (first == 2 * N || weight[i] < weight[first]) {
+					second = first;
+					first = i;
+				} else if (second == 2 * N || weight[i] < weight[second]) {
+					second = i;
+				}
+			}
+			merged[first] = merged[second] = true;
+			parent[first] = parent[second] = next;
+			weight[next] = weight[first] + weight[second];
+		}
+
+		for (size_t i = 0; i < N; ++i) {
+			int length = 0;
+			for (size_t node = i; node != 2 * N - 2; node = parent[node]) {
+				++length;
+			}
+			if (length > huffman_static_detail::MaxCodeLength) {
+				throw HuffmanException("Static Table Code Too Long");
+			}
+			lengths[i] = static_cast<uint8_t>(length);
+			if (length > longestCode) {
+				longestCode = length;
+			}
+		}
+	}
+
+	/**
+	 * Assign canonical codes in order of (length, character) and fill in the
+	 * per-length tables used for decoding.
+	 */
+	constexpr void assignCodes() {
+		size_t used = 0;
+		uint32_t code = 0;
+		for (int length = 1; length <= longestCode; ++length) {
+			firstCode[length] = code;
+			firstIndex[length] = static_cast<uint32_t>(used);
+			for (size_t i = 0; i < N; ++i) {
+				if (lengths[i] == length) {
+					codes[i] = code++;
+					decodeSymbols[used++] = characters[i];
+				}
+			}
+			lengthCount[length] = static_cast<uint32_t>(used) - firstIndex[length];
+			code <<= 1;
+		}
+	}
+
+	int characters[N];
+	uint32_t codes[N];
+	uint8_t lengths[N];
+
+	int decodeSymbols[N];
+	uint32_t firstCode[huffman_static_detail::MaxCodeLength + 1];
+	uint32_t firstIndex[huffman_static_detail::MaxCodeLength + 1];
+	uint32_t lengthCount[huffman_static_detail::MaxCodeLength + 1];
+	int longestCode;
+};
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef HUFFMAN_SYMBOLS_H
+#define HUFFMAN_SYMBOLS_H
+
+#include <cstdint>
+#include <vector>
+
+/**
+ * Maps Unicode code points to dense symbol ranks, so that per-symbol data
+ * can be kept in plain vectors indexed by rank rather than in maps keyed by
+ * code point.
+ *
+ * The index is a two-level page table. The code point space is split into
+ * pages of 256 code points; the top level holds, for every page, the offset
+ * of its rank array. Pages without any symbols all share a single page of
+ * NoSymbol entries, so a lookup is always exactly two array reads with no
+ * branches beyond the range check, and only the pages in use cost memory.
+ */
+class HuffmanSymbolIndex {
+public:
+	/** Returned by rank() for code points that are not in the index. */
+	static constexpr uint32_t NoSymbol = UINT32_MAX;
+	/** The largest code point that can be indexed. */
+	static constexpr int MaxCodePoint = 0x10FFFF;
+
+	/**
+	 * Rebuild the index. Each symbol gets its position in the list as its
+	 * rank.
+	 * @param symbols The code points to index, each from 0 to MaxCodePoint
+	 *                and appearing at most once.
+	 */
+	void build(const std::vector<int> &symbols) {
+		pages.assign((MaxCodePoint >> PageBits) + 1, 0);
+		ranks.assign(PageSize, NoSymbol);
+		for (size_t i = 0; i < symbols.size(); ++i) {
+			uint32_t &page = pages[symbols[i] >> PageBits];
+			if (page == 0) {
+				page = static_cast<uint32_t>(ranks.size());
+				ranks.resize(ranks.size() + PageSize, NoSymbol);
+			}
+			ranks[page + (symbols[i] & PageMask)] = static_cast<uint32_t>(i);
+		}
+		count = symbols.size();
+	}
+
+	/**
+	 * @param codePoint The code point to look up.
+	 * @return The rank of the code point, or NoSymbol if it is not indexed.
+	 */
+	uint32_t rank(int codePoint) const {
+		if (static_cast<unsigned>(codePoint) > static_cast<unsigned>(MaxCodePoint) || pages.empty()) {
+			return NoSymbol;
+		}
+		return ranks[pages[codePoint >> PageBits] + (codePoint & PageMask)];
+	}
+
+	/** @return The number of symbols in the index. */
+	size_t size() const {
+		return count;
+	}
+
+private:
+	static constexpr unsigned PageBits = 8;
+	static constexpr uint32_t PageSize = 1u << PageBits;
+	static constexpr int PageMask = PageSize - 1;
+
+	std::vector<uint32_t> pages;
+	std::vector<uint32_t> ranks;
+	size_t count = 0;
+};
+
+#endif
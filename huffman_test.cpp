@@ -1,7 +1,32 @@
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <iterator>
+#include <sstream>
+#include <thread>
+#include <utility>
 
 #include "huffman.h"
+#include "huffman_ans.h"
+#include "huffman_bank.h"
+#include "huffman_blocks.h"
+#include "huffman_cache.h"
+#include "huffman_decoded_cache.h"
+#include "huffman_decoder.h"
+#include "huffman_encoder.h"
+#include "huffman_histogram.h"
+#include "huffman_io.h"
+#include "huffman_lz.h"
+#include "huffman_memory.h"
+#include "huffman_multi.h"
+#include "huffman_search.h"
+#include "huffman_static.h"
+
+constexpr std::string_view staticCorpus = "the quick brown fox jumps over the lazy dog; THE QUICK BROWN FOX JUMPS OVER THE LAZY DOG.";
+static constexpr StaticHuffmanTable<huffmanStaticSymbolCount(staticCorpus)> staticTable(
+        huffmanStaticFrequencies<huffmanStaticSymbolCount(staticCorpus)>(staticCorpus));
 
 int main() {
 	HuffmanTable ht;
@@ -78,5 +103,892 @@ int main() {
         return 1;
     }
 
+    /* ***********************************************************************
+     * Test Copying and Moving Tables
+     */
+    try {
+        HuffmanTable copied(ht);
+        HuffmanTable assigned;
+        assigned = copied;
+        copied = HuffmanTable();
+        HuffmanTable moved(std::move(assigned));
+        if (moved.decode(ht.encode(toEncode)) != toEncode || copied.getCodes().size() != 0) {
+            std::cerr << "ERROR: Copied table does not decode like the original\n";
+            return 1;
+        }
+    } catch (HuffmanException &e) {
+        std::cerr << "ERROR: " << e.what() << "\n";
+        return 1;
+    }
+
+    /* ***********************************************************************
+     * Test Encoding and Decoding into Exactly Sized Buffers
+     */
+    try {
+        std::vector<unsigned char> packed((ht.encodedBitLength(toEncode) + 7) / 8);
+        size_t bits = ht.encode(toEncode, packed.data(), packed.size());
+        std::string unpacked(ht.decodedByteLength(packed.data(), bits), '\0');
+        unpacked.resize(ht.decode(packed.data(), bits, &unpacked[0], unpacked.size()));
+        HuffmanDecodeTable fastDecoder(ht);
+        if (fastDecoder.decode(packed.data(), bits) != toEncode) {
+            std::cerr << "ERROR: fast decoder round trip failed\n";
+            return 1;
+        }
+        HuffmanHugePageAllocator hugePages;
+        HuffmanDecodeTable placedDecoder(ht, HuffmanDecodeTable::DefaultLookupBits, &hugePages, true);
+        if (placedDecoder.decode(packed.data(), bits) != toEncode
+                || placedDecoder.getReplicaCount() != huffmanNumaNodeCount()) {
+            std::cerr << "ERROR: huge page decoder round trip failed\n";
+            return 1;
+        }
+        std::string sink;
+        ht.decode(ht.encode(std::string_view(toEncode)), std::back_inserter(sink));
+        if (bits != encodedString.size() || unpacked != toEncode || sink != toEncode) {
+            std::cerr << "ERROR: caller buffer round trip failed\n";
+            return 1;
+        }
+    } catch (HuffmanException &e) {
+        std::cerr << "ERROR: " << e.what() << "\n";
+        return 1;
+    }
+
+    /* ***********************************************************************
+     * Test Length-prefixed Strings
+     */
+    HuffmanTable prefixed;
+    prefixed.setLengthPrefixed(true);
+    for (int i = 0; inputStrings[i] != nullptr; ++i) {
+        prefixed.addFrequencies(inputStrings[i]);
+    }
+    prefixed.buildTree();
+    try {
+        std::vector<bool> prefixedString = prefixed.encode(toEncode);
+        std::vector<bool> symbolsOnly = ht.encodeSymbols(toEncode);
+        std::cout << "Length-prefixed size (bits): " << prefixedString.size();
+        std::cout << ", without terminator: " << symbolsOnly.size() << "\n";
+        if (prefixed.decode(prefixedString) != toEncode
+                || ht.decode(symbolsOnly, strlen(toEncode)) != toEncode
+                || ht.decode(ht.encodeSymbols("Randolph"), 8) != "Randolph") {
+            std::cerr << "ERROR: length-prefixed round trip failed\n";
+            return 1;
+        }
+    } catch (HuffmanException &e) {
+        std::cerr << "ERROR: " << e.what() << "\n";
+        return 1;
+    }
+
+    /* ***********************************************************************
+     * Test Lazy Decoding
+     */
+    try {
+        std::string text = inputStrings[2];
+        size_t characters = 0;
+        for (unsigned char byte : text) {
+            characters += (byte & 0xC0) != 0x80;
+        }
+        for (const HuffmanTable *table : { &ht, &prefixed }) {
+            std::vector<unsigned char> data((table->encodedBitLength(text) + 7) / 8);
+            size_t bits = table->encode(text, data.data(), data.size());
+            HuffmanCodePointRange codePoints = table->codePoints(data.data(), bits);
+            auto third = std::next(codePoints.begin(), 2);
+            // the first three characters are all that should be read
+            size_t prefixBits = third.getBitPosition();
+            if (*codePoints.begin() != 0x5F15 || *third != 0x30CF
+                    || static_cast<size_t>(std::distance(codePoints.begin(), codePoints.end())) != characters
+                    || table->decodePrefix(data.data(), prefixBits, 3) != text.substr(0, 9)
+                    || table->decodePrefix(data.data(), bits, SIZE_MAX) != text) {
+                std::cerr << "ERROR: lazy decoding failed\n";
+                return 1;
+            }
+            if (table == &ht) {
+                std::cout << "Lazy decoding: 3 of " << characters << " characters read from " << prefixBits;
+                std::cout << " of " << bits << " bits\n";
+            }
+        }
+    } catch (HuffmanException &e) {
+        std::cerr << "ERROR: " << e.what() << "\n";
+        return 1;
+    }
+
+    /* ***********************************************************************
+     * Test Batch Decoding
+     */
+    try {
+        // every word and every sentence, so there are strings that fit in
+        // one word of input and strings that run on past the scratch tail
+        std::vector<std::string> texts;
+        for (int i = 0; inputStrings[i] != nullptr; ++i) {
+            std::string text = inputStrings[i];
+            for (char separator : { ' ', '.', '\xE3' }) {
+                for (size_t start = 0, end; start < text.size(); start = end + 1) {
+                    end = std::min(text.find(separator, start), text.size());
+                    if (separator != '\xE3') {
+                        texts.push_back(text.substr(start, end - start));
+                    } else if (end < text.size()) {
+                        texts.push_back(text.substr(0, end));
+                    }
+                }
+            }
+        }
+        for (const HuffmanTable *table : { &ht, &prefixed }) {
+            HuffmanDecodeTable fastDecoder(*table);
+            std::vector<std::vector<unsigned char>> data;
+            std::vector<std::string> out;
+            std::vector<HuffmanBatchString> batch;
+            for (const std::string &text : texts) {
+                data.emplace_back((table->encodedBitLength(text) + 7) / 8);
+                out.emplace_back(text.size() + 1, '\0');
+            }
+            for (size_t i = 0; i < texts.size(); ++i) {
+                size_t bits = table->encode(texts[i], data[i].data(), data[i].size());
+                batch.push_back(HuffmanBatchString{data[i].data(), bits, &out[i][0], out[i].size(), 0});
+            }
+            fastDecoder.decodeBatch(batch.data(), batch.size());
+            for (size_t i = 0; i < texts.size(); ++i) {
+                if (out[i].substr(0, batch[i].written) != texts[i]) {
+                    std::cerr << "ERROR: batch decoding failed for \"" << texts[i] << "\"\n";
+                    return 1;
+                }
+            }
+
+            // a truncated string must be reported, as decode() would
+            batch[texts.size() / 2].bitLength /= 2;
+            bool rejected = false;
+            try {
+                fastDecoder.decodeBatch(batch.data(), batch.size());
+            } catch (HuffmanException&) {
+                rejected = true;
+            }
+            if (!rejected) {
+                std::cerr << "ERROR: batch decoding accepted a truncated string\n";
+                return 1;
+            }
+        }
+        std::cout << "Batch decoding: " << texts.size() << " strings, ";
+        std::cout << (HuffmanDecodeTable::hasVectorBatch() ? "AVX2 lanes" : "scalar") << "\n";
+    } catch (HuffmanException &e) {
+        std::cerr << "ERROR: " << e.what() << "\n";
+        return 1;
+    }
+
+    /* ***********************************************************************
+     * Test Parallel Block Decoding
+     */
+    std::string longText;
+    while (longText.size() < 1024 * 1024) {
+        for (int i = 0; inputStrings[i] != nullptr; ++i) {
+            longText += inputStrings[i];
+        }
+    }
+    try {
+        HuffmanBlockStream blocks;
+        blocks.encode(ht, longText, 16 * 1024, 4);
+        std::cout << "Block stream: " << longText.size() << " bytes => " << blocks.getData().size();
+        std::cout << " bytes in " << blocks.getBlocks().size() << " blocks\n";
+        if (blocks.decode(ht, 4) != longText || blocks.decode(ht, 1) != longText) {
+            std::cerr << "ERROR: block stream round trip failed\n";
+            return 1;
+        }
+
+        // forged indexes claiming a terabyte, first of data the stream does
+        // not hold and then of text one byte of codes cannot decode to
+        size_t rejected = 0;
+        for (uint64_t bitLength : { uint64_t(1) << 43, uint64_t(8) }) {
+            std::stringstream forged;
+            huffmanWriteU64(forged, uint64_t(1) << 40);
+            huffmanWriteU64(forged, 1);
+            huffmanWriteU64(forged, bitLength);
+            huffmanWriteU64(forged, uint64_t(1) << 40);
+            forged.put('\0');
+            HuffmanBlockStream loaded;
+            try {
+                loaded.load(forged);
+                loaded.decode(ht, 1);
+            } catch (HuffmanException&) {
+                ++rejected;
+            }
+        }
+        if (rejected != 2) {
+            std::cerr << "ERROR: forged block index was accepted\n";
+            return 1;
+        }
+    } catch (HuffmanException &e) {
+        std::cerr << "ERROR: " << e.what() << "\n";
+        return 1;
+    }
+
+    /* ***********************************************************************
+     * Test Fast Encoding
+     */
+    try {
+        HuffmanTable escaping;
+        escaping.setEscape(true);
+        escaping.addFrequencies(inputStrings[0]);
+        escaping.buildTree();
+        std::vector<std::string> texts = { "", longText };
+        for (int i = 0; inputStrings[i] != nullptr; ++i) {
+            texts.push_back(inputStrings[i]);
+        }
+        for (const HuffmanTable *table : { &ht, &prefixed, &escaping }) {
+            HuffmanEncodeTable encoder(*table);
+            for (const std::string &text : texts) {
+                size_t bits = table->encodedBitLength(text);
+                std::vector<unsigned char> expected((bits + 7) / 8), scalar(expected.size());
+                std::vector<unsigned char> fast(encoder.maxEncodedBytes(text.size()));
+                table->encode(text, expected.data(), expected.size());
+                if (encoder.encode(text, fast.data(), fast.size()) != bits || !std::equal(expected.begin(), expected.end(), fast.begin())
+                        || encoder.encodeScalar(text, scalar.data(), scalar.size()) != bits || scalar != expected) {
+                    std::cerr << "ERROR: fast encoding differs from HuffmanTable::encode()\n";
+                    return 1;
+                }
+                bits = table->symbolsBitLength(text);
+                expected.assign((bits + 7) / 8, 0);
+                table->encodeSymbols(text, expected.data(), expected.size());
+                if (encoder.encodeSymbols(text, fast.data(), fast.size()) != bits || !std::equal(expected.begin(), expected.end(), fast.begin())) {
+                    std::cerr << "ERROR: fast encoding differs from HuffmanTable::encodeSymbols()\n";
+                    return 1;
+                }
+            }
+        }
+
+        HuffmanEncodeTable encoder(ht);
+        std::vector<unsigned char> small(ht.encodedBitLength(inputStrings[0]) / 8);
+        bool rejected = false;
+        try {
+            encoder.encode(inputStrings[0], small.data(), small.size());
+        } catch (HuffmanException&) {
+            rejected = true;
+        }
+        std::string expectedError, actualError;
+        try {
+            ht.encode("\x7F", small.data(), small.size());
+        } catch (HuffmanException &e) {
+            expectedError = e.what();
+        }
+        try {
+            encoder.encode("\x7F", small.data(), small.size());
+        } catch (HuffmanException &e) {
+            actualError = e.what();
+        }
+        if (!rejected || expectedError.empty() || actualError != expectedError) {
+            std::cerr << "ERROR: fast encoding did not report errors as HuffmanTable::encode() does\n";
+            return 1;
+        }
+        std::cout << "Fast encoding: " << texts.size() << " strings on 3 tables, ";
+        std::cout << (HuffmanEncodeTable::hasVectorEncode() ? "AVX2 blocks" : "scalar blocks") << "\n";
+    } catch (HuffmanException &e) {
+        std::cerr << "ERROR: " << e.what() << "\n";
+        return 1;
+    }
+
+    /* ***********************************************************************
+     * Test Cost Estimates
+     */
+    try {
+        HuffmanCostEstimate estimate = ht.estimateCost();
+        size_t encodedBits = 0;
+        for (int i = 0; inputStrings[i] != nullptr; ++i) {
+            encodedBits += ht.encodedBitLength(inputStrings[i]);
+        }
+        std::cout << "Cost estimate: " << estimate.inputBytes * 8 << " => " << estimate.huffmanBits;
+        std::cout << " bits (entropy " << estimate.entropyBits() << ", ratio " << estimate.ratio() << ")\n";
+        if (estimate.huffmanBits != encodedBits || ht.costWith(ht) != encodedBits
+                || estimate.huffmanBits < estimate.entropyBits()) {
+            std::cerr << "ERROR: cost estimate does not match encoded length\n";
+            return 1;
+        }
+    } catch (HuffmanException &e) {
+        std::cerr << "ERROR: " << e.what() << "\n";
+        return 1;
+    }
+
+    /* ***********************************************************************
+     * Test Escape Codes
+     */
+    try {
+        HuffmanTable escaping;
+        escaping.setEscape(true);
+        escaping.addFrequencies(inputStrings[0]);
+        escaping.buildTree();
+        std::stringstream saved;
+        escaping.save(saved);
+        HuffmanTable loaded;
+        loaded.load(saved);
+        HuffmanDecodeTable fastEscaping(loaded);
+
+        const char *unseen = "Zebra \xE2\x98\x83 \xF0\x9F\x98\x80 Quagga";
+        std::vector<unsigned char> data((escaping.encodedBitLength(unseen) + 7) / 8);
+        size_t bits = escaping.encode(unseen, data.data(), data.size());
+        std::cout << "Escape codes: " << strlen(unseen) * 8 << " => " << bits << " bits\n";
+        if (loaded.decode(escaping.encode(unseen)) != unseen || fastEscaping.decode(data.data(), bits) != unseen) {
+            std::cerr << "ERROR: escape code round trip failed\n";
+            return 1;
+        }
+    } catch (HuffmanException &e) {
+        std::cerr << "ERROR: " << e.what() << "\n";
+        return 1;
+    }
+
+    /* ***********************************************************************
+     * Test Exporting Tables
+     */
+    try {
+        HuffmanTable small;
+        small.setLengthPrefixed(true);
+        small.setEscape(true);
+        small.addFrequencies("aaaaaaaa\n\n\n\nbb\tc");
+        small.buildTree();
+        std::ostringstream dump;
+        small.dumpTree(dump);
+        const char *golden =
+            "HUFFMAN TREE DATA DUMP\n"
+            "    BIT SEQUENCE  CHARACTER\n"
+            "            0000: 'b' (0x62)\n"
+            "            0001: 'c' (0x63)\n"
+            "            0010: ESCAPE\n"
+            "            0011: 0x9\n"
+            "              01: 0xA\n"
+            "               1: 'a' (0x61)\n";
+        if (dump.str() != golden) {
+            std::cerr << "ERROR: tree dump does not match:\n" << dump.str();
+            return 1;
+        }
+
+        for (const HuffmanTable *table : { &small, &ht }) {
+            size_t leaves = table->getSymbols().size() + (table->hasEscape() ? 1 : 0);
+            std::ostringstream json, dot;
+            table->writeJson(json);
+            table->writeDot(dot);
+
+            size_t entries = 0, at = 0;
+            for (size_t i = 0; i < table->getCodes().size(); ++i, ++at) {
+                const HuffmanCode &code = table->getCodes()[i];
+                std::string expected = "\"length\":" + std::to_string(code.length) + ",\"code\":\"";
+                for (unsigned bit = code.length; bit > 0; --bit) {
+                    expected += ((code.bits >> (bit - 1)) & 1) ? '1' : '0';
+                }
+                at = json.str().find(expected + '"', at);
+                if (at == std::string::npos) {
+                    std::cerr << "ERROR: JSON code of symbol " << table->getSymbols()[i] << " does not match\n";
+                    return 1;
+                }
+            }
+            for (at = json.str().find("{\"type\":"); at != std::string::npos; at = json.str().find("{\"type\":", at + 1)) {
+                ++entries;
+            }
+            size_t edges = 0;
+            for (at = dot.str().find(" -> "); at != std::string::npos; at = dot.str().find(" -> ", at + 1)) {
+                ++edges;
+            }
+            std::vector<size_t> lengths = table->getCodeLengthCounts();
+            size_t counted = 0;
+            for (size_t count : lengths) {
+                counted += count;
+            }
+            if (entries != leaves || edges != 2 * (leaves - 1) || counted != leaves) {
+                std::cerr << "ERROR: exports disagree on the number of symbols (" << leaves << "): JSON " << entries
+                          << ", DOT edges " << edges << ", code lengths " << counted << "\n";
+                return 1;
+            }
+        }
+    } catch (HuffmanException &e) {
+        std::cerr << "ERROR: " << e.what() << "\n";
+        return 1;
+    }
+
+    /* ***********************************************************************
+     * Test Saving Only Code Lengths
+     */
+    try {
+        HuffmanTable canonical(ht);
+        canonical.setEscape(true);
+        canonical.buildTree();
+        canonical.makeCanonical();
+        std::stringstream full, compact;
+        canonical.save(full);
+        canonical.saveCodeLengths(compact);
+        std::cout << "Code lengths: " << compact.str().size() << " bytes, full table " << full.str().size() << " bytes\n";
+        HuffmanTable loaded;
+        loaded.loadCodeLengths(compact);
+        const char *unseen = "towered over \xE2\x98\x83 the prelate";
+        auto sameCode = [](const HuffmanCode &lhs, const HuffmanCode &rhs) {
+            return lhs.bits == rhs.bits && lhs.length == rhs.length;
+        };
+        if (loaded.getSymbols() != canonical.getSymbols() || !std::equal(loaded.getCodes().begin(), loaded.getCodes().end(),
+                                                                        canonical.getCodes().begin(), sameCode)
+                || loaded.decode(canonical.encode(unseen)) != unseen || compact.str().size() * 4 > full.str().size()) {
+            std::cerr << "ERROR: code length round trip failed\n";
+            return 1;
+        }
+    } catch (HuffmanException &e) {
+        std::cerr << "ERROR: " << e.what() << "\n";
+        return 1;
+    }
+
+    /* ***********************************************************************
+     * Test Histograms
+     */
+    try {
+        HuffmanHistogram english, japanese, top(8);
+        english.add(inputStrings[0]);
+        english.add(inputStrings[1]);
+        japanese.add(inputStrings[2]);
+        std::stringstream saved;
+        japanese.save(saved);
+        std::cout << "Histogram: " << japanese.size() << " symbols in " << saved.str().size() << " bytes\n";
+        HuffmanHistogram loaded;
+        loaded.load(saved);
+        english.merge(loaded);
+        for (int i = 0; inputStrings[i] != nullptr; ++i) {
+            top.add(inputStrings[i]);
+        }
+
+        HuffmanTable merged;
+        merged.addFrequencies(english);
+        merged.buildTree();
+        if (merged.estimateCost().huffmanBits != ht.estimateCost().huffmanBits || english.total() != ht.getFrequencies().total()
+                || top.size() != 8 || top.count(' ') < ht.getFrequencies().count(' ')) {
+            std::cerr << "ERROR: merged histogram does not match\n";
+            return 1;
+        }
+    } catch (HuffmanException &e) {
+        std::cerr << "ERROR: " << e.what() << "\n";
+        return 1;
+    }
+
+    /* ***********************************************************************
+     * Test 64-bit Weights and Rescaling
+     */
+    try {
+        // Fibonacci counts give the deepest possible tree, and total far more
+        // than fits in an int
+        HuffmanHistogram fibonacci;
+        uint64_t previous = 1, current = 1;
+        for (int i = 0; i < 60; ++i) {
+            fibonacci.add(0x100 + i, current);
+            uint64_t next = previous + current;
+            previous = current;
+            current = next;
+        }
+        HuffmanTable exact;
+        exact.setLengthPrefixed(true);
+        exact.addFrequencies(fibonacci);
+        exact.buildTree();
+        unsigned longest = 0;
+        for (const HuffmanCode &code : exact.getCodes()) {
+            longest = std::max(longest, code.length);
+        }
+        std::string text = "\u0100\u0120\u013B";
+        if (longest != 59 || exact.decode(exact.encode(text)) != text) {
+            std::cerr << "ERROR: table built from 64-bit weights is wrong\n";
+            return 1;
+        }
+
+        HuffmanHistogram rescaled = fibonacci;
+        rescaled.rescale(1 << 20);
+        bool kept = rescaled.size() == fibonacci.size();
+        for (const auto &i : rescaled) {
+            kept = kept && i.second >= 1;
+        }
+        HuffmanTable bounded;
+        bounded.setLengthPrefixed(true);
+        bounded.setRescaleTotal(1 << 20);
+        bounded.addFrequencies(fibonacci);
+        bounded.buildTree();
+        longest = 0;
+        for (const HuffmanCode &code : bounded.getCodes()) {
+            longest = std::max(longest, code.length);
+        }
+        if (!kept || rescaled.total() != (1 << 20) || longest > 27 || bounded.getFrequencies().total() != fibonacci.total()
+                || bounded.decode(bounded.encode(text)) != text) {
+            std::cerr << "ERROR: rescaled weights are wrong\n";
+            return 1;
+        }
+        std::cout << "Rescaling: longest code " << longest << " bits, from 59 bits with exact weights\n";
+
+        bool threw = false;
+        try {
+            rescaled.rescale(10);
+        } catch (HuffmanException&) {
+            threw = true;
+        }
+        if (!threw) {
+            std::cerr << "ERROR: rescaling below the number of symbols did not throw\n";
+            return 1;
+        }
+    } catch (HuffmanException &e) {
+        std::cerr << "ERROR: " << e.what() << "\n";
+        return 1;
+    }
+
+    /* ***********************************************************************
+     * Test the Table Cache
+     */
+    try {
+        std::filesystem::path directory = std::filesystem::temp_directory_path() / "huffman_test_cache";
+        std::filesystem::remove_all(directory);
+        HuffmanTableCache cache(directory.string());
+        HuffmanTable first, second, escaping;
+        for (HuffmanTable *table : { &first, &second, &escaping }) {
+            table->setLengthPrefixed(true);
+            for (int i = 0; inputStrings[i] != nullptr; ++i) {
+                table->addFrequencies(inputStrings[i]);
+            }
+        }
+        escaping.setEscape(true);
+        bool firstHit = cache.buildTree(first);
+        bool secondHit = cache.buildTree(second);
+        bool escapingHit = cache.buildTree(escaping);
+        if (firstHit || !secondHit || escapingHit || second.encode(inputStrings[2]) != first.encode(inputStrings[2])
+                || second.getSymbols() != first.getSymbols() || second.getFrequencies().total() != first.getFrequencies().total()
+                || cache.getPath(first) == cache.getPath(escaping)) {
+            std::cerr << "ERROR: table cache did not reuse the right tables\n";
+            return 1;
+        }
+
+        // a damaged entry is rebuilt and replaced
+        std::ofstream(cache.getPath(first), std::ios::binary | std::ios::trunc) << "HUFC";
+        HuffmanTable third;
+        third.setLengthPrefixed(true);
+        third.addFrequencies(first.getFrequencies());
+        bool damagedHit = cache.buildTree(third);
+        bool repairedHit = cache.buildTree(third);
+        size_t entries = std::distance(std::filesystem::directory_iterator(directory), std::filesystem::directory_iterator());
+        if (damagedHit || !repairedHit || third.encode(inputStrings[0]) != first.encode(inputStrings[0]) || entries != 2) {
+            std::cerr << "ERROR: table cache did not replace a damaged entry\n";
+            return 1;
+        }
+        std::filesystem::remove_all(directory);
+        std::cout << "Table cache: built 2 tables, loaded 2 from the cache\n";
+    } catch (HuffmanException &e) {
+        std::cerr << "ERROR: " << e.what() << "\n";
+        return 1;
+    }
+
+    /* ***********************************************************************
+     * Test Multiple Tables
+     */
+    try {
+        std::vector<std::string_view> corpus;
+        for (int i = 0; inputStrings[i] != nullptr; ++i) {
+            corpus.push_back(inputStrings[i]);
+        }
+        HuffmanMultiTable trained;
+        trained.train(corpus, 2);
+        std::stringstream saved;
+        trained.save(saved);
+        HuffmanMultiTable multi;
+        multi.load(saved);
+
+        size_t singleBits = 0, multiBits = 0;
+        for (std::string_view text : corpus) {
+            std::vector<unsigned char> data((multi.encodedBitLength(text) + 7) / 8);
+            size_t bits = multi.encode(text, data.data(), data.size());
+            singleBits += ht.encodedBitLength(text);
+            multiBits += bits;
+            if (multi.decode(data.data(), bits) != text) {
+                std::cerr << "ERROR: multiple table round trip failed\n";
+                return 1;
+            }
+        }
+        std::cout << "Multiple tables: " << singleBits << " bits with one table => " << multiBits;
+        std::cout << " bits with " << multi.getTableCount() << "\n";
+        if (multiBits >= singleBits) {
+            std::cerr << "ERROR: multiple tables did not beat a single table\n";
+            return 1;
+        }
+    } catch (HuffmanException &e) {
+        std::cerr << "ERROR: " << e.what() << "\n";
+        return 1;
+    }
+
+    /* ***********************************************************************
+     * Test the ANS Backend
+     */
+    try {
+        HuffmanAnsTable ans(ht);
+        HuffmanAnsTable prefixedAns(prefixed);
+        size_t huffmanBits = 0, ansBits = 0;
+        for (int i = 0; inputStrings[i] != nullptr; ++i) {
+            std::string_view text = inputStrings[i];
+            std::vector<unsigned char> data((ans.encodedBitLength(text) + 7) / 8);
+            size_t bits = ans.encode(text, data.data(), data.size());
+            std::string out(text.size(), '\0');
+            huffmanBits += ht.encodedBitLength(text);
+            ansBits += bits;
+            if (ans.decode(data.data(), bits) != text
+                    || ans.decode(data.data(), bits, &out[0], out.size()) != text.size() || out != text
+                    || ans.decode(ans.encodeSymbols(text), text.size()) != text
+                    || prefixedAns.decode(prefixedAns.encode(text)) != text) {
+                std::cerr << "ERROR: ANS round trip failed\n";
+                return 1;
+            }
+        }
+        std::cout << "ANS backend (" << (1u << ans.getTableLog()) << " states): " << huffmanBits;
+        std::cout << " bits with Huffman => " << ansBits << " bits\n";
+        if (ansBits >= huffmanBits || ans.decode(ans.encode("")) != "" || prefixedAns.decode(prefixedAns.encode("")) != "") {
+            std::cerr << "ERROR: ANS backend did not beat Huffman coding\n";
+            return 1;
+        }
+    } catch (HuffmanException &e) {
+        std::cerr << "ERROR: " << e.what() << "\n";
+        return 1;
+    }
+
+    /* ***********************************************************************
+     * Test the LZ Front End
+     */
+    try {
+        std::vector<std::string> samples(inputStrings, inputStrings + 3);
+        samples.push_back("ab ab ab ab ab ab ab ab ab ab ab ab.");
+        HuffmanLz fast(HuffmanLz::MinLevel), best(HuffmanLz::MaxLevel), banked;
+        fast.train(samples);
+        best.train(samples);
+        banked.setDictionary(samples[0] + samples[1]);
+        banked.train(samples);
+        size_t huffmanBits = 0, fastBits = 0, bestBits = 0;
+        for (const std::string &text : samples) {
+            std::vector<unsigned char> fastData, bestData;
+            size_t fastLength = fast.encode(text, fastData);
+            size_t bestLength = best.encode(text, bestData);
+            fastBits += fastLength;
+            bestBits += bestLength;
+            huffmanBits += ht.encodedBitLength(text);
+            std::string out(text.size(), '\0');
+            if (fast.decode(fastData.data(), fastLength) != text
+                    || best.decode(bestData.data(), bestLength, &out[0], out.size()) != text.size()
+                    || out != text) {
+                std::cerr << "ERROR: LZ round trip failed\n";
+                return 1;
+            }
+        }
+        std::string phrase = "the Prelate's Servant Randolph lived in the manor-house";
+        std::vector<unsigned char> phraseData;
+        size_t phraseBits = banked.encode(phrase, phraseData);
+        std::cout << "LZ front end: " << huffmanBits << " bits order-0 => " << fastBits << " bits at level ";
+        std::cout << fast.getLevel() << ", " << bestBits << " at level " << best.getLevel() << "; ";
+        std::cout << ht.encodedBitLength(phrase) << " => " << phraseBits << " bits with a dictionary\n";
+        if (bestBits >= huffmanBits || bestBits > fastBits || phraseBits >= ht.encodedBitLength(phrase)
+                || banked.decode(phraseData.data(), phraseBits) != phrase) {
+            std::cerr << "ERROR: LZ front end did not beat order-0 Huffman coding\n";
+            return 1;
+        }
+
+        // one long match decodes to far more than its bits, so the growing
+        // decoder must stop at its bound
+        std::string run(100000, 'a');
+        std::vector<unsigned char> runData;
+        size_t runBits = fast.encode(run, runData);
+        bool bounded = false;
+        try {
+            fast.decode(runData.data(), runBits, run.size() - 1);
+        } catch (HuffmanException&) {
+            bounded = true;
+        }
+        if (!bounded || fast.decode(runData.data(), runBits, run.size()) != run) {
+            std::cerr << "ERROR: LZ decoder ignored its output bound\n";
+            return 1;
+        }
+    } catch (HuffmanException &e) {
+        std::cerr << "ERROR: " << e.what() << "\n";
+        return 1;
+    }
+
+    /* ***********************************************************************
+     * Test Deduplicating String Banks
+     */
+    try {
+        const char *messages[] = {
+            "the servant's power.", "servant's power.", "power.", "the servant's power.",
+            "the Prelate's Servant", "Servant", "the servant's power.", "wood 引阜ハモ",
+        };
+        HuffmanDecodeTable fastDecoder(ht);
+        HuffmanStringBankBuilder builder(ht);
+        size_t separateBits = 0;
+        for (const char *message : messages) {
+            builder.add(message);
+            separateBits += ht.encodedBitLength(message);
+        }
+        size_t uniqueCount = builder.getUniqueCount();
+        HuffmanStringBank bank = builder.build();
+        std::cout << "String bank: " << std::size(messages) << " strings, " << uniqueCount << " distinct, ";
+        std::cout << separateBits << " => " << bank.getBitLength() << " bits\n";
+        // the second and third end the first, and the sixth ends the fifth
+        size_t sharedBits = ht.encodedBitLength(messages[0]) + ht.encodedBitLength(messages[4])
+                + ht.encodedBitLength(messages[7]);
+        if (uniqueCount != 6 || bank.size() != std::size(messages) || bank.getBitLength() != sharedBits
+                || !bank.equal(0, 6) || bank.equal(0, 1)) {
+            std::cerr << "ERROR: string bank did not share duplicates and tails\n";
+            return 1;
+        }
+        for (size_t i = 0; i < bank.size(); ++i) {
+            std::vector<unsigned char> data((ht.encodedBitLength(messages[i]) + 7) / 8 + 1, 0xFF);
+            size_t bits = ht.encode(messages[i], data.data(), data.size());
+            // stray bits past the end must not matter
+            std::vector<unsigned char> copy(data);
+            copy[bits / 8] ^= static_cast<unsigned char>(0xFF >> (bits % 8));
+            if (bank.decode(i, fastDecoder) != messages[i] || bank.hash(i) != huffmanEncodedHash(data.data(), bits)
+                    || huffmanEncodedHash(copy.data(), bits) != huffmanEncodedHash(data.data(), bits)
+                    || !huffmanEncodedEqual(data.data(), bits, copy.data(), bits)
+                    || huffmanEncodedEqual(data.data(), bits, data.data(), bits - 1)) {
+                std::cerr << "ERROR: string bank round trip failed\n";
+                return 1;
+            }
+        }
+    } catch (HuffmanException &e) {
+        std::cerr << "ERROR: " << e.what() << "\n";
+        return 1;
+    }
+
+    /* ***********************************************************************
+     * Test the Decoded-string Cache
+     */
+    try {
+        HuffmanDecodeTable fastDecoder(ht);
+        HuffmanStringBankBuilder builder(ht);
+        std::vector<std::vector<unsigned char>> encoded;
+        std::vector<size_t> bitLengths;
+        for (int i = 0; inputStrings[i] != nullptr; ++i) {
+            builder.add(inputStrings[i]);
+            encoded.emplace_back((ht.encodedBitLength(inputStrings[i]) + 7) / 8);
+            bitLengths.push_back(ht.encode(inputStrings[i], encoded.back().data(), encoded.back().size()));
+        }
+        HuffmanStringBank bank = builder.build();
+
+        HuffmanDecodedCache cache(fastDecoder, 1 << 20, 4);
+        HuffmanDecodedCache::Handle first = cache.decode(encoded[0].data(), bitLengths[0]);
+        HuffmanDecodedCache::Handle again = cache.decode(encoded[0].data(), bitLengths[0]);
+        HuffmanDecodedCache::Handle byId = cache.decode(7, encoded[1].data(), bitLengths[1]);
+        HuffmanDecodedCache::Handle byIndex = cache.decode(bank, 2);
+        if (*first != inputStrings[0] || again != first || *byId != inputStrings[1] || *byIndex != inputStrings[2]
+                || cache.decode(7, encoded[1].data(), bitLengths[1]) != byId || cache.decode(bank, 2) != byIndex
+                || cache.decode(encoded[1].data(), bitLengths[1]) == byId) {
+            std::cerr << "ERROR: decoded-string cache lookups are wrong\n";
+            return 1;
+        }
+        HuffmanDecodedCache::Stats stats = cache.getStats();
+        if (stats.hits != 3 || stats.misses != 4 || stats.entries != 4 || stats.evictions != 0) {
+            std::cerr << "ERROR: decoded-string cache counters are wrong\n";
+            return 1;
+        }
+
+        // a budget for about two strings per shard keeps evicting, but the
+        // handles given out stay valid
+        size_t budget = 2 * (std::strlen(inputStrings[2]) + HuffmanDecodedCache::EntryOverhead);
+        HuffmanDecodedCache small(fastDecoder, budget, 1);
+        std::vector<HuffmanDecodedCache::Handle> handles;
+        for (int round = 0; round < 3; ++round) {
+            for (size_t i = 0; i < bank.size(); ++i) {
+                handles.push_back(small.decode(bank, i));
+            }
+        }
+        stats = small.getStats();
+        small.clear();
+        for (size_t i = 0; i < handles.size(); ++i) {
+            if (*handles[i] != inputStrings[i % bank.size()]) {
+                std::cerr << "ERROR: decoded-string cache handle changed after eviction\n";
+                return 1;
+            }
+        }
+        if (stats.bytes > budget || stats.evictions == 0 || small.getStats().entries != 0) {
+            std::cerr << "ERROR: decoded-string cache exceeded its budget\n";
+            return 1;
+        }
+
+        // threads looking up the same strings all see the right text
+        std::vector<std::thread> threads;
+        std::vector<int> failures(4, 0);
+        for (size_t t = 0; t < failures.size(); ++t) {
+            threads.emplace_back([&, t]() {
+                for (int round = 0; round < 1000; ++round) {
+                    size_t i = (round + t) % encoded.size();
+                    if (*cache.decode(encoded[i].data(), bitLengths[i]) != inputStrings[i]) {
+                        ++failures[t];
+                    }
+                }
+            });
+        }
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+        stats = cache.getStats();
+        if (std::count(failures.begin(), failures.end(), 0) != 4) {
+            std::cerr << "ERROR: decoded-string cache failed under concurrent lookups\n";
+            return 1;
+        }
+        std::cout << "Decoded-string cache: " << stats.hits << " hits, " << stats.misses << " misses\n";
+    } catch (HuffmanException &e) {
+        std::cerr << "ERROR: " << e.what() << "\n";
+        return 1;
+    }
+
+    /* ***********************************************************************
+     * Test Compressed-domain Search
+     */
+    try {
+        const char *patterns[] = { "Prelate's Servant", "the", "ee", "フぐ", "。", "Zebra" };
+        size_t found = 0;
+        for (const HuffmanTable *table : { &ht, &prefixed }) {
+            for (const char *pattern : patterns) {
+                HuffmanSearch search(*table, pattern);
+                for (int i = 0; inputStrings[i] != nullptr; ++i) {
+                    std::string text = inputStrings[i];
+                    std::vector<unsigned char> data((table->encodedBitLength(text) + 7) / 8);
+                    size_t bits = table->encode(text, data.data(), data.size());
+                    size_t expectedCount = 0;
+                    for (size_t at = text.find(pattern); at != std::string::npos; at = text.find(pattern, at + 1)) {
+                        ++expectedCount;
+                    }
+                    size_t at = text.find(pattern);
+                    size_t expected = at == std::string::npos ? HuffmanSearch::NotFound : at;
+                    if (search.find(data.data(), bits) != expected || search.count(data.data(), bits) != expectedCount) {
+                        std::cerr << "ERROR: compressed search for \"" << pattern << "\" disagrees with std::string\n";
+                        return 1;
+                    }
+                    found += expectedCount;
+                }
+            }
+        }
+
+        HuffmanTable escaping;
+        escaping.setEscape(true);
+        escaping.addFrequencies(inputStrings[0]);
+        escaping.buildTree();
+        const char *unseen = "Zebra \xE2\x98\x83 \xF0\x9F\x98\x80 Quagga";
+        std::vector<unsigned char> data((escaping.encodedBitLength(unseen) + 7) / 8);
+        size_t bits = escaping.encode(unseen, data.data(), data.size());
+        std::cout << "Compressed search: " << found << " matches found without decoding\n";
+        if (HuffmanSearch(escaping, "\xF0\x9F\x98\x80 Q").find(data.data(), bits) != 10
+                || HuffmanSearch(escaping, "Zebra").count(data.data(), bits) != 1
+                || HuffmanSearch(ht, "Zebra").contains(data.data(), bits)
+                || HuffmanSearch(escaping, "").find(data.data(), bits) != 0) {
+            std::cerr << "ERROR: compressed search of escaped characters failed\n";
+            return 1;
+        }
+    } catch (HuffmanException &e) {
+        std::cerr << "ERROR: " << e.what() << "\n";
+        return 1;
+    }
+
+    /* ***********************************************************************
+     * Test Compile-time Table
+     */
+    const char *staticText = "the lazy fox jumps over the brown dog.";
+    unsigned char staticData[64];
+    char staticOut[64];
+    try {
+        size_t bits = staticTable.encode(staticText, staticData, sizeof(staticData));
+        size_t length = staticTable.decode(staticData, bits, staticOut, sizeof(staticOut));
+        std::cout << "Static table (max code length " << staticTable.maxCodeLength() << "): ";
+        std::cout << strlen(staticText) * 8 << " => " << bits << " bits\n";
+        if (std::string(staticOut, length) != staticText) {
+            std::cerr << "ERROR: static table round trip failed\n";
+            return 1;
+        }
+    } catch (HuffmanException &e) {
+        std::cerr << "ERROR: " << e.what() << "\n";
+        return 1;
+    }
+
 	return 0;
 }
\ No newline at end of file
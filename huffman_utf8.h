@@ -0,0 +1,18 @@
+#ifndef HUFFMAN_UTF8_H
+#define HUFFMAN_UTF8_H
+
+/*
+ * The vendored utf8 library derives its iterators from std::iterator, which
+ * C++17 deprecates. Include it through here so that its deprecation warnings
+ * are silenced without hiding any in our own code.
+ */
+#if defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+#endif
+#include "utf8/utf8.h"
+#if defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+
+#endif